@@ -43,6 +43,9 @@
 #include "hw/smbios.h"
 #include "exec-memory.h"
 #include "hw/pcspk.h"
+#include "qemu/page_cache.h"
+#include "cpus.h"
+#include "trace.h"
 
 #ifdef TARGET_SPARC
 int graphic_width = 1024;
@@ -94,26 +97,26 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
-
-#ifdef __ALTIVEC__
-#include <altivec.h>
-#define VECTYPE        vector unsigned char
-#define SPLAT(p)       vec_splat(vec_ld(0, p), 0)
-#define ALL_EQ(v1, v2) vec_all_eq(v1, v2)
-/* altivec.h may redefine the bool macro as vector type.
- * Reset it to POSIX semantics. */
-#undef bool
-#define bool _Bool
-#elif defined __SSE2__
-#include <emmintrin.h>
-#define VECTYPE        __m128i
-#define SPLAT(p)       _mm_set1_epi8(*(p))
-#define ALL_EQ(v1, v2) (_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) == 0xFFFF)
-#else
-#define VECTYPE        unsigned long
-#define SPLAT(p)       (*(p) * (~0UL / 255))
-#define ALL_EQ(v1, v2) ((v1) == (v2))
-#endif
+#define RAM_SAVE_FLAG_XBZRLE   0x40
+/* pages follow on extra streams; be32 number of streams */
+#define RAM_SAVE_FLAG_MULTIFD  0x80
+/* every stream is done with the pages sent so far; be32 sequence */
+#define RAM_SAVE_FLAG_MULTIFD_SYNC 0x100
+/* postcopy step: byte POSTCOPY_CMD_*, then its arguments */
+#define RAM_SAVE_FLAG_POSTCOPY 0x200
+
+/* the destination checks it can fault pages in */
+#define POSTCOPY_CMD_ADVISE    1
+/* the source has opened the postcopy channel */
+#define POSTCOPY_CMD_START     2
+/* drop a range of a block: idstr, be64 start, be64 length */
+#define POSTCOPY_CMD_DISCARD   3
+/* every range has been dropped, fault the pages in from now on */
+#define POSTCOPY_CMD_RUN       4
+
+/* encodings of RAM_SAVE_FLAG_XBZRLE pages: byte encoding, be16 length */
+#define ENCODING_FLAG_XBZRLE   0x1
+#define ENCODING_FLAG_ZLIB     0x2
 
 
 static struct defconfig_file {
@@ -146,77 +149,319 @@ int qemu_read_default_config_files(bool userconfig)
     return 0;
 }
 
-static int is_dup_page(uint8_t *page)
+static struct {
+    /* buffer used for XBZRLE encoding */
+    uint8_t *encoded_buf;
+    /* snapshot of the page being encoded */
+    uint8_t *current_buf;
+    /* buffer used for XBZRLE decoding */
+    uint8_t *decoded_buf;
+    /* copies of the pages last sent */
+    PageCache *cache;
+} XBZRLE;
+
+static struct {
+    uint64_t xbzrle_bytes;
+    uint64_t xbzrle_pages;
+    uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_overflows;
+} acct_info;
+
+int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    VECTYPE *p = (VECTYPE *)page;
-    VECTYPE val = SPLAT(page);
-    int i;
+    int64_t ret;
 
-    for (i = 0; i < TARGET_PAGE_SIZE / sizeof(VECTYPE); i++) {
-        if (!ALL_EQ(val, p[i])) {
-            return 0;
-        }
+    if (new_size < TARGET_PAGE_SIZE) {
+        return -1;
+    }
+    if (XBZRLE.cache != NULL) {
+        ret = cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE);
+        return ret < 0 ? ret : ret * TARGET_PAGE_SIZE;
     }
+    return new_size;
+}
 
-    return 1;
+uint64_t xbzrle_mig_bytes_transferred(void)
+{
+    return acct_info.xbzrle_bytes;
+}
+
+uint64_t xbzrle_mig_pages_transferred(void)
+{
+    return acct_info.xbzrle_pages;
+}
+
+uint64_t xbzrle_mig_pages_cache_miss(void)
+{
+    return acct_info.xbzrle_cache_miss;
+}
+
+uint64_t xbzrle_mig_pages_overflow(void)
+{
+    return acct_info.xbzrle_overflows;
+}
+
+/* block of the last page header in the stream, which a continuation names */
+static RAMBlock *last_sent_block;
+
+static void save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                           int cont, int flag)
+{
+    qemu_put_be64(f, offset | cont | flag);
+    last_sent_block = block;
+    if (!cont) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr,
+                        strlen(block->idstr));
+    }
+}
+
+/*
+ * Send the page at 'current_data' as a delta from the copy of it in the
+ * cache, and update the cache.  The destination must end up with the
+ * same contents as the cache, so on a miss or an overflow the caller
+ * sends the cached copy (*page) rather than the guest page itself.
+ *
+ * Returns the number of bytes sent, 0 if the page did not change, or
+ * -1 if the caller must send *page whole.
+ */
+static int save_xbzrle_page(QEMUFile *f, uint8_t **page,
+                            ram_addr_t current_addr, RAMBlock *block,
+                            ram_addr_t offset, int cont)
+{
+    int encoded_len, bytes_sent;
+    uint8_t *prev_cached_page;
+
+    if (!cache_is_cached(XBZRLE.cache, current_addr)) {
+        cache_insert(XBZRLE.cache, current_addr, *page);
+        *page = get_cached_data(XBZRLE.cache, current_addr);
+        acct_info.xbzrle_cache_miss++;
+        return -1;
+    }
+
+    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+
+    /* the guest can change the page while we encode it */
+    memcpy(XBZRLE.current_buf, *page, TARGET_PAGE_SIZE);
+
+    encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
+                                       TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
+                                       TARGET_PAGE_SIZE);
+    if (encoded_len == 0) {
+        return 0;
+    }
+
+    memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+    if (encoded_len < 0) {
+        acct_info.xbzrle_overflows++;
+        *page = prev_cached_page;
+        return -1;
+    }
+
+    save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_XBZRLE);
+    qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
+    qemu_put_be16(f, encoded_len);
+    qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
+    bytes_sent = encoded_len + 1 + 2;
+    acct_info.xbzrle_pages++;
+    acct_info.xbzrle_bytes += bytes_sent;
+
+    return bytes_sent;
 }
 
 static RAMBlock *last_block;
 static ram_addr_t last_offset;
+/* true until every page has been sent once: no deltas before that */
+static bool ram_bulk_stage;
+/* streams carrying the pages, 0 if they go over the main stream */
+static int multifd_channels;
+/* threads compressing the pages, 0 if they are not compressed */
+static int compress_threads;
+static uint64_t bytes_transferred;
+
+static ram_addr_t ram_save_remaining(void)
+{
+    return ram_list.dirty_pages;
+}
+
+/*
+ * History of the passes over RAM, for query-migrate.  A pass ends when
+ * the search for dirty pages wraps around to the first block.
+ */
+#define RAM_PASSES_MAX 64
+
+typedef struct RAMPass {
+    int64_t duration;
+    uint64_t transferred;
+    uint64_t dirty_pages;
+} RAMPass;
+
+static struct {
+    uint64_t count;
+    int64_t time_last;
+    uint64_t bytes_last;
+    RAMPass passes[RAM_PASSES_MAX];
+} ram_passes;
+
+static void ram_pass_start(void)
+{
+    memset(&ram_passes, 0, sizeof(ram_passes));
+    ram_passes.time_last = qemu_get_clock_ms(rt_clock);
+}
+
+static void ram_pass_done(void)
+{
+    RAMPass *pass = &ram_passes.passes[ram_passes.count % RAM_PASSES_MAX];
+    int64_t now = qemu_get_clock_ms(rt_clock);
+
+    pass->duration = now - ram_passes.time_last;
+    pass->transferred = bytes_transferred - ram_passes.bytes_last;
+    pass->dirty_pages = ram_save_remaining();
+    trace_ram_pass(ram_passes.count, pass->duration, pass->transferred,
+                   pass->dirty_pages);
+
+    ram_passes.count++;
+    ram_passes.time_last = now;
+    ram_passes.bytes_last = bytes_transferred;
+}
+
+/* The last passes, oldest first */
+MigrationIterationList *ram_iterations(void)
+{
+    MigrationIterationList *head = NULL, *entry;
+    uint64_t i;
+
+    for (i = ram_passes.count; i > 0 &&
+         i + RAM_PASSES_MAX > ram_passes.count; i--) {
+        RAMPass *pass = &ram_passes.passes[(i - 1) % RAM_PASSES_MAX];
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->duration = pass->duration;
+        entry->value->transferred = pass->transferred;
+        entry->value->dirty_pages = pass->dirty_pages;
+        entry->value->bandwidth = pass->duration ?
+            pass->transferred * 1000 / pass->duration : 0;
+        entry->next = head;
+        head = entry;
+    }
+    return head;
+}
+
+/*
+ * Compressed pages are written when their thread is done, after pages
+ * found later, so their header always names the block.
+ */
+static int save_compressed_page(QEMUFile *f, void *opaque, uint64_t offset,
+                                const uint8_t *page, const uint8_t *data,
+                                int len)
+{
+    RAMBlock *block = opaque;
+
+    if (len < 0) {
+        save_block_hdr(f, block, offset, 0, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, page, TARGET_PAGE_SIZE);
+        return TARGET_PAGE_SIZE;
+    }
+
+    save_block_hdr(f, block, offset, 0, RAM_SAVE_FLAG_XBZRLE);
+    qemu_put_byte(f, ENCODING_FLAG_ZLIB);
+    qemu_put_be16(f, len);
+    qemu_put_buffer(f, data, len);
+    return len + 1 + 2;
+}
 
 static int ram_save_block(QEMUFile *f)
 {
     RAMBlock *block = last_block;
     ram_addr_t offset = last_offset;
+    RAMBlock *start_block;
+    bool complete_round = false;
     int bytes_sent = 0;
     MemoryRegion *mr;
 
     if (!block)
         block = QLIST_FIRST(&ram_list.blocks);
+    start_block = block;
 
-    do {
+    for (;;) {
         mr = block->mr;
-        if (memory_region_get_dirty(mr, offset, TARGET_PAGE_SIZE,
-                                    DIRTY_MEMORY_MIGRATION)) {
+        offset = memory_region_find_dirty(mr, offset, block->length - offset,
+                                          DIRTY_MEMORY_MIGRATION);
+        if (complete_round && block == start_block && offset >= last_offset) {
+            /* back where we started: nothing is dirty */
+            return 0;
+        }
+        if (offset < block->length) {
             uint8_t *p;
-            int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+            int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+            ram_addr_t current_addr = block->offset + offset;
+            int pending = 0;
 
             memory_region_reset_dirty(mr, offset, TARGET_PAGE_SIZE,
                                       DIRTY_MEMORY_MIGRATION);
 
             p = memory_region_get_ram_ptr(mr) + offset;
 
-            if (is_dup_page(p)) {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_COMPRESS);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
-                }
-                qemu_put_byte(f, *p);
+            /* a copy still being compressed would overtake this one */
+            if (compress_threads) {
+                pending = compress_save_page_done(f, block, offset);
+            }
+
+            if (multifd_channels) {
+                multifd_queue_page(block->idstr, offset, p);
+                bytes_sent = TARGET_PAGE_SIZE;
+            } else if (buffer_is_zero(p, TARGET_PAGE_SIZE)) {
+                save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_COMPRESS);
+                qemu_put_byte(f, 0);
                 bytes_sent = 1;
+                if (XBZRLE.cache &&
+                    cache_is_cached(XBZRLE.cache, current_addr)) {
+                    memset(get_cached_data(XBZRLE.cache, current_addr), 0,
+                           TARGET_PAGE_SIZE);
+                }
             } else {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_PAGE);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
+                bytes_sent = -1;
+                if (XBZRLE.cache && !ram_bulk_stage) {
+                    bytes_sent = save_xbzrle_page(f, &p, current_addr, block,
+                                                  offset, cont);
+                } else if (compress_threads) {
+                    /* 0 until the threads catch up: go on with the next */
+                    bytes_sent = compress_save_page(f, block, offset, p);
+                }
+                if (bytes_sent < 0) {
+                    save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+                    /* the cached copy must match what the destination got,
+                       so only send straight from guest RAM without XBZRLE;
+                       a page changed before the flush is dirty again */
+                    if (XBZRLE.cache) {
+                        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+                    } else {
+                        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+                    }
+                    bytes_sent = TARGET_PAGE_SIZE;
                 }
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent = TARGET_PAGE_SIZE;
             }
+            bytes_sent += pending;
 
-            break;
+            /* an unmodified page costs nothing, go on to the next one */
+            if (bytes_sent != 0) {
+                break;
+            }
+            offset += TARGET_PAGE_SIZE;
         }
 
-        offset += TARGET_PAGE_SIZE;
         if (offset >= block->length) {
             offset = 0;
             block = QLIST_NEXT(block, next);
-            if (!block)
+            if (!block) {
                 block = QLIST_FIRST(&ram_list.blocks);
+                complete_round = true;
+                ram_bulk_stage = false;
+                ram_pass_done();
+            }
         }
-    } while (block != last_block || offset != last_offset);
+    }
 
     last_block = block;
     last_offset = offset;
@@ -224,34 +469,86 @@ static int ram_save_block(QEMUFile *f)
     return bytes_sent;
 }
 
-static uint64_t bytes_transferred;
+uint64_t ram_bytes_remaining(void)
+{
+    return ram_save_remaining() * TARGET_PAGE_SIZE +
+           postcopy_bytes_remaining();
+}
 
-static ram_addr_t ram_save_remaining(void)
+uint64_t ram_bytes_transferred(void)
 {
-    RAMBlock *block;
-    ram_addr_t count = 0;
+    return bytes_transferred + postcopy_bytes_sent();
+}
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        ram_addr_t addr;
-        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-            if (memory_region_get_dirty(block->mr, addr, TARGET_PAGE_SIZE,
-                                        DIRTY_MEMORY_MIGRATION)) {
-                count++;
-            }
-        }
-    }
+/*
+ * Dirty rate accounting.  Pages dirtied since the last round are the
+ * growth of the dirty counter, as the pages sent were cleared from it.
+ */
+#define DIRTY_RATE_PERIOD_MS 1000
+
+/* auto-converge: throttle after this many periods of falling behind */
+#define THROTTLE_HIGH_PERIODS 2
+#define THROTTLE_INITIAL_PCT 20
+#define THROTTLE_INCREMENT_PCT 10
+
+static struct {
+    int64_t time_last;
+    uint64_t bytes_xfer_last;
+    uint64_t dirty_pages_period;
+    ram_addr_t dirty_pages_last;
+    uint64_t dirty_pages_rate;
+    int dirty_rate_high_cnt;
+} dirty_rate;
+
+uint64_t ram_dirty_pages_rate(void)
+{
+    return dirty_rate.dirty_pages_rate;
+}
+
+/* how long the guest would be stopped, had the last round been the last */
+static uint64_t expected_downtime;
 
-    return count;
+uint64_t ram_expected_downtime(void)
+{
+    return expected_downtime;
 }
 
-uint64_t ram_bytes_remaining(void)
+static void mig_throttle_guest_down(void)
 {
-    return ram_save_remaining() * TARGET_PAGE_SIZE;
+    int pct = cpu_throttle_get_percentage();
+
+    cpu_throttle_set(pct ? pct + THROTTLE_INCREMENT_PCT : THROTTLE_INITIAL_PCT);
 }
 
-uint64_t ram_bytes_transferred(void)
+static void ram_account_dirty_pages(void)
 {
-    return bytes_transferred;
+    int64_t now = qemu_get_clock_ms(rt_clock);
+    uint64_t bytes_xfer_period;
+
+    if (ram_save_remaining() > dirty_rate.dirty_pages_last) {
+        dirty_rate.dirty_pages_period += ram_save_remaining() -
+                                         dirty_rate.dirty_pages_last;
+    }
+    if (now < dirty_rate.time_last + DIRTY_RATE_PERIOD_MS) {
+        return;
+    }
+
+    dirty_rate.dirty_pages_rate = dirty_rate.dirty_pages_period * 1000 /
+                                  (now - dirty_rate.time_last);
+    bytes_xfer_period = bytes_transferred - dirty_rate.bytes_xfer_last;
+
+    /* the guest dirtied more than half of what we sent: it is winning */
+    if (migrate_auto_converge() &&
+        dirty_rate.dirty_pages_period * TARGET_PAGE_SIZE >
+        bytes_xfer_period / 2 &&
+        ++dirty_rate.dirty_rate_high_cnt >= THROTTLE_HIGH_PERIODS) {
+        mig_throttle_guest_down();
+        dirty_rate.dirty_rate_high_cnt = 0;
+    }
+
+    dirty_rate.time_last = now;
+    dirty_rate.bytes_xfer_last = bytes_transferred;
+    dirty_rate.dirty_pages_period = 0;
 }
 
 uint64_t ram_bytes_total(void)
@@ -294,6 +591,256 @@ static void sort_ram_list(void)
     g_free(blocks);
 }
 
+/* RAM is saved as it was at the start, see snapshot-ram.c */
+static bool ram_background;
+static uint8_t *ram_background_page;
+
+static void migration_end(void)
+{
+    if (ram_background) {
+        snapshot_ram_cleanup();
+        g_free(ram_background_page);
+        ram_background_page = NULL;
+        ram_background = false;
+    }
+
+    memory_global_dirty_log_stop();
+    multifd_channels = 0;
+    cpu_throttle_set(0);
+    compress_save_cleanup();
+    compress_threads = 0;
+
+    if (XBZRLE.cache) {
+        cache_fini(XBZRLE.cache);
+        g_free(XBZRLE.encoded_buf);
+        g_free(XBZRLE.current_buf);
+        XBZRLE.cache = NULL;
+        XBZRLE.encoded_buf = NULL;
+        XBZRLE.current_buf = NULL;
+    }
+}
+
+static uint64_t multifd_sent_last;
+static int64_t multifd_time_last;
+
+/*
+ * Pages handed to the multifd channels are not on the wire yet, so
+ * measure what the channels actually sent since the last round.
+ */
+static double multifd_bandwidth(void)
+{
+    uint64_t sent = multifd_bytes_sent();
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    double bwidth;
+
+    bwidth = (double)(sent - multifd_sent_last) / (now - multifd_time_last);
+    multifd_sent_last = sent;
+    multifd_time_last = now;
+
+    return bwidth;
+}
+
+/*
+ * Get ready to save RAM while the guest keeps running, before the guest
+ * is paused for the snapshot: the next save is of RAM as it is then.
+ */
+int ram_save_background_prepare(void)
+{
+    RAMBlock *block;
+    int ret;
+
+    ret = snapshot_ram_setup(TARGET_PAGE_SIZE);
+    if (ret < 0) {
+        return ret;
+    }
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        ret = snapshot_ram_add_block(block,
+                                     memory_region_get_ram_ptr(block->mr),
+                                     block->length);
+        if (ret < 0) {
+            fprintf(stderr, "snapshot: cannot write protect block %s: %s\n",
+                    block->idstr, strerror(-ret));
+            snapshot_ram_cleanup();
+            return ret;
+        }
+    }
+
+    ram_background = true;
+    ram_background_page = g_malloc(TARGET_PAGE_SIZE);
+    return 0;
+}
+
+/* Undo ram_save_background_prepare(), if the save does not happen */
+void ram_save_background_cancel(void)
+{
+    if (ram_background) {
+        migration_end();
+    }
+}
+
+static void ram_save_header(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+    }
+}
+
+/* Returns 1 if a page was saved, 0 if none is left, or a negative errno */
+static int ram_save_background_page(QEMUFile *f)
+{
+    uint8_t *p = ram_background_page;
+    RAMBlock *block;
+    uint64_t offset;
+    void *opaque;
+    int cont;
+    int ret;
+
+    ret = snapshot_ram_next_page(&opaque, &offset, p);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    block = opaque;
+    cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    if (buffer_is_zero(p, TARGET_PAGE_SIZE)) {
+        save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        bytes_transferred += 1;
+    } else {
+        save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        bytes_transferred += TARGET_PAGE_SIZE;
+    }
+    return 1;
+}
+
+/* longest a round keeps the main loop busy, in ms */
+#define RAM_BACKGROUND_SLICE 50
+
+/*
+ * Every page is saved once, whatever the guest does meanwhile, so a
+ * round goes on until its time is up rather than until the dirty pages
+ * converge.
+ */
+static int ram_save_background(QEMUFile *f, int stage)
+{
+    int64_t end = qemu_get_clock_ms(rt_clock) + RAM_BACKGROUND_SLICE;
+    int ret;
+
+    if (stage == 1) {
+        bytes_transferred = 0;
+        last_sent_block = NULL;
+
+        ret = snapshot_ram_protect();
+        if (ret < 0) {
+            return ret;
+        }
+        ram_save_header(f);
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 0;
+    }
+
+    do {
+        ret = ram_save_background_page(f);
+    } while (ret > 0 &&
+             (stage == 3 || qemu_get_clock_ms(rt_clock) < end));
+
+    if (ret < 0) {
+        return ret;
+    }
+    if (stage == 3) {
+        migration_end();
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return ret == 0;
+}
+
+static void ram_save_postcopy_cmd(QEMUFile *f, int cmd)
+{
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+    qemu_put_byte(f, cmd);
+}
+
+static void ram_save_discard(QEMUFile *f, RAMBlock *block, ram_addr_t start,
+                             ram_addr_t length)
+{
+    ram_save_postcopy_cmd(f, POSTCOPY_CMD_DISCARD);
+    qemu_put_byte(f, strlen(block->idstr));
+    qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+    qemu_put_be64(f, start);
+    qemu_put_be64(f, length);
+}
+
+/*
+ * Last stage of a postcopy migration: rather than the dirty pages, send
+ * the ranges the destination must drop.  The pages themselves follow on
+ * the postcopy channel, once the destination runs the guest.
+ */
+static int ram_save_postcopy(QEMUFile *f)
+{
+    RAMBlock *block;
+    int ret;
+
+    ret = postcopy_save_setup(TARGET_PAGE_SIZE);
+    if (ret < 0) {
+        return ret;
+    }
+    ram_save_postcopy_cmd(f, POSTCOPY_CMD_START);
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        ram_addr_t addr, start = 0;
+        bool in_range = false;
+
+        postcopy_save_add_block(block->idstr,
+                                memory_region_get_ram_ptr(block->mr),
+                                block->length);
+
+        for (addr = 0; addr <= block->length; addr += TARGET_PAGE_SIZE) {
+            if (addr < block->length &&
+                memory_region_get_dirty(block->mr, addr, TARGET_PAGE_SIZE,
+                                        DIRTY_MEMORY_MIGRATION)) {
+                memory_region_reset_dirty(block->mr, addr, TARGET_PAGE_SIZE,
+                                          DIRTY_MEMORY_MIGRATION);
+                postcopy_save_mark_page(addr);
+                if (!in_range) {
+                    start = addr;
+                    in_range = true;
+                }
+            } else if (in_range) {
+                ram_save_discard(f, block, start, addr - start);
+                in_range = false;
+            }
+        }
+    }
+
+    ram_save_postcopy_cmd(f, POSTCOPY_CMD_RUN);
+    migration_end();
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return postcopy_save_run();
+}
+
+/* End a round: tell the destination to wait for the channels */
+static int multifd_sync(QEMUFile *f)
+{
+    int64_t seq = multifd_save_sync();
+
+    if (seq < 0) {
+        return seq;
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    qemu_put_be32(f, seq);
+    return 0;
+}
+
 int ram_save_live(QEMUFile *f, int stage, void *opaque)
 {
     ram_addr_t addr;
@@ -303,19 +850,56 @@ int ram_save_live(QEMUFile *f, int stage, void *opaque)
     int ret;
 
     if (stage < 0) {
-        memory_global_dirty_log_stop();
+        migration_end();
         return 0;
     }
 
+    if (ram_background) {
+        return ram_save_background(f, stage);
+    }
+
     memory_global_sync_dirty_bitmap(get_system_memory());
 
+    if (stage == 3 && migration_in_postcopy()) {
+        return ram_save_postcopy(f);
+    }
+
     if (stage == 1) {
         RAMBlock *block;
         bytes_transferred = 0;
         last_block = NULL;
+        last_sent_block = NULL;
         last_offset = 0;
+        ram_bulk_stage = true;
         sort_ram_list();
 
+        multifd_channels = multifd_save_start(TARGET_PAGE_SIZE);
+        multifd_sent_last = 0;
+        multifd_time_last = qemu_get_clock_ns(rt_clock);
+
+        /* the cache is not thread safe, so no deltas over multifd */
+        if (migrate_use_xbzrle() && !multifd_channels) {
+            XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
+                                      TARGET_PAGE_SIZE,
+                                      TARGET_PAGE_SIZE);
+            if (!XBZRLE.cache) {
+                fprintf(stderr, "Error creating XBZRLE cache\n");
+                return -ENOMEM;
+            }
+            XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
+            XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
+            memset(&acct_info, 0, sizeof(acct_info));
+        }
+
+        if (!multifd_channels) {
+            compress_threads = compress_save_setup(TARGET_PAGE_SIZE,
+                                                   save_compressed_page);
+            if (compress_threads < 0) {
+                compress_threads = 0;
+                return -ENOMEM;
+            }
+        }
+
         /* Make sure all dirty bits are set */
         QLIST_FOREACH(block, &ram_list.blocks, next) {
             for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
@@ -328,13 +912,22 @@ int ram_save_live(QEMUFile *f, int stage, void *opaque)
 
         memory_global_dirty_log_start();
 
-        qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+        ram_save_header(f);
 
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            qemu_put_byte(f, strlen(block->idstr));
-            qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-            qemu_put_be64(f, block->length);
+        if (multifd_channels) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD);
+            qemu_put_be32(f, multifd_channels);
+        }
+        if (migrate_use_postcopy()) {
+            ram_save_postcopy_cmd(f, POSTCOPY_CMD_ADVISE);
         }
+
+        memset(&dirty_rate, 0, sizeof(dirty_rate));
+        dirty_rate.time_last = qemu_get_clock_ms(rt_clock);
+        ram_pass_start();
+        expected_downtime = 0;
+    } else if (stage == 2) {
+        ram_account_dirty_pages();
     }
 
     bytes_transferred_last = bytes_transferred;
@@ -343,6 +936,11 @@ int ram_save_live(QEMUFile *f, int stage, void *opaque)
     while ((ret = qemu_file_rate_limit(f)) == 0) {
         int bytes_sent;
 
+        /* the channels have enough to chew on until the next round */
+        if (multifd_channels && multifd_save_busy()) {
+            break;
+        }
+
         bytes_sent = ram_save_block(f);
         bytes_transferred += bytes_sent;
         if (bytes_sent == 0) { /* no more blocks */
@@ -356,6 +954,9 @@ int ram_save_live(QEMUFile *f, int stage, void *opaque)
 
     bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
     bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
+    if (multifd_channels) {
+        bwidth = multifd_bandwidth();
+    }
 
     /* if we haven't transferred anything this round, force expected_time to a
      * a very high value, but without crashing */
@@ -370,15 +971,44 @@ int ram_save_live(QEMUFile *f, int stage, void *opaque)
         /* flush all remaining blocks regardless of rate limiting */
         while ((bytes_sent = ram_save_block(f)) != 0) {
             bytes_transferred += bytes_sent;
+            if (multifd_channels && multifd_save_wait() < 0) {
+                break;
+            }
         }
-        memory_global_dirty_log_stop();
     }
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    /* the round ends with every page it found */
+    if (compress_threads) {
+        bytes_transferred += compress_save_flush(f);
+    }
+
+    if (multifd_channels) {
+        ret = multifd_sync(f);
+        if (ret < 0) {
+            return ret;
+        }
+    }
 
-    expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+    if (stage == 3) {
+        migration_end();
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    /* do not leave references to guest RAM queued between rounds */
+    qemu_fflush(f);
+
+    dirty_rate.dirty_pages_last = ram_save_remaining();
+    expected_time = (ram_save_remaining() * TARGET_PAGE_SIZE +
+                     multifd_bytes_pending()) / bwidth;
+    if (stage == 2) {
+        expected_downtime = expected_time / 1000000;
+        trace_ram_save_iterate(ram_save_remaining(), bwidth * 1000000000,
+                               expected_downtime);
+    }
 
-    return (stage == 2) && (expected_time <= migrate_max_downtime());
+    /* with postcopy, what is left is sent after the switch */
+    return (stage == 2) && (expected_time <= migrate_max_downtime() ||
+                            (migrate_use_postcopy() && !ram_bulk_stage));
 }
 
 static inline void *host_from_stream_offset(QEMUFile *f,
@@ -411,6 +1041,95 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     return NULL;
 }
 
+static int ram_load_multifd_setup(int num)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        multifd_load_add_block(block->idstr,
+                               memory_region_get_ram_ptr(block->mr),
+                               block->length);
+    }
+    return multifd_load_setup(num, TARGET_PAGE_SIZE);
+}
+
+static int ram_load_postcopy(QEMUFile *f)
+{
+    RAMBlock *block;
+    uint64_t start, length;
+    char id[256];
+    uint8_t len;
+
+    switch (qemu_get_byte(f)) {
+    case POSTCOPY_CMD_ADVISE:
+        if (kvm_enabled() && !kvm_has_sync_mmu()) {
+            fprintf(stderr, "postcopy needs a KVM with synchronous MMU\n");
+            return -EINVAL;
+        }
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            postcopy_load_add_block(block->idstr,
+                                    memory_region_get_ram_ptr(block->mr),
+                                    block->length);
+        }
+        return postcopy_load_advise(TARGET_PAGE_SIZE);
+    case POSTCOPY_CMD_START:
+        return postcopy_load_start();
+    case POSTCOPY_CMD_DISCARD:
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        start = qemu_get_be64(f);
+        length = qemu_get_be64(f);
+        return postcopy_load_discard(id, start, length);
+    case POSTCOPY_CMD_RUN:
+        return postcopy_load_run();
+    default:
+        fprintf(stderr, "Unknown postcopy command\n");
+        return -EINVAL;
+    }
+}
+
+static int load_xbzrle(QEMUFile *f, void *host)
+{
+    int ret, xh_flags;
+    unsigned int xh_len;
+
+    xh_flags = qemu_get_byte(f);
+    xh_len = qemu_get_be16(f);
+    if (xh_flags == ENCODING_FLAG_ZLIB) {
+        if (compress_load_page(f, host, TARGET_PAGE_SIZE, xh_len) < 0) {
+            fprintf(stderr, "Failed to load compressed page\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (!XBZRLE.decoded_buf) {
+        XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+    if (xh_flags != ENCODING_FLAG_XBZRLE) {
+        fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
+        return -1;
+    }
+    if (xh_len > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
+        return -1;
+    }
+    qemu_get_buffer(f, XBZRLE.decoded_buf, xh_len);
+
+    /* the delta applies to the page once any inflate into it is done */
+    if (compress_load_page_done(host) < 0) {
+        return -1;
+    }
+    ret = xbzrle_decode_buffer(XBZRLE.decoded_buf, xh_len, host,
+                               TARGET_PAGE_SIZE);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
+        return -1;
+    }
+    return 0;
+}
+
 int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
@@ -472,6 +1191,9 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             ch = qemu_get_byte(f);
+            if (compress_load_page_done(host) < 0) {
+                return -EINVAL;
+            }
             memset(host, ch, TARGET_PAGE_SIZE);
 #ifndef _WIN32
             if (ch == 0 &&
@@ -483,8 +1205,33 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
             void *host;
 
             host = host_from_stream_offset(f, addr, flags);
+            if (compress_load_page_done(host) < 0) {
+                return -EINVAL;
+            }
 
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
+            void *host;
+
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+            if (load_xbzrle(f, host) < 0) {
+                return -EINVAL;
+            }
+        } else if (flags & RAM_SAVE_FLAG_MULTIFD) {
+            if (ram_load_multifd_setup(qemu_get_be32(f)) < 0) {
+                return -EINVAL;
+            }
+        } else if (flags & RAM_SAVE_FLAG_MULTIFD_SYNC) {
+            if (multifd_load_sync(qemu_get_be32(f)) < 0) {
+                return -EIO;
+            }
+        } else if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            if (ram_load_postcopy(f) < 0) {
+                return -EINVAL;
+            }
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -492,6 +1239,11 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
+    /* the next section may build on the pages still being inflated */
+    if (compress_load_flush() < 0) {
+        return -EINVAL;
+    }
+
     return 0;
 }
 
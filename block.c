@@ -2041,6 +2041,28 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
     return ret;
 }
 
+/**
+ * Allocate storage for a byte range of the image so that later writes into
+ * it do not have to.  The image grows if the range ends beyond its end; the
+ * new space reads as zeroes.
+ */
+int bdrv_preallocate(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    BlockDriver *drv = bs->drv;
+    int ret;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_preallocate)
+        return -ENOTSUP;
+    if (bs->read_only)
+        return -EACCES;
+    ret = drv->bdrv_preallocate(bs, offset, bytes);
+    if (ret == 0) {
+        ret = refresh_total_sectors(bs, bs->total_sectors);
+    }
+    return ret;
+}
+
 /**
  * Length of a allocated file in bytes. Sparse files are counted by actual
  * allocated space. Return < 0 if error or unknown.
@@ -2243,6 +2265,20 @@ void bdrv_set_io_limits(BlockDriverState *bs,
     bs->io_limits_enabled = bdrv_io_limits_enabled(bs);
 }
 
+/* Takes effect the next time a format driver is opened on bs */
+void bdrv_set_metadata_cache_size(BlockDriverState *bs, int64_t l2_size,
+                                  int64_t refcount_size)
+{
+    bs->l2_cache_size = l2_size;
+    bs->refcount_cache_size = refcount_size;
+}
+
+/* Takes effect the next time a format driver is opened on bs */
+void bdrv_set_cluster_reservation(BlockDriverState *bs, int64_t size)
+{
+    bs->cluster_reservation = size;
+}
+
 /* Recognize floppy formats */
 typedef struct FDFormat {
     FDriveType drive;
@@ -2623,8 +2659,13 @@ int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *top,
          * might have
          *
          * [sector_num+x, nr_sectors] allocated.
+         *
+         * A backing file that is shorter than top ends the range only
+         * because it ends; whatever is beyond its end reads as zeros.
          */
-        if (n > pnum_inter) {
+        if (n > pnum_inter &&
+            (intermediate == top ||
+             sector_num + pnum_inter < intermediate->total_sectors)) {
             n = pnum_inter;
         }
 
@@ -2700,7 +2741,7 @@ BlockInfoList *qmp_query_block(Error **errp)
 }
 
 /* Consider exposing this as a full fledged QMP command */
-static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
+static BlockStats *qmp_query_blockstat(BlockDriverState *bs, Error **errp)
 {
     BlockStats *s;
 
@@ -2722,6 +2763,20 @@ static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
 
+    if (bs->drv && bs->drv->bdrv_get_metadata_cache_stats) {
+        BlockMetadataCacheStats cache = {0};
+
+        bs->drv->bdrv_get_metadata_cache_stats(bs, &cache);
+        s->stats->has_l2_cache_hits = true;
+        s->stats->l2_cache_hits = cache.l2_hits;
+        s->stats->has_l2_cache_misses = true;
+        s->stats->l2_cache_misses = cache.l2_misses;
+        s->stats->has_refcount_cache_hits = true;
+        s->stats->refcount_cache_hits = cache.refcount_hits;
+        s->stats->has_refcount_cache_misses = true;
+        s->stats->refcount_cache_misses = cache.refcount_misses;
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = qmp_query_blockstat(bs->file, NULL);
@@ -2957,6 +3012,47 @@ int bdrv_snapshot_load_tmp(BlockDriverState *bs,
     return -ENOTSUP;
 }
 
+/*
+ * Drop the VM state saved with the current image, before a new one is
+ * written there while the image is in use.
+ */
+int bdrv_snapshot_discard_vmstate(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (drv->bdrv_snapshot_discard_vmstate) {
+        return drv->bdrv_snapshot_discard_vmstate(bs);
+    }
+    if (bs->file) {
+        return bdrv_snapshot_discard_vmstate(bs->file);
+    }
+    return -ENOTSUP;
+}
+
+/*
+ * Move the VM state saved with the current image to the snapshot
+ * snapshot_id, which was created without one.
+ */
+int bdrv_snapshot_take_vmstate(BlockDriverState *bs, const char *snapshot_id,
+                               uint64_t vm_state_size)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (drv->bdrv_snapshot_take_vmstate) {
+        return drv->bdrv_snapshot_take_vmstate(bs, snapshot_id,
+                                               vm_state_size);
+    }
+    if (bs->file) {
+        return bdrv_snapshot_take_vmstate(bs->file, snapshot_id,
+                                          vm_state_size);
+    }
+    return -ENOTSUP;
+}
+
 BlockDriverState *bdrv_find_backing_image(BlockDriverState *bs,
         const char *backing_file)
 {
@@ -3796,6 +3892,22 @@ void bdrv_invalidate_cache_all(void)
     }
 }
 
+int bdrv_flush_metadata_all(void)
+{
+    BlockDriverState *bs;
+    int ret;
+
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        if (bs->drv && bs->drv->bdrv_flush_metadata) {
+            ret = bs->drv->bdrv_flush_metadata(bs);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
 void bdrv_clear_incoming_migration_all(void)
 {
     BlockDriverState *bs;
@@ -28,32 +28,81 @@
 #include "trace.h"
 
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    bool    loading;
+    bool    prefetched;
     int     ref;
+    QLIST_ENTRY(Qcow2CachedTable) hash_next;
+    QTAILQ_ENTRY(Qcow2CachedTable) lru;
 } Qcow2CachedTable;
 
+/*
+ * Cached tables are looked up by offset through a hash table and evicted in
+ * LRU order.  All tables live in one contiguous buffer so that a table
+ * pointer handed out by qcow2_cache_get() maps back to its entry without a
+ * search.
+ *
+ * qcow2_cache_prefetch() reads a table without holding the driver lock; the
+ * entry is marked as loading meanwhile and lookups of it wait on @loaded.
+ */
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    uint8_t*                tables;
+    QLIST_HEAD(, Qcow2CachedTable)* buckets;
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_bits;
+    uint64_t                hash_mask;
+    int                     nb_loading;
+    CoQueue                 loaded;
     bool                    depends_on_flush;
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
+static inline void *qcow2_cache_table(Qcow2Cache *c, int i)
+{
+    return c->tables + ((size_t)i << c->table_bits);
+}
+
+static inline int qcow2_cache_table_index(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t diff = (uint8_t *)table - c->tables;
+
+    assert(diff >= 0 && (diff >> c->table_bits) < c->size);
+    return diff >> c->table_bits;
+}
+
+static inline uint64_t qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return (offset >> c->table_bits) & c->hash_mask;
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
+    uint64_t buckets = 1;
     int i;
 
+    while (buckets < num_tables) {
+        buckets <<= 1;
+    }
+
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
+    c->table_bits = s->cluster_bits;
+    c->hash_mask = buckets - 1;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->tables = qemu_blockalign(bs, (size_t)num_tables << s->cluster_bits);
+    c->buckets = g_malloc0(sizeof(*c->buckets) * buckets);
+    QTAILQ_INIT(&c->lru);
+    qemu_co_queue_init(&c->loaded);
 
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
     }
 
     return c;
@@ -63,17 +112,25 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 {
     int i;
 
+    assert(c->nb_loading == 0);
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->tables);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -120,7 +177,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset, qcow2_cache_table(c, i),
         s->cluster_size);
     if (ret < 0) {
         return ret;
@@ -131,15 +188,16 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     return 0;
 }
 
-int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+/*
+ * Writes all dirty tables back to the image file, but does not flush it; the
+ * caller must flush bs->file before anything that depends on the tables.
+ */
+int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c)
 {
-    BDRVQcowState *s = bs->opaque;
     int result = 0;
     int ret;
     int i;
 
-    trace_qcow2_cache_flush(qemu_coroutine_self(), c == s->l2_table_cache);
-
     for (i = 0; i < c->size; i++) {
         ret = qcow2_cache_entry_flush(bs, c, i);
         if (ret < 0 && result != -ENOSPC) {
@@ -147,6 +205,18 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
         }
     }
 
+    return result;
+}
+
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+{
+    BDRVQcowState *s = bs->opaque;
+    int result;
+    int ret;
+
+    trace_qcow2_cache_flush(qemu_coroutine_self(), c == s->l2_table_cache);
+
+    result = qcow2_cache_write(bs, c);
     if (result == 0) {
         ret = bdrv_flush(bs->file);
         if (ret < 0) {
@@ -187,38 +257,40 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
-
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
-        }
+    Qcow2CachedTable *entry;
 
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+    QTAILQ_FOREACH(entry, &c->lru, lru) {
+        if (!entry->ref) {
+            return entry - c->entries;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
+    /* Tables that are being prefetched are released once their read
+     * completes; anything else means that the cache is too small */
+    if (c->nb_loading == 0) {
         abort();
     }
-    return min_index;
+    return -EAGAIN;
+}
+
+static Qcow2CachedTable *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    Qcow2CachedTable *entry;
+
+    QLIST_FOREACH(entry, &c->buckets[qcow2_cache_hash(c, offset)],
+                  hash_next) {
+        if (entry->offset == offset) {
+            return entry;
+        }
+    }
+    return NULL;
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *entry;
     int i;
     int ret;
 
@@ -226,18 +298,28 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
+again:
+    entry = qcow2_cache_lookup(c, offset);
+    if (entry && entry->loading) {
+        qemu_co_queue_wait(&c->loaded);
+        goto again;
+    }
+    if (entry) {
+        i = entry - c->entries;
+        /* A prefetch already counted the first access as a miss */
+        if (read_from_disk && !entry->prefetched) {
+            c->hits++;
         }
+        goto found;
     }
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
-    if (i < 0) {
-        return i;
+    if (i == -EAGAIN) {
+        qemu_co_queue_wait(&c->loaded);
+        goto again;
     }
 
     ret = qcow2_cache_entry_flush(bs, c, i);
@@ -247,28 +329,34 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        QLIST_REMOVE(&c->entries[i], hash_next);
+        c->entries[i].offset = 0;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        c->misses++;
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_table(c, i),
+                         s->cluster_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    QLIST_INSERT_HEAD(&c->buckets[qcow2_cache_hash(c, offset)],
+                      &c->entries[i], hash_next);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    c->entries[i].prefetched = false;
+    QTAILQ_REMOVE(&c->lru, &c->entries[i], lru);
+    QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
     c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_table(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -276,6 +364,75 @@ found:
     return 0;
 }
 
+/*
+ * Reads the table at offset into the cache unless it is cached already.  The
+ * caller must hold lock, which is dropped for the read so that other requests
+ * can keep working with the rest of the cache meanwhile; it is held again on
+ * return.  Read errors are not reported: the table is simply not cached, and
+ * the next qcow2_cache_get() for it tries again.
+ */
+void coroutine_fn qcow2_cache_prefetch(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, CoMutex *lock)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *entry;
+    int i;
+    int ret;
+
+    /* Leave half of the cache to requests that hold the lock */
+    if (qcow2_cache_lookup(c, offset) || c->nb_loading >= c->size / 2) {
+        return;
+    }
+
+    i = qcow2_cache_find_entry_to_replace(c);
+    if (i < 0) {
+        return;
+    }
+
+    ret = qcow2_cache_entry_flush(bs, c, i);
+    if (ret < 0) {
+        return;
+    }
+
+    trace_qcow2_cache_prefetch(qemu_coroutine_self(), c == s->l2_table_cache,
+                               offset, i);
+
+    entry = &c->entries[i];
+    if (entry->offset) {
+        QLIST_REMOVE(entry, hash_next);
+    }
+    entry->offset = offset;
+    entry->loading = true;
+    entry->prefetched = true;
+    entry->ref++;
+    QLIST_INSERT_HEAD(&c->buckets[qcow2_cache_hash(c, offset)], entry,
+                      hash_next);
+    QTAILQ_REMOVE(&c->lru, entry, lru);
+    QTAILQ_INSERT_TAIL(&c->lru, entry, lru);
+    c->nb_loading++;
+    c->misses++;
+
+    qemu_co_mutex_unlock(lock);
+
+    if (c == s->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+    }
+    ret = bdrv_pread(bs->file, offset, qcow2_cache_table(c, i),
+                     s->cluster_size);
+
+    /* Publish the table before anyone who waited for it can run */
+    if (ret < 0) {
+        QLIST_REMOVE(entry, hash_next);
+        entry->offset = 0;
+    }
+    entry->loading = false;
+    entry->ref--;
+    c->nb_loading--;
+    qemu_co_queue_restart_all(&c->loaded);
+
+    qemu_co_mutex_lock(lock);
+}
+
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table)
 {
@@ -290,16 +447,8 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_table_index(c, *table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
-
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -309,15 +458,7 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_table_index(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
     c->entries[i].dirty = true;
 }
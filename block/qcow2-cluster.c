@@ -124,12 +124,41 @@ static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
     return ret;
 }
 
+/*
+ * qcow2_prefetch_l2_table
+ *
+ * Brings the L2 table for the given guest offset into the cache without
+ * holding s->lock for the read, so that concurrent requests that work on
+ * other L2 tables are not serialised behind it.  Must be called with s->lock
+ * held, at a point where the caller can cope with it being dropped.
+ */
+void coroutine_fn qcow2_prefetch_l2_table(BlockDriverState *bs,
+                                          uint64_t offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    unsigned int l1_index;
+    uint64_t l2_offset;
+
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size) {
+        return;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (l2_offset) {
+        qcow2_cache_prefetch(bs, s->l2_table_cache, l2_offset, &s->lock);
+    }
+}
+
 /*
  * Writes one sector of the L1 table to the disk (can't update single entries
- * and we really don't want bdrv_pread to perform a read-modify-write)
+ * and we really don't want bdrv_pread to perform a read-modify-write).  The
+ * entry for l1_index is written as l1_entry, which the caller stores in
+ * s->l1_table once the write has succeeded.
  */
 #define L1_ENTRIES_PER_SECTOR (512 / 8)
-static int write_l1_entry(BlockDriverState *bs, int l1_index)
+static int write_l1_entry(BlockDriverState *bs, int l1_index,
+                          uint64_t l1_entry)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t buf[L1_ENTRIES_PER_SECTOR];
@@ -140,6 +169,7 @@ static int write_l1_entry(BlockDriverState *bs, int l1_index)
     for (i = 0; i < L1_ENTRIES_PER_SECTOR; i++) {
         buf[i] = cpu_to_be64(s->l1_table[l1_start_index + i]);
     }
+    buf[l1_index - l1_start_index] = cpu_to_be64(l1_entry);
 
     BLKDBG_EVENT(bs->file, BLKDBG_L1_UPDATE);
     ret = bdrv_pwrite_sync(bs->file, s->l1_table_offset + 8 * l1_start_index,
@@ -159,11 +189,19 @@ static int write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * In coroutine context, s->lock is held on entry and dropped while the new
+ * table and the L1 entry are written, so that requests for other L2 tables
+ * can go ahead.  Requests for this one wait in get_cluster_table() until the
+ * L1 entry points to it.
  */
 
 static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 {
     BDRVQcowState *s = bs->opaque;
+    bool unlock = qemu_in_coroutine();
+    QCowL2Alloc l2_alloc = {
+        .l1_index = l1_index,
+    };
     uint64_t old_l2_offset;
     uint64_t *l2_table;
     int64_t l2_offset;
@@ -180,20 +218,18 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         return l2_offset;
     }
 
-    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
-    if (ret < 0) {
-        goto fail;
-    }
-
-    /* allocate a new entry in the l2 cache */
-
-    trace_qcow2_l2_allocate_get_empty(bs, l1_index);
-    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
-    if (ret < 0) {
-        return ret;
+    /* The refcount of the new table must be on disk before the L1 entry
+     * points to it.  The flush after the table write below covers it. */
+    if (qcow2_need_accurate_refcounts(s)) {
+        ret = qcow2_cache_write(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
-    l2_table = *table;
+    /* Build the table outside the cache; nothing can look it up until the
+     * L1 entry is updated */
+    l2_table = qemu_blockalign(bs, s->cluster_size);
 
     if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
         /* if there was no old l2 table, clear the new table */
@@ -218,32 +254,56 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         }
     }
 
+    qemu_co_queue_init(&l2_alloc.waiting_requests);
+    QLIST_INSERT_HEAD(&s->l2_allocs, &l2_alloc, next_in_flight);
+    if (unlock) {
+        qemu_co_mutex_unlock(&s->lock);
+    }
+
     /* write the l2 table to the file */
     BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
     trace_qcow2_l2_allocate_write_l2(bs, l1_index);
-    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    ret = bdrv_pwrite_sync(bs->file, l2_offset, l2_table, s->cluster_size);
+
+    /* update the L1 entry; allocations in the same L1 sector take turns,
+     * and each one is visible in s->l1_table before the next one writes */
+    if (unlock) {
+        qemu_co_mutex_lock(&s->l1_lock);
+    }
+    if (ret >= 0) {
+        trace_qcow2_l2_allocate_write_l1(bs, l1_index);
+        ret = write_l1_entry(bs, l1_index, l2_offset | QCOW_OFLAG_COPIED);
+    }
+    if (unlock) {
+        qemu_co_mutex_lock(&s->lock);
+        qemu_co_mutex_unlock(&s->l1_lock);
+    }
+
+    QLIST_REMOVE(&l2_alloc, next_in_flight);
+    qemu_co_queue_restart_all(&l2_alloc.waiting_requests);
     if (ret < 0) {
         goto fail;
     }
-
-    /* update the L1 entry */
-    trace_qcow2_l2_allocate_write_l1(bs, l1_index);
     s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
-    ret = write_l1_entry(bs, l1_index);
+
+    /* allocate a new entry in the l2 cache */
+
+    trace_qcow2_l2_allocate_get_empty(bs, l1_index);
+    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
     if (ret < 0) {
         goto fail;
     }
 
-    *table = l2_table;
+    memcpy(*table, l2_table, s->cluster_size);
+    qemu_vfree(l2_table);
+
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
     return 0;
 
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
-    qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
-    s->l1_table[l1_index] = old_l2_offset;
+    qemu_vfree(l2_table);
     return ret;
 }
 
@@ -488,6 +548,20 @@ out:
     return ret;
 }
 
+/*
+ * Waits until an L2 allocation that runs without s->lock has updated the L1
+ * table.  The caller must look up the L1 entry again afterwards.
+ */
+static void coroutine_fn wait_for_l2_alloc(BDRVQcowState *s,
+                                           QCowL2Alloc *l2_alloc)
+{
+    assert(qemu_in_coroutine());
+
+    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_queue_wait(&l2_alloc->waiting_requests);
+    qemu_co_mutex_lock(&s->lock);
+}
+
 /*
  * get_cluster_table
  *
@@ -507,12 +581,22 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
     unsigned int l1_index, l2_index;
     uint64_t l2_offset;
     uint64_t *l2_table = NULL;
+    QCowL2Alloc *l2_alloc;
     int ret;
 
     /* seek the the l2 offset in the l1 table */
 
+again:
     l1_index = offset >> (s->l2_bits + s->cluster_bits);
     if (l1_index >= s->l1_size) {
+        /* Growing the table moves it, so L2 allocations that are about to
+         * write an entry of the old one must finish first */
+        l2_alloc = QLIST_FIRST(&s->l2_allocs);
+        if (l2_alloc) {
+            wait_for_l2_alloc(s, l2_alloc);
+            goto again;
+        }
+
         ret = qcow2_grow_l1_table(bs, l1_index + 1, false);
         if (ret < 0) {
             return ret;
@@ -530,6 +614,14 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
             return ret;
         }
     } else {
+        /* Another request may be allocating this table already */
+        QLIST_FOREACH(l2_alloc, &s->l2_allocs, next_in_flight) {
+            if (l2_alloc->l1_index == l1_index) {
+                wait_for_l2_alloc(s, l2_alloc);
+                goto again;
+            }
+        }
+
         /* First allocate a new L2 table (and do COW if needed) */
         ret = l2_allocate(bs, l1_index, &l2_table);
         if (ret < 0) {
@@ -662,7 +754,17 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
         qcow2_cache_depends_on_flush(s->l2_table_cache);
     }
 
-    qcow2_cache_set_dependency(bs, s->l2_table_cache, s->refcount_block_cache);
+    if (s->use_lazy_refcounts) {
+        ret = qcow2_mark_dirty(bs);
+        if (ret < 0) {
+            goto err;
+        }
+    }
+
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
     ret = get_cluster_table(bs, m->offset, &l2_table, &l2_index);
     if (ret < 0) {
         goto err;
@@ -779,7 +881,7 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = old_alloc->offset >> s->cluster_bits;
         uint64_t old_end = old_start + old_alloc->nb_clusters;
 
-        if (end < old_start || start > old_end) {
+        if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
             if (start < old_start) {
@@ -806,7 +908,9 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
-    if (*host_offset == 0) {
+    if (s->reserve_size) {
+        return qcow2_alloc_reserved_clusters(bs, host_offset, nb_clusters);
+    } else if (*host_offset == 0) {
         int64_t cluster_offset =
             qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
         if (cluster_offset < 0) {
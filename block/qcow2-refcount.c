@@ -616,6 +616,100 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Cluster reservation
+ *
+ * With -drive cluster-reservation, data clusters are handed out from a
+ * contiguous range of the image file whose refcounts were increased in one
+ * go when it was reserved, so that an allocating write only has to update
+ * its L2 table.  Reserved but unused clusters have a refcount of 1 and are
+ * not referenced by any L2 table; qcow2_release_reservation() gives them
+ * back.
+ */
+static int qcow2_refill_reservation(BlockDriverState *bs, int64_t min_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t size, offset;
+    int ret;
+
+    qcow2_release_reservation(bs);
+
+    size = MAX(s->reserve_size, min_size);
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        return offset;
+    }
+
+    /* Hosts that can't preallocate still save the refcount updates */
+    ret = bdrv_preallocate(bs->file, offset, size);
+    if (ret < 0 && ret != -ENOTSUP) {
+        qcow2_free_clusters(bs, offset, size);
+        return ret;
+    }
+
+    s->reserve_offset = offset;
+    s->reserve_end = offset + size;
+    return 0;
+}
+
+/*
+ * Takes *nb_clusters contiguous clusters from the reservation.  If
+ * *host_offset is non-zero the clusters must start there; *nb_clusters is
+ * then reduced, possibly to 0, if the reservation does not continue at that
+ * offset.  Otherwise the reservation is refilled if necessary and
+ * *host_offset is set to the first cluster taken.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int qcow2_alloc_reserved_clusters(BlockDriverState *bs, uint64_t *host_offset,
+    unsigned int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t size = (int64_t) *nb_clusters << s->cluster_bits;
+    int ret;
+
+    if (*host_offset != 0) {
+        if (*host_offset != s->reserve_offset) {
+            *nb_clusters = 0;
+            return 0;
+        }
+        size = MIN(size, s->reserve_end - s->reserve_offset);
+        *nb_clusters = size >> s->cluster_bits;
+    } else {
+        if (s->reserve_end - s->reserve_offset < size) {
+            ret = qcow2_refill_reservation(bs, size);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        *host_offset = s->reserve_offset;
+    }
+
+    s->reserve_offset += size;
+    return 0;
+}
+
+/*
+ * Frees the unused part of the reservation, and truncates the image file if
+ * it was at its end.
+ */
+void qcow2_release_reservation(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->reserve_offset == s->reserve_end) {
+        return;
+    }
+
+    qcow2_free_clusters(bs, s->reserve_offset,
+                        s->reserve_end - s->reserve_offset);
+    if (bdrv_getlength(bs->file) == s->reserve_end) {
+        bdrv_truncate(bs->file, s->reserve_offset);
+    }
+
+    s->reserve_offset = s->reserve_end = 0;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
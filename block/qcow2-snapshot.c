@@ -658,3 +658,219 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs, const char *snapshot_name)
 
     return 0;
 }
+
+static int write_active_l1_table(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l1_table;
+    int i, ret;
+
+    l1_table = g_malloc(s->l1_size * sizeof(uint64_t));
+    for (i = 0; i < s->l1_size; i++) {
+        l1_table[i] = cpu_to_be64(s->l1_table[i]);
+    }
+    ret = bdrv_pwrite_sync(bs->file, s->l1_table_offset, l1_table,
+                           s->l1_size * sizeof(uint64_t));
+    g_free(l1_table);
+
+    return ret;
+}
+
+/*
+ * Drop the VM state area of the current image, so that a snapshot taken
+ * next has none and the VM state can be written to the current image
+ * while it is in use.
+ */
+int qcow2_snapshot_discard_vmstate(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *old_l1_table, *l2_table;
+    int nb_entries, i, j, ret;
+
+    nb_entries = s->l1_size - s->l1_vm_state_index;
+    if (nb_entries <= 0) {
+        return 0;
+    }
+
+    /* nothing cached may be written back to the clusters once free */
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Unlink the L2 tables first: a failure later only leaks clusters */
+    old_l1_table = g_malloc(nb_entries * sizeof(uint64_t));
+    memcpy(old_l1_table, s->l1_table + s->l1_vm_state_index,
+           nb_entries * sizeof(uint64_t));
+    memset(s->l1_table + s->l1_vm_state_index, 0,
+           nb_entries * sizeof(uint64_t));
+
+    ret = write_active_l1_table(bs);
+    if (ret < 0) {
+        memcpy(s->l1_table + s->l1_vm_state_index, old_l1_table,
+               nb_entries * sizeof(uint64_t));
+        goto out;
+    }
+
+    /*
+     * Snapshots may share the L2 tables, so leave them as they are and
+     * only drop the references of the current image.
+     */
+    for (i = 0; i < nb_entries; i++) {
+        uint64_t l2_offset = old_l1_table[i] & L1E_OFFSET_MASK;
+
+        if (!l2_offset) {
+            continue;
+        }
+        ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
+                              (void **) &l2_table);
+        if (ret < 0) {
+            goto out;
+        }
+        for (j = 0; j < s->l2_size; j++) {
+            qcow2_free_any_clusters(bs, be64_to_cpu(l2_table[j]), 1);
+        }
+        ret = qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+        if (ret < 0) {
+            goto out;
+        }
+        qcow2_free_clusters(bs, l2_offset, s->cluster_size);
+    }
+
+#ifdef DEBUG_ALLOC
+    {
+        BdrvCheckResult result = {0};
+        qcow2_check_refcounts(bs, &result);
+    }
+#endif
+out:
+    g_free(old_l1_table);
+    return ret;
+}
+
+/*
+ * Hand the VM state area of the current image over to a snapshot taken
+ * after qcow2_snapshot_discard_vmstate().  The clusters are referenced
+ * by the snapshot instead of the current image, so no refcount changes.
+ */
+int qcow2_snapshot_take_vmstate(BlockDriverState *bs, const char *snapshot_id,
+                                uint64_t vm_state_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowSnapshot *sn;
+    uint64_t *sn_l1_table = NULL;
+    int64_t sn_l1_table_offset, old_l1_table_offset;
+    int sn_l1_size, old_l1_size;
+    int snapshot_index, i, ret;
+
+    snapshot_index = find_snapshot_by_id(bs, snapshot_id);
+    if (snapshot_index < 0) {
+        return -ENOENT;
+    }
+    sn = &s->snapshots[snapshot_index];
+    if (sn->vm_state_size) {
+        return -EEXIST;
+    }
+
+    /* the tables the snapshot gets must be on disk first */
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    sn_l1_size = MAX(sn->l1_size, s->l1_size);
+    sn_l1_table = g_malloc0(align_offset(sn_l1_size * sizeof(uint64_t), 512));
+    ret = bdrv_pread(bs->file, sn->l1_table_offset, sn_l1_table,
+                     sn->l1_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+    for (i = s->l1_vm_state_index; i < s->l1_size; i++) {
+        if (sn_l1_table[i]) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        sn_l1_table[i] = cpu_to_be64(s->l1_table[i]);
+    }
+
+    /* The VM state may have grown the L1 table: the snapshot's must too */
+    sn_l1_table_offset = sn->l1_table_offset;
+    if (sn_l1_size > sn->l1_size) {
+        sn_l1_table_offset = qcow2_alloc_clusters(bs,
+                                                  sn_l1_size * sizeof(uint64_t));
+        if (sn_l1_table_offset < 0) {
+            ret = sn_l1_table_offset;
+            goto fail;
+        }
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            goto fail_free;
+        }
+        ret = bdrv_pwrite_sync(bs->file, sn_l1_table_offset, sn_l1_table,
+                               sn_l1_size * sizeof(uint64_t));
+        if (ret < 0) {
+            goto fail_free;
+        }
+    }
+
+    /*
+     * Unlink the VM state from the current image before linking it to the
+     * snapshot: if we fail in between, clusters leak but none is shared
+     * without its refcount saying so.
+     */
+    for (i = s->l1_vm_state_index; i < s->l1_size; i++) {
+        s->l1_table[i] = 0;
+    }
+    ret = write_active_l1_table(bs);
+    if (ret < 0) {
+        for (i = s->l1_vm_state_index; i < s->l1_size; i++) {
+            s->l1_table[i] = be64_to_cpu(sn_l1_table[i]);
+        }
+        goto fail_free;
+    }
+
+    if (sn_l1_table_offset == sn->l1_table_offset) {
+        ret = bdrv_pwrite_sync(bs->file, sn_l1_table_offset, sn_l1_table,
+                               sn_l1_size * sizeof(uint64_t));
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    old_l1_table_offset = sn->l1_table_offset;
+    old_l1_size = sn->l1_size;
+    sn->l1_table_offset = sn_l1_table_offset;
+    sn->l1_size = sn_l1_size;
+    sn->vm_state_size = vm_state_size;
+
+    ret = qcow2_write_snapshots(bs);
+    if (ret < 0) {
+        sn->l1_table_offset = old_l1_table_offset;
+        sn->l1_size = old_l1_size;
+        sn->vm_state_size = 0;
+        goto fail;
+    }
+
+    if (sn_l1_table_offset != old_l1_table_offset) {
+        qcow2_free_clusters(bs, old_l1_table_offset,
+                            old_l1_size * sizeof(uint64_t));
+    }
+    g_free(sn_l1_table);
+
+#ifdef DEBUG_ALLOC
+    {
+        BdrvCheckResult result = {0};
+        qcow2_check_refcounts(bs, &result);
+    }
+#endif
+    return 0;
+
+fail_free:
+    if (sn_l1_table_offset != sn->l1_table_offset) {
+        qcow2_free_clusters(bs, sn_l1_table_offset,
+                            sn_l1_size * sizeof(uint64_t));
+    }
+fail:
+    g_free(sn_l1_table);
+    return ret;
+}
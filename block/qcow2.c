@@ -214,12 +214,105 @@ static void report_unsupported_feature(BlockDriverState *bs,
     }
 }
 
+/*
+ * Sets the dirty bit and flushes afterwards if necessary.
+ *
+ * The incompatible_features bit is only set if the image file header was
+ * updated successfully.  Therefore it is not required to check the return
+ * value of this function.
+ */
+int qcow2_mark_dirty(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t val;
+    int ret;
+
+    assert(s->qcow_version >= 3);
+
+    if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
+        return 0; /* already dirty */
+    }
+
+    val = cpu_to_be64(s->incompatible_features | QCOW2_INCOMPAT_DIRTY);
+    ret = bdrv_pwrite(bs->file, offsetof(QCowHeader, incompatible_features),
+                      &val, sizeof(val));
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Only treat image as dirty if the header was updated successfully */
+    s->incompatible_features |= QCOW2_INCOMPAT_DIRTY;
+    return 0;
+}
+
+/*
+ * Clears the dirty bit and flushes before if necessary.  Only call this
+ * function when there are no pending requests, it does not guard against
+ * concurrent requests dirtying the image.
+ */
+static int qcow2_mark_clean(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (!(s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
+        return 0;
+    }
+
+    /* The L2 tables reference clusters whose refcounts are only in the
+     * refcount cache, so both caches must hit the disk before the bit
+     * goes away. */
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->incompatible_features &= ~QCOW2_INCOMPAT_DIRTY;
+    return qcow2_update_header(bs);
+}
+
+/*
+ * Turns a -drive l2-cache-size/refcount-cache-size value into a number of
+ * cached tables.  0 keeps the default and BDRV_CACHE_SIZE_FULL asks for
+ * full_tables, enough to hold the metadata of the whole image.
+ */
+static int qcow2_cache_tables(BDRVQcowState *s, int64_t size,
+                              int64_t full_tables, int min_tables,
+                              int default_tables)
+{
+    int64_t tables;
+
+    if (size == 0) {
+        return default_tables;
+    } else if (size == BDRV_CACHE_SIZE_FULL) {
+        tables = full_tables;
+    } else {
+        tables = size >> s->cluster_bits;
+    }
+
+    return MIN(MAX(tables, min_tables), INT_MAX >> s->cluster_bits);
+}
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
     int len, i, ret = 0;
     QCowHeader header;
     uint64_t ext_end;
+    int l2_cache_tables, refcount_cache_tables, refblock_bits;
+    int64_t file_length;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -287,16 +380,20 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     s->compatible_features      = header.compatible_features;
     s->autoclear_features       = header.autoclear_features;
 
-    if (s->incompatible_features != 0) {
+    if (s->incompatible_features & ~QCOW2_INCOMPAT_MASK) {
         void *feature_table = NULL;
         qcow2_read_extensions(bs, header.header_length, ext_end,
                               &feature_table);
         report_unsupported_feature(bs, feature_table,
-                                   s->incompatible_features);
+                                   s->incompatible_features &
+                                   ~QCOW2_INCOMPAT_MASK);
         ret = -ENOTSUP;
         goto fail;
     }
 
+    s->use_lazy_refcounts = s->compatible_features &
+                            QCOW2_COMPAT_LAZY_REFCOUNTS;
+
     /* Check support for various header values */
     if (header.refcount_order != 4) {
         report_unsupported(bs, "%d bit reference counts",
@@ -357,9 +454,26 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         }
     }
 
-    /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
+    /* alloc L2 table/refcount block cache; a requested L2 cache larger than
+     * the L1 table cannot hold more than one table per L1 entry */
+    l2_cache_tables = qcow2_cache_tables(s, bs->l2_cache_size,
+                                         s->l1_vm_state_index,
+                                         MIN_L2_CACHE_SIZE, L2_CACHE_SIZE);
+    if (bs->l2_cache_size != 0) {
+        l2_cache_tables = MAX(MIN(l2_cache_tables, s->l1_size),
+                              MIN_L2_CACHE_SIZE);
+    }
+
+    file_length = MAX(bdrv_getlength(bs->file), 0);
+    refblock_bits = 2 * s->cluster_bits - REFCOUNT_SHIFT;
+    refcount_cache_tables =
+        qcow2_cache_tables(s, bs->refcount_cache_size,
+                           DIV_ROUND_UP(MAX(header.size, file_length),
+                                        1ULL << refblock_bits) + 1,
+                           MIN_REFCOUNT_CACHE_SIZE, REFCOUNT_CACHE_SIZE);
+
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_tables);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_tables);
 
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -368,12 +482,18 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     s->cluster_cache_offset = -1;
     s->flags = flags;
 
+    if (!bs->read_only) {
+        s->reserve_size = align_offset(bs->cluster_reservation,
+                                       s->cluster_size);
+    }
+
     ret = qcow2_refcount_init(bs);
     if (ret != 0) {
         goto fail;
     }
 
     QLIST_INIT(&s->cluster_allocs);
+    QLIST_INIT(&s->l2_allocs);
 
     /* read qcow2 extensions */
     if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL)) {
@@ -411,6 +531,25 @@ static int qcow2_open(BlockDriverState *bs, int flags)
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_mutex_init(&s->l1_lock);
+
+    /* Repair image if dirty.  An incoming migration must leave the image
+     * alone, the source is still running and writing to it. */
+    if (!(flags & (BDRV_O_CHECK | BDRV_O_INCOMING)) && !bs->read_only &&
+        (s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
+        BdrvCheckResult result = {0};
+
+        ret = qcow2_check_refcounts(bs, &result,
+                                    BDRV_FIX_ERRORS | BDRV_FIX_LEAKS);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        ret = qcow2_mark_clean(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
 
 #ifdef DEBUG_ALLOC
     {
@@ -532,6 +671,8 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     while (remaining_sectors != 0) {
 
         /* prepare next request */
+        qcow2_prefetch_l2_table(bs, sector_num << 9);
+
         cur_nr_sectors = remaining_sectors;
         if (s->crypt_method) {
             cur_nr_sectors = MIN(cur_nr_sectors,
@@ -704,6 +845,8 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     while (remaining_sectors != 0) {
 
         trace_qcow2_writev_start_part(qemu_coroutine_self());
+        qcow2_prefetch_l2_table(bs, sector_num << 9);
+
         index_in_cluster = sector_num & (s->cluster_sectors - 1);
         n_end = index_in_cluster + remaining_sectors;
         if (s->crypt_method &&
@@ -783,11 +926,20 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_release_reservation(bs);
     g_free(s->l1_table);
 
     qcow2_cache_flush(bs, s->l2_table_cache);
     qcow2_cache_flush(bs, s->refcount_block_cache);
 
+    /* An image opened for qemu-img check stays dirty unless the check
+     * repaired everything; qcow2_check() clears the bit in that case.  The
+     * destination of a migration does not own the image yet. */
+    if (!bs->read_only && !(s->flags & (BDRV_O_CHECK | BDRV_O_INCOMING))) {
+        qcow2_mark_clean(bs);
+    }
+
     qcow2_cache_destroy(bs, s->l2_table_cache);
     qcow2_cache_destroy(bs, s->refcount_block_cache);
 
@@ -800,10 +952,18 @@ static void qcow2_close(BlockDriverState *bs)
     qcow2_free_snapshots(bs);
 }
 
+static int qcow2_flush_metadata(BlockDriverState *bs)
+{
+    if (bs->read_only) {
+        return 0;
+    }
+    return qcow2_mark_clean(bs);
+}
+
 static void qcow2_invalidate_cache(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
-    int flags = s->flags;
+    int flags = s->flags & ~BDRV_O_INCOMING;
     AES_KEY aes_encrypt_key;
     AES_KEY aes_decrypt_key;
     uint32_t crypt_method = 0;
@@ -952,7 +1112,16 @@ int qcow2_update_header(BlockDriverState *bs)
 
     /* Feature table */
     Qcow2Feature features[] = {
-        /* no feature defined yet */
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_DIRTY_BITNR,
+            .name = "dirty bit",
+        },
+        {
+            .type = QCOW2_FEAT_TYPE_COMPATIBLE,
+            .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
+            .name = "lazy refcounts",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1135,6 +1304,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         header.crypt_method = cpu_to_be32(QCOW_CRYPT_NONE);
     }
 
+    if (flags & BLOCK_FLAG_LAZY_REFCOUNTS) {
+        header.compatible_features |=
+            cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
+    }
+
     ret = bdrv_pwrite(bs, 0, &header, sizeof(header));
     if (ret < 0) {
         goto out;
@@ -1248,6 +1422,8 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
                     options->value.s);
                 return -EINVAL;
             }
+        } else if (!strcmp(options->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
+            flags |= options->value.n ? BLOCK_FLAG_LAZY_REFCOUNTS : 0;
         }
         options++;
     }
@@ -1258,6 +1434,12 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
         return -EINVAL;
     }
 
+    if (version < 3 && (flags & BLOCK_FLAG_LAZY_REFCOUNTS)) {
+        fprintf(stderr, "Lazy refcounts only supported with compatibility "
+                "level 1.1 and above (use compat=1.1 or greater)\n");
+        return -EINVAL;
+    }
+
     return qcow2_create2(filename, sectors, backing_file, backing_fmt, flags,
                          cluster_size, prealloc, options, version);
 }
@@ -1412,8 +1594,15 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
             goto fail;
         }
     } else {
+        /* In coroutine context, L2 allocation expects s->lock to be held */
+        if (qemu_in_coroutine()) {
+            qemu_co_mutex_lock(&s->lock);
+        }
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
+        if (qemu_in_coroutine()) {
+            qemu_co_mutex_unlock(&s->lock);
+        }
         if (!cluster_offset) {
             ret = -EIO;
             goto fail;
@@ -1444,10 +1633,12 @@ static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
         return ret;
     }
 
-    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
-    if (ret < 0) {
-        qemu_co_mutex_unlock(&s->lock);
-        return ret;
+    if (qcow2_need_accurate_refcounts(s)) {
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            return ret;
+        }
     }
     qemu_co_mutex_unlock(&s->lock);
 
@@ -1467,11 +1658,30 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static void qcow2_get_metadata_cache_stats(BlockDriverState *bs,
+                                           BlockMetadataCacheStats *stats)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    qcow2_cache_get_stats(s->l2_table_cache, &stats->l2_hits,
+                          &stats->l2_misses);
+    qcow2_cache_get_stats(s->refcount_block_cache, &stats->refcount_hits,
+                          &stats->refcount_misses);
+}
+
 
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
-    return qcow2_check_refcounts(bs, result, fix);
+    int ret = qcow2_check_refcounts(bs, result, fix);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (fix && result->check_errors == 0 && result->corruptions == 0) {
+        return qcow2_mark_clean(bs);
+    }
+    return ret;
 }
 
 #if 0
@@ -1562,6 +1772,11 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .type = OPT_STRING,
         .help = "Preallocation mode (allowed values: off, metadata)"
     },
+    {
+        .name = BLOCK_OPT_LAZY_REFCOUNTS,
+        .type = OPT_FLAG,
+        .help = "Postpone refcount updates",
+    },
     { NULL }
 };
 
@@ -1590,7 +1805,10 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_delete   = qcow2_snapshot_delete,
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
+    .bdrv_snapshot_discard_vmstate = qcow2_snapshot_discard_vmstate,
+    .bdrv_snapshot_take_vmstate    = qcow2_snapshot_take_vmstate,
     .bdrv_get_info      = qcow2_get_info,
+    .bdrv_get_metadata_cache_stats = qcow2_get_metadata_cache_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -1598,6 +1816,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_change_backing_file   = qcow2_change_backing_file,
 
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
+    .bdrv_flush_metadata        = qcow2_flush_metadata,
 
     .create_options = qcow2_create_options,
     .bdrv_check = qcow2_check,
@@ -407,6 +407,20 @@ static int raw_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+static int raw_preallocate(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+#ifdef CONFIG_FALLOCATE
+    BDRVRawState *s = bs->opaque;
+
+    if (fallocate(s->fd, 0, offset, bytes) < 0) {
+        return -errno;
+    }
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
 #ifdef __OpenBSD__
 static int64_t raw_getlength(BlockDriverState *bs)
 {
@@ -745,6 +759,7 @@ static BlockDriver bdrv_file = {
     .bdrv_aio_flush = raw_aio_flush,
 
     .bdrv_truncate = raw_truncate,
+    .bdrv_preallocate = raw_preallocate,
     .bdrv_getlength = raw_getlength,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
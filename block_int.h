@@ -33,6 +33,7 @@
 
 #define BLOCK_FLAG_ENCRYPT	1
 #define BLOCK_FLAG_COMPAT6	4
+#define BLOCK_FLAG_LAZY_REFCOUNTS 8
 
 #define BLOCK_IO_LIMIT_READ     0
 #define BLOCK_IO_LIMIT_WRITE    1
@@ -41,6 +42,8 @@
 #define BLOCK_IO_SLICE_TIME     100000000
 #define NANOSECONDS_PER_SECOND  1000000000.0
 
+#define BDRV_CACHE_SIZE_FULL    -1
+
 #define BLOCK_OPT_SIZE          "size"
 #define BLOCK_OPT_ENCRYPT       "encryption"
 #define BLOCK_OPT_COMPAT6       "compat6"
@@ -51,6 +54,7 @@
 #define BLOCK_OPT_PREALLOC      "preallocation"
 #define BLOCK_OPT_SUBFMT        "subformat"
 #define BLOCK_OPT_COMPAT_LEVEL  "compat"
+#define BLOCK_OPT_LAZY_REFCOUNTS "lazy_refcounts"
 
 typedef struct BdrvTrackedRequest BdrvTrackedRequest;
 
@@ -64,6 +68,13 @@ typedef struct BlockIOBaseValue {
     uint64_t ios[2];
 } BlockIOBaseValue;
 
+typedef struct BlockMetadataCacheStats {
+    uint64_t l2_hits;
+    uint64_t l2_misses;
+    uint64_t refcount_hits;
+    uint64_t refcount_misses;
+} BlockMetadataCacheStats;
+
 typedef struct BlockJob BlockJob;
 
 /**
@@ -182,6 +193,13 @@ struct BlockDriver {
      */
     void (*bdrv_invalidate_cache)(BlockDriverState *bs);
 
+    /*
+     * Writes out metadata whose update is deferred while the image is open,
+     * so that another process can take the image over (e.g. the destination
+     * of a migration on shared storage).
+     */
+    int (*bdrv_flush_metadata)(BlockDriverState *bs);
+
     /*
      * Flushes all data that was already written to the OS all the way down to
      * the disk (for example raw-posix calls fsync()).
@@ -197,6 +215,8 @@ struct BlockDriver {
 
     const char *protocol_name;
     int (*bdrv_truncate)(BlockDriverState *bs, int64_t offset);
+    int (*bdrv_preallocate)(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes);
     int64_t (*bdrv_getlength)(BlockDriverState *bs);
     int64_t (*bdrv_get_allocated_file_size)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
@@ -211,7 +231,13 @@ struct BlockDriver {
                               QEMUSnapshotInfo **psn_info);
     int (*bdrv_snapshot_load_tmp)(BlockDriverState *bs,
                                   const char *snapshot_name);
+    int (*bdrv_snapshot_discard_vmstate)(BlockDriverState *bs);
+    int (*bdrv_snapshot_take_vmstate)(BlockDriverState *bs,
+                                      const char *snapshot_id,
+                                      uint64_t vm_state_size);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    void (*bdrv_get_metadata_cache_stats)(BlockDriverState *bs,
+                                          BlockMetadataCacheStats *stats);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, const uint8_t *buf,
                              int64_t pos, int size);
@@ -309,6 +335,16 @@ struct BlockDriverState {
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
 
+    /* Requested size in bytes of the format driver's L2 table and refcount
+     * block caches; 0 selects the driver default, BDRV_CACHE_SIZE_FULL asks
+     * for enough tables to cover the whole image. */
+    int64_t l2_cache_size;
+    int64_t refcount_cache_size;
+
+    /* Allocate new data clusters from reservations of this many bytes of
+     * the image file (0 allocates cluster by cluster) */
+    int64_t cluster_reservation;
+
     /* Whether the disk can expand beyond total_sectors */
     int growable;
 
@@ -340,6 +376,9 @@ int get_tmp_filename(char *filename, int size);
 
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits);
+void bdrv_set_metadata_cache_size(BlockDriverState *bs, int64_t l2_size,
+                                  int64_t refcount_size);
+void bdrv_set_cluster_reservation(BlockDriverState *bs, int64_t size);
 
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
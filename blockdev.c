@@ -254,6 +254,29 @@ static int parse_block_error_action(const char *buf, int is_read)
     }
 }
 
+static int parse_metadata_cache_size(QemuOpts *opts, const char *name,
+                                     int64_t *size)
+{
+    const char *buf = qemu_opt_get(opts, name);
+    char *end;
+
+    *size = 0;
+    if (!buf) {
+        return 0;
+    }
+    if (!strcmp(buf, "full")) {
+        *size = BDRV_CACHE_SIZE_FULL;
+        return 0;
+    }
+
+    *size = strtosz_suffix(buf, &end, STRTOSZ_DEFSUFFIX_B);
+    if (*size < 0 || *end) {
+        error_report("'%s' invalid %s", buf, name);
+        return -1;
+    }
+    return 0;
+}
+
 static bool do_check_io_limits(BlockIOLimit *io_limits)
 {
     bool bps_flag;
@@ -293,6 +316,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     const char *devaddr;
     DriveInfo *dinfo;
     BlockIOLimit io_limits;
+    int64_t l2_cache_size, refcount_cache_size;
     int snapshot = 0;
     bool copy_on_read;
     int ret;
@@ -431,6 +455,13 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         return NULL;
     }
 
+    /* format driver metadata caches */
+    if (parse_metadata_cache_size(opts, "l2-cache-size", &l2_cache_size) < 0 ||
+        parse_metadata_cache_size(opts, "refcount-cache-size",
+                                  &refcount_cache_size) < 0) {
+        return NULL;
+    }
+
     on_write_error = BLOCK_ERR_STOP_ENOSPC;
     if ((buf = qemu_opt_get(opts, "werror")) != NULL) {
         if (type != IF_IDE && type != IF_SCSI && type != IF_VIRTIO && type != IF_NONE) {
@@ -542,6 +573,12 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     /* disk I/O throttling */
     bdrv_set_io_limits(dinfo->bdrv, &io_limits);
 
+    bdrv_set_metadata_cache_size(dinfo->bdrv, l2_cache_size,
+                                 refcount_cache_size);
+    bdrv_set_cluster_reservation(dinfo->bdrv,
+                                 qemu_opt_get_size(opts, "cluster-reservation",
+                                                   0));
+
     switch(type) {
     case IF_IDE:
     case IF_SCSI:
@@ -18,12 +18,14 @@
 #include "qemu-timer.h"
 #include "qemu-char.h"
 #include "buffered_file.h"
+#include "iov.h"
 
 //#define DEBUG_BUFFERED_FILE
 
 typedef struct QEMUFileBuffered
 {
     BufferedPutFunc *put_buffer;
+    BufferedWritevFunc *writev;
     BufferedPutReadyFunc *put_ready;
     BufferedWaitForUnfreezeFunc *wait_for_unfreeze;
     BufferedCloseFunc *close;
@@ -170,6 +172,68 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, in
     return offset;
 }
 
+static int buffered_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                  int64_t pos)
+{
+    QEMUFileBuffered *s = opaque;
+    size_t size = iov_size(iov, iovcnt);
+    size_t offset = 0;
+    ssize_t ret;
+    int i, error;
+
+    DPRINTF("putting %zu bytes in %d pieces at %" PRId64 "\n",
+            size, iovcnt, pos);
+
+    error = qemu_file_get_error(s->file);
+    if (error) {
+        DPRINTF("flush when error, bailing: %s\n", strerror(-error));
+        return error;
+    }
+
+    DPRINTF("unfreezing output\n");
+    s->freeze_output = 0;
+
+    buffered_flush(s);
+
+    while (!s->freeze_output && offset < size) {
+        if (s->bytes_xfer > s->xfer_limit) {
+            DPRINTF("transfer limit exceeded when putting\n");
+            break;
+        }
+
+        ret = s->writev(s->opaque, iov, iovcnt, offset);
+        if (ret == -EAGAIN) {
+            DPRINTF("backend not ready, freezing\n");
+            s->freeze_output = 1;
+            break;
+        }
+
+        if (ret <= 0) {
+            DPRINTF("error putting\n");
+            qemu_file_set_error(s->file, ret);
+            return -EINVAL;
+        }
+
+        DPRINTF("put %zd byte(s)\n", ret);
+        offset += ret;
+        s->bytes_xfer += ret;
+    }
+
+    /* the buffers are not ours, so copy what is left */
+    DPRINTF("buffering %zu bytes\n", size - offset);
+    for (i = 0; i < iovcnt; i++) {
+        if (offset < iov[i].iov_len) {
+            buffered_append(s, (uint8_t *)iov[i].iov_base + offset,
+                            iov[i].iov_len - offset);
+            offset = 0;
+        } else {
+            offset -= iov[i].iov_len;
+        }
+    }
+
+    return size;
+}
+
 static int buffered_close(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
@@ -265,6 +329,7 @@ static void buffered_rate_tick(void *opaque)
 QEMUFile *qemu_fopen_ops_buffered(void *opaque,
                                   size_t bytes_per_sec,
                                   BufferedPutFunc *put_buffer,
+                                  BufferedWritevFunc *writev,
                                   BufferedPutReadyFunc *put_ready,
                                   BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
                                   BufferedCloseFunc *close)
@@ -276,6 +341,7 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
     s->opaque = opaque;
     s->xfer_limit = bytes_per_sec / 10;
     s->put_buffer = put_buffer;
+    s->writev = writev;
     s->put_ready = put_ready;
     s->wait_for_unfreeze = wait_for_unfreeze;
     s->close = close;
@@ -284,6 +350,9 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
                              buffered_close, buffered_rate_limit,
                              buffered_set_rate_limit,
 			     buffered_get_rate_limit);
+    if (writev) {
+        qemu_file_set_writev(s->file, buffered_writev_buffer);
+    }
 
     s->timer = qemu_new_timer_ms(rt_clock, buffered_rate_tick, s);
 
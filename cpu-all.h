@@ -396,7 +396,11 @@ DECLARE_TLS(CPUArchState *,cpu_single_env);
 #define CPU_INTERRUPT_TGT_INT_2   0x0800
 #define CPU_INTERRUPT_TGT_INT_3   0x2000
 
-/* First unused bit: 0x4000.  */
+/* Flush the TLB before running more guest code.  Used to flush the TLB
+   of a vCPU that runs on another thread (multi-threaded TCG).  */
+#define CPU_INTERRUPT_TLB_FLUSH   0x4000
+
+/* First unused bit: 0x8000.  */
 
 /* The set of all bits that should be masked when single-stepping.  */
 #define CPU_INTERRUPT_SSTEP_MASK \
@@ -424,6 +428,9 @@ void cpu_reset_interrupt(CPUArchState *env, int mask);
 
 void cpu_exit(CPUArchState *s);
 
+bool tb_evict_requested(void);
+void tb_evict_pending(CPUArchState *env);
+
 bool qemu_cpu_has_work(CPUArchState *env);
 
 /* Breakpoint/watchpoint flags */
@@ -454,6 +461,7 @@ void cpu_watchpoint_remove_all(CPUArchState *env, int mask);
 void cpu_single_step(CPUArchState *env, int enabled);
 int cpu_is_stopped(CPUArchState *env);
 void run_on_cpu(CPUArchState *env, void (*func)(void *data), void *data);
+void async_run_on_cpu(CPUArchState *env, void (*func)(void *data), void *data);
 
 #if !defined(CONFIG_USER_ONLY)
 
@@ -485,6 +493,8 @@ typedef struct RAMBlock {
 
 typedef struct RAMList {
     uint8_t *phys_dirty;
+    /* pages with MIGRATION_DIRTY_FLAG set in phys_dirty */
+    ram_addr_t dirty_pages;
     QLIST_HEAD(, RAMBlock) blocks;
 } RAMList;
 extern RAMList ram_list;
@@ -64,8 +64,10 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
     if (max_cycles > CF_COUNT_MASK)
         max_cycles = CF_COUNT_MASK;
 
+    tcg_tb_lock();
     tb = tb_gen_code(env, orig_tb->pc, orig_tb->cs_base, orig_tb->flags,
                      max_cycles);
+    tcg_tb_unlock();
     env->current_tb = tb;
     /* execute the generated code */
     next_tb = tcg_qemu_tb_exec(env, tb->tc_ptr);
@@ -76,8 +78,44 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
            the TB starts executing.  */
         cpu_pc_from_tb(env, tb);
     }
+    tcg_tb_lock();
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
+    tcg_tb_unlock();
+}
+
+typedef struct TBLookupDesc {
+    CPUArchState *env;
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+    tb_page_addr_t phys_page1;
+} TBLookupDesc;
+
+static bool tb_cmp(const void *p, const void *d)
+{
+    const TranslationBlock *tb = p;
+    const TBLookupDesc *desc = d;
+
+    if (tb->pc == desc->pc &&
+        tb->page_addr[0] == desc->phys_page1 &&
+        tb->cs_base == desc->cs_base &&
+        tb->flags == desc->flags) {
+        /* check next page if needed */
+        if (tb->page_addr[1] != -1) {
+            tb_page_addr_t phys_page2;
+            target_ulong virt_page2;
+
+            virt_page2 = (desc->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            phys_page2 = get_page_addr_code(desc->env, virt_page2);
+            if (tb->page_addr[1] == phys_page2) {
+                return true;
+            }
+        } else {
+            return true;
+        }
+    }
+    return false;
 }
 
 static TranslationBlock *tb_find_slow(CPUArchState *env,
@@ -85,52 +123,27 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
                                       target_ulong cs_base,
                                       uint64_t flags)
 {
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
+    TranslationBlock *tb;
+    TBLookupDesc desc;
+    tb_page_addr_t phys_pc;
+    uint32_t h;
 
     tb_invalidated_flag = 0;
 
     /* find translated block using physical mappings */
     phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
-            } else {
-                goto found;
-            }
-        }
-        ptb1 = &tb->phys_hash_next;
-    }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tb_phys_hash[h];
-        tb_phys_hash[h] = tb;
+    desc.env = env;
+    desc.pc = pc;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+    desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    h = tb_hash_func(phys_pc, pc, flags, cs_base);
+    tb = qht_lookup(&tb_phys_hash, tb_cmp, &desc, h);
+    if (!tb) {
+        /* if no translated code available, then translate it now */
+        tb = tb_gen_code(env, pc, cs_base, flags, 0);
     }
+
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
@@ -154,6 +167,29 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
     return tb;
 }
 
+/* Called from generated code ending with an indirect branch: return the
+   host code of the next TB if it is in the virtual PC cache and nothing
+   needs the attention of cpu_exec(), else the epilogue, which returns to
+   cpu_exec() as exit_tb(0) would.  Only the fast path is tried, so this
+   never translates and never takes tb_lock.  */
+void *helper_lookup_tb_ptr(CPUArchState *env)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    if (unlikely(env->interrupt_request || env->exit_request)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    return tb->tc_ptr;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 CPUDebugExcpHandler *cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -268,6 +304,19 @@ int cpu_exec(CPUArchState *env)
             for(;;) {
                 interrupt_request = env->interrupt_request;
                 if (unlikely(interrupt_request)) {
+#if !defined(CONFIG_USER_ONLY)
+                    /* with tcg_threads=multi, interrupt_request and the
+                       interrupt controllers are protected by the global
+                       mutex; a cpu_loop_exit() below drops it */
+                    bool locked = qemu_tcg_mt_lock_iothread();
+
+                    interrupt_request = env->interrupt_request;
+                    if (interrupt_request & CPU_INTERRUPT_TLB_FLUSH) {
+                        env->interrupt_request &= ~CPU_INTERRUPT_TLB_FLUSH;
+                        tlb_flush(env, 1);
+                        next_tb = 0;
+                    }
+#endif
                     if (unlikely(env->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -518,6 +567,9 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+#if !defined(CONFIG_USER_ONLY)
+                    qemu_tcg_mt_unlock_iothread(locked);
+#endif
                 }
                 if (unlikely(env->exit_request)) {
                     env->exit_request = 0;
@@ -543,7 +595,7 @@ int cpu_exec(CPUArchState *env)
 #endif
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
-                spin_lock(&tb_lock);
+                tcg_tb_lock();
                 tb = tb_find_fast(env);
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
@@ -554,6 +606,15 @@ int cpu_exec(CPUArchState *env)
                     next_tb = 0;
                     tb_invalidated_flag = 0;
                 }
+#ifdef TARGET_HAS_HOT_TRACES
+                /* cold TBs count their executions and come back here
+                   when they are hot; retranslate them as traces */
+                if (tb->cflags == 0 && !use_icount &&
+                    tb->exec_count >= TB_TRACE_THRESHOLD) {
+                    tb = tb_gen_trace(env, tb);
+                    next_tb = 0;
+                }
+#endif
 #ifdef CONFIG_DEBUG_EXEC
                 qemu_log_mask(CPU_LOG_EXEC, "Trace %p [" TARGET_FMT_lx "] %s\n",
                              tb->tc_ptr, tb->pc,
@@ -562,10 +623,12 @@ int cpu_exec(CPUArchState *env)
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
                    jump. */
-                if (next_tb != 0 && tb->page_addr[1] == -1) {
+                if (next_tb != 0 && tb->page_addr[1] == -1 &&
+                    tb_is_valid((TranslationBlock *)(next_tb & ~3)) &&
+                    tb_is_valid(tb)) {
                     tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
                 }
-                spin_unlock(&tb_lock);
+                tcg_tb_unlock();
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -577,7 +640,14 @@ int cpu_exec(CPUArchState *env)
                     tc_ptr = tb->tc_ptr;
                     /* execute the generated code */
                     next_tb = tcg_qemu_tb_exec(env, tc_ptr);
-                    if ((next_tb & 3) == 2) {
+                    if ((next_tb & 3) == 2 && !use_icount) {
+                        /* Kicked by cpu_unlink_tb() before the TB ran,
+                           see gen-icount.h.  */
+                        tb = (TranslationBlock *)(next_tb & ~3);
+                        env->icount_decr.u16.high = 0;
+                        cpu_pc_from_tb(env, tb);
+                        next_tb = 0;
+                    } else if ((next_tb & 3) == 2) {
                         /* Instruction counter expired.  */
                         int insns_left;
                         tb = (TranslationBlock *)(next_tb & ~3);
@@ -613,6 +683,14 @@ int cpu_exec(CPUArchState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+#if !defined(CONFIG_USER_ONLY)
+            /* the longjmp may have left a locked section */
+            tcg_tb_lock_reset();
+            qemu_tcg_mt_reset_iothread();
+#if defined(TARGET_I386)
+            cpu_x86_lock_reset();
+#endif
+#endif
         }
     } /* for(;;) */
 
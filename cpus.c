@@ -328,6 +328,10 @@ void configure_icount(const char *option)
     if (!option) {
         return;
     }
+    if (mttcg_enabled) {
+        fprintf(stderr, "-icount is not supported with tcg_threads=multi\n");
+        exit(1);
+    }
 
     icount_warp_timer = qemu_new_timer_ns(rt_clock, icount_warp_rt, NULL);
     if (strcmp(option, "auto") != 0) {
@@ -471,7 +475,10 @@ static void cpu_signal(int sig)
     if (cpu_single_env) {
         cpu_exit(cpu_single_env);
     }
-    exit_request = 1;
+    /* with one thread per vCPU, the kick is only for this thread's vCPU */
+    if (!mttcg_enabled) {
+        exit_request = 1;
+    }
 }
 
 #ifdef CONFIG_LINUX
@@ -614,12 +621,26 @@ static void qemu_tcg_init_cpu_signals(void)
 QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
+/* set while this thread holds qemu_global_mutex through
+   qemu_mutex_lock_iothread() */
+static DEFINE_TLS(bool, iothread_locked);
 
 static QemuThread io_thread;
 
 static QemuThread *tcg_cpu_thread;
 static QemuCond *tcg_halt_cond;
 
+/* each TCG vCPU runs on its own thread (-machine tcg_threads=multi) */
+bool mttcg_enabled;
+
+/* Multi-threaded TCG: number of vCPUs inside cpu_exec(), and whether an
+   exclusive section is waiting for them or running.  Both are protected
+   by qemu_global_mutex.  */
+static int tcg_running_cpus;
+static bool tcg_exclusive_pending;
+static QemuCond tcg_exclusive_cond;
+static QemuCond tcg_exclusive_resume;
+
 /* cpu creation */
 static QemuCond qemu_cpu_cond;
 /* system init */
@@ -633,6 +654,8 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
+    qemu_cond_init(&tcg_exclusive_cond);
+    qemu_cond_init(&tcg_exclusive_resume);
     qemu_mutex_init(&qemu_global_mutex);
 
     qemu_thread_get_self(&io_thread);
@@ -649,6 +672,7 @@ void run_on_cpu(CPUArchState *env, void (*func)(void *data), void *data)
 
     wi.func = func;
     wi.data = data;
+    wi.free = false;
     if (!env->queued_work_first) {
         env->queued_work_first = &wi;
     } else {
@@ -667,6 +691,32 @@ void run_on_cpu(CPUArchState *env, void (*func)(void *data), void *data)
     }
 }
 
+/* Like run_on_cpu, but does not wait for func to run */
+void async_run_on_cpu(CPUArchState *env, void (*func)(void *data), void *data)
+{
+    struct qemu_work_item *wi;
+
+    if (qemu_cpu_is_self(env)) {
+        func(data);
+        return;
+    }
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    if (!env->queued_work_first) {
+        env->queued_work_first = wi;
+    } else {
+        env->queued_work_last->next = wi;
+    }
+    env->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+
+    qemu_cpu_kick(env);
+}
+
 static void flush_queued_work(CPUArchState *env)
 {
     struct qemu_work_item *wi;
@@ -678,7 +728,11 @@ static void flush_queued_work(CPUArchState *env)
     while ((wi = env->queued_work_first)) {
         env->queued_work_first = wi->next;
         wi->func(wi->data);
-        wi->done = true;
+        if (wi->free) {
+            g_free(wi);
+        } else {
+            wi->done = true;
+        }
     }
     env->queued_work_last = NULL;
     qemu_cond_broadcast(&qemu_work_cond);
@@ -760,6 +814,105 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+static void qemu_tcg_mt_wait_io_event(CPUArchState *env)
+{
+    while (cpu_thread_is_idle(env)) {
+        qemu_cond_wait(env->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(env);
+}
+
+/* Wait until no vCPU executes guest code, and keep them out of cpu_exec()
+   until tcg_exclusive_end().  Called with qemu_global_mutex held, from
+   outside cpu_exec(): vCPUs that are waiting for the mutex inside
+   cpu_exec() must be able to take it and leave.  */
+static void tcg_exclusive_start(void)
+{
+    CPUArchState *env;
+
+    while (tcg_exclusive_pending) {
+        qemu_cond_wait(&tcg_exclusive_resume, &qemu_global_mutex);
+    }
+    tcg_exclusive_pending = true;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (env != cpu_single_env) {
+            qemu_cpu_kick(env);
+        }
+    }
+    while (tcg_running_cpus > 0) {
+        qemu_cond_wait(&tcg_exclusive_cond, &qemu_global_mutex);
+    }
+}
+
+static void tcg_exclusive_end(void)
+{
+    tcg_exclusive_pending = false;
+    qemu_cond_broadcast(&tcg_exclusive_resume);
+}
+
+/* Run env without qemu_global_mutex, which the vCPU takes back only
+   around device accesses (see qemu_tcg_mt_lock_iothread()).  */
+static int tcg_mt_cpu_exec(CPUArchState *env)
+{
+    int r;
+
+    while (tcg_exclusive_pending) {
+        qemu_cond_wait(&tcg_exclusive_resume, &qemu_global_mutex);
+    }
+    if (!cpu_can_run(env)) {
+        return EXCP_INTERRUPT;
+    }
+
+    tcg_running_cpus++;
+    qemu_mutex_unlock_iothread();
+    r = cpu_exec(env);
+    qemu_mutex_lock_iothread();
+    cpu_single_env = env;
+    if (--tcg_running_cpus == 0 && tcg_exclusive_pending) {
+        qemu_cond_signal(&tcg_exclusive_cond);
+    }
+
+    /* the code buffer is full; other vCPUs may still be running code
+       that the eviction would overwrite */
+    if (tb_evict_requested()) {
+        tcg_exclusive_start();
+        tb_evict_pending(env);
+        tcg_exclusive_end();
+    }
+    return r;
+}
+
+static void *qemu_tcg_mt_cpu_thread_fn(void *arg)
+{
+    CPUArchState *env = arg;
+    int r;
+
+    qemu_tcg_init_cpu_signals();
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(env->thread);
+    env->thread_id = qemu_get_thread_id();
+    /* stays set outside cpu_exec() so that cpu_signal() always finds
+       the vCPU to kick */
+    cpu_single_env = env;
+
+    /* signal CPU creation */
+    env->created = 1;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(env)) {
+            r = tcg_mt_cpu_exec(env);
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(env);
+            }
+        }
+        qemu_tcg_mt_wait_io_event(env);
+    }
+
+    return NULL;
+}
+
 static void *qemu_dummy_cpu_thread_fn(void *arg)
 {
 #ifdef _WIN32
@@ -864,7 +1017,7 @@ void qemu_cpu_kick(void *_env)
     CPUArchState *env = _env;
 
     qemu_cond_broadcast(env->halt_cond);
-    if (!tcg_enabled() && !env->thread_kicked) {
+    if ((!tcg_enabled() || mttcg_enabled) && !env->thread_kicked) {
         qemu_cpu_kick_thread(env);
         env->thread_kicked = true;
     }
@@ -893,7 +1046,7 @@ int qemu_cpu_is_self(void *_env)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
+    if (!tcg_enabled() || mttcg_enabled) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -904,13 +1057,136 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    tls_var(iothread_locked) = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    tls_var(iothread_locked) = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+/* Take qemu_global_mutex for a device access from a multi-threaded TCG
+   vCPU.  Returns false, and does nothing, if the vCPUs share one thread,
+   which always holds the mutex, or if this thread already holds it.  */
+bool qemu_tcg_mt_lock_iothread(void)
+{
+    if (!mttcg_enabled || tls_var(iothread_locked)) {
+        return false;
+    }
+    qemu_mutex_lock_iothread();
+    return true;
+}
+
+void qemu_tcg_mt_unlock_iothread(bool locked)
+{
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+/* Called by cpu_exec() after a longjmp, which may have skipped the
+   qemu_tcg_mt_unlock_iothread() of a device access.  */
+void qemu_tcg_mt_reset_iothread(void)
+{
+    if (mttcg_enabled && tls_var(iothread_locked)) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+int qemu_tcg_configure_threads(const char *threads)
+{
+    if (!strcmp(threads, "single")) {
+        mttcg_enabled = false;
+    } else if (!strcmp(threads, "multi")) {
+        /* needs real thread-local variables, a host that patches
+           direct jumps between TBs atomically, and TLB entries that the
+           host can update atomically */
+#if defined(TARGET_SUPPORTS_MTTCG) && defined(__linux__) && \
+    HOST_LONG_BITS >= TARGET_LONG_BITS && \
+    (defined(__i386__) || defined(__x86_64__))
+        mttcg_enabled = true;
+#else
+        fprintf(stderr, "tcg_threads=multi is not supported "
+                "for this target or host\n");
+        return -1;
+#endif
+    } else {
+        fprintf(stderr, "Invalid tcg_threads value: %s\n", threads);
+        return -1;
+    }
+    return 0;
+}
+
+/* vCPU throttling: each timeslice of guest execution is followed by a
+   sleep, so that the vCPUs run throttle_percentage % less of the time */
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+#define CPU_THROTTLE_PCT_MAX 99
+
+static QEMUTimer *throttle_timer;
+static int throttle_percentage;
+
+static void cpu_throttle_thread(void *opaque)
+{
+    CPUArchState *env = opaque;
+    CPUArchState *self_env = cpu_single_env;
+    double pct;
+
+    if (throttle_percentage) {
+        pct = throttle_percentage / 100.0;
+        qemu_mutex_unlock(&qemu_global_mutex);
+        g_usleep(pct / (1 - pct) * CPU_THROTTLE_TIMESLICE_NS / 1000);
+        qemu_mutex_lock(&qemu_global_mutex);
+        cpu_single_env = self_env;
+    }
+    env->throttle_thread_scheduled = 0;
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUArchState *env;
+    double pct;
+
+    if (!throttle_percentage) {
+        return;
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (!env->throttle_thread_scheduled) {
+            env->throttle_thread_scheduled = 1;
+            async_run_on_cpu(env, cpu_throttle_thread, env);
+        }
+        /* a single thread runs all the TCG vCPUs */
+        if (tcg_enabled() && !mttcg_enabled) {
+            break;
+        }
+    }
+
+    pct = throttle_percentage / 100.0;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS / (1 - pct));
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    if (!throttle_timer) {
+        throttle_timer = qemu_new_timer_ns(rt_clock, cpu_throttle_timer_tick,
+                                           NULL);
+    }
+
+    throttle_percentage = MIN(MAX(new_throttle_pct, 0), CPU_THROTTLE_PCT_MAX);
+    if (throttle_percentage) {
+        qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                       CPU_THROTTLE_TIMESLICE_NS);
+    } else {
+        qemu_del_timer(throttle_timer);
+    }
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return throttle_percentage;
+}
+
 static int all_vcpus_paused(void)
 {
     CPUArchState *penv = first_cpu;
@@ -938,7 +1214,7 @@ void pause_all_vcpus(void)
 
     if (!qemu_thread_is_self(&io_thread)) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !mttcg_enabled) {
             while (penv) {
                 penv->stop = 0;
                 penv->stopped = 1;
@@ -1008,6 +1284,18 @@ static void qemu_kvm_start_vcpu(CPUArchState *env)
     }
 }
 
+static void qemu_tcg_mt_start_vcpu(CPUArchState *env)
+{
+    env->thread = g_malloc0(sizeof(QemuThread));
+    env->halt_cond = g_malloc0(sizeof(QemuCond));
+    qemu_cond_init(env->halt_cond);
+    qemu_thread_create(env->thread, qemu_tcg_mt_cpu_thread_fn, env,
+                       QEMU_THREAD_JOINABLE);
+    while (env->created == 0) {
+        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+    }
+}
+
 static void qemu_dummy_start_vcpu(CPUArchState *env)
 {
     env->thread = g_malloc0(sizeof(QemuThread));
@@ -1029,6 +1317,8 @@ void qemu_init_vcpu(void *_env)
     env->stopped = 1;
     if (kvm_enabled()) {
         qemu_kvm_start_vcpu(env);
+    } else if (tcg_enabled() && mttcg_enabled) {
+        qemu_tcg_mt_start_vcpu(env);
     } else if (tcg_enabled()) {
         qemu_tcg_init_vcpu(env);
     } else {
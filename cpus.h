@@ -7,6 +7,11 @@ void resume_all_vcpus(void);
 void pause_all_vcpus(void);
 void cpu_stop_current(void);
 
+int qemu_tcg_configure_threads(const char *threads);
+
+void cpu_throttle_set(int new_throttle_pct);
+int cpu_throttle_get_percentage(void);
+
 void cpu_synchronize_all_states(void);
 void cpu_synchronize_all_post_reset(void);
 void cpu_synchronize_all_post_init(void);
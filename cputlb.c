@@ -21,6 +21,7 @@
 #include "cpu.h"
 #include "exec-all.h"
 #include "memory.h"
+#include "qemu-barrier.h"
 
 #include "cputlb.h"
 
@@ -70,6 +71,14 @@ void tlb_flush(CPUArchState *env, int flush_global)
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
     }
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        int mmu_idx;
+
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
+    }
+    env->vtlb_index = 0;
 
     memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
@@ -78,21 +87,26 @@ void tlb_flush(CPUArchState *env, int flush_global)
     tlb_flush_count++;
 }
 
+static inline bool tlb_entry_is_page(CPUTLBEntry *tlb_entry, target_ulong addr)
+{
+    return addr == (tlb_entry->addr_read &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_write &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_code &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK));
+}
+
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
-    if (addr == (tlb_entry->addr_read &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_write &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_code &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (tlb_entry_is_page(tlb_entry, addr)) {
         *tlb_entry = s_cputlb_empty_entry;
     }
 }
 
 void tlb_flush_page(CPUArchState *env, target_ulong addr)
 {
-    int i;
+    int i, k;
     int mmu_idx;
 
 #if defined(DEBUG_TLB)
@@ -116,6 +130,9 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        }
     }
 
     tb_flush_jmp_cache(env, addr);
@@ -151,6 +168,13 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
     if (tlb_is_dirty_ram(tlb_entry)) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
+#if TARGET_LONG_BITS <= HOST_LONG_BITS
+            if (mttcg_enabled) {
+                /* the vCPU that owns the entry may be writing it */
+                __sync_fetch_and_or(&tlb_entry->addr_write, TLB_NOTDIRTY);
+                return;
+            }
+#endif
             tlb_entry->addr_write |= TLB_NOTDIRTY;
         }
     }
@@ -165,12 +189,24 @@ static inline void tlb_update_dirty(CPUTLBEntry *tlb_entry)
         p = (void *)(uintptr_t)((tlb_entry->addr_write & TARGET_PAGE_MASK)
             + tlb_entry->addend);
         ram_addr = qemu_ram_addr_from_host_nofail(p);
-        if (!cpu_physical_memory_is_dirty(ram_addr)) {
+        if (cpu_physical_memory_needs_notdirty(ram_addr)) {
             tlb_entry->addr_write |= TLB_NOTDIRTY;
         }
     }
 }
 
+/* With tcg_threads=multi, tlb_reset_dirty_range() can run on another
+   thread while the owner of the entry rewrites it, and its TLB_NOTDIRTY
+   may be lost.  It clears the dirty flags before looking at the TLBs, so
+   the owner checks them again after writing the entry.  */
+static inline void tlb_recheck_dirty(CPUTLBEntry *tlb_entry)
+{
+    if (mttcg_enabled) {
+        smp_mb();
+        tlb_update_dirty(tlb_entry);
+    }
+}
+
 void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
 {
     CPUArchState *env;
@@ -185,6 +221,10 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -193,6 +233,7 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 {
     if (tlb_entry->addr_write == (vaddr | TLB_NOTDIRTY)) {
         tlb_entry->addr_write = vaddr;
+        tlb_recheck_dirty(tlb_entry);
     }
 }
 
@@ -200,16 +241,52 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
    so that it is no longer dirty */
 void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
 {
-    int i;
+    int i, k;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
     i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
     }
 }
 
+/* Called by the softmmu helpers when the page of 'addr' is not in the
+   main TLB.  If the victim TLB has it, swap it with the entry at 'index'
+   and return true.  'elt_ofs' selects the addr_read, addr_write or
+   addr_code field of the entries.  */
+bool tlb_victim_hit(CPUArchState *env1, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong addr)
+{
+    int vidx;
+
+    env1->tlb_misses++;
+    addr &= TARGET_PAGE_MASK;
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        CPUTLBEntry *vte = &env1->tlb_v_table[mmu_idx][vidx];
+        target_ulong cmp = *(target_ulong *)((uintptr_t)vte + elt_ofs);
+
+        if (addr == (cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+            CPUTLBEntry *te = &env1->tlb_table[mmu_idx][index];
+            CPUTLBEntry tmp_te = *te;
+            target_phys_addr_t tmp_iotlb = env1->iotlb[mmu_idx][index];
+
+            *te = *vte;
+            *vte = tmp_te;
+            env1->iotlb[mmu_idx][index] = env1->iotlb_v[mmu_idx][vidx];
+            env1->iotlb_v[mmu_idx][vidx] = tmp_iotlb;
+            tlb_recheck_dirty(te);
+            tlb_recheck_dirty(vte);
+            env1->tlb_victim_hits++;
+            return true;
+        }
+    }
+    return false;
+}
+
 /* Our TLB does not support large pages, so remember the area covered by
    large pages and trigger a full TLB flush if these are invalidated.  */
 static void tlb_add_large_page(CPUArchState *env, target_ulong vaddr,
@@ -278,8 +355,21 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                                             &address);
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* keep the entry we replace in the victim TLB, unless it is empty
+       or maps the same page */
+    if (te->addr_read != -1 || te->addr_write != -1 || te->addr_code != -1) {
+        if (!tlb_entry_is_page(te, vaddr & TARGET_PAGE_MASK)) {
+            unsigned int vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+
+            env->tlb_v_table[mmu_idx][vidx] = *te;
+            env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+            tlb_recheck_dirty(&env->tlb_v_table[mmu_idx][vidx]);
+        }
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -298,7 +388,7 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
             /* Write access calls the I/O callback.  */
             te->addr_write = address | TLB_MMIO;
         } else if (memory_region_is_ram(section->mr)
-                   && !cpu_physical_memory_is_dirty(
+                   && cpu_physical_memory_needs_notdirty(
                            section->mr->ram_addr
                            + memory_region_section_addr(section, paddr))) {
             te->addr_write = address | TLB_NOTDIRTY;
@@ -308,6 +398,7 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     } else {
         te->addr_write = -1;
     }
+    tlb_recheck_dirty(te);
 }
 
 /* NOTE: this function can trigger an exception */
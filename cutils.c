@@ -304,38 +304,191 @@ void qemu_iovec_memset_skip(QEMUIOVector *qiov, int c, size_t count,
 }
 
 /*
- * Checks if a buffer is all zeroes
+ * Zero buffer detection
  *
- * Attention! The len must be a multiple of 4 * sizeof(long) due to
- * restriction of optimizations in this function.
+ * The generic version works on longs; SSE2 and AVX2 versions are used
+ * when the host has them.  The best one is picked once at startup.
  */
-bool buffer_is_zero(const void *buf, size_t len)
+
+static bool buffer_zero_int(const void *buf, size_t len)
 {
+    const unsigned char *p = buf;
+    const long *data;
+    size_t i, n;
+
+    /* bytes up to the first aligned long */
+    while (len && (uintptr_t)p % sizeof(long)) {
+        if (*p++) {
+            return false;
+        }
+        len--;
+    }
+
     /*
      * Use long as the biggest available internal data type that fits into the
      * CPU register and unroll the loop to smooth out the effect of memory
      * latency.
      */
+    data = (const long *)p;
+    n = len / sizeof(long);
+    for (i = 0; i + 4 <= n; i += 4) {
+        if (data[i] | data[i + 1] | data[i + 2] | data[i + 3]) {
+            return false;
+        }
+    }
+    for (; i < n; i++) {
+        if (data[i]) {
+            return false;
+        }
+    }
+
+    p = (const unsigned char *)(data + n);
+    for (len %= sizeof(long); len; len--) {
+        if (*p++) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    size_t i;
-    long d0, d1, d2, d3;
-    const long * const data = buf;
+#ifdef __SSE2__
+#include <emmintrin.h>
 
-    assert(len % (4 * sizeof(long)) == 0);
-    len /= sizeof(long);
+/* 64 bytes per iteration, the tail is left to buffer_zero_int */
+static bool buffer_zero_sse2(const void *buf, size_t len)
+{
+    const __m128i *p = buf;
+    const __m128i zero = _mm_setzero_si128();
+    size_t i, n = len / 64;
 
-    for (i = 0; i < len; i += 4) {
-        d0 = data[i + 0];
-        d1 = data[i + 1];
-        d2 = data[i + 2];
-        d3 = data[i + 3];
+    for (i = 0; i < n; i++, p += 4) {
+        __m128i t = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p),
+                                              _mm_loadu_si128(p + 1)),
+                                 _mm_or_si128(_mm_loadu_si128(p + 2),
+                                              _mm_loadu_si128(p + 3)));
 
-        if (d0 || d1 || d2 || d3) {
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xffff) {
             return false;
         }
     }
+    return buffer_zero_int(p, len % 64);
+}
+#endif
 
-    return true;
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <cpuid.h>
+#include <immintrin.h>
+
+/* 128 bytes per iteration, the tail is left to buffer_zero_int */
+static bool buffer_zero_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    size_t i, n = len / 128;
+
+    for (i = 0; i < n; i++, p += 4) {
+        __m256i t = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(p),
+                                                    _mm256_loadu_si256(p + 1)),
+                                    _mm256_or_si256(_mm256_loadu_si256(p + 2),
+                                                    _mm256_loadu_si256(p + 3)));
+
+        if (!_mm256_testz_si256(t, t)) {
+            return false;
+        }
+    }
+    return buffer_zero_int(p, len % 128);
+}
+#pragma GCC pop_options
+
+/* AVX2 needs both the CPU feature and an OS that saves the YMM registers */
+static bool avx2_usable(void)
+{
+    unsigned int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+    asm("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    if ((a & 6) != 6) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & bit_AVX2;
+}
+#endif
+
+#define BUFFER_ACCEL_SSE2 1
+#define BUFFER_ACCEL_AVX2 2
+
+static unsigned buffer_accel_avail;
+static bool (*buffer_accel)(const void *, size_t) = buffer_zero_int;
+
+static void buffer_accel_select(unsigned avail)
+{
+    bool (*fn)(const void *, size_t) = buffer_zero_int;
+
+#ifdef __SSE2__
+    if (avail & BUFFER_ACCEL_SSE2) {
+        fn = buffer_zero_sse2;
+    }
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (avail & BUFFER_ACCEL_AVX2) {
+        fn = buffer_zero_avx2;
+    }
+#endif
+    buffer_accel = fn;
+}
+
+static void __attribute__((constructor)) buffer_accel_init(void)
+{
+    unsigned avail = 0;
+
+#ifdef __SSE2__
+    avail |= BUFFER_ACCEL_SSE2;
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (avx2_usable()) {
+        avail |= BUFFER_ACCEL_AVX2;
+    }
+#endif
+    buffer_accel_avail = avail;
+    buffer_accel_select(avail);
+}
+
+/*
+ * Drop the fastest implementation still in use, so that tests can cover
+ * the slower ones.  Once the generic one is reached, go back to the best
+ * one and return false.
+ */
+bool test_buffer_is_zero_next_accel(void)
+{
+    unsigned bit;
+
+    for (bit = BUFFER_ACCEL_AVX2; bit; bit >>= 1) {
+        if (buffer_accel_avail & bit) {
+            buffer_accel_avail &= ~bit;
+            buffer_accel_select(buffer_accel_avail);
+            return true;
+        }
+    }
+    buffer_accel_init();
+    return false;
+}
+
+/*
+ * Checks if a buffer is all zeroes
+ *
+ * buf and len need no particular alignment.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    return buffer_accel(buf, len);
 }
 
 #ifndef _WIN32
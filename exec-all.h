@@ -21,6 +21,7 @@
 #define _EXEC_ALL_H_
 
 #include "qemu-common.h"
+#include "qht.h"
 
 /* allow to see translation results - the slowdown should be negligible, so we leave it */
 #define DEBUG_DISAS
@@ -91,7 +92,9 @@ void QEMU_NORETURN cpu_io_recompile(CPUArchState *env, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUArchState *env, 
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
+TranslationBlock *tb_gen_trace(CPUArchState *env, TranslationBlock *tb);
 void cpu_exec_init(CPUArchState *env);
+void *helper_lookup_tb_ptr(CPUArchState *env);
 void QEMU_NORETURN cpu_loop_exit(CPUArchState *env1);
 int page_unprotect(target_ulong address, uintptr_t pc, void *puc);
 void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
@@ -118,6 +121,7 @@ static inline void tlb_flush(CPUArchState *env, int flush_global)
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
+/* initial number of entries in tb_phys_hash, it grows on demand */
 #define CODE_GEN_PHYS_HASH_BITS     15
 #define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
 
@@ -144,13 +148,13 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_TRACE       0x10000 /* Hot trace: conditional branches are
+                                  side exits, not block ends.  */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -171,8 +175,12 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    uint32_t exec_count; /* executions, counted by the TB itself */
 };
 
+/* number of executions after which a TB is retranslated as a trace */
+#define TB_TRACE_THRESHOLD 32
+
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
 {
     target_ulong tmp;
@@ -188,9 +196,20 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+/* mix all the fields that identify a TB, so that TBs for the same code
+   translated in different CPU states land in different buckets */
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc, target_ulong pc,
+                                    uint64_t flags, target_ulong cs_base)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t h;
+
+    h = (uint64_t)phys_pc * 0x9e3779b97f4a7c15ULL;
+    h ^= ((uint64_t)pc ^ ((uint64_t)cs_base << 17)) * 0xc2b2ae3d27d4eb4fULL;
+    h ^= flags * 0x165667b19e3779f9ULL;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    return h;
 }
 
 void tb_free(TranslationBlock *tb);
@@ -199,7 +218,7 @@ void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+extern QHT tb_phys_hash;
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -280,12 +299,28 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
     }
 }
 
+/* A TB stays in memory until its region is evicted, but it must not be
+   chained to or from once tb_phys_invalidate() has dropped it: with
+   tcg_threads=multi a vCPU can still be holding it.  */
+static inline bool tb_is_valid(TranslationBlock *tb)
+{
+    return tb->page_addr[0] != -1;
+}
+
 TranslationBlock *tb_find_pc(uintptr_t pc_ptr);
 
 #include "qemu-lock.h"
 
 extern spinlock_t tb_lock;
 
+void tcg_tb_lock(void);
+void tcg_tb_unlock(void);
+#if !defined(CONFIG_USER_ONLY)
+bool tcg_tb_lock_nested(void);
+void tcg_tb_unlock_nested(bool locked);
+void tcg_tb_lock_reset(void);
+#endif
+
 extern int tb_invalidated_flag;
 
 /* The return address may point to the start of the next instruction.
@@ -311,6 +346,8 @@ extern uintptr_t tci_tb_ptr;
 #if !defined(CONFIG_USER_ONLY)
 
 struct MemoryRegion *iotlb_to_region(target_phys_addr_t index);
+bool tlb_io_lock(CPUArchState *env1, target_phys_addr_t index,
+                 uintptr_t retaddr);
 uint64_t io_mem_read(struct MemoryRegion *mr, target_phys_addr_t addr,
                      unsigned size);
 void io_mem_write(struct MemoryRegion *mr, target_phys_addr_t addr,
@@ -318,6 +355,23 @@ void io_mem_write(struct MemoryRegion *mr, target_phys_addr_t addr,
 
 void tlb_fill(CPUArchState *env1, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr);
+bool tlb_victim_hit(CPUArchState *env1, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong addr);
+
+/* Record a store to RAM through TLB entry 'index' in the dirty log of
+   the CPU.  For RAM, the iotlb entry holds the ram_addr of the page
+   minus its virtual address, with the section number in the low bits;
+   strip those before adding the address or they carry into the page
+   number.  */
+static inline void tlb_dirty_log_write(CPUArchState *env1, int mmu_idx,
+                                       int index, target_ulong addr)
+{
+    if (unlikely(env1->dirty_log != NULL)) {
+        ram_addr_t ram_addr = (env1->iotlb[mmu_idx][index] & TARGET_PAGE_MASK)
+                              + (addr & TARGET_PAGE_MASK);
+        env1->dirty_log[ram_addr >> TARGET_PAGE_BITS] = 1;
+    }
+}
 
 #include "softmmu_defs.h"
 
@@ -41,6 +41,11 @@ void qemu_unregister_coalesced_mmio(target_phys_addr_t addr, ram_addr_t size);
 
 int cpu_physical_memory_set_dirty_tracking(int enable);
 
+/* nonzero while TCG stores log the pages they write in env->dirty_log */
+extern int cpu_dirty_log_inline;
+
+void cpu_physical_memory_sync_dirty_log(ram_addr_t start, ram_addr_t length);
+
 #define VGA_DIRTY_FLAG       0x01
 #define CODE_DIRTY_FLAG      0x02
 #define MIGRATION_DIRTY_FLAG 0x08
@@ -56,6 +61,19 @@ static inline int cpu_physical_memory_get_dirty_flags(ram_addr_t addr)
     return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS];
 }
 
+/* return nonzero if writes to the page must go through the notdirty
+   callback (TLB_NOTDIRTY) */
+static inline int cpu_physical_memory_needs_notdirty(ram_addr_t addr)
+{
+    int dirty_flags = cpu_physical_memory_get_dirty_flags(addr);
+
+    if (cpu_dirty_log_inline) {
+        /* other writes are logged inline, only code must be caught */
+        return !(dirty_flags & CODE_DIRTY_FLAG);
+    }
+    return dirty_flags != 0xff;
+}
+
 static inline int cpu_physical_memory_get_dirty(ram_addr_t start,
                                                 ram_addr_t length,
                                                 int dirty_flags)
@@ -73,15 +91,82 @@ static inline int cpu_physical_memory_get_dirty(ram_addr_t start,
     return ret;
 }
 
-static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
+/* return the address of the first page in [start, end) with one of
+   dirty_flags set, or end; the flags are tested a word at a time */
+static inline ram_addr_t cpu_physical_memory_find_dirty(ram_addr_t start,
+                                                        ram_addr_t end,
+                                                        int dirty_flags)
+{
+    const uint8_t *p = ram_list.phys_dirty;
+    unsigned long mask = dirty_flags * (~0UL / 0xff);
+    ram_addr_t page, last;
+
+    page = start >> TARGET_PAGE_BITS;
+    last = TARGET_PAGE_ALIGN(end) >> TARGET_PAGE_BITS;
+    while (page < last && page % sizeof(unsigned long)) {
+        if (p[page] & dirty_flags) {
+            return page << TARGET_PAGE_BITS;
+        }
+        page++;
+    }
+    while (page + sizeof(unsigned long) <= last &&
+           !(*(unsigned long *)(p + page) & mask)) {
+        page += sizeof(unsigned long);
+    }
+    for (; page < last; page++) {
+        if (p[page] & dirty_flags) {
+            return page << TARGET_PAGE_BITS;
+        }
+    }
+    return end;
+}
+
+/* With tcg_threads=multi, vCPU threads set and clear dirty flags without
+   holding the global mutex, so the read-modify-writes must be atomic.  */
+static inline int cpu_physical_memory_or_flags(uint8_t *p, int dirty_flags)
 {
-    ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] = 0xff;
+    int old;
+
+    if (mttcg_enabled) {
+        old = __sync_fetch_and_or(p, dirty_flags);
+        if (dirty_flags & ~old & MIGRATION_DIRTY_FLAG) {
+            __sync_fetch_and_add(&ram_list.dirty_pages, 1);
+        }
+        return old | dirty_flags;
+    }
+    if (dirty_flags & ~*p & MIGRATION_DIRTY_FLAG) {
+        ram_list.dirty_pages++;
+    }
+    return *p |= dirty_flags;
+}
+
+static inline void cpu_physical_memory_and_flags(uint8_t *p, int dirty_flags)
+{
+    int old;
+
+    if (mttcg_enabled) {
+        old = __sync_fetch_and_and(p, ~dirty_flags);
+        if (dirty_flags & old & MIGRATION_DIRTY_FLAG) {
+            __sync_fetch_and_sub(&ram_list.dirty_pages, 1);
+        }
+        return;
+    }
+    if (dirty_flags & *p & MIGRATION_DIRTY_FLAG) {
+        ram_list.dirty_pages--;
+    }
+    *p &= ~dirty_flags;
 }
 
 static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
                                                       int dirty_flags)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] |= dirty_flags;
+    return cpu_physical_memory_or_flags(
+        &ram_list.phys_dirty[addr >> TARGET_PAGE_BITS], dirty_flags);
+}
+
+static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
+{
+    cpu_physical_memory_set_dirty_flags(addr, 0xff);
 }
 
 static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
@@ -95,7 +180,7 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
     start &= TARGET_PAGE_MASK;
     p = ram_list.phys_dirty + (start >> TARGET_PAGE_BITS);
     for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
-        *p++ |= dirty_flags;
+        cpu_physical_memory_or_flags(p++, dirty_flags);
     }
 }
 
@@ -103,16 +188,14 @@ static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
                                                         ram_addr_t length,
                                                         int dirty_flags)
 {
-    int mask;
     uint8_t *p;
     ram_addr_t addr, end;
 
     end = TARGET_PAGE_ALIGN(start + length);
     start &= TARGET_PAGE_MASK;
-    mask = ~dirty_flags;
     p = ram_list.phys_dirty + (start >> TARGET_PAGE_BITS);
     for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
-        *p++ &= mask;
+        cpu_physical_memory_and_flags(p++, dirty_flags);
     }
 }
 
@@ -33,6 +33,7 @@
 #include "kvm.h"
 #include "hw/xen.h"
 #include "qemu-timer.h"
+#include "qemu-thread.h"
 #include "memory.h"
 #include "exec-memory.h"
 #if defined(CONFIG_USER_ONLY)
@@ -81,11 +82,21 @@
 
 static TranslationBlock *tbs;
 static int code_gen_max_blocks;
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
-static int nb_tbs;
+/* TBs indexed by tb_hash_func(), see tb_find_slow() */
+QHT tb_phys_hash;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 
+#if !defined(CONFIG_USER_ONLY)
+/* With tcg_threads=multi the vCPU threads translate concurrently, so
+   tcg_tb_lock() is a real mutex.  It also protects their lookups in the
+   physical memory map.  Take it after the global mutex, never before.
+   The owner is tracked in both modes so that tcg_tb_lock_nested() works
+   from paths that may or may not run under the lock.  */
+static QemuMutex tb_mutex;
+static DEFINE_TLS(bool, have_tb_lock);
+#endif
+
 #if defined(__arm__) || defined(__sparc_v9__)
 /* The prologue must be reachable with a direct jump. ARM and Sparc64
  have limited branch ranges (possibly also PPC) so place it in a
@@ -104,9 +115,27 @@ spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 uint8_t code_gen_prologue[1024] code_gen_section;
 static uint8_t *code_gen_buffer;
 static unsigned long code_gen_buffer_size;
-/* threshold to flush the translated code buffer */
-static unsigned long code_gen_buffer_max_size;
-static uint8_t *code_gen_ptr;
+
+/* The translation buffer is split into regions that are filled in turn.
+   When the last one is full, only the oldest region is evicted instead
+   of flushing the whole buffer, so most of the hot code survives.  */
+#define CODE_GEN_MAX_REGIONS 8
+/* Each region must hold many TBs on top of the worst case TB size */
+#define CODE_GEN_MIN_REGION_SIZE (16 * TCG_MAX_OP_SIZE * OPC_BUF_SIZE)
+
+typedef struct CodeGenRegion {
+    uint8_t *start;
+    uint8_t *ptr;           /* where the code of the next TB goes */
+    uint8_t *max;           /* threshold to move to the next region */
+    TranslationBlock *tbs;  /* TBs whose code is in this region */
+    int nb_tbs;
+} CodeGenRegion;
+
+static CodeGenRegion code_gen_regions[CODE_GEN_MAX_REGIONS];
+static int code_gen_nb_regions;
+static unsigned long code_gen_region_size;
+static int code_gen_region_max_blocks;
+static CodeGenRegion *code_gen_region;
 
 #if !defined(CONFIG_USER_ONLY)
 int phys_ram_fd;
@@ -219,6 +248,9 @@ static MemoryRegion io_mem_watch;
 /* statistics */
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
+static int tb_region_evict_count;
+static int tb_region_evict_tbs;
+static int tb_trace_count;
 
 #ifdef _WIN32
 static void map_exec(void *addr, long size)
@@ -604,12 +636,37 @@ static void code_gen_alloc(unsigned long tb_size)
 #endif
 #endif /* !USE_STATIC_CODE_GEN_BUFFER */
     map_exec(code_gen_prologue, sizeof(code_gen_prologue));
-    code_gen_buffer_max_size = code_gen_buffer_size -
-        (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
     code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
     tbs = g_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
 }
 
+static void code_gen_regions_init(void)
+{
+    int i;
+
+    code_gen_nb_regions = code_gen_buffer_size / CODE_GEN_MIN_REGION_SIZE;
+    if (code_gen_nb_regions > CODE_GEN_MAX_REGIONS) {
+        code_gen_nb_regions = CODE_GEN_MAX_REGIONS;
+    } else if (code_gen_nb_regions < 1) {
+        code_gen_nb_regions = 1;
+    }
+    code_gen_region_size = (code_gen_buffer_size / code_gen_nb_regions) &
+        ~(CODE_GEN_ALIGN - 1);
+    code_gen_region_max_blocks = code_gen_max_blocks / code_gen_nb_regions;
+
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        CodeGenRegion *r = &code_gen_regions[i];
+
+        r->start = code_gen_buffer + i * code_gen_region_size;
+        r->ptr = r->start;
+        r->max = r->start + code_gen_region_size -
+            (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
+        r->tbs = tbs + i * code_gen_region_max_blocks;
+        r->nb_tbs = 0;
+    }
+    code_gen_region = code_gen_regions;
+}
+
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
    (in bytes) allocated to the translation buffer. Zero means default
    size. */
@@ -617,8 +674,12 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
-    code_gen_ptr = code_gen_buffer;
+    code_gen_regions_init();
     tcg_register_jit(code_gen_buffer, code_gen_buffer_size);
+    qht_init(&tb_phys_hash, CODE_GEN_PHYS_HASH_SIZE, QHT_MODE_AUTO_RESIZE);
+#if !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&tb_mutex);
+#endif
     page_init();
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
     /* There's no guest base to take into account, so go ahead and
@@ -632,6 +693,60 @@ bool tcg_enabled(void)
     return code_gen_buffer != NULL;
 }
 
+void tcg_tb_lock(void)
+{
+#if defined(CONFIG_USER_ONLY)
+    spin_lock(&tb_lock);
+#else
+    assert(!tls_var(have_tb_lock));
+    if (mttcg_enabled) {
+        qemu_mutex_lock(&tb_mutex);
+    }
+    tls_var(have_tb_lock) = true;
+#endif
+}
+
+void tcg_tb_unlock(void)
+{
+#if defined(CONFIG_USER_ONLY)
+    spin_unlock(&tb_lock);
+#else
+    assert(tls_var(have_tb_lock));
+    tls_var(have_tb_lock) = false;
+    if (mttcg_enabled) {
+        qemu_mutex_unlock(&tb_mutex);
+    }
+#endif
+}
+
+#if !defined(CONFIG_USER_ONLY)
+/* Take tb_lock unless this thread already holds it.  Returns whether
+   it was taken, to be passed to tcg_tb_unlock_nested().  */
+bool tcg_tb_lock_nested(void)
+{
+    if (tls_var(have_tb_lock)) {
+        return false;
+    }
+    tcg_tb_lock();
+    return true;
+}
+
+void tcg_tb_unlock_nested(bool locked)
+{
+    if (locked) {
+        tcg_tb_unlock();
+    }
+}
+
+/* Drop tb_lock if a longjmp out of a locked section left it held. */
+void tcg_tb_lock_reset(void)
+{
+    if (tls_var(have_tb_lock)) {
+        tcg_tb_unlock();
+    }
+}
+#endif
+
 void cpu_exec_init_all(void)
 {
 #if !defined(CONFIG_USER_ONLY)
@@ -714,29 +829,33 @@ void cpu_exec_init(CPUArchState *env)
 #endif
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block. Return NULL if the current region
+   has too many translation blocks or too much generated code. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    CodeGenRegion *r = code_gen_region;
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size)
+    if (r->nb_tbs >= code_gen_region_max_blocks || r->ptr >= r->max) {
         return NULL;
-    tb = &tbs[nb_tbs++];
+    }
+    tb = &r->tbs[r->nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->exec_count = 0;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    CodeGenRegion *r = code_gen_region;
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
-        code_gen_ptr = tb->tc_ptr;
-        nb_tbs--;
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
+        r->ptr = tb->tc_ptr;
+        r->nb_tbs--;
     }
 }
 
@@ -781,88 +900,140 @@ static void page_flush_tb(void)
 }
 
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
+/* XXX: tb_flush is currently not thread safe.  The caller must hold
+   tb_lock and no other CPU may be executing generated code, see
+   docs/multi-thread-tcg.txt */
 void tb_flush(CPUArchState *env1)
 {
     CPUArchState *env;
+    int i;
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(code_gen_ptr - code_gen_buffer),
-           nb_tbs, nb_tbs > 0 ?
-           ((unsigned long)(code_gen_ptr - code_gen_buffer)) / nb_tbs : 0);
+    printf("qemu: flush region=%d code_size=%ld nb_tbs=%d\n",
+           (int)(code_gen_region - code_gen_regions),
+           (unsigned long)(code_gen_region->ptr - code_gen_region->start),
+           code_gen_region->nb_tbs);
 #endif
-    if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
+    if ((unsigned long)(code_gen_region->ptr - code_gen_region->start) >
+        code_gen_region_size) {
         cpu_abort(env1, "Internal error: code buffer overflow\n");
+    }
 
-    nb_tbs = 0;
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        code_gen_regions[i].nb_tbs = 0;
+        code_gen_regions[i].ptr = code_gen_regions[i].start;
+    }
+    code_gen_region = code_gen_regions;
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
     }
 
-    memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
+    qht_reset(&tb_phys_hash);
     page_flush_tb();
 
-    code_gen_ptr = code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
 }
 
+/* Start translating into the next region, after invalidating all the TBs
+   it still holds.  Regions are reused in FIFO order, so this drops the
+   oldest translations.  The same restrictions as for tb_flush() apply.  */
+static void tb_evict_region(CPUArchState *env1)
+{
+    CodeGenRegion *r;
+    int i;
+
+    if (code_gen_nb_regions == 1) {
+        tb_flush(env1);
+        return;
+    }
+
+    r = code_gen_region + 1;
+    if (r == code_gen_regions + code_gen_nb_regions) {
+        r = code_gen_regions;
+    }
+#if defined(DEBUG_FLUSH)
+    printf("qemu: evict region=%d nb_tbs=%d\n",
+           (int)(r - code_gen_regions), r->nb_tbs);
+#endif
+    /* tb_phys_invalidate() unchains the TBs from the surviving regions */
+    for (i = 0; i < r->nb_tbs; i++) {
+        tb_phys_invalidate(&r->tbs[i], -1);
+    }
+    tb_region_evict_count++;
+    tb_region_evict_tbs += r->nb_tbs;
+
+    r->nb_tbs = 0;
+    r->ptr = r->start;
+    code_gen_region = r;
+}
+
+#if !defined(CONFIG_USER_ONLY)
+/* Set by tb_gen_code() when a vCPU thread ran out of code buffer */
+static bool tb_evict_request;
+
+bool tb_evict_requested(void)
+{
+    return tb_evict_request;
+}
+
+/* Do the eviction requested by tb_gen_code().  Called with no vCPU in
+   cpu_exec(); several vCPUs may have asked for it, but only the first
+   call evicts.  */
+void tb_evict_pending(CPUArchState *env)
+{
+    tcg_tb_lock();
+    if (tb_evict_request) {
+        tb_evict_region(env);
+        tb_evict_request = false;
+    }
+    tcg_tb_unlock();
+}
+#endif
+
 #ifdef DEBUG_TB_CHECK
 
+static void do_tb_invalidate_check(void *p, uint32_t hash, void *userp)
+{
+    TranslationBlock *tb = p;
+    target_ulong address = *(target_ulong *)userp;
+
+    if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
+          address >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx
+               " PC=%08lx size=%04x\n",
+               address, (long)tb->pc, tb->size);
+    }
+}
+
 static void tb_invalidate_check(target_ulong address)
 {
-    TranslationBlock *tb;
-    int i;
     address &= TARGET_PAGE_MASK;
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
-        }
+    qht_iter(&tb_phys_hash, do_tb_invalidate_check, &address);
+}
+
+static void do_tb_page_check(void *p, uint32_t hash, void *userp)
+{
+    TranslationBlock *tb = p;
+    int flags1, flags2;
+
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+               (long)tb->pc, tb->size, flags1, flags2);
     }
 }
 
 /* verify that all the pages have correct rights for code */
 static void tb_page_check(void)
 {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
-        }
-    }
+    qht_iter(&tb_phys_hash, do_tb_page_check, NULL);
 }
 
 #endif
 
-/* invalidate one TB */
-static inline void tb_remove(TranslationBlock **ptb, TranslationBlock *tb,
-                             int next_offset)
-{
-    TranslationBlock *tb1;
-    for(;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = *(TranslationBlock **)((char *)tb1 + next_offset);
-            break;
-        }
-        ptb = (TranslationBlock **)((char *)tb1 + next_offset);
-    }
-}
-
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -923,11 +1094,15 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
+    /* already invalidated, see tb_is_valid() */
+    if (tb->page_addr[0] == -1) {
+        return;
+    }
+
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_remove(&tb_phys_hash[h], tb,
-              offsetof(TranslationBlock, phys_hash_next));
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cs_base);
+    qht_remove(&tb_phys_hash, tb, h);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -967,6 +1142,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         tb1 = tb2;
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
+    tb->page_addr[0] = -1;
 
     tb_phys_invalidate_count++;
 }
@@ -1039,21 +1215,40 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+#if !defined(CONFIG_USER_ONLY)
+        if (mttcg_enabled) {
+            /* other vCPUs may be running code from the region that is
+               evicted next; leave cpu_exec() and evict it once they are
+               all out, see tb_evict_pending() */
+            tb_evict_request = true;
+            env->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(env);
+        }
+#endif
+        /* make room by evicting the oldest translations */
+        tb_evict_region(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
         tb_invalidated_flag = 1;
     }
-    tc_ptr = code_gen_ptr;
+    tc_ptr = code_gen_region->ptr;
     tb->tc_ptr = tc_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+#if defined(CONFIG_LINUX_USER)
+    if (tb_cache_lookup(tb, code_gen_region->start + code_gen_region_size -
+                        tc_ptr, &code_gen_size) < 0) {
+        cpu_gen_code(env, tb, &code_gen_size);
+        tb_cache_add(tb, code_gen_size);
+    }
+#else
     cpu_gen_code(env, tb, &code_gen_size);
-    code_gen_ptr = (void *)(((uintptr_t)code_gen_ptr + code_gen_size +
-                             CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+#endif
+    code_gen_region->ptr = (void *)(((uintptr_t)tc_ptr + code_gen_size +
+                                     CODE_GEN_ALIGN - 1) &
+                                    ~(CODE_GEN_ALIGN - 1));
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -1065,6 +1260,21 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     return tb;
 }
 
+/* Replace a hot TB by a trace starting at the same pc (see CF_TRACE).
+   Called with tb_lock held.  */
+TranslationBlock *tb_gen_trace(CPUArchState *env, TranslationBlock *tb)
+{
+    target_ulong pc = tb->pc;
+    target_ulong cs_base = tb->cs_base;
+    int flags = tb->flags;
+
+    tb_phys_invalidate(tb, -1);
+    tb = tb_gen_code(env, pc, cs_base, flags, CF_TRACE);
+    env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    tb_trace_count++;
+    return tb;
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1089,8 +1299,9 @@ void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end,
  * access: the virtual CPU will exit the current TB if code is modified inside
  * this TB.
  */
-void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
-                                   int is_cpu_write_access)
+static void tb_invalidate_phys_page_range_1(tb_page_addr_t start,
+                                            tb_page_addr_t end,
+                                            int is_cpu_write_access)
 {
     TranslationBlock *tb, *tb_next, *saved_tb;
     CPUArchState *env = cpu_single_env;
@@ -1194,6 +1405,21 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
 #endif
 }
 
+void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
+                                   int is_cpu_write_access)
+{
+#if !defined(CONFIG_USER_ONLY)
+    /* the SMC case above longjmps with the lock held; cpu_exec() drops
+       it */
+    bool locked = tcg_tb_lock_nested();
+
+    tb_invalidate_phys_page_range_1(start, end, is_cpu_write_access);
+    tcg_tb_unlock_nested(locked);
+#else
+    tb_invalidate_phys_page_range_1(start, end, is_cpu_write_access);
+#endif
+}
+
 /* len must be <= 8 and start must be a multiple of len */
 static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
 {
@@ -1208,9 +1434,14 @@ static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
                   (intptr_t)cpu_single_env->segs[R_CS].base);
     }
 #endif
+#if !defined(CONFIG_USER_ONLY)
+    /* the code bitmap can be freed by another vCPU */
+    bool locked = tcg_tb_lock_nested();
+#endif
+
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p)
-        return;
+        goto out;
     if (p->code_bitmap) {
         offset = start & ~TARGET_PAGE_MASK;
         b = p->code_bitmap[offset >> 3] >> (offset & 7);
@@ -1220,6 +1451,11 @@ static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     do_invalidate:
         tb_invalidate_phys_page_range(start, start + len, 1);
     }
+ out:
+#if !defined(CONFIG_USER_ONLY)
+    tcg_tb_unlock_nested(locked);
+#endif
+    return;
 }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -1346,17 +1582,14 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
+    uint32_t h;
 
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
     /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cs_base);
+    qht_insert(&tb_phys_hash, tb, h);
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1385,22 +1618,29 @@ void tb_link_page(TranslationBlock *tb,
    tb[1].tc_ptr. Return NULL if not found */
 TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
+    CodeGenRegion *r;
+    unsigned long i;
     int m_min, m_max, m;
     uintptr_t v;
     TranslationBlock *tb;
 
-    if (nb_tbs <= 0)
+    if (tc_ptr < (uintptr_t)code_gen_buffer) {
         return NULL;
-    if (tc_ptr < (uintptr_t)code_gen_buffer ||
-        tc_ptr >= (uintptr_t)code_gen_ptr) {
+    }
+    i = (tc_ptr - (uintptr_t)code_gen_buffer) / code_gen_region_size;
+    if (i >= code_gen_nb_regions) {
+        return NULL;
+    }
+    r = &code_gen_regions[i];
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)r->ptr) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr)
             return tb;
@@ -1410,7 +1650,7 @@ TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 static void tb_reset_jump_recursive(TranslationBlock *tb);
@@ -1672,6 +1912,15 @@ static void cpu_unlink_tb(CPUArchState *env)
     TranslationBlock *tb;
     static spinlock_t interrupt_lock = SPIN_LOCK_UNLOCKED;
 
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled) {
+        /* the other vCPU threads chain and unchain TBs under tb_lock,
+           which a signal handler cannot take; make the check at the
+           start of the next TB fail instead, see gen-icount.h */
+        env->icount_decr.u16.high = 0xffff;
+        return;
+    }
+#endif
     spin_lock(&interrupt_lock);
     tb = env->current_tb;
     /* if the cpu is currently executing code, we must unlink it and
@@ -1838,6 +2087,11 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
         return;
     cpu_physical_memory_mask_dirty_range(start, length, dirty_flags);
 
+    if (cpu_dirty_log_inline && !(dirty_flags & CODE_DIRTY_FLAG)) {
+        /* stores are logged anyway, no need to trap them */
+        return;
+    }
+
     /* we modify the TLB cache so that the dirty bit will be set again
        when accessing the range */
     start1 = (uintptr_t)qemu_safe_ram_ptr(start);
@@ -1850,10 +2104,86 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     cpu_tlb_reset_dirty_all(start1, length);
 }
 
+int cpu_dirty_log_inline;
+
+static ram_addr_t last_ram_offset(void);
+
+/* Fold the dirty logs of all CPUs into the dirty flags of the pages in
+   [start, start + length).  */
+void cpu_physical_memory_sync_dirty_log(ram_addr_t start, ram_addr_t length)
+{
+    CPUArchState *env;
+    ram_addr_t page, end;
+
+    if (!cpu_dirty_log_inline) {
+        return;
+    }
+    end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        for (page = start >> TARGET_PAGE_BITS; page < end; page++) {
+            if (env->dirty_log[page]) {
+                env->dirty_log[page] = 0;
+                cpu_physical_memory_set_dirty_flags(page << TARGET_PAGE_BITS,
+                                                    0xff & ~CODE_DIRTY_FLAG);
+            }
+        }
+    }
+}
+
+/* Make room in the dirty logs for the RAM block at [start, start + size) */
+static void cpu_dirty_log_resize(ram_addr_t start, ram_addr_t size)
+{
+    CPUArchState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        env->dirty_log = g_realloc(env->dirty_log,
+                                   last_ram_offset() >> TARGET_PAGE_BITS);
+        memset(env->dirty_log + (start >> TARGET_PAGE_BITS), 0,
+               size >> TARGET_PAGE_BITS);
+    }
+}
+
+#ifdef TCG_TARGET_HAS_DIRTY_LOG
+/* Switch TCG between logging stores to RAM inline and trapping the first
+   store to each clean page through notdirty_mem_write.  */
+static void cpu_dirty_log_set(int enable)
+{
+    CPUArchState *env;
+
+    if (!enable == !cpu_dirty_log_inline) {
+        return;
+    }
+    if (enable) {
+        cpu_dirty_log_resize(0, last_ram_offset());
+    } else {
+        cpu_physical_memory_sync_dirty_log(0, last_ram_offset());
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            g_free(env->dirty_log);
+            env->dirty_log = NULL;
+        }
+    }
+    cpu_dirty_log_inline = enable;
+    tcg_ctx.dirty_log = enable;
+
+    /* both the TLB entries and the translated stores depend on it */
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        tlb_flush(env, 1);
+    }
+    tb_flush(first_cpu);
+}
+#endif
+
 int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int ret = 0;
     in_migration = enable;
+#ifdef TCG_TARGET_HAS_DIRTY_LOG
+    /* switching needs a tb_flush() while no vCPU runs, and the per-CPU
+       logs would be folded while their owners write them */
+    if (tcg_enabled() && !mttcg_enabled) {
+        cpu_dirty_log_set(enable);
+    }
+#endif
     return ret;
 }
 
@@ -2556,6 +2886,10 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                                        last_ram_offset() >> TARGET_PAGE_BITS);
     memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
            0xff, size >> TARGET_PAGE_BITS);
+    ram_list.dirty_pages += size >> TARGET_PAGE_BITS;
+    if (cpu_dirty_log_inline) {
+        cpu_dirty_log_resize(new_block->offset, size);
+    }
 
     if (kvm_enabled())
         kvm_setup_guest_memory(new_block->host, size);
@@ -2575,6 +2909,8 @@ void qemu_ram_free_from_ptr(ram_addr_t addr)
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE(block, next);
+            cpu_physical_memory_mask_dirty_range(block->offset, block->length,
+                                                 MIGRATION_DIRTY_FLAG);
             g_free(block);
             return;
         }
@@ -2588,6 +2924,9 @@ void qemu_ram_free(ram_addr_t addr)
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE(block, next);
+            /* keep ram_list.dirty_pages exact if the range is reused */
+            cpu_physical_memory_mask_dirty_range(block->offset, block->length,
+                                                 MIGRATION_DIRTY_FLAG);
             if (block->flags & RAM_PREALLOC_MASK) {
                 ;
             } else if (mem_path) {
@@ -2880,7 +3219,6 @@ static void notdirty_mem_write(void *opaque, target_phys_addr_t ram_addr,
     if (!(dirty_flags & CODE_DIRTY_FLAG)) {
 #if !defined(CONFIG_USER_ONLY)
         tb_invalidate_phys_page_fast(ram_addr, size);
-        dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
 #endif
     }
     switch (size) {
@@ -2896,8 +3234,10 @@ static void notdirty_mem_write(void *opaque, target_phys_addr_t ram_addr,
     default:
         abort();
     }
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
-    cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
+    /* leave CODE_DIRTY_FLAG alone: another vCPU may have cleared it
+       since it was read above, by translating code from this page */
+    dirty_flags = cpu_physical_memory_set_dirty_flags(ram_addr,
+                                                      0xff & ~CODE_DIRTY_FLAG);
     /* we remove the notdirty callback only if the code has been
        flushed */
     if (dirty_flags == 0xff)
@@ -2934,6 +3274,9 @@ static void check_watchpoint(int offset, int len_mask, int flags)
             wp->flags |= BP_WATCHPOINT_HIT;
             if (!env->watchpoint_hit) {
                 env->watchpoint_hit = wp;
+                /* both branches leave with a longjmp, and cpu_exec()
+                   drops the lock */
+                tcg_tb_lock_nested();
                 tb = tb_find_pc(env->mem_io_pc);
                 if (!tb) {
                     cpu_abort(env, "check_watchpoint: could not find TB for "
@@ -3131,6 +3474,48 @@ MemoryRegion *iotlb_to_region(target_phys_addr_t index)
     return phys_sections[index & ~TARGET_PAGE_MASK].mr;
 }
 
+/* With tcg_threads=multi, take the global mutex for an I/O access by
+   a vCPU through the TLB entry whose iotlb value is 'index'.  Accesses to
+   RAM, ROM and unassigned memory do not need it.  Returns whether the
+   mutex was taken.  */
+bool tlb_io_lock(CPUArchState *env1, target_phys_addr_t index,
+                 uintptr_t retaddr)
+{
+    unsigned int section = index & ~TARGET_PAGE_MASK;
+    TranslationBlock *tb;
+    bool locked;
+
+    if (!mttcg_enabled ||
+        section == phys_section_notdirty || section == phys_section_rom ||
+        section == phys_section_unassigned || section == phys_section_watch) {
+        return false;
+    }
+    /* a code fetch from a device, done by the translator; it cannot
+       take the global mutex after tb_lock */
+    if (tls_var(have_tb_lock)) {
+        return false;
+    }
+    locked = qemu_tcg_mt_lock_iothread();
+    if (env1->interrupt_request & CPU_INTERRUPT_TLB_FLUSH) {
+        /* The memory map changed after the TLB was filled, so 'index' may
+           name a section that is gone.  Flush, and restart the access
+           through tlb_fill().  */
+        env1->interrupt_request &= ~CPU_INTERRUPT_TLB_FLUSH;
+        tlb_flush(env1, 1);
+        qemu_tcg_mt_unlock_iothread(locked);
+        if (retaddr) {
+            tcg_tb_lock();
+            tb = tb_find_pc(retaddr);
+            if (tb) {
+                cpu_restore_state(tb, env1, retaddr);
+            }
+            tcg_tb_unlock();
+        }
+        cpu_resume_from_signal(env1, NULL);
+    }
+    return locked;
+}
+
 static void io_mem_init(void)
 {
     memory_region_init_io(&io_mem_ram, &error_mem_ops, NULL, "ram", UINT64_MAX);
@@ -3145,8 +3530,12 @@ static void io_mem_init(void)
                           "watch", UINT64_MAX);
 }
 
+/* vCPU threads read the memory map under tb_lock, see tlb_io_lock() */
+static bool core_tb_locked;
+
 static void core_begin(MemoryListener *listener)
 {
+    core_tb_locked = tcg_tb_lock_nested();
     destroy_all_mappings();
     phys_sections_clear();
     phys_map.ptr = PHYS_MAP_NODE_NIL;
@@ -3164,8 +3553,15 @@ static void core_commit(MemoryListener *listener)
        reset the modified entries */
     /* XXX: slow ! */
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
-        tlb_flush(env, 1);
+        if (mttcg_enabled && env != cpu_single_env) {
+            /* the TLB belongs to another thread, which flushes it before
+               its next TB or device access */
+            cpu_interrupt(env, CPU_INTERRUPT_TLB_FLUSH);
+        } else {
+            tlb_flush(env, 1);
+        }
     }
+    tcg_tb_unlock_nested(core_tb_locked);
 }
 
 static void core_region_add(MemoryListener *listener,
@@ -3198,6 +3594,11 @@ static void core_log_stop(MemoryListener *listener,
 static void core_log_sync(MemoryListener *listener,
                           MemoryRegionSection *section)
 {
+    if (memory_region_is_ram(section->mr)) {
+        cpu_physical_memory_sync_dirty_log(section->mr->ram_addr +
+                                           section->offset_within_region,
+                                           section->size);
+    }
 }
 
 static void core_log_global_start(MemoryListener *listener)
@@ -4152,41 +4553,57 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, nb_tbs, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    unsigned long code_size;
     TranslationBlock *tb;
+    QHTStats hst;
+#if !defined(CONFIG_USER_ONLY)
+    CPUArchState *env;
+#endif
 
+    nb_tbs = 0;
+    code_size = 0;
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for(i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size)
-            max_target_code_size = tb->size;
-        if (tb->page_addr[1] != -1)
-            cross_page++;
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        CodeGenRegion *r = &code_gen_regions[i];
+
+        nb_tbs += r->nb_tbs;
+        code_size += r->ptr - r->start;
+        for (j = 0; j < r->nb_tbs; j++) {
+            tb = &r->tbs[j];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size)
+                max_target_code_size = tb->size;
+            if (tb->page_addr[1] != -1)
+                cross_page++;
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%ld\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
-    cpu_fprintf(f, "TB count            %d/%d\n", 
+    cpu_fprintf(f, "gen code size       %ld/%ld\n",
+                code_size, code_gen_buffer_size);
+    cpu_fprintf(f, "code regions        %d of %ld bytes (current %d)\n",
+                code_gen_nb_regions, code_gen_region_size,
+                (int)(code_gen_region - code_gen_regions));
+    cpu_fprintf(f, "TB count            %d/%d\n",
                 nb_tbs, code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %ld bytes (expansion ratio: %0.1f)\n",
+                nb_tbs ? code_size / nb_tbs : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -4195,10 +4612,29 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp_count * 100) / nb_tbs : 0,
                 direct_jmp2_count,
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
+
+    qht_statistics(&tb_phys_hash, &hst);
+    cpu_fprintf(f, "TB hash buckets     %zu/%zu (%0.2f%% head buckets used)\n",
+                hst.used_head_buckets, hst.head_buckets,
+                (double)hst.used_head_buckets / hst.head_buckets * 100);
+    cpu_fprintf(f, "TB hash avg chain   %0.3f buckets max=%zu\n",
+                hst.used_head_buckets ?
+                (double)hst.chain_buckets / hst.used_head_buckets : 0,
+                hst.max_chain);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d (%d TBs)\n",
+                tb_region_evict_count, tb_region_evict_tbs);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB hot traces       %d\n", tb_trace_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+#if !defined(CONFIG_USER_ONLY)
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        cpu_fprintf(f, "CPU %d TLB misses    %" PRIu64
+                    " (%" PRIu64 " victim TLB hits)\n",
+                    env->cpu_index, env->tlb_misses, env->tlb_victim_hits);
+    }
+#endif
     tcg_dump_info(f, cpu_fprintf);
 }
 
@@ -5,16 +5,33 @@
 static TCGArg *icount_arg;
 static int icount_label;
 
+/* Multi-threaded TCG kicks a vCPU by setting icount_decr.u16.high, see
+   cpu_unlink_tb(), so the check at the start of each TB is needed even
+   without -icount.  */
+static inline int gen_icount_check(void)
+{
+#if !defined(CONFIG_USER_ONLY)
+    return use_icount || mttcg_enabled;
+#else
+    return use_icount;
+#endif
+}
+
 static inline void gen_icount_start(void)
 {
     TCGv_i32 count;
 
-    if (!use_icount)
+    if (!gen_icount_check())
         return;
 
     icount_label = gen_new_label();
     count = tcg_temp_local_new_i32();
     tcg_gen_ld_i32(count, cpu_env, offsetof(CPUArchState, icount_decr.u32));
+    if (!use_icount) {
+        tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, icount_label);
+        tcg_temp_free_i32(count);
+        return;
+    }
     /* This is a horrid hack to allow fixing up the value later.  */
     icount_arg = gen_opparam_ptr + 1;
     tcg_gen_subi_i32(count, count, 0xdeadbeef);
@@ -28,6 +45,8 @@ static void gen_icount_end(TranslationBlock *tb, int num_insns)
 {
     if (use_icount) {
         *icount_arg = num_insns;
+    }
+    if (gen_icount_check()) {
         gen_set_label(icount_label);
         tcg_gen_exit_tb((tcg_target_long)tb + 2);
     }
@@ -264,19 +264,27 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "background:-b,name:s?",
+        .params     = "[-b] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created "
+                      "(use -b to save RAM while the guest runs)",
         .mhandler.cmd = do_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-b] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-b}, the guest is only paused while the disks are
+snapshotted and the device state is saved; RAM is saved afterwards,
+as it was at that point, while the guest runs.  The snapshot has no
+VM state until that is done, and migration is blocked meanwhile.  This
+needs a host kernel that can write protect memory with userfaultfd and
+the VM state to go to a qcow2 image.
 ETEXI
 
     {
@@ -858,6 +866,70 @@ STEXI
 @item migrate_set_downtime @var{second}
 @findex migrate_set_downtime
 Set maximum tolerated downtime (in seconds) for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_cache_size",
+        .args_type  = "value:o",
+        .params     = "value",
+        .help       = "set cache size (in bytes) for XBZRLE migrations,"
+                      "the cache size will be rounded down to the nearest "
+                      "power of 2.\n"
+                      "The cache size affects the number of cache misses."
+                      "In case of a high cache miss ratio you need to increase"
+                      " the cache size",
+        .mhandler.cmd = hmp_migrate_set_cache_size,
+    },
+
+STEXI
+@item migrate_set_cache_size @var{value}
+@findex migrate_set_cache_size
+Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "migrate_set_capability",
+        .args_type  = "capability:s,state:b",
+        .params     = "capability state",
+        .help       = "Enable/Disable the usage of a capability for migration",
+        .mhandler.cmd = hmp_migrate_set_capability,
+    },
+
+STEXI
+@item migrate_set_capability @var{capability} @var{state}
+@findex migrate_set_capability
+Enable/Disable the usage of a capability @var{capability} for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_multifd_channels",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set the number of connections used for RAM pages "
+                      "by multifd migrations",
+        .mhandler.cmd = hmp_migrate_set_multifd_channels,
+    },
+
+STEXI
+@item migrate_set_multifd_channels @var{value}
+@findex migrate_set_multifd_channels
+Set the number of connections used for RAM pages to @var{value} when the
+multifd capability is on.
+ETEXI
+
+    {
+        .name       = "migrate_set_parameter",
+        .args_type  = "parameter:s,value:i",
+        .params     = "parameter value",
+        .help       = "set a migration tunable: compress-level, "
+                      "compress-threads or decompress-threads",
+        .mhandler.cmd = hmp_migrate_set_parameter,
+    },
+
+STEXI
+@item migrate_set_parameter @var{parameter} @var{value}
+@findex migrate_set_parameter
+Set the migration tunable @var{parameter} to @var{value}.
 ETEXI
 
     {
@@ -1419,6 +1491,16 @@ show CPU statistics
 show user network stack connection states
 @item info migrate
 show migration status
+@item info migrate_capabilities
+show current migration capabilities
+@item info migrate_cache_size
+show current migration XBZRLE cache size
+@item info migrate_multifd_channels
+show the number of multifd migration channels
+@item info migrate_parameters
+show current migration tunables
+@item info vmstate_times
+show how long each device state took to save or load in the last migration
 @item info balloon
 show balloon information
 @item info qtree
@@ -131,8 +131,21 @@ void hmp_info_mice(Monitor *mon)
 void hmp_info_migrate(Monitor *mon)
 {
     MigrationInfo *info;
+    MigrationCapabilityStatusList *caps, *cap;
 
     info = qmp_query_migrate(NULL);
+    caps = qmp_query_migrate_capabilities(NULL);
+
+    /* do not display parameters during setup */
+    if (info->has_status && caps) {
+        monitor_printf(mon, "capabilities: ");
+        for (cap = caps; cap; cap = cap->next) {
+            monitor_printf(mon, "%s: %s ",
+                           MigrationCapability_lookup[cap->value->capability],
+                           cap->value->state ? "on" : "off");
+        }
+        monitor_printf(mon, "\n");
+    }
 
     if (info->has_status) {
         monitor_printf(mon, "Migration status: %s\n", info->status);
@@ -145,6 +158,10 @@ void hmp_info_migrate(Monitor *mon)
                        info->ram->remaining >> 10);
         monitor_printf(mon, "total ram: %" PRIu64 " kbytes\n",
                        info->ram->total >> 10);
+        if (info->ram->has_dirty_pages_rate) {
+            monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages/s\n",
+                           info->ram->dirty_pages_rate);
+        }
     }
 
     if (info->has_disk) {
@@ -156,7 +173,121 @@ void hmp_info_migrate(Monitor *mon)
                        info->disk->total >> 10);
     }
 
+    if (info->has_xbzrle_cache) {
+        monitor_printf(mon, "cache size: %" PRIu64 " bytes\n",
+                       info->xbzrle_cache->cache_size);
+        monitor_printf(mon, "xbzrle transferred: %" PRIu64 " kbytes\n",
+                       info->xbzrle_cache->bytes >> 10);
+        monitor_printf(mon, "xbzrle pages: %" PRIu64 " pages\n",
+                       info->xbzrle_cache->pages);
+        monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_miss);
+        monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
+                       info->xbzrle_cache->overflow);
+    }
+
+    if (info->has_cpu_throttle_percentage) {
+        monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                       info->cpu_throttle_percentage);
+    }
+
+    if (info->has_total_time) {
+        monitor_printf(mon, "total time: %" PRIu64 " milliseconds\n",
+                       info->total_time);
+    }
+    if (info->has_expected_downtime) {
+        monitor_printf(mon, "expected downtime: %" PRIu64 " milliseconds\n",
+                       info->expected_downtime);
+    }
+    if (info->has_downtime) {
+        monitor_printf(mon, "downtime: %" PRIu64 " milliseconds\n",
+                       info->downtime);
+    }
+    if (info->has_phases) {
+        MigrationPhases *phases = info->phases;
+
+        monitor_printf(mon, "phases (us): setup %" PRId64 " iterate %" PRId64
+                       " stop %" PRId64 " ram %" PRId64 " block %" PRId64
+                       " devices %" PRId64 " flush %" PRId64 "\n",
+                       phases->setup, phases->iterate, phases->stop,
+                       phases->ram, phases->block, phases->devices,
+                       phases->flush);
+    }
+    if (info->has_iterations) {
+        MigrationIterationList *iter;
+
+        monitor_printf(mon, "passes over ram:\n");
+        for (iter = info->iterations; iter; iter = iter->next) {
+            monitor_printf(mon, "  %" PRId64 " ms, %" PRId64 " kbytes, %"
+                           PRId64 " kbytes/s, %" PRId64 " pages dirty\n",
+                           iter->value->duration,
+                           iter->value->transferred >> 10,
+                           iter->value->bandwidth >> 10,
+                           iter->value->dirty_pages);
+        }
+    }
+
     qapi_free_MigrationInfo(info);
+    qapi_free_MigrationCapabilityStatusList(caps);
+}
+
+void hmp_info_migrate_capabilities(Monitor *mon)
+{
+    MigrationCapabilityStatusList *caps, *cap;
+
+    caps = qmp_query_migrate_capabilities(NULL);
+
+    if (caps) {
+        monitor_printf(mon, "capabilities: ");
+        for (cap = caps; cap; cap = cap->next) {
+            monitor_printf(mon, "%s: %s ",
+                           MigrationCapability_lookup[cap->value->capability],
+                           cap->value->state ? "on" : "off");
+        }
+        monitor_printf(mon, "\n");
+    }
+
+    qapi_free_MigrationCapabilityStatusList(caps);
+}
+
+void hmp_info_migrate_cache_size(Monitor *mon)
+{
+    monitor_printf(mon, "xbzrle cache size: %" PRId64 " kbytes\n",
+                   qmp_query_migrate_cache_size(NULL) >> 10);
+}
+
+void hmp_info_migrate_multifd_channels(Monitor *mon)
+{
+    monitor_printf(mon, "multifd channels: %" PRId64 "\n",
+                   qmp_query_migrate_multifd_channels(NULL));
+}
+
+void hmp_info_migrate_parameters(Monitor *mon)
+{
+    MigrationParameters *params;
+
+    params = qmp_query_migrate_parameters(NULL);
+    monitor_printf(mon, "compress-level: %" PRId64 "\n",
+                   params->compress_level);
+    monitor_printf(mon, "compress-threads: %" PRId64 "\n",
+                   params->compress_threads);
+    monitor_printf(mon, "decompress-threads: %" PRId64 "\n",
+                   params->decompress_threads);
+    qapi_free_MigrationParameters(params);
+}
+
+void hmp_info_vmstate_times(Monitor *mon)
+{
+    VMStateTimesList *list, *entry;
+
+    list = qmp_query_vmstate_times(NULL);
+    for (entry = list; entry; entry = entry->next) {
+        monitor_printf(mon, "%s/%" PRId64 " (section %" PRId64 "): save %"
+                       PRId64 " us, load %" PRId64 " us\n", entry->value->name,
+                       entry->value->instance_id, entry->value->section_id,
+                       entry->value->save_time, entry->value->load_time);
+    }
+    qapi_free_VMStateTimesList(list);
 }
 
 void hmp_info_cpus(Monitor *mon)
@@ -269,8 +400,7 @@ void hmp_info_blockstats(Monitor *mon)
                        " flush_operations=%" PRId64
                        " wr_total_time_ns=%" PRId64
                        " rd_total_time_ns=%" PRId64
-                       " flush_total_time_ns=%" PRId64
-                       "\n",
+                       " flush_total_time_ns=%" PRId64,
                        stats->value->stats->rd_bytes,
                        stats->value->stats->wr_bytes,
                        stats->value->stats->rd_operations,
@@ -279,6 +409,17 @@ void hmp_info_blockstats(Monitor *mon)
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
                        stats->value->stats->flush_total_time_ns);
+        if (stats->value->stats->has_l2_cache_hits) {
+            monitor_printf(mon, " l2_cache_hits=%" PRId64
+                           " l2_cache_misses=%" PRId64
+                           " refcount_cache_hits=%" PRId64
+                           " refcount_cache_misses=%" PRId64,
+                           stats->value->stats->l2_cache_hits,
+                           stats->value->stats->l2_cache_misses,
+                           stats->value->stats->refcount_cache_hits,
+                           stats->value->stats->refcount_cache_misses);
+        }
+        monitor_printf(mon, "\n");
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -733,6 +874,74 @@ void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
     qmp_migrate_set_speed(value, NULL);
 }
 
+void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    qmp_migrate_set_cache_size(value, &err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_migrate_set_multifd_channels(Monitor *mon, const QDict *qdict)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    qmp_migrate_set_multifd_channels(value, &err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    if (strcmp(param, "compress-level") == 0) {
+        qmp_migrate_set_parameters(true, value, false, 0, false, 0, &err);
+    } else if (strcmp(param, "compress-threads") == 0) {
+        qmp_migrate_set_parameters(false, 0, true, value, false, 0, &err);
+    } else if (strcmp(param, "decompress-threads") == 0) {
+        qmp_migrate_set_parameters(false, 0, false, 0, true, value, &err);
+    } else {
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+    }
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
+{
+    const char *cap = qdict_get_str(qdict, "capability");
+    bool state = qdict_get_bool(qdict, "state");
+    Error *err = NULL;
+    MigrationCapabilityStatusList *caps = g_malloc0(sizeof(*caps));
+    int i;
+
+    for (i = 0; i < MIGRATION_CAPABILITY_MAX; i++) {
+        if (strcmp(cap, MigrationCapability_lookup[i]) == 0) {
+            caps->value = g_malloc0(sizeof(*caps->value));
+            caps->value->capability = i;
+            caps->value->state = state;
+            caps->next = NULL;
+            qmp_migrate_set_capabilities(caps, &err);
+            break;
+        }
+    }
+
+    if (i == MIGRATION_CAPABILITY_MAX) {
+        error_set(&err, QERR_INVALID_PARAMETER, cap);
+    }
+
+    qapi_free_MigrationCapabilityStatusList(caps);
+
+    if (err) {
+        monitor_printf(mon, "migrate_set_capability: %s\n",
+                       error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
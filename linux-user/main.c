@@ -3118,6 +3118,13 @@ static void handle_arg_strace(const char *arg)
     do_strace = 1;
 }
 
+static const char *tb_cache_file;
+
+static void handle_arg_tb_cache(const char *arg)
+{
+    tb_cache_file = arg;
+}
+
 static void handle_arg_version(const char *arg)
 {
     printf("qemu-" TARGET_ARCH " version " QEMU_VERSION QEMU_PKGVERSION
@@ -3169,6 +3176,8 @@ struct qemu_argument arg_table[] = {
      "",           "run in singlestep mode"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
+    {"tbcache",    "QEMU_TB_CACHE",    true,  handle_arg_tb_cache,
+     "file",       "reuse code translated by earlier runs, saved in 'file'"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
      "",           "display version information and exit"},
     {NULL, NULL, false, NULL, NULL, NULL}
@@ -3511,6 +3520,11 @@ int main(int argc, char **argv, char **envp)
     env->opaque = ts;
     task_settid(ts);
 
+    /* Breakpoints and single-stepping change the generated code */
+    if (tb_cache_file && !singlestep && !gdbstub_port) {
+        tb_cache_init(tb_cache_file, cpu_model);
+    }
+
     ret = loader_exec(filename, target_argv, target_environ, regs,
         info, &bprm);
     if (ret != 0) {
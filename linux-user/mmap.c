@@ -140,6 +140,9 @@ int target_mprotect(abi_ulong start, abi_ulong len, int prot)
             goto error;
     }
     page_set_flags(start, start + len, prot | PAGE_VALID);
+    if ((prot & (PROT_EXEC | PROT_WRITE)) != PROT_EXEC) {
+        tb_cache_unmap(start, len);
+    }
     mmap_unlock();
     return 0;
 error:
@@ -573,6 +576,7 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
     page_dump(stdout);
     printf("\n");
 #endif
+    tb_cache_map_file(start, len, prot, flags, fd, offset);
     tb_invalidate_phys_range(start, start + len, 0);
     mmap_unlock();
     return start;
@@ -678,6 +682,7 @@ int target_munmap(abi_ulong start, abi_ulong len)
 
     if (ret == 0) {
         page_set_flags(start, start + len, 0);
+        tb_cache_unmap(start, len);
         tb_invalidate_phys_range(start, start + len, 0);
     }
     mmap_unlock();
@@ -756,6 +761,8 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
         prot = page_get_flags(old_addr);
         page_set_flags(old_addr, old_addr + old_size, 0);
         page_set_flags(new_addr, new_addr + new_size, prot | PAGE_VALID);
+        tb_cache_unmap(old_addr, old_size);
+        tb_cache_unmap(new_addr, new_size);
     }
     tb_invalidate_phys_range(new_addr, new_addr + new_size, 0);
     mmap_unlock();
@@ -263,6 +263,16 @@ void mmap_fork_start(void);
 void mmap_fork_end(int child);
 #endif
 
+/* tbcache.c */
+void tb_cache_init(const char *path, const char *cpu_model);
+void tb_cache_map_file(abi_ulong start, abi_ulong len, int prot, int flags,
+                       int fd, abi_ulong offset);
+void tb_cache_unmap(abi_ulong start, abi_ulong len);
+int tb_cache_lookup(TranslationBlock *tb, size_t max_code_size,
+                    int *code_size);
+void tb_cache_add(TranslationBlock *tb, int code_size);
+void tb_cache_save(void);
+
 /* main.c */
 extern unsigned long guest_stack_size;
 
@@ -0,0 +1,568 @@
+/*
+ *  Persistent translation cache for read-only file mappings
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Short-lived processes spend much of their time translating the same
+ * code of the dynamic loader and of the C library.  When enabled with
+ * -tbcache, the host code of TBs that lie in executable, read-only,
+ * private file mappings is saved at exit, together with the places where
+ * it refers to things outside of the TB (see TCGCodeReloc).  The next
+ * process using the same cache file maps it, and tb_gen_code copies the
+ * saved code into code_gen_buffer instead of translating it.
+ *
+ * Cached code embeds guest addresses and the addresses of QEMU's helpers,
+ * so a TB is only reused for the same guest pc in a mapping of the same
+ * file (device, inode, size and mtime), by the same QEMU binary loaded at
+ * the same address, with the same guest_base and CPU model.  Concurrent
+ * processes each rewrite the whole file with rename(), so the last one
+ * to exit wins.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "qemu.h"
+#include "qht.h"
+#include "tcg.h"
+#include "cache-utils.h"
+
+//#define DEBUG_TB_CACHE
+
+#define TB_CACHE_MAGIC      0x31434254554d4551ULL /* "QEMUTBC1" */
+#define TB_CACHE_VERSION    1
+#define TB_CACHE_MAX_SIZE   (64 * 1024 * 1024)
+#define TB_CACHE_MAX_MAPS   256
+
+typedef struct TBCacheFileId {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+} TBCacheFileId;
+
+typedef struct TBCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t nb_entries;
+    TBCacheFileId exe;          /* the QEMU binary */
+    uint64_t code_stamp;        /* where that binary was loaded */
+    uint64_t guest_base;
+    char cpu_model[64];
+} TBCacheHeader;
+
+/* Each entry is followed by its relocations and then by its code,
+   padded to a multiple of 8 bytes. */
+typedef struct TBCacheEntry {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    TBCacheFileId file;
+    uint64_t file_offset;       /* of pc */
+    uint32_t size;
+    uint32_t icount;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint32_t nb_relocs;
+    uint32_t code_size;
+} TBCacheEntry;
+
+typedef struct TBCacheRef {
+    TBCacheEntry *entry;
+    bool allocated;             /* not part of the mapped cache file */
+} TBCacheRef;
+
+typedef struct TBCacheKey {
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+} TBCacheKey;
+
+/* A read-only file mapping of the guest */
+typedef struct TBCacheMap {
+    abi_ulong start;
+    abi_ulong end;
+    uint64_t offset;
+    TBCacheFileId file;
+} TBCacheMap;
+
+static bool tb_cache_enabled;
+static char *tb_cache_path;
+static TBCacheHeader tb_cache_header;
+static uint64_t tb_cache_guest_base;
+static QHT tb_cache_ht;
+static size_t tb_cache_size;
+static bool tb_cache_dirty;
+static TBCacheMap tb_cache_maps[TB_CACHE_MAX_MAPS];
+static int tb_cache_nb_maps;
+
+static size_t tb_cache_entry_len(const TBCacheEntry *e)
+{
+    size_t len = sizeof(*e) + e->nb_relocs * sizeof(TCGCodeReloc) +
+                 e->code_size;
+
+    return (len + 7) & ~(size_t)7;
+}
+
+static TCGCodeReloc *tb_cache_entry_relocs(TBCacheEntry *e)
+{
+    return (TCGCodeReloc *)(e + 1);
+}
+
+static uint8_t *tb_cache_entry_code(TBCacheEntry *e)
+{
+    return (uint8_t *)(tb_cache_entry_relocs(e) + e->nb_relocs);
+}
+
+/* Whether the jump offsets of E lie within its code.  The relocations
+   are checked by tcg_apply_code_reloc, which knows their width. */
+static bool tb_cache_entry_valid(const TBCacheEntry *e)
+{
+    int n;
+
+    if (e->nb_relocs > TCG_MAX_CODE_RELOCS ||
+        e->code_size > TCG_MAX_OP_SIZE * OPC_BUF_SIZE) {
+        return false;
+    }
+    for (n = 0; n < 2; n++) {
+        if (e->tb_next_offset[n] == 0xffff) {
+            continue;
+        }
+        if (e->tb_next_offset[n] > e->code_size) {
+            return false;
+        }
+#ifdef USE_DIRECT_JUMP
+        /* tb_set_jmp_target patches a 32-bit displacement */
+        if (e->tb_jmp_offset[n] + sizeof(uint32_t) > e->code_size) {
+            return false;
+        }
+#endif
+    }
+    return true;
+}
+
+static uint32_t tb_cache_hash(target_ulong pc, target_ulong cs_base,
+                              uint64_t flags)
+{
+    return tb_hash_func(pc, pc, flags, cs_base);
+}
+
+static bool tb_cache_cmp(const void *obj, const void *userp)
+{
+    const TBCacheRef *ref = obj;
+    const TBCacheKey *key = userp;
+
+    return ref->entry->pc == key->pc && ref->entry->cs_base == key->cs_base &&
+           ref->entry->flags == key->flags;
+}
+
+static void tb_cache_file_id(TBCacheFileId *id, const struct stat *st)
+{
+    memset(id, 0, sizeof(*id));
+    id->dev = st->st_dev;
+    id->ino = st->st_ino;
+    id->size = st->st_size;
+    id->mtime = st->st_mtime;
+}
+
+static TBCacheMap *tb_cache_find_map(abi_ulong addr)
+{
+    int i;
+
+    for (i = 0; i < tb_cache_nb_maps; i++) {
+        if (addr >= tb_cache_maps[i].start && addr < tb_cache_maps[i].end) {
+            return &tb_cache_maps[i];
+        }
+    }
+    return NULL;
+}
+
+static void tb_cache_free_ref(void *obj, uint32_t hash, void *userp)
+{
+    TBCacheRef *ref = obj;
+
+    if (ref->allocated) {
+        g_free(ref->entry);
+    }
+    g_free(ref);
+}
+
+/* guest_base is only final once the executable has been loaded; code
+   translated for another value is useless. */
+static void tb_cache_check_guest_base(void)
+{
+    if (tb_cache_guest_base != GUEST_BASE) {
+        qht_iter(&tb_cache_ht, tb_cache_free_ref, NULL);
+        qht_reset(&tb_cache_ht);
+        tb_cache_size = 0;
+        tb_cache_guest_base = GUEST_BASE;
+    }
+}
+
+/* Replace the entry for the same TB, if any, with REF */
+static void tb_cache_insert(TBCacheRef *ref)
+{
+    TBCacheEntry *e = ref->entry;
+    TBCacheKey key = { e->pc, e->cs_base, e->flags };
+    uint32_t hash = tb_cache_hash(e->pc, e->cs_base, e->flags);
+    TBCacheRef *old;
+
+    old = qht_lookup(&tb_cache_ht, tb_cache_cmp, &key, hash);
+    if (old) {
+        qht_remove(&tb_cache_ht, old, hash);
+        tb_cache_size -= tb_cache_entry_len(old->entry);
+        tb_cache_free_ref(old, hash, NULL);
+    }
+    qht_insert(&tb_cache_ht, ref, hash);
+    tb_cache_size += tb_cache_entry_len(e);
+}
+
+static void tb_cache_load(void)
+{
+    TBCacheHeader *hdr;
+    TBCacheEntry *e;
+    TBCacheRef *ref;
+    struct stat st;
+    uint8_t *p, *end;
+    uint32_t i;
+    void *buf;
+    int fd;
+
+    fd = open(tb_cache_path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return;
+    }
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        return;
+    }
+
+    hdr = buf;
+    if (hdr->magic != TB_CACHE_MAGIC || hdr->version != TB_CACHE_VERSION ||
+        memcmp(&hdr->exe, &tb_cache_header.exe, sizeof(hdr->exe)) ||
+        hdr->code_stamp != tb_cache_header.code_stamp ||
+        strncmp(hdr->cpu_model, tb_cache_header.cpu_model,
+                sizeof(hdr->cpu_model))) {
+        munmap(buf, st.st_size);
+        return;
+    }
+    tb_cache_guest_base = hdr->guest_base;
+
+    /* The mapping is kept for the lifetime of the process */
+    p = (uint8_t *)(hdr + 1);
+    end = (uint8_t *)buf + st.st_size;
+    for (i = 0; i < hdr->nb_entries; i++) {
+        e = (TBCacheEntry *)p;
+        if (end - p < sizeof(*e) || !tb_cache_entry_valid(e) ||
+            end - p < tb_cache_entry_len(e)) {
+            break;
+        }
+        ref = g_malloc(sizeof(*ref));
+        ref->entry = e;
+        ref->allocated = false;
+        tb_cache_insert(ref);
+        p += tb_cache_entry_len(e);
+    }
+#ifdef DEBUG_TB_CACHE
+    fprintf(stderr, "tbcache: loaded %u TBs from %s\n", i, tb_cache_path);
+#endif
+}
+
+void tb_cache_init(const char *path, const char *cpu_model)
+{
+#ifdef TCG_TARGET_HAS_CODE_RELOCS
+    struct stat st;
+
+    if (stat("/proc/self/exe", &st) < 0) {
+        return;
+    }
+    tb_cache_path = g_strdup(path);
+    memset(&tb_cache_header, 0, sizeof(tb_cache_header));
+    tb_cache_header.magic = TB_CACHE_MAGIC;
+    tb_cache_header.version = TB_CACHE_VERSION;
+    tb_cache_file_id(&tb_cache_header.exe, &st);
+    tb_cache_header.code_stamp = (uintptr_t)tb_gen_code;
+    pstrcpy(tb_cache_header.cpu_model, sizeof(tb_cache_header.cpu_model),
+            cpu_model);
+
+    qht_init(&tb_cache_ht, 1024, QHT_MODE_AUTO_RESIZE);
+    tb_cache_guest_base = -1;
+    tb_cache_load();
+
+    tcg_ctx.code_relocs_enabled = 1;
+    tb_cache_enabled = true;
+#else
+    fprintf(stderr, "qemu: translation cache not supported on this host\n");
+#endif
+}
+
+void tb_cache_map_file(abi_ulong start, abi_ulong len, int prot, int flags,
+                       int fd, abi_ulong offset)
+{
+    TBCacheMap *map;
+    struct stat st;
+
+    if (!tb_cache_enabled || len == 0) {
+        return;
+    }
+    tb_cache_unmap(start, len);
+    if ((flags & MAP_ANONYMOUS) || (flags & MAP_TYPE) != MAP_PRIVATE ||
+        (prot & (PROT_EXEC | PROT_WRITE)) != PROT_EXEC ||
+        tb_cache_nb_maps == TB_CACHE_MAX_MAPS || fstat(fd, &st) < 0) {
+        return;
+    }
+    map = &tb_cache_maps[tb_cache_nb_maps++];
+    map->start = start;
+    map->end = start + len;
+    map->offset = offset;
+    tb_cache_file_id(&map->file, &st);
+}
+
+void tb_cache_unmap(abi_ulong start, abi_ulong len)
+{
+    int i;
+
+    if (!tb_cache_enabled) {
+        return;
+    }
+    for (i = tb_cache_nb_maps - 1; i >= 0; i--) {
+        if (tb_cache_maps[i].start < start + len &&
+            start < tb_cache_maps[i].end) {
+            tb_cache_maps[i] = tb_cache_maps[--tb_cache_nb_maps];
+        }
+    }
+}
+
+/* Fill TB (whose pc, cs_base, flags, cflags and tc_ptr are set) from the
+   cache, using at most MAX_CODE_SIZE bytes at tc_ptr.  Returns 0 and sets
+   *CODE_SIZE on success.  Called with tb_lock held. */
+int tb_cache_lookup(TranslationBlock *tb, size_t max_code_size,
+                    int *code_size)
+{
+#ifdef TCG_TARGET_HAS_CODE_RELOCS
+    TBCacheKey key = { tb->pc, tb->cs_base, tb->flags };
+    TBCacheRef *ref;
+    TBCacheEntry *e;
+    TBCacheMap *map;
+    TCGCodeReloc *r;
+    uint32_t i;
+    bool valid;
+
+    if (!tb_cache_enabled || tb->cflags) {
+        return -1;
+    }
+    tb_cache_check_guest_base();
+    ref = qht_lookup(&tb_cache_ht, tb_cache_cmp, &key,
+                     tb_cache_hash(tb->pc, tb->cs_base, tb->flags));
+    if (!ref) {
+        return -1;
+    }
+    e = ref->entry;
+    if (e->code_size > max_code_size) {
+        return -1;
+    }
+
+    mmap_lock();
+    map = tb_cache_find_map(tb->pc);
+    valid = map && tb->pc + e->size <= map->end &&
+            !memcmp(&e->file, &map->file, sizeof(e->file)) &&
+            e->file_offset == map->offset + (tb->pc - map->start);
+    mmap_unlock();
+    if (!valid) {
+        return -1;
+    }
+
+    memcpy(tb->tc_ptr, tb_cache_entry_code(e), e->code_size);
+    r = tb_cache_entry_relocs(e);
+    for (i = 0; i < e->nb_relocs; i++) {
+        if (tcg_apply_code_reloc(tb->tc_ptr, e->code_size, &r[i],
+                                 (uintptr_t)tb) < 0) {
+            return -1;
+        }
+    }
+    flush_icache_range((uintptr_t)tb->tc_ptr,
+                       (uintptr_t)tb->tc_ptr + e->code_size);
+
+    tb->size = e->size;
+    tb->icount = e->icount;
+    tb->tb_next_offset[0] = e->tb_next_offset[0];
+    tb->tb_next_offset[1] = e->tb_next_offset[1];
+#ifdef USE_DIRECT_JUMP
+    tb->tb_jmp_offset[0] = e->tb_jmp_offset[0];
+    tb->tb_jmp_offset[1] = e->tb_jmp_offset[1];
+#endif
+    *code_size = e->code_size;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* Remember TB, which has just been translated to CODE_SIZE bytes.
+   Called with tb_lock held. */
+void tb_cache_add(TranslationBlock *tb, int code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    TBCacheEntry *e;
+    TBCacheRef *ref;
+    TBCacheMap *map;
+    TBCacheFileId file;
+    uint64_t file_offset;
+    size_t len;
+    int i;
+
+    if (!tb_cache_enabled || tb->cflags ||
+        s->nb_code_relocs > TCG_MAX_CODE_RELOCS) {
+        return;
+    }
+    tb_cache_check_guest_base();
+    for (i = 0; i < s->nb_code_relocs; i++) {
+        if (s->code_relocs[i].type == TCG_CODE_RELOC_TB &&
+            (s->code_relocs[i].value & ~(uint64_t)3) != (uintptr_t)tb) {
+            return;
+        }
+    }
+
+    mmap_lock();
+    map = tb_cache_find_map(tb->pc);
+    if (map && tb->pc + tb->size <= map->end) {
+        file = map->file;
+        file_offset = map->offset + (tb->pc - map->start);
+    } else {
+        map = NULL;
+    }
+    mmap_unlock();
+    if (!map) {
+        return;
+    }
+
+    len = sizeof(*e) + s->nb_code_relocs * sizeof(TCGCodeReloc) + code_size;
+    len = (len + 7) & ~(size_t)7;
+    if (tb_cache_size + len > TB_CACHE_MAX_SIZE) {
+        return;
+    }
+
+    e = g_malloc0(len);
+    e->pc = tb->pc;
+    e->cs_base = tb->cs_base;
+    e->flags = tb->flags;
+    e->file = file;
+    e->file_offset = file_offset;
+    e->size = tb->size;
+    e->icount = tb->icount;
+    e->tb_next_offset[0] = tb->tb_next_offset[0];
+    e->tb_next_offset[1] = tb->tb_next_offset[1];
+#ifdef USE_DIRECT_JUMP
+    e->tb_jmp_offset[0] = tb->tb_jmp_offset[0];
+    e->tb_jmp_offset[1] = tb->tb_jmp_offset[1];
+#endif
+    e->nb_relocs = s->nb_code_relocs;
+    e->code_size = code_size;
+    memcpy(tb_cache_entry_relocs(e), s->code_relocs,
+           e->nb_relocs * sizeof(TCGCodeReloc));
+    memcpy(tb_cache_entry_code(e), tb->tc_ptr, code_size);
+
+    ref = g_malloc(sizeof(*ref));
+    ref->entry = e;
+    ref->allocated = true;
+    tb_cache_insert(ref);
+    tb_cache_dirty = true;
+}
+
+typedef struct TBCacheWriter {
+    FILE *f;
+    uint32_t nb_entries;
+    bool error;
+} TBCacheWriter;
+
+static void tb_cache_write_entry(void *obj, uint32_t hash, void *userp)
+{
+    TBCacheRef *ref = obj;
+    TBCacheWriter *w = userp;
+    size_t len = tb_cache_entry_len(ref->entry);
+    size_t pad = len - (sizeof(*ref->entry) +
+                        ref->entry->nb_relocs * sizeof(TCGCodeReloc) +
+                        ref->entry->code_size);
+    static const uint8_t zeroes[8];
+
+    if (fwrite(ref->entry, len - pad, 1, w->f) != 1 ||
+        (pad && fwrite(zeroes, pad, 1, w->f) != 1)) {
+        w->error = true;
+    }
+    w->nb_entries++;
+}
+
+/* Write the cache back if this process added TBs to it */
+void tb_cache_save(void)
+{
+    TBCacheHeader hdr;
+    TBCacheWriter w;
+    char *tmp;
+    int fd;
+
+    if (!tb_cache_enabled || !tb_cache_dirty) {
+        return;
+    }
+    spin_lock(&tb_lock);
+    tmp = g_malloc(strlen(tb_cache_path) + 8);
+    sprintf(tmp, "%s.XXXXXX", tb_cache_path);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        goto out;
+    }
+    w.f = fdopen(fd, "w");
+    if (!w.f) {
+        close(fd);
+        unlink(tmp);
+        goto out;
+    }
+
+    hdr = tb_cache_header;
+    hdr.guest_base = tb_cache_guest_base;
+    w.nb_entries = 0;
+    w.error = fwrite(&hdr, sizeof(hdr), 1, w.f) != 1;
+    qht_iter(&tb_cache_ht, tb_cache_write_entry, &w);
+
+    /* now that the count is known, rewrite the header */
+    hdr.nb_entries = w.nb_entries;
+    if (fseek(w.f, 0, SEEK_SET) < 0 ||
+        fwrite(&hdr, sizeof(hdr), 1, w.f) != 1) {
+        w.error = true;
+    }
+    if (fclose(w.f) != 0 || w.error || rename(tmp, tb_cache_path) < 0) {
+        unlink(tmp);
+    } else {
+        tb_cache_dirty = false;
+    }
+#ifdef DEBUG_TB_CACHE
+    fprintf(stderr, "tbcache: saved %u TBs to %s\n", w.nb_entries,
+            tb_cache_path);
+#endif
+ out:
+    g_free(tmp);
+    spin_unlock(&tb_lock);
+}
@@ -1081,6 +1081,17 @@ bool memory_region_get_dirty(MemoryRegion *mr, target_phys_addr_t addr,
                                          1 << client);
 }
 
+target_phys_addr_t memory_region_find_dirty(MemoryRegion *mr,
+                                            target_phys_addr_t addr,
+                                            target_phys_addr_t size,
+                                            unsigned client)
+{
+    assert(mr->terminates);
+    return cpu_physical_memory_find_dirty(mr->ram_addr + addr,
+                                          mr->ram_addr + addr + size,
+                                          1 << client) - mr->ram_addr;
+}
+
 void memory_region_set_dirty(MemoryRegion *mr, target_phys_addr_t addr,
                              target_phys_addr_t size)
 {
@@ -419,6 +419,25 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client);
 bool memory_region_get_dirty(MemoryRegion *mr, target_phys_addr_t addr,
                              target_phys_addr_t size, unsigned client);
 
+/**
+ * memory_region_find_dirty: Find the next dirty page in a range of bytes
+ *                           for a specified client.
+ *
+ * Returns the address (relative to the start of the region) of the first
+ * page of the range that is dirty for @client, or @addr + @size if none
+ * is.  Much faster than calling memory_region_get_dirty() on each page.
+ *
+ * @mr: the memory region being queried.
+ * @addr: the address (relative to the start of the region) to start from.
+ * @size: the size of the range being queried.
+ * @client: the user of the logging information; %DIRTY_MEMORY_MIGRATION or
+ *          %DIRTY_MEMORY_VGA.
+ */
+target_phys_addr_t memory_region_find_dirty(MemoryRegion *mr,
+                                            target_phys_addr_t addr,
+                                            target_phys_addr_t size,
+                                            unsigned client);
+
 /**
  * memory_region_set_dirty: Mark a range of bytes as dirty in a memory region.
  *
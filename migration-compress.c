@@ -0,0 +1,533 @@
+/*
+ * QEMU live migration: parallel page compression
+ *
+ * When the "compress" capability is on, the pages that would be sent
+ * whole are deflated by a pool of threads.  The main thread still walks
+ * the dirty bitmap and writes the stream: it hands each page to an idle
+ * thread and writes out the result of the threads that are done, so the
+ * pages may reach the stream in a different order than they were found.
+ * A page can be found again while an older copy is still in flight,
+ * because the vCPUs keep dirtying it, so before the main thread sends a
+ * page in any form it writes out the older copy with
+ * compress_save_page_done(); every round also writes out all the pages
+ * in flight before its end marker.
+ *
+ * The destination reads the compressed pages in stream order and hands
+ * them to its own pool of threads, which inflate them straight into
+ * guest RAM.  Anything else that writes a page first waits for the
+ * inflate of that page with compress_load_page_done(), and they are all
+ * finished at the end of each section as well.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <zlib.h>
+
+#include "qemu-common.h"
+#include "hw/hw.h"
+#include "qemu-thread.h"
+#include "migration.h"
+
+//#define DEBUG_MIGRATION_COMPRESS
+
+#ifdef DEBUG_MIGRATION_COMPRESS
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-compress: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/*
+ * A thread is idle (!busy), working (busy && !done), or holds a result
+ * for the main thread (busy && done).  Only the main thread sets busy,
+ * and only the thread sets done, both with the lock held.
+ */
+typedef struct CompressParam {
+    QemuThread thread;
+    bool busy;
+    bool done;
+    void *opaque;
+    uint64_t offset;
+    const uint8_t *page;
+    uint8_t *buf;
+    int len;                    /* -1 if the page did not shrink */
+    z_stream stream;
+} CompressParam;
+
+static struct {
+    CompressParam *threads;
+    int num_threads;
+    unsigned int page_size;
+    CompressPutFunc *put;
+    bool quit;
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+} comp_send;
+
+typedef struct DecompressParam {
+    QemuThread thread;
+    bool busy;
+    uint8_t *host;
+    uint8_t *buf;
+    int len;
+    z_stream stream;
+} DecompressParam;
+
+static struct {
+    DecompressParam *threads;
+    int num_threads;
+    unsigned int page_size;
+    bool quit;
+    bool error;
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+} comp_recv;
+
+static int compress_page(CompressParam *p)
+{
+    z_stream *stream = &p->stream;
+
+    if (deflateReset(stream) != Z_OK) {
+        return -1;
+    }
+    stream->next_in = (uint8_t *)p->page;
+    stream->avail_in = comp_send.page_size;
+    stream->next_out = p->buf;
+    /* anything that does not save at least a byte is sent as is */
+    stream->avail_out = comp_send.page_size - 1;
+
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return stream->total_out;
+}
+
+static void *compress_thread(void *opaque)
+{
+    CompressParam *p = opaque;
+    int len;
+
+    qemu_mutex_lock(&comp_send.lock);
+    for (;;) {
+        while (!(p->busy && !p->done) && !comp_send.quit) {
+            qemu_cond_wait(&comp_send.work_cond, &comp_send.lock);
+        }
+        if (comp_send.quit) {
+            break;
+        }
+        qemu_mutex_unlock(&comp_send.lock);
+
+        len = compress_page(p);
+
+        qemu_mutex_lock(&comp_send.lock);
+        p->len = len;
+        p->done = true;
+        qemu_cond_broadcast(&comp_send.done_cond);
+    }
+    qemu_mutex_unlock(&comp_send.lock);
+
+    return NULL;
+}
+
+/*
+ * Start the compression threads for a migration that is about to send
+ * pages of page_size bytes.  put writes out the compressed pages.
+ * Returns the number of threads, 0 if the capability is off, or a
+ * negative errno.
+ */
+int compress_save_setup(unsigned int page_size, CompressPutFunc *put)
+{
+    int i, num, level;
+
+    if (!migrate_use_compression()) {
+        return 0;
+    }
+
+    num = migrate_compress_threads();
+    level = migrate_compress_level();
+    comp_send.threads = g_malloc0(num * sizeof(CompressParam));
+    comp_send.num_threads = 0;
+    comp_send.page_size = page_size;
+    comp_send.put = put;
+    comp_send.quit = false;
+    qemu_mutex_init(&comp_send.lock);
+    qemu_cond_init(&comp_send.work_cond);
+    qemu_cond_init(&comp_send.done_cond);
+
+    for (i = 0; i < num; i++) {
+        CompressParam *p = &comp_send.threads[i];
+
+        if (deflateInit(&p->stream, level) != Z_OK) {
+            fprintf(stderr, "migration: could not set up compression\n");
+            compress_save_cleanup();
+            return -ENOMEM;
+        }
+        p->buf = g_malloc(page_size);
+        comp_send.num_threads++;
+        qemu_thread_create(&p->thread, compress_thread, p,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    DPRINTF("%d threads at level %d\n", num, level);
+    return num;
+}
+
+/* Write out the result held by p, which the main thread owns */
+static int compress_put_result(QEMUFile *f, CompressParam *p)
+{
+    return comp_send.put(f, p->opaque, p->offset, p->page, p->buf, p->len);
+}
+
+/*
+ * Write out the copy of the page at opaque and offset that is still in
+ * flight, if any, so that it does not land on top of a newer one.  Call
+ * it before sending the page again.  Returns the number of bytes
+ * written to f.
+ */
+int compress_save_page_done(QEMUFile *f, void *opaque, uint64_t offset)
+{
+    CompressParam *p = NULL;
+    int i, bytes = 0;
+
+    qemu_mutex_lock(&comp_send.lock);
+    for (i = 0; i < comp_send.num_threads; i++) {
+        if (comp_send.threads[i].busy &&
+            comp_send.threads[i].opaque == opaque &&
+            comp_send.threads[i].offset == offset) {
+            p = &comp_send.threads[i];
+            break;
+        }
+    }
+    while (p && !p->done) {
+        qemu_cond_wait(&comp_send.done_cond, &comp_send.lock);
+    }
+    qemu_mutex_unlock(&comp_send.lock);
+
+    if (p) {
+        bytes = compress_put_result(f, p);
+        qemu_mutex_lock(&comp_send.lock);
+        p->busy = false;
+        qemu_mutex_unlock(&comp_send.lock);
+    }
+
+    return bytes;
+}
+
+/*
+ * Queue the page at 'page' for compression; opaque and offset are given
+ * back to the put function with the result.  The page must stay mapped
+ * until it is written out, and must not be in flight already (see
+ * compress_save_page_done()).  Returns the number of bytes written to f
+ * for pages queued earlier.
+ */
+int compress_save_page(QEMUFile *f, void *opaque, uint64_t offset,
+                       const uint8_t *page)
+{
+    CompressParam *p = NULL;
+    int i, bytes = 0;
+
+    qemu_mutex_lock(&comp_send.lock);
+    while (!p) {
+        for (i = 0; i < comp_send.num_threads; i++) {
+            if (!comp_send.threads[i].busy || comp_send.threads[i].done) {
+                p = &comp_send.threads[i];
+                break;
+            }
+        }
+        if (!p) {
+            qemu_cond_wait(&comp_send.done_cond, &comp_send.lock);
+        }
+    }
+    qemu_mutex_unlock(&comp_send.lock);
+
+    if (p->busy) {
+        bytes = compress_put_result(f, p);
+    }
+
+    qemu_mutex_lock(&comp_send.lock);
+    p->opaque = opaque;
+    p->offset = offset;
+    p->page = page;
+    p->done = false;
+    p->busy = true;
+    qemu_cond_broadcast(&comp_send.work_cond);
+    qemu_mutex_unlock(&comp_send.lock);
+
+    return bytes;
+}
+
+/*
+ * Wait for every page in flight and write it out.  Returns the number
+ * of bytes written to f.
+ */
+int compress_save_flush(QEMUFile *f)
+{
+    int i, bytes = 0;
+
+    for (i = 0; i < comp_send.num_threads; i++) {
+        CompressParam *p = &comp_send.threads[i];
+
+        qemu_mutex_lock(&comp_send.lock);
+        while (p->busy && !p->done) {
+            qemu_cond_wait(&comp_send.done_cond, &comp_send.lock);
+        }
+        qemu_mutex_unlock(&comp_send.lock);
+
+        if (p->busy) {
+            bytes += compress_put_result(f, p);
+            qemu_mutex_lock(&comp_send.lock);
+            p->busy = false;
+            qemu_mutex_unlock(&comp_send.lock);
+        }
+    }
+
+    return bytes;
+}
+
+/* Stop the threads; the pages still in flight are dropped */
+void compress_save_cleanup(void)
+{
+    int i;
+
+    if (!comp_send.threads) {
+        return;
+    }
+
+    qemu_mutex_lock(&comp_send.lock);
+    comp_send.quit = true;
+    qemu_cond_broadcast(&comp_send.work_cond);
+    qemu_mutex_unlock(&comp_send.lock);
+
+    for (i = 0; i < comp_send.num_threads; i++) {
+        CompressParam *p = &comp_send.threads[i];
+
+        qemu_thread_join(&p->thread);
+        deflateEnd(&p->stream);
+        g_free(p->buf);
+    }
+    qemu_cond_destroy(&comp_send.done_cond);
+    qemu_cond_destroy(&comp_send.work_cond);
+    qemu_mutex_destroy(&comp_send.lock);
+    g_free(comp_send.threads);
+    comp_send.threads = NULL;
+    comp_send.num_threads = 0;
+}
+
+static bool decompress_page(DecompressParam *p)
+{
+    z_stream *stream = &p->stream;
+
+    if (inflateReset(stream) != Z_OK) {
+        return false;
+    }
+    stream->next_in = p->buf;
+    stream->avail_in = p->len;
+    stream->next_out = p->host;
+    stream->avail_out = comp_recv.page_size;
+
+    return inflate(stream, Z_FINISH) == Z_STREAM_END &&
+           stream->total_out == comp_recv.page_size;
+}
+
+static void *decompress_thread(void *opaque)
+{
+    DecompressParam *p = opaque;
+    bool ok;
+
+    qemu_mutex_lock(&comp_recv.lock);
+    for (;;) {
+        while (!p->busy && !comp_recv.quit) {
+            qemu_cond_wait(&comp_recv.work_cond, &comp_recv.lock);
+        }
+        if (!p->busy) {
+            break;
+        }
+        qemu_mutex_unlock(&comp_recv.lock);
+
+        ok = decompress_page(p);
+
+        qemu_mutex_lock(&comp_recv.lock);
+        if (!ok) {
+            DPRINTF("could not inflate page at %p\n", p->host);
+            comp_recv.error = true;
+        }
+        p->busy = false;
+        qemu_cond_broadcast(&comp_recv.done_cond);
+    }
+    qemu_mutex_unlock(&comp_recv.lock);
+
+    return NULL;
+}
+
+static int compress_load_setup(unsigned int page_size)
+{
+    int i, num;
+
+    num = migrate_decompress_threads();
+    comp_recv.threads = g_malloc0(num * sizeof(DecompressParam));
+    comp_recv.num_threads = 0;
+    comp_recv.page_size = page_size;
+    comp_recv.quit = false;
+    comp_recv.error = false;
+    qemu_mutex_init(&comp_recv.lock);
+    qemu_cond_init(&comp_recv.work_cond);
+    qemu_cond_init(&comp_recv.done_cond);
+
+    for (i = 0; i < num; i++) {
+        DecompressParam *p = &comp_recv.threads[i];
+
+        if (inflateInit(&p->stream) != Z_OK) {
+            fprintf(stderr, "migration: could not set up decompression\n");
+            compress_load_cleanup();
+            return -ENOMEM;
+        }
+        p->buf = g_malloc(page_size);
+        comp_recv.num_threads++;
+        qemu_thread_create(&p->thread, decompress_thread, p,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    DPRINTF("%d decompression threads\n", num);
+    return 0;
+}
+
+/*
+ * Wait until the page at host, if it is being inflated, is in guest RAM.
+ * Call it before writing the page by other means.  Returns 0 on success,
+ * or -EINVAL if a page could not be inflated.
+ */
+int compress_load_page_done(void *host)
+{
+    bool error;
+    int i;
+
+    if (!comp_recv.threads) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&comp_recv.lock);
+    for (i = 0; i < comp_recv.num_threads; i++) {
+        while (comp_recv.threads[i].busy &&
+               comp_recv.threads[i].host == host) {
+            qemu_cond_wait(&comp_recv.done_cond, &comp_recv.lock);
+        }
+    }
+    error = comp_recv.error;
+    qemu_mutex_unlock(&comp_recv.lock);
+
+    return error ? -EINVAL : 0;
+}
+
+/*
+ * Read a compressed page of len bytes from f, and have it inflated into
+ * the page_size bytes at host.  Returns 0 on success, or a negative
+ * errno if the page is malformed or an earlier one failed.
+ */
+int compress_load_page(QEMUFile *f, void *host, unsigned int page_size,
+                       int len)
+{
+    DecompressParam *p = NULL;
+    int i;
+
+    if (!comp_recv.threads && compress_load_setup(page_size) < 0) {
+        return -ENOMEM;
+    }
+    if (len <= 0 || len >= comp_recv.page_size) {
+        return -EINVAL;
+    }
+    /* two inflates into the same page could finish in either order */
+    if (compress_load_page_done(host) < 0) {
+        return -EINVAL;
+    }
+
+    qemu_mutex_lock(&comp_recv.lock);
+    while (!p && !comp_recv.error) {
+        for (i = 0; i < comp_recv.num_threads; i++) {
+            if (!comp_recv.threads[i].busy) {
+                p = &comp_recv.threads[i];
+                break;
+            }
+        }
+        if (!p) {
+            qemu_cond_wait(&comp_recv.done_cond, &comp_recv.lock);
+        }
+    }
+    qemu_mutex_unlock(&comp_recv.lock);
+
+    if (!p) {
+        return -EINVAL;
+    }
+
+    /* idle, so the thread does not look at its buffer */
+    qemu_get_buffer(f, p->buf, len);
+
+    qemu_mutex_lock(&comp_recv.lock);
+    p->host = host;
+    p->len = len;
+    p->busy = true;
+    qemu_cond_broadcast(&comp_recv.work_cond);
+    qemu_mutex_unlock(&comp_recv.lock);
+
+    return 0;
+}
+
+/*
+ * Wait until every page read so far is in guest RAM.  Returns 0 on
+ * success, or -EINVAL if one of them could not be inflated.
+ */
+int compress_load_flush(void)
+{
+    bool error;
+    int i;
+
+    if (!comp_recv.threads) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&comp_recv.lock);
+    for (i = 0; i < comp_recv.num_threads; i++) {
+        while (comp_recv.threads[i].busy) {
+            qemu_cond_wait(&comp_recv.done_cond, &comp_recv.lock);
+        }
+    }
+    error = comp_recv.error;
+    qemu_mutex_unlock(&comp_recv.lock);
+
+    return error ? -EINVAL : 0;
+}
+
+void compress_load_cleanup(void)
+{
+    int i;
+
+    if (!comp_recv.threads) {
+        return;
+    }
+
+    compress_load_flush();
+
+    qemu_mutex_lock(&comp_recv.lock);
+    comp_recv.quit = true;
+    qemu_cond_broadcast(&comp_recv.work_cond);
+    qemu_mutex_unlock(&comp_recv.lock);
+
+    for (i = 0; i < comp_recv.num_threads; i++) {
+        DecompressParam *p = &comp_recv.threads[i];
+
+        qemu_thread_join(&p->thread);
+        inflateEnd(&p->stream);
+        g_free(p->buf);
+    }
+
+    qemu_cond_destroy(&comp_recv.done_cond);
+    qemu_cond_destroy(&comp_recv.work_cond);
+    qemu_mutex_destroy(&comp_recv.lock);
+    g_free(comp_recv.threads);
+    comp_recv.threads = NULL;
+    comp_recv.num_threads = 0;
+}
@@ -0,0 +1,785 @@
+/*
+ * QEMU live migration: RAM pages over multiple streams
+ *
+ * The main migration stream carries device state and the RAM block
+ * list; when the "multifd" capability is on, the RAM pages themselves
+ * travel over extra connections, each one fed by its own thread.
+ *
+ * The main thread still scans and clears the dirty bitmap (that touches
+ * the TLBs of the vCPUs, so it needs the iothread lock), and hands the
+ * dirty pages to the channel threads in batches.  A page always goes to
+ * the same channel, so two copies of a page can never be reordered.
+ * Each round of ram_save_live ends with a sync marker on every channel;
+ * the destination does not go past the matching marker on the main
+ * stream until every channel has delivered it.
+ *
+ * Channel stream:
+ *   header = be32 MULTIFD_MAGIC, be32 MULTIFD_VERSION, be32 channel id
+ *   record = be64 (page offset | flags) [idstr] [byte | page | be32 seq]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "hw/hw.h"
+#include "qemu_socket.h"
+#include "qemu-thread.h"
+#include "qemu-timer.h"
+#include "qemu-queue.h"
+#include "migration.h"
+
+//#define DEBUG_MIGRATION_MULTIFD
+
+#ifdef DEBUG_MIGRATION_MULTIFD
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-multifd: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#ifdef _WIN32
+#define SHUT_RDWR SD_BOTH
+#endif
+
+#define MULTIFD_MAGIC   0x4d464421      /* "MFD!" */
+#define MULTIFD_VERSION 1
+
+/* record flags, in the low bits of the page offset */
+#define MULTIFD_FLAG_PAGE  0x01
+#define MULTIFD_FLAG_FILL  0x02
+#define MULTIFD_FLAG_BLOCK 0x04
+#define MULTIFD_FLAG_SYNC  0x08
+#define MULTIFD_FLAG_EOS   0x10
+
+/* consecutive pages sent by a channel before moving to the next one */
+#define MULTIFD_BATCH_PAGES 64
+/* batches that may wait for a channel before the sender backs off */
+#define MULTIFD_QUEUE_DEPTH 4
+
+typedef struct MultiFDPage {
+    const char *idstr;
+    uint64_t offset;
+    uint8_t *host;
+} MultiFDPage;
+
+typedef struct MultiFDBatch {
+    int num_pages;
+    uint32_t sync_seq;          /* sync marker after the pages, 0 if none */
+    bool eos;
+    MultiFDPage pages[MULTIFD_BATCH_PAGES];
+    QSIMPLEQ_ENTRY(MultiFDBatch) next;
+} MultiFDBatch;
+
+typedef struct MultiFDSendChannel {
+    int id;
+    int fd;
+    QEMUFile *file;
+    QemuThread thread;
+    QSIMPLEQ_HEAD(, MultiFDBatch) queue;
+    int pending;
+    /* batch being filled by the main thread */
+    MultiFDBatch *open;
+    /* block of the last page sent, owned by the channel thread */
+    const char *last_idstr;
+} MultiFDSendChannel;
+
+static struct {
+    MultiFDSendChannel *channels;
+    int num_channels;
+    unsigned int page_size;
+    bool quit;
+    int error;
+    uint32_t sync_seq;
+    uint64_t pages_queued;
+    uint64_t pages_sent;
+    uint64_t bytes_sent;
+    int64_t rate_limit;
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond space_cond;
+} multifd_send;
+
+static int channel_put_buffer(void *opaque, const uint8_t *buf,
+                              int64_t pos, int size)
+{
+    MultiFDSendChannel *c = opaque;
+
+    return send_all(c->fd, buf, size) == size ? size : -EIO;
+}
+
+static int channel_close(void *opaque)
+{
+    MultiFDSendChannel *c = opaque;
+    int ret = 0;
+
+    if (close(c->fd) < 0) {
+        ret = -errno;
+    }
+    c->fd = -1;
+    return ret;
+}
+
+static uint64_t multifd_send_batch(MultiFDSendChannel *c, MultiFDBatch *b)
+{
+    QEMUFile *f = c->file;
+    uint64_t start = qemu_ftell(f);
+    int i;
+
+    for (i = 0; i < b->num_pages; i++) {
+        MultiFDPage *page = &b->pages[i];
+        int flags = 0;
+
+        if (page->idstr != c->last_idstr) {
+            flags |= MULTIFD_FLAG_BLOCK;
+        }
+        if (buffer_is_zero(page->host, multifd_send.page_size)) {
+            flags |= MULTIFD_FLAG_FILL;
+        } else {
+            flags |= MULTIFD_FLAG_PAGE;
+        }
+
+        qemu_put_be64(f, page->offset | flags);
+        if (flags & MULTIFD_FLAG_BLOCK) {
+            qemu_put_byte(f, strlen(page->idstr));
+            qemu_put_buffer(f, (uint8_t *)page->idstr, strlen(page->idstr));
+            c->last_idstr = page->idstr;
+        }
+        if (flags & MULTIFD_FLAG_FILL) {
+            qemu_put_byte(f, 0);
+        } else {
+            qemu_put_buffer(f, page->host, multifd_send.page_size);
+        }
+    }
+
+    if (b->sync_seq) {
+        qemu_put_be64(f, MULTIFD_FLAG_SYNC);
+        qemu_put_be32(f, b->sync_seq);
+    }
+    if (b->eos) {
+        qemu_put_be64(f, MULTIFD_FLAG_EOS);
+    }
+    if (b->sync_seq || b->eos) {
+        qemu_fflush(f);
+    }
+
+    return qemu_ftell(f) - start;
+}
+
+/* Sleep off whatever this channel sent beyond its share of the limit */
+static void multifd_send_throttle(int64_t *window_start, uint64_t *window_bytes)
+{
+    int64_t limit, now;
+
+    qemu_mutex_lock(&multifd_send.lock);
+    limit = multifd_send.rate_limit / multifd_send.num_channels / 10;
+    qemu_mutex_unlock(&multifd_send.lock);
+
+    now = get_clock();
+    if (now - *window_start >= 100 * SCALE_MS) {
+        *window_start = now;
+        *window_bytes = 0;
+    } else if (limit > 0 && *window_bytes >= limit) {
+        g_usleep((*window_start + 100 * SCALE_MS - now) / SCALE_US);
+        *window_start = get_clock();
+        *window_bytes = 0;
+    }
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendChannel *c = opaque;
+    int64_t window_start = get_clock();
+    uint64_t window_bytes = 0;
+
+    for (;;) {
+        MultiFDBatch *b;
+        uint64_t sent = 0;
+        int num_pages;
+        bool failed;
+
+        qemu_mutex_lock(&multifd_send.lock);
+        while (QSIMPLEQ_EMPTY(&c->queue) && !multifd_send.quit) {
+            qemu_cond_wait(&multifd_send.work_cond, &multifd_send.lock);
+        }
+        b = QSIMPLEQ_FIRST(&c->queue);
+        if (!b) {
+            qemu_mutex_unlock(&multifd_send.lock);
+            break;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&c->queue, next);
+        failed = multifd_send.error;
+        qemu_mutex_unlock(&multifd_send.lock);
+
+        /* after an error, only drain the queue */
+        if (!failed) {
+            sent = multifd_send_batch(c, b);
+        }
+        num_pages = b->num_pages;
+        g_free(b);
+
+        qemu_mutex_lock(&multifd_send.lock);
+        if (qemu_file_get_error(c->file) && !multifd_send.error) {
+            DPRINTF("channel %d failed\n", c->id);
+            multifd_send.error = qemu_file_get_error(c->file);
+        }
+        multifd_send.bytes_sent += sent;
+        multifd_send.pages_sent += num_pages;
+        c->pending--;
+        qemu_cond_broadcast(&multifd_send.space_cond);
+        qemu_mutex_unlock(&multifd_send.lock);
+
+        window_bytes += sent;
+        multifd_send_throttle(&window_start, &window_bytes);
+    }
+
+    return NULL;
+}
+
+static void multifd_push_batch(MultiFDSendChannel *c)
+{
+    qemu_mutex_lock(&multifd_send.lock);
+    QSIMPLEQ_INSERT_TAIL(&c->queue, c->open, next);
+    c->pending++;
+    qemu_cond_broadcast(&multifd_send.work_cond);
+    qemu_mutex_unlock(&multifd_send.lock);
+    c->open = NULL;
+}
+
+/*
+ * Open the extra connections for a migration that is about to start,
+ * and start their threads.  Returns the number of channels, 0 if the
+ * capability is off or the transport only has one stream, or a
+ * negative errno.
+ */
+int multifd_save_setup(MigrationState *s)
+{
+    int i, num;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    if (!s->open_channel) {
+        fprintf(stderr, "multifd needs a tcp: or unix: migration, "
+                "using a single stream\n");
+        return 0;
+    }
+
+    num = migrate_multifd_channels();
+    multifd_send.channels = g_malloc0(num * sizeof(MultiFDSendChannel));
+    multifd_send.num_channels = num;
+    multifd_send.page_size = 0;
+    multifd_send.quit = false;
+    multifd_send.error = 0;
+    multifd_send.sync_seq = 0;
+    multifd_send.pages_queued = 0;
+    multifd_send.pages_sent = 0;
+    multifd_send.bytes_sent = 0;
+    multifd_send.rate_limit = s->bandwidth_limit;
+    qemu_mutex_init(&multifd_send.lock);
+    qemu_cond_init(&multifd_send.work_cond);
+    qemu_cond_init(&multifd_send.space_cond);
+
+    for (i = 0; i < num; i++) {
+        MultiFDSendChannel *c = &multifd_send.channels[i];
+
+        c->id = i;
+        QSIMPLEQ_INIT(&c->queue);
+        c->fd = s->open_channel(s);
+        if (c->fd < 0) {
+            fprintf(stderr, "multifd: could not open channel %d\n", i);
+            multifd_send.num_channels = i;
+            multifd_save_cleanup();
+            return -EIO;
+        }
+        c->file = qemu_fopen_ops(c, channel_put_buffer, NULL, channel_close,
+                                 NULL, NULL, NULL);
+        qemu_put_be32(c->file, MULTIFD_MAGIC);
+        qemu_put_be32(c->file, MULTIFD_VERSION);
+        qemu_put_be32(c->file, i);
+        qemu_fflush(c->file);
+
+        qemu_thread_create(&c->thread, multifd_send_thread, c,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    DPRINTF("%d channels open\n", num);
+    return num;
+}
+
+/*
+ * Called by the RAM code when it starts sending pages.  Returns the
+ * number of channels that carry them, or 0 if they go over the main
+ * stream.
+ */
+int multifd_save_start(unsigned int page_size)
+{
+    multifd_send.page_size = page_size;
+    return multifd_send.num_channels;
+}
+
+void multifd_set_rate_limit(int64_t rate_limit)
+{
+    if (multifd_send.channels) {
+        qemu_mutex_lock(&multifd_send.lock);
+        multifd_send.rate_limit = rate_limit;
+        qemu_mutex_unlock(&multifd_send.lock);
+    }
+}
+
+/*
+ * Queue a page for sending.  The page is read when the channel gets to
+ * it, so its dirty bit must already be clear.
+ */
+void multifd_queue_page(const char *idstr, uint64_t offset, uint8_t *host)
+{
+    uint64_t page = offset / multifd_send.page_size;
+    MultiFDSendChannel *c;
+
+    c = &multifd_send.channels[(page / MULTIFD_BATCH_PAGES) %
+                               multifd_send.num_channels];
+    if (!c->open) {
+        c->open = g_malloc0(sizeof(MultiFDBatch));
+    }
+    c->open->pages[c->open->num_pages].idstr = idstr;
+    c->open->pages[c->open->num_pages].offset = offset;
+    c->open->pages[c->open->num_pages].host = host;
+    multifd_send.pages_queued++;
+    if (++c->open->num_pages == MULTIFD_BATCH_PAGES) {
+        multifd_push_batch(c);
+    }
+}
+
+static bool multifd_queue_full(void)
+{
+    int i;
+
+    for (i = 0; i < multifd_send.num_channels; i++) {
+        if (multifd_send.channels[i].pending >= MULTIFD_QUEUE_DEPTH) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* True if the channels have enough queued up for now */
+bool multifd_save_busy(void)
+{
+    bool busy;
+
+    qemu_mutex_lock(&multifd_send.lock);
+    busy = multifd_queue_full() || multifd_send.error;
+    qemu_mutex_unlock(&multifd_send.lock);
+
+    return busy;
+}
+
+/* Wait until every channel can take another batch */
+int multifd_save_wait(void)
+{
+    int ret;
+
+    qemu_mutex_lock(&multifd_send.lock);
+    while (multifd_queue_full() && !multifd_send.error) {
+        qemu_cond_wait(&multifd_send.space_cond, &multifd_send.lock);
+    }
+    ret = multifd_send.error;
+    qemu_mutex_unlock(&multifd_send.lock);
+
+    return ret;
+}
+
+/*
+ * Flush the pages queued so far and put a sync marker on every channel.
+ * Returns the sequence number of the marker, which the caller sends on
+ * the main stream, or a negative errno if a channel failed.
+ */
+int64_t multifd_save_sync(void)
+{
+    uint32_t seq;
+    int i;
+
+    if (multifd_send.error) {
+        return multifd_send.error;
+    }
+
+    seq = ++multifd_send.sync_seq;
+    if (!seq) {
+        seq = ++multifd_send.sync_seq;
+    }
+    for (i = 0; i < multifd_send.num_channels; i++) {
+        MultiFDSendChannel *c = &multifd_send.channels[i];
+
+        if (!c->open) {
+            c->open = g_malloc0(sizeof(MultiFDBatch));
+        }
+        c->open->sync_seq = seq;
+        multifd_push_batch(c);
+    }
+
+    return seq;
+}
+
+uint64_t multifd_bytes_pending(void)
+{
+    uint64_t pending;
+
+    if (!multifd_send.channels) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&multifd_send.lock);
+    pending = multifd_send.pages_queued - multifd_send.pages_sent;
+    qemu_mutex_unlock(&multifd_send.lock);
+
+    return pending * multifd_send.page_size;
+}
+
+uint64_t multifd_bytes_sent(void)
+{
+    uint64_t sent;
+
+    if (!multifd_send.channels) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&multifd_send.lock);
+    sent = multifd_send.bytes_sent;
+    qemu_mutex_unlock(&multifd_send.lock);
+
+    return sent;
+}
+
+static int multifd_save_stop(bool flush)
+{
+    int i, ret;
+
+    if (!multifd_send.channels) {
+        return 0;
+    }
+
+    for (i = 0; i < multifd_send.num_channels; i++) {
+        MultiFDSendChannel *c = &multifd_send.channels[i];
+
+        if (flush) {
+            if (!c->open) {
+                c->open = g_malloc0(sizeof(MultiFDBatch));
+            }
+            c->open->eos = true;
+            multifd_push_batch(c);
+        } else {
+            g_free(c->open);
+            c->open = NULL;
+            /* unblock a thread stuck in send() */
+            shutdown(c->fd, SHUT_RDWR);
+        }
+    }
+
+    qemu_mutex_lock(&multifd_send.lock);
+    multifd_send.quit = true;
+    if (!flush && !multifd_send.error) {
+        multifd_send.error = -ECANCELED;
+    }
+    qemu_cond_broadcast(&multifd_send.work_cond);
+    qemu_mutex_unlock(&multifd_send.lock);
+
+    for (i = 0; i < multifd_send.num_channels; i++) {
+        MultiFDSendChannel *c = &multifd_send.channels[i];
+
+        qemu_thread_join(&c->thread);
+        qemu_fclose(c->file);
+    }
+    ret = multifd_send.error;
+
+    g_free(multifd_send.channels);
+    multifd_send.channels = NULL;
+    multifd_send.num_channels = 0;
+    qemu_cond_destroy(&multifd_send.space_cond);
+    qemu_cond_destroy(&multifd_send.work_cond);
+    qemu_mutex_destroy(&multifd_send.lock);
+
+    return ret;
+}
+
+/*
+ * Wait until the channels have sent everything, then close them.
+ * Returns 0, or a negative errno if a channel failed.
+ */
+int multifd_save_finish(void)
+{
+    return multifd_save_stop(true);
+}
+
+/* Drop whatever is still queued and close the channels */
+void multifd_save_cleanup(void)
+{
+    multifd_save_stop(false);
+}
+
+/* incoming side */
+
+typedef struct MultiFDRecvBlock {
+    char idstr[256];
+    uint8_t *host;
+    uint64_t length;
+} MultiFDRecvBlock;
+
+typedef struct MultiFDRecvChannel {
+    int fd;
+    QEMUFile *file;
+    QemuThread thread;
+    uint32_t synced;
+} MultiFDRecvChannel;
+
+static struct {
+    MultiFDRecvChannel *channels;
+    int num_channels;
+    unsigned int page_size;
+    MultiFDRecvBlock *blocks;
+    int num_blocks;
+    int error;
+    QemuMutex lock;
+    QemuCond sync_cond;
+} multifd_recv;
+
+void multifd_load_add_block(const char *idstr, uint8_t *host,
+                            uint64_t length)
+{
+    MultiFDRecvBlock *block;
+
+    multifd_recv.blocks = g_realloc(multifd_recv.blocks,
+                                    (multifd_recv.num_blocks + 1) *
+                                    sizeof(MultiFDRecvBlock));
+    block = &multifd_recv.blocks[multifd_recv.num_blocks++];
+    pstrcpy(block->idstr, sizeof(block->idstr), idstr);
+    block->host = host;
+    block->length = length;
+}
+
+static MultiFDRecvBlock *multifd_find_block(const char *idstr)
+{
+    int i;
+
+    for (i = 0; i < multifd_recv.num_blocks; i++) {
+        if (!strcmp(multifd_recv.blocks[i].idstr, idstr)) {
+            return &multifd_recv.blocks[i];
+        }
+    }
+    return NULL;
+}
+
+static int multifd_recv_channel(MultiFDRecvChannel *c)
+{
+    QEMUFile *f = c->file;
+    uint64_t page_mask = multifd_recv.page_size - 1;
+    MultiFDRecvBlock *block = NULL;
+
+    for (;;) {
+        uint64_t v = qemu_get_be64(f);
+        uint64_t offset = v & ~page_mask;
+        int flags = v & page_mask;
+
+        if (qemu_file_get_error(f)) {
+            return qemu_file_get_error(f);
+        }
+
+        if (flags & MULTIFD_FLAG_EOS) {
+            return 0;
+        }
+
+        if (flags & MULTIFD_FLAG_SYNC) {
+            uint32_t seq = qemu_get_be32(f);
+
+            qemu_mutex_lock(&multifd_recv.lock);
+            c->synced = seq;
+            qemu_cond_broadcast(&multifd_recv.sync_cond);
+            qemu_mutex_unlock(&multifd_recv.lock);
+            continue;
+        }
+
+        if (flags & MULTIFD_FLAG_BLOCK) {
+            char id[256];
+            uint8_t len = qemu_get_byte(f);
+
+            qemu_get_buffer(f, (uint8_t *)id, len);
+            id[len] = 0;
+            block = multifd_find_block(id);
+            if (!block) {
+                fprintf(stderr, "multifd: can't find block %s!\n", id);
+                return -EINVAL;
+            }
+        }
+        if (!block || offset >= block->length) {
+            fprintf(stderr, "multifd: bad page record\n");
+            return -EINVAL;
+        }
+
+        if (flags & MULTIFD_FLAG_FILL) {
+            memset(block->host + offset, qemu_get_byte(f),
+                   multifd_recv.page_size);
+        } else if (flags & MULTIFD_FLAG_PAGE) {
+            qemu_get_buffer(f, block->host + offset, multifd_recv.page_size);
+        } else {
+            fprintf(stderr, "multifd: unknown record flags %#x\n", flags);
+            return -EINVAL;
+        }
+    }
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvChannel *c = opaque;
+    int ret;
+
+    ret = multifd_recv_channel(c);
+
+    qemu_mutex_lock(&multifd_recv.lock);
+    if (ret < 0 && !multifd_recv.error) {
+        multifd_recv.error = ret;
+    }
+    qemu_cond_broadcast(&multifd_recv.sync_cond);
+    qemu_mutex_unlock(&multifd_recv.lock);
+
+    return NULL;
+}
+
+/*
+ * Accept the channels announced on the main stream and start reading
+ * them.  The RAM blocks must have been registered with
+ * multifd_load_add_block() first.
+ */
+int multifd_load_setup(int num, unsigned int page_size)
+{
+    int listen_fd = migrate_incoming_listen_fd();
+    int i;
+
+    if (listen_fd < 0) {
+        fprintf(stderr, "multifd needs a tcp: or unix: incoming migration\n");
+        return -EINVAL;
+    }
+    if (num <= 0 || num > MULTIFD_CHANNELS_MAX || multifd_recv.channels) {
+        fprintf(stderr, "multifd: bad number of channels %d\n", num);
+        return -EINVAL;
+    }
+
+    multifd_recv.channels = g_malloc0(num * sizeof(MultiFDRecvChannel));
+    multifd_recv.num_channels = num;
+    multifd_recv.page_size = page_size;
+    multifd_recv.error = 0;
+    qemu_mutex_init(&multifd_recv.lock);
+    qemu_cond_init(&multifd_recv.sync_cond);
+
+    socket_set_block(listen_fd);
+    for (i = 0; i < num; i++) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        MultiFDRecvChannel *c;
+        QEMUFile *f;
+        uint32_t id;
+        int fd;
+
+        do {
+            fd = qemu_accept(listen_fd, (struct sockaddr *)&addr,
+                             &addrlen);
+        } while (fd == -1 && socket_error() == EINTR);
+        if (fd == -1) {
+            fprintf(stderr, "multifd: could not accept channel\n");
+            goto fail;
+        }
+
+        f = qemu_fopen_socket(fd);
+        if (qemu_get_be32(f) != MULTIFD_MAGIC ||
+            qemu_get_be32(f) != MULTIFD_VERSION) {
+            fprintf(stderr, "multifd: bad channel header\n");
+            qemu_fclose(f);
+            close(fd);
+            goto fail;
+        }
+        id = qemu_get_be32(f);
+        if (id >= num || multifd_recv.channels[id].file) {
+            fprintf(stderr, "multifd: bad channel id %u\n", id);
+            qemu_fclose(f);
+            close(fd);
+            goto fail;
+        }
+
+        c = &multifd_recv.channels[id];
+        c->fd = fd;
+        c->file = f;
+        qemu_thread_create(&c->thread, multifd_recv_thread, c,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    DPRINTF("%d channels accepted\n", num);
+    return 0;
+
+fail:
+    multifd_recv.error = -EINVAL;
+    multifd_load_cleanup();
+    return -EINVAL;
+}
+
+/* Wait until every channel has delivered sync marker 'seq' */
+int multifd_load_sync(uint32_t seq)
+{
+    int i, ret;
+
+    if (!multifd_recv.channels) {
+        fprintf(stderr, "multifd: sync without channels\n");
+        return -EINVAL;
+    }
+
+    qemu_mutex_lock(&multifd_recv.lock);
+    for (i = 0; i < multifd_recv.num_channels && !multifd_recv.error; ) {
+        if ((int32_t)(multifd_recv.channels[i].synced - seq) >= 0) {
+            i++;
+        } else {
+            qemu_cond_wait(&multifd_recv.sync_cond, &multifd_recv.lock);
+        }
+    }
+    ret = multifd_recv.error;
+    qemu_mutex_unlock(&multifd_recv.lock);
+
+    return ret;
+}
+
+/* Wait for the channels to end and close them */
+void multifd_load_cleanup(void)
+{
+    int i, error;
+
+    if (multifd_recv.channels) {
+        qemu_mutex_lock(&multifd_recv.lock);
+        error = multifd_recv.error;
+        qemu_mutex_unlock(&multifd_recv.lock);
+
+        for (i = 0; i < multifd_recv.num_channels; i++) {
+            MultiFDRecvChannel *c = &multifd_recv.channels[i];
+
+            if (c->file && error) {
+                shutdown(c->fd, SHUT_RDWR);
+            }
+        }
+        for (i = 0; i < multifd_recv.num_channels; i++) {
+            MultiFDRecvChannel *c = &multifd_recv.channels[i];
+
+            if (!c->file) {
+                continue;
+            }
+            qemu_thread_join(&c->thread);
+            qemu_fclose(c->file);
+            close(c->fd);
+        }
+        qemu_cond_destroy(&multifd_recv.sync_cond);
+        qemu_mutex_destroy(&multifd_recv.lock);
+        g_free(multifd_recv.channels);
+        multifd_recv.channels = NULL;
+        multifd_recv.num_channels = 0;
+    }
+
+    g_free(multifd_recv.blocks);
+    multifd_recv.blocks = NULL;
+    multifd_recv.num_blocks = 0;
+}
@@ -40,6 +40,12 @@ static int socket_write(MigrationState *s, const void * buf, size_t size)
     return send(s->fd, buf, size, 0);
 }
 
+static int socket_writev(MigrationState *s, struct iovec *iov, int len,
+                         int iov_offset)
+{
+    return qemu_sendv(s->fd, iov, len, iov_offset);
+}
+
 static int tcp_close(MigrationState *s)
 {
     int r = 0;
@@ -53,6 +59,24 @@ static int tcp_close(MigrationState *s)
     return r;
 }
 
+#ifndef _WIN32
+static int tcp_open_channel(MigrationState *s)
+{
+    Error *err = NULL;
+    int fd;
+
+    fd = inet_connect(s->channel_addr, true, &err);
+    if (error_is_set(&err)) {
+        DPRINTF("channel connect failed: %s\n", error_get_pretty(err));
+        error_free(err);
+        return -1;
+    }
+    socket_set_block(fd);
+
+    return fd;
+}
+#endif
+
 static void tcp_wait_for_connect(void *opaque)
 {
     MigrationState *s = opaque;
@@ -84,7 +108,12 @@ int tcp_start_outgoing_migration(MigrationState *s, const char *host_port,
 {
     s->get_error = socket_errno;
     s->write = socket_write;
+    s->writev = socket_writev;
     s->close = tcp_close;
+#ifndef _WIN32
+    s->open_channel = tcp_open_channel;
+    s->channel_addr = g_strdup(host_port);
+#endif
 
     s->fd = inet_connect(host_port, false, errp);
 
@@ -133,7 +162,11 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
+#ifndef _WIN32
+    migrate_set_incoming_listen_fd(s);
+#endif
     process_incoming_migration(f);
+    migrate_set_incoming_listen_fd(-1);
     qemu_fclose(f);
 out:
     close(c);
@@ -152,6 +185,15 @@ int tcp_start_incoming_migration(const char *host_port, Error **errp)
         return -1;
     }
 
+    /* inet_listen() uses a backlog of 1; leave room for the multifd or
+     * postcopy channels, which connect before they are accepted.  A second
+     * listen() only changes the backlog. */
+    if (listen(s, MULTIFD_CHANNELS_MAX + 1) != 0) {
+        error_set(errp, QERR_SOCKET_LISTEN_FAILED);
+        closesocket(s);
+        return -1;
+    }
+
     qemu_set_fd_handler2(s, NULL, tcp_accept_incoming_migration, NULL,
                          (void *)(intptr_t)s);
 
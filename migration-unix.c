@@ -40,6 +40,12 @@ static int unix_write(MigrationState *s, const void * buf, size_t size)
     return write(s->fd, buf, size);
 }
 
+static int unix_writev(MigrationState *s, struct iovec *iov, int len,
+                       int iov_offset)
+{
+    return qemu_sendv(s->fd, iov, len, iov_offset);
+}
+
 static int unix_close(MigrationState *s)
 {
     int r = 0;
@@ -53,6 +59,32 @@ static int unix_close(MigrationState *s)
     return r;
 }
 
+static int unix_open_channel(MigrationState *s)
+{
+    struct sockaddr_un addr;
+    int fd, ret;
+
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", s->channel_addr);
+
+    fd = qemu_socket(PF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    do {
+        ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1) {
+        DPRINTF("channel connect failed: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
 static void unix_wait_for_connect(void *opaque)
 {
     MigrationState *s = opaque;
@@ -88,7 +120,10 @@ int unix_start_outgoing_migration(MigrationState *s, const char *path)
     snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
     s->get_error = unix_errno;
     s->write = unix_write;
+    s->writev = unix_writev;
     s->close = unix_close;
+    s->open_channel = unix_open_channel;
+    s->channel_addr = g_strdup(path);
 
     s->fd = qemu_socket(PF_UNIX, SOCK_STREAM, 0);
     if (s->fd == -1) {
@@ -143,7 +178,9 @@ static void unix_accept_incoming_migration(void *opaque)
         goto out;
     }
 
+    migrate_set_incoming_listen_fd(s);
     process_incoming_migration(f);
+    migrate_set_incoming_listen_fd(-1);
     qemu_fclose(f);
 out:
     close(c);
@@ -176,7 +213,9 @@ int unix_start_incoming_migration(const char *path)
         fprintf(stderr, "bind(unix:%s): %s\n", addr.sun_path, strerror(errno));
         goto err;
     }
-    if (listen(s, 1) == -1) {
+    /* leave room for the multifd or postcopy channels, which connect
+     * before they are accepted */
+    if (listen(s, MULTIFD_CHANNELS_MAX + 1) == -1) {
         fprintf(stderr, "listen(unix:%s): %s\n", addr.sun_path,
                 strerror(errno));
         ret = -errno;
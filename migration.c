@@ -22,6 +22,10 @@
 #include "qemu_socket.h"
 #include "block-migration.h"
 #include "qmp-commands.h"
+#include "cpus.h"
+#include "iov.h"
+#include "qemu-timer.h"
+#include "trace.h"
 
 //#define DEBUG_MIGRATION
 
@@ -39,10 +43,23 @@ enum {
     MIG_STATE_CANCELLED,
     MIG_STATE_ACTIVE,
     MIG_STATE_COMPLETED,
+    /* the destination runs the guest, and fetches the missing pages */
+    MIG_STATE_POSTCOPY_ACTIVE,
 };
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
 
+/* Migration XBZRLE default cache size */
+#define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
+
+/* Streams used for RAM pages by multifd migration */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+
+/* Page compression: zlib level and threads on each side */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREADS 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREADS 2
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -55,6 +72,13 @@ static MigrationState *migrate_get_current(void)
     static MigrationState current_migration = {
         .state = MIG_STATE_SETUP,
         .bandwidth_limit = MAX_THROTTLE,
+        .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+        .parameters = {
+            .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+            .compress_threads = DEFAULT_MIGRATE_COMPRESS_THREADS,
+            .decompress_threads = DEFAULT_MIGRATE_DECOMPRESS_THREADS,
+        },
     };
 
     return &current_migration;
@@ -88,6 +112,8 @@ void process_incoming_migration(QEMUFile *f)
         fprintf(stderr, "load of migration failed\n");
         exit(0);
     }
+    multifd_load_cleanup();
+    compress_load_cleanup();
     qemu_announce_self();
     DPRINTF("successfully loaded vm state\n");
 
@@ -113,6 +139,53 @@ uint64_t migrate_max_downtime(void)
     return max_downtime;
 }
 
+MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
+{
+    MigrationCapabilityStatusList *head = NULL;
+    MigrationCapabilityStatusList *caps;
+    MigrationState *s = migrate_get_current();
+    int i;
+
+    for (i = MIGRATION_CAPABILITY_MAX - 1; i >= 0; i--) {
+        caps = g_malloc0(sizeof(*caps));
+        caps->value = g_malloc(sizeof(*caps->value));
+        caps->value->capability = i;
+        caps->value->state = s->enabled_capabilities[i];
+        caps->next = head;
+        head = caps;
+    }
+
+    return head;
+}
+
+static void get_xbzrle_cache_stats(MigrationInfo *info)
+{
+    if (migrate_use_xbzrle()) {
+        info->has_xbzrle_cache = true;
+        info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
+        info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
+        info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
+        info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
+        info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
+        info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+    }
+}
+
+static void get_downtime(MigrationInfo *info, MigrationState *s)
+{
+    info->has_downtime = true;
+    info->downtime = s->downtime / 1000000;
+    info->has_phases = true;
+    info->phases = g_malloc(sizeof(*info->phases));
+    *info->phases = s->phases;
+}
+
+static void get_iterations(MigrationInfo *info)
+{
+    info->iterations = ram_iterations();
+    info->has_iterations = info->iterations != NULL;
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -131,6 +204,20 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->transferred = ram_bytes_transferred();
         info->ram->remaining = ram_bytes_remaining();
         info->ram->total = ram_bytes_total();
+        info->ram->has_dirty_pages_rate = true;
+        info->ram->dirty_pages_rate = ram_dirty_pages_rate();
+
+        info->has_total_time = true;
+        info->total_time = (qemu_get_clock_ns(rt_clock) - s->start_time) /
+                           1000000;
+        info->has_expected_downtime = true;
+        info->expected_downtime = ram_expected_downtime();
+        get_iterations(info);
+
+        if (cpu_throttle_get_percentage()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -139,10 +226,35 @@ MigrationInfo *qmp_query_migrate(Error **errp)
             info->disk->remaining = blk_mig_bytes_remaining();
             info->disk->total = blk_mig_bytes_total();
         }
+
+        get_xbzrle_cache_stats(info);
+        break;
+    case MIG_STATE_POSTCOPY_ACTIVE:
+        info->has_status = true;
+        info->status = g_strdup("postcopy-active");
+
+        info->has_ram = true;
+        info->ram = g_malloc0(sizeof(*info->ram));
+        info->ram->transferred = ram_bytes_transferred();
+        info->ram->remaining = ram_bytes_remaining();
+        info->ram->total = ram_bytes_total();
+
+        info->has_total_time = true;
+        info->total_time = (qemu_get_clock_ns(rt_clock) - s->start_time) /
+                           1000000;
+        get_downtime(info, s);
+        get_iterations(info);
         break;
     case MIG_STATE_COMPLETED:
+        get_xbzrle_cache_stats(info);
+
         info->has_status = true;
         info->status = g_strdup("completed");
+
+        info->has_total_time = true;
+        info->total_time = s->total_time / 1000000;
+        get_downtime(info, s);
+        get_iterations(info);
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -157,6 +269,23 @@ MigrationInfo *qmp_query_migrate(Error **errp)
     return info;
 }
 
+void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
+                                  Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationCapabilityStatusList *cap;
+
+    if (s->state == MIG_STATE_ACTIVE ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    for (cap = params; cap; cap = cap->next) {
+        s->enabled_capabilities[cap->value->capability] = cap->value->state;
+    }
+}
+
 /* shared migration helpers */
 
 static int migrate_fd_cleanup(MigrationState *s)
@@ -165,6 +294,11 @@ static int migrate_fd_cleanup(MigrationState *s)
 
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
 
+    multifd_save_cleanup();
+    postcopy_save_cleanup();
+    g_free(s->channel_addr);
+    s->channel_addr = NULL;
+
     if (s->file) {
         DPRINTF("closing file\n");
         ret = qemu_fclose(s->file);
@@ -187,13 +321,44 @@ void migrate_fd_error(MigrationState *s)
     migrate_fd_cleanup(s);
 }
 
+/*
+ * The guest is down from stop_time until the destination has the whole
+ * state, or can run on its own with postcopy.
+ */
+static void migrate_fd_downtime(MigrationState *s)
+{
+    MigrationPhases *phases = &s->phases;
+    int64_t now = qemu_get_clock_ns(rt_clock);
+
+    s->downtime = now - s->stop_time;
+    phases->setup = s->setup_time / 1000;
+    phases->iterate = (s->stop_time - s->start_time - s->setup_time) / 1000;
+    phases->ram = qemu_savevm_complete_time("ram") / 1000;
+    phases->block = qemu_savevm_complete_time("block") / 1000;
+    phases->devices = qemu_savevm_complete_time(NULL) / 1000;
+    phases->stop = (s->complete_time - s->stop_time) / 1000 -
+                   phases->ram - phases->block - phases->devices;
+    phases->flush = (now - s->complete_time) / 1000;
+
+    trace_migrate_downtime(s->downtime / 1000, phases->stop, phases->ram,
+                           phases->block, phases->devices, phases->flush);
+}
+
 static void migrate_fd_completed(MigrationState *s)
 {
     DPRINTF("setting completed state\n");
-    if (migrate_fd_cleanup(s) < 0) {
+    if (multifd_save_finish() < 0) {
+        migrate_fd_cleanup(s);
+        s->state = MIG_STATE_ERROR;
+    } else if (migrate_fd_cleanup(s) < 0) {
         s->state = MIG_STATE_ERROR;
     } else {
+        if (s->state != MIG_STATE_POSTCOPY_ACTIVE) {
+            migrate_fd_downtime(s);
+        }
         s->state = MIG_STATE_COMPLETED;
+        s->total_time = qemu_get_clock_ns(rt_clock) - s->start_time;
+        trace_migrate_completed(s->total_time / 1000000);
         runstate_set(RUN_STATE_POSTMIGRATE);
     }
     notifier_list_notify(&migration_state_notifiers, s);
@@ -216,7 +381,8 @@ static ssize_t migrate_fd_put_buffer(void *opaque, const void *data,
     MigrationState *s = opaque;
     ssize_t ret;
 
-    if (s->state != MIG_STATE_ACTIVE) {
+    if (s->state != MIG_STATE_ACTIVE &&
+        s->state != MIG_STATE_POSTCOPY_ACTIVE) {
         return -EIO;
     }
 
@@ -234,11 +400,46 @@ static ssize_t migrate_fd_put_buffer(void *opaque, const void *data,
     return ret;
 }
 
+static ssize_t migrate_fd_writev(void *opaque, struct iovec *iov, int iovcnt,
+                                 size_t offset)
+{
+    MigrationState *s = opaque;
+    ssize_t ret;
+
+    if (s->state != MIG_STATE_ACTIVE &&
+        s->state != MIG_STATE_POSTCOPY_ACTIVE) {
+        return -EIO;
+    }
+
+    do {
+        ret = s->writev(s, iov, iov_size(iov, iovcnt) - offset, offset);
+    } while (ret == -1 && ((s->get_error(s)) == EINTR));
+
+    if (ret == -1)
+        ret = -(s->get_error(s));
+
+    if (ret == -EAGAIN) {
+        qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
+    }
+
+    return ret;
+}
+
 static void migrate_fd_put_ready(void *opaque)
 {
     MigrationState *s = opaque;
     int ret;
 
+    if (s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+        /* the guest cannot run here again, whatever happens */
+        ret = postcopy_save_poll();
+        if (ret < 0) {
+            migrate_fd_error(s);
+        } else if (ret == 1) {
+            migrate_fd_completed(s);
+        }
+        return;
+    }
     if (s->state != MIG_STATE_ACTIVE) {
         DPRINTF("put_ready returning because of non-active state\n");
         return;
@@ -252,11 +453,36 @@ static void migrate_fd_put_ready(void *opaque)
         int old_vm_running = runstate_is_running();
 
         DPRINTF("done iterating\n");
+        s->stop_time = qemu_get_clock_ns(rt_clock);
         qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
         vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
 
-        if (qemu_savevm_state_complete(s->file) < 0) {
+        /* With shared storage the destination takes the images over when
+           it has loaded the state, so deferred metadata updates (qcow2
+           lazy refcounts) must be on disk before the last section. */
+        ret = bdrv_flush_metadata_all();
+        if (ret < 0) {
             migrate_fd_error(s);
+            if (old_vm_running) {
+                vm_start();
+            }
+            return;
+        }
+
+        /* RAM sends the list of pages still to send, not the pages */
+        if (migrate_use_postcopy()) {
+            s->state = MIG_STATE_POSTCOPY_ACTIVE;
+        }
+
+        ret = qemu_savevm_state_complete(s->file);
+        s->complete_time = qemu_get_clock_ns(rt_clock);
+        if (ret < 0) {
+            migrate_fd_error(s);
+        } else if (s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+            DPRINTF("postcopy\n");
+            migrate_fd_downtime(s);
+            notifier_list_notify(&migration_state_notifiers, s);
+            return;
         } else {
             migrate_fd_completed(s);
         }
@@ -288,7 +514,8 @@ static void migrate_fd_wait_for_unfreeze(void *opaque)
     int ret;
 
     DPRINTF("wait for unfreeze\n");
-    if (s->state != MIG_STATE_ACTIVE)
+    if (s->state != MIG_STATE_ACTIVE &&
+        s->state != MIG_STATE_POSTCOPY_ACTIVE)
         return;
 
     do {
@@ -347,10 +574,16 @@ void migrate_fd_connect(MigrationState *s)
     s->file = qemu_fopen_ops_buffered(s,
                                       s->bandwidth_limit,
                                       migrate_fd_put_buffer,
+                                      s->writev ? migrate_fd_writev : NULL,
                                       migrate_fd_put_ready,
                                       migrate_fd_wait_for_unfreeze,
                                       migrate_fd_close);
 
+    if (multifd_save_setup(s) < 0) {
+        migrate_fd_error(s);
+        return;
+    }
+
     DPRINTF("beginning savevm\n");
     ret = qemu_savevm_state_begin(s->file, s->blk, s->shared);
     if (ret < 0) {
@@ -358,6 +591,8 @@ void migrate_fd_connect(MigrationState *s)
         migrate_fd_error(s);
         return;
     }
+    s->setup_time = qemu_get_clock_ns(rt_clock) - s->start_time;
+    trace_migrate_setup(s->setup_time / 1000);
     migrate_fd_put_ready(s);
 }
 
@@ -365,14 +600,28 @@ static MigrationState *migrate_init(int blk, int inc)
 {
     MigrationState *s = migrate_get_current();
     int64_t bandwidth_limit = s->bandwidth_limit;
+    bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int64_t multifd_channels = s->multifd_channels;
+    MigrationParameters parameters = s->parameters;
 
+    memcpy(enabled_capabilities, s->enabled_capabilities,
+           sizeof(enabled_capabilities));
+
+    g_free(s->channel_addr);
     memset(s, 0, sizeof(*s));
     s->bandwidth_limit = bandwidth_limit;
+    memcpy(s->enabled_capabilities, enabled_capabilities,
+           sizeof(enabled_capabilities));
+    s->xbzrle_cache_size = xbzrle_cache_size;
+    s->multifd_channels = multifd_channels;
+    s->parameters = parameters;
     s->blk = blk;
     s->shared = inc;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
+    s->start_time = qemu_get_clock_ns(rt_clock);
 
     return s;
 }
@@ -397,7 +646,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     const char *p;
     int ret;
 
-    if (s->state == MIG_STATE_ACTIVE) {
+    if (s->state == MIG_STATE_ACTIVE ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -445,6 +695,117 @@ void qmp_migrate_cancel(Error **errp)
     migrate_fd_cancel(migrate_get_current());
 }
 
+void qmp_migrate_set_cache_size(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    int64_t new_size;
+
+    /* Check for truncation */
+    if (value != (size_t)value) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
+                  "exceeding address space");
+        return;
+    }
+
+    /* Cache should not be larger than guest ram size */
+    if (value > ram_bytes_total()) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
+                  "exceeds guest ram size ");
+        return;
+    }
+
+    new_size = xbzrle_cache_resize(value);
+    if (new_size < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
+                  "is smaller than page size");
+        return;
+    }
+
+    s->xbzrle_cache_size = new_size;
+}
+
+int64_t qmp_query_migrate_cache_size(Error **errp)
+{
+    return migrate_xbzrle_cache_size();
+}
+
+void qmp_migrate_set_multifd_channels(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (value < 1 || value > MULTIFD_CHANNELS_MAX) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "multifd channels",
+                  "a value between 1 and 16");
+        return;
+    }
+
+    s->multifd_channels = value;
+}
+
+int64_t qmp_query_migrate_multifd_channels(Error **errp)
+{
+    return migrate_multifd_channels();
+}
+
+void qmp_migrate_set_parameters(bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-level",
+                  "a value between 0 and 9");
+        return;
+    }
+    if (has_compress_threads &&
+        (compress_threads < 1 || compress_threads > COMPRESS_THREADS_MAX)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-threads",
+                  "a value between 1 and 255");
+        return;
+    }
+    if (has_decompress_threads &&
+        (decompress_threads < 1 ||
+         decompress_threads > COMPRESS_THREADS_MAX)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                  "a value between 1 and 255");
+        return;
+    }
+
+    if (has_compress_level) {
+        s->parameters.compress_level = compress_level;
+    }
+    if (has_compress_threads) {
+        s->parameters.compress_threads = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->parameters.decompress_threads = decompress_threads;
+    }
+}
+
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params = g_malloc0(sizeof(*params));
+
+    *params = migrate_get_current()->parameters;
+    return params;
+}
+
 void qmp_migrate_set_speed(int64_t value, Error **errp)
 {
     MigrationState *s;
@@ -456,6 +817,7 @@ void qmp_migrate_set_speed(int64_t value, Error **errp)
     s = migrate_get_current();
     s->bandwidth_limit = value;
     qemu_file_set_rate_limit(s->file, s->bandwidth_limit);
+    multifd_set_rate_limit(s->bandwidth_limit);
 }
 
 void qmp_migrate_set_downtime(double value, Error **errp)
@@ -464,3 +826,140 @@ void qmp_migrate_set_downtime(double value, Error **errp)
     value = MAX(0, MIN(UINT64_MAX, value));
     max_downtime = (uint64_t)value;
 }
+
+int migrate_use_xbzrle(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_XBZRLE];
+}
+
+int64_t migrate_xbzrle_cache_size(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->xbzrle_cache_size;
+}
+
+int migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->multifd_channels;
+}
+
+/* Postcopy needs a second connection, and does not mix with multifd */
+int migrate_use_postcopy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY] &&
+           s->open_channel && !migrate_use_multifd();
+}
+
+int migrate_auto_converge(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
+}
+
+/* Multifd channels carry raw pages, so compression is off with them */
+int migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS] &&
+           !migrate_use_multifd();
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_threads;
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.decompress_threads;
+}
+
+bool migration_in_postcopy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->state == MIG_STATE_POSTCOPY_ACTIVE;
+}
+
+/* Whether an outgoing migration uses the save handlers */
+bool migration_is_running(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->state == MIG_STATE_ACTIVE ||
+           s->state == MIG_STATE_POSTCOPY_ACTIVE;
+}
+
+/* Connect another stream to the destination, returns a socket or -1 */
+int migrate_open_channel(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->open_channel ? s->open_channel(s) : -1;
+}
+
+static int incoming_listen_fd = -1;
+
+/* The socket the incoming migration was accepted on, -1 if none */
+void migrate_set_incoming_listen_fd(int fd)
+{
+    incoming_listen_fd = fd;
+}
+
+int migrate_incoming_listen_fd(void)
+{
+    return incoming_listen_fd;
+}
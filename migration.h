@@ -18,9 +18,15 @@
 #include "qemu-common.h"
 #include "notify.h"
 #include "error.h"
+#include "qapi-types.h"
 
 typedef struct MigrationState MigrationState;
 
+/* upper bound for the multifd-channels setting */
+#define MULTIFD_CHANNELS_MAX 16
+/* upper bound for the (de)compress-threads parameters */
+#define COMPRESS_THREADS_MAX 255
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -30,9 +36,28 @@ struct MigrationState
     int (*get_error)(MigrationState *s);
     int (*close)(MigrationState *s);
     int (*write)(MigrationState *s, const void *buff, size_t size);
+    /* send len bytes of iov from iov_offset on, NULL if unsupported */
+    int (*writev)(MigrationState *s, struct iovec *iov, int len,
+                  int iov_offset);
+    /* connect another stream to the destination, NULL if unsupported */
+    int (*open_channel)(MigrationState *s);
+    char *channel_addr;
     void *opaque;
     int blk;
     int shared;
+    bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int64_t xbzrle_cache_size;
+    int64_t multifd_channels;
+    MigrationParameters parameters;
+    /* rt_clock timestamps, in ns */
+    int64_t start_time;
+    int64_t stop_time;
+    int64_t complete_time;
+    /* durations, in ns */
+    int64_t setup_time;
+    int64_t downtime;
+    int64_t total_time;
+    MigrationPhases phases;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -75,10 +100,103 @@ bool migration_has_failed(MigrationState *);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+uint64_t ram_dirty_pages_rate(void);
+uint64_t ram_expected_downtime(void);
+MigrationIterationList *ram_iterations(void);
 
 int ram_save_live(QEMUFile *f, int stage, void *opaque);
+int ram_save_background_prepare(void);
+void ram_save_background_cancel(void);
 int ram_load(QEMUFile *f, void *opaque, int version_id);
 
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen);
+int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+int migrate_use_xbzrle(void);
+int64_t migrate_xbzrle_cache_size(void);
+
+int migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+int migrate_use_postcopy(void);
+int migrate_auto_converge(void);
+int migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+bool migration_in_postcopy(void);
+bool migration_is_running(void);
+
+int migrate_open_channel(void);
+void migrate_set_incoming_listen_fd(int fd);
+int migrate_incoming_listen_fd(void);
+
+int multifd_save_setup(MigrationState *s);
+int multifd_save_start(unsigned int page_size);
+void multifd_set_rate_limit(int64_t rate_limit);
+void multifd_queue_page(const char *idstr, uint64_t offset, uint8_t *host);
+bool multifd_save_busy(void);
+int multifd_save_wait(void);
+int64_t multifd_save_sync(void);
+uint64_t multifd_bytes_pending(void);
+uint64_t multifd_bytes_sent(void);
+int multifd_save_finish(void);
+void multifd_save_cleanup(void);
+
+void multifd_load_add_block(const char *idstr, uint8_t *host,
+                            uint64_t length);
+int multifd_load_setup(int num, unsigned int page_size);
+int multifd_load_sync(uint32_t seq);
+void multifd_load_cleanup(void);
+
+/* writes out a page compressed to len bytes, or page itself if len < 0;
+   returns the number of bytes written */
+typedef int (CompressPutFunc)(QEMUFile *f, void *opaque, uint64_t offset,
+                              const uint8_t *page, const uint8_t *data,
+                              int len);
+
+int compress_save_setup(unsigned int page_size, CompressPutFunc *put);
+int compress_save_page_done(QEMUFile *f, void *opaque, uint64_t offset);
+int compress_save_page(QEMUFile *f, void *opaque, uint64_t offset,
+                       const uint8_t *page);
+int compress_save_flush(QEMUFile *f);
+void compress_save_cleanup(void);
+
+int compress_load_page(QEMUFile *f, void *host, unsigned int page_size,
+                       int len);
+int compress_load_page_done(void *host);
+int compress_load_flush(void);
+void compress_load_cleanup(void);
+
+int postcopy_save_setup(unsigned int page_size);
+void postcopy_save_add_block(const char *idstr, uint8_t *host,
+                             uint64_t length);
+void postcopy_save_mark_page(uint64_t offset);
+int postcopy_save_run(void);
+int postcopy_save_poll(void);
+uint64_t postcopy_bytes_remaining(void);
+uint64_t postcopy_bytes_sent(void);
+void postcopy_save_cleanup(void);
+
+void postcopy_load_add_block(const char *idstr, uint8_t *host,
+                             uint64_t length);
+int postcopy_load_advise(unsigned int page_size);
+int postcopy_load_start(void);
+int postcopy_load_discard(const char *idstr, uint64_t start, uint64_t length);
+int postcopy_load_run(void);
+
+int snapshot_ram_setup(unsigned int page_size);
+int snapshot_ram_add_block(void *opaque, uint8_t *host, uint64_t length);
+int snapshot_ram_protect(void);
+int snapshot_ram_next_page(void **opaque, uint64_t *offset, uint8_t *buf);
+void snapshot_ram_cleanup(void);
+
+int64_t xbzrle_cache_resize(int64_t new_size);
+uint64_t xbzrle_mig_bytes_transferred(void);
+uint64_t xbzrle_mig_pages_transferred(void);
+uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_overflow(void);
+
 /**
  * @migrate_add_blocker - prevent migration from proceeding
  *
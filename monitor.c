@@ -2686,6 +2686,41 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show migration status",
         .mhandler.info = hmp_info_migrate,
     },
+    {
+        .name       = "migrate_capabilities",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration capabilities",
+        .mhandler.info = hmp_info_migrate_capabilities,
+    },
+    {
+        .name       = "migrate_cache_size",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration xbzrle cache size",
+        .mhandler.info = hmp_info_migrate_cache_size,
+    },
+    {
+        .name       = "migrate_multifd_channels",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the number of multifd migration channels",
+        .mhandler.info = hmp_info_migrate_multifd_channels,
+    },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration tunables",
+        .mhandler.info = hmp_info_migrate_parameters,
+    },
+    {
+        .name       = "vmstate_times",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show how long each device state took to migrate",
+        .mhandler.info = hmp_info_vmstate_times,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
@@ -0,0 +1,174 @@
+/*
+ * Page cache for migration
+ *
+ * A direct mapped cache of guest pages, indexed by page address.  It
+ * keeps the last copy of each page sent by migration, so that the next
+ * copy can be sent as a delta.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/page_cache.h"
+
+typedef struct CacheItem {
+    uint64_t it_addr;
+    uint64_t it_age;
+    uint8_t *it_data;
+} CacheItem;
+
+struct PageCache {
+    CacheItem *page_cache;
+    unsigned int page_size;
+    int64_t max_num_items;
+    uint64_t max_item_age;
+    int64_t num_items;
+};
+
+static int64_t cache_round_pages(int64_t num_pages)
+{
+    int64_t n = 1;
+
+    /* keep a power of two, so that the slot is a mask of the address */
+    while (n * 2 <= num_pages) {
+        n *= 2;
+    }
+    return n;
+}
+
+static CacheItem *cache_items_new(int64_t num_pages)
+{
+    CacheItem *items;
+    int64_t i;
+
+    items = g_try_malloc(num_pages * sizeof(*items));
+    if (!items) {
+        return NULL;
+    }
+    for (i = 0; i < num_pages; i++) {
+        items[i].it_data = NULL;
+        items[i].it_age = 0;
+        items[i].it_addr = -1;
+    }
+    return items;
+}
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
+    PageCache *cache;
+
+    if (num_pages <= 0) {
+        return NULL;
+    }
+
+    cache = g_malloc(sizeof(*cache));
+    cache->page_size = page_size;
+    cache->num_items = 0;
+    cache->max_item_age = 0;
+    cache->max_num_items = cache_round_pages(num_pages);
+    cache->page_cache = cache_items_new(cache->max_num_items);
+    if (!cache->page_cache) {
+        g_free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void cache_fini(PageCache *cache)
+{
+    int64_t i;
+
+    g_assert(cache);
+    g_assert(cache->page_cache);
+
+    for (i = 0; i < cache->max_num_items; i++) {
+        g_free(cache->page_cache[i].it_data);
+    }
+    g_free(cache->page_cache);
+    g_free(cache);
+}
+
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+{
+    size_t pos;
+
+    pos = (addr / cache->page_size) & (cache->max_num_items - 1);
+    return &cache->page_cache[pos];
+}
+
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
+{
+    return cache_get_by_addr(cache, addr)->it_addr == addr;
+}
+
+uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it->it_addr == addr ? it->it_data : NULL;
+}
+
+void cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (!it->it_data) {
+        it->it_data = g_malloc(cache->page_size);
+        cache->num_items++;
+    }
+    memcpy(it->it_data, pdata, cache->page_size);
+    it->it_age = ++cache->max_item_age;
+    it->it_addr = addr;
+}
+
+int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
+{
+    CacheItem *new_items, *old_items;
+    int64_t old_num_items, i;
+
+    g_assert(cache);
+
+    if (new_num_pages <= 0) {
+        return -1;
+    }
+    new_num_pages = cache_round_pages(new_num_pages);
+    if (new_num_pages == cache->max_num_items) {
+        return cache->max_num_items;
+    }
+
+    new_items = cache_items_new(new_num_pages);
+    if (!new_items) {
+        return -1;
+    }
+
+    old_items = cache->page_cache;
+    old_num_items = cache->max_num_items;
+    cache->page_cache = new_items;
+    cache->max_num_items = new_num_pages;
+    cache->num_items = 0;
+
+    /* move the pages over; on a collision the most recent one wins */
+    for (i = 0; i < old_num_items; i++) {
+        CacheItem *old_it = &old_items[i];
+        CacheItem *new_it;
+
+        if (!old_it->it_data) {
+            continue;
+        }
+        new_it = cache_get_by_addr(cache, old_it->it_addr);
+        if (!new_it->it_data) {
+            *new_it = *old_it;
+            cache->num_items++;
+        } else if (new_it->it_age < old_it->it_age) {
+            g_free(new_it->it_data);
+            *new_it = *old_it;
+        } else {
+            g_free(old_it->it_data);
+        }
+    }
+    g_free(old_items);
+
+    return cache->max_num_items;
+}
@@ -0,0 +1,903 @@
+/*
+ * QEMU live migration: postcopy RAM
+ *
+ * With the "postcopy" capability on, the source does not wait for the
+ * dirty pages to converge.  Once every page has been sent once, it stops
+ * the guest and sends, instead of the pages dirtied since then, a list
+ * of them followed by the device state; the destination starts the guest
+ * right away.  The destination drops the stale pages and registers guest
+ * RAM with userfaultfd: a guest access to a dropped page blocks, and the
+ * faulting address is sent back to the source as a request.  The source
+ * sends requested pages ahead of the others, which it keeps streaming in
+ * the background until none is left.
+ *
+ * Pages and requests do not use the main stream but an extra connection,
+ * so that a fault taken while the device state is loaded can be served.
+ *
+ * Page channel, source to destination:
+ *   header  = be32 POSTCOPY_MAGIC, be32 POSTCOPY_VERSION
+ *   record  = be64 (page offset | flags) [idstr] [byte | page]
+ * Requests, destination to source:
+ *   request = byte idstr length, idstr, be64 page offset
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "hw/hw.h"
+#include "qemu_socket.h"
+#include "qemu-thread.h"
+#include "bitmap.h"
+#include "migration.h"
+
+#ifdef CONFIG_USERFAULTFD
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#endif
+
+//#define DEBUG_MIGRATION_POSTCOPY
+
+#ifdef DEBUG_MIGRATION_POSTCOPY
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-postcopy: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#ifdef _WIN32
+#define SHUT_RDWR SD_BOTH
+#endif
+
+#define POSTCOPY_MAGIC   0x50435059     /* "PCPY" */
+#define POSTCOPY_VERSION 1
+
+/* record flags, in the low bits of the page offset */
+#define POSTCOPY_FLAG_PAGE  0x01
+#define POSTCOPY_FLAG_FILL  0x02
+#define POSTCOPY_FLAG_BLOCK 0x04
+#define POSTCOPY_FLAG_EOS   0x10
+
+/* largest request: length byte, idstr, be64 offset */
+#define POSTCOPY_REQUEST_MAX (1 + 255 + 8)
+
+/* outgoing */
+
+typedef struct PostcopySendBlock {
+    char idstr[256];
+    uint8_t *host;
+    uint64_t length;
+    /* pages that were dirtied after they were sent */
+    unsigned long *bitmap;
+} PostcopySendBlock;
+
+static struct {
+    PostcopySendBlock *blocks;
+    int num_blocks;
+    unsigned int page_size;
+    int fd;
+    QEMUFile *file;
+    QemuThread thread;
+    bool running;
+    /* block of the last record, owned by the thread */
+    PostcopySendBlock *last_block;
+    /* request being read, owned by the thread */
+    uint8_t req[POSTCOPY_REQUEST_MAX];
+    int req_len;
+    QemuMutex lock;
+    /* protected by lock */
+    uint64_t pages_pending;
+    uint64_t bytes_sent;
+    int state;                  /* 0, 1 once done, or a negative errno */
+} postcopy_send = {
+    .fd = -1,
+};
+
+static int channel_put_buffer(void *opaque, const uint8_t *buf,
+                              int64_t pos, int size)
+{
+    int fd = (intptr_t)opaque;
+
+    return send_all(fd, buf, size) == size ? size : -EIO;
+}
+
+/*
+ * Open the page channel, when the source switches to postcopy.  The
+ * dirty pages are then registered with postcopy_save_add_block() and
+ * postcopy_save_mark_page(), and the thread started with
+ * postcopy_save_run().
+ */
+int postcopy_save_setup(unsigned int page_size)
+{
+    int fd;
+
+    fd = migrate_open_channel();
+    if (fd < 0) {
+        fprintf(stderr, "postcopy: could not open the page channel\n");
+        return -EIO;
+    }
+
+    postcopy_send.fd = fd;
+    postcopy_send.file = qemu_fopen_ops((void *)(intptr_t)fd,
+                                        channel_put_buffer, NULL, NULL,
+                                        NULL, NULL, NULL);
+    postcopy_send.page_size = page_size;
+    postcopy_send.last_block = NULL;
+    postcopy_send.req_len = 0;
+    postcopy_send.pages_pending = 0;
+    postcopy_send.bytes_sent = 0;
+    postcopy_send.state = 0;
+    qemu_mutex_init(&postcopy_send.lock);
+
+    qemu_put_be32(postcopy_send.file, POSTCOPY_MAGIC);
+    qemu_put_be32(postcopy_send.file, POSTCOPY_VERSION);
+    qemu_fflush(postcopy_send.file);
+
+    return qemu_file_get_error(postcopy_send.file);
+}
+
+void postcopy_save_add_block(const char *idstr, uint8_t *host,
+                             uint64_t length)
+{
+    PostcopySendBlock *block;
+
+    postcopy_send.blocks = g_realloc(postcopy_send.blocks,
+                                     (postcopy_send.num_blocks + 1) *
+                                     sizeof(PostcopySendBlock));
+    block = &postcopy_send.blocks[postcopy_send.num_blocks++];
+    pstrcpy(block->idstr, sizeof(block->idstr), idstr);
+    block->host = host;
+    block->length = length;
+    block->bitmap = bitmap_new(length / postcopy_send.page_size);
+}
+
+/* Mark a page of the last block added as still to be sent */
+void postcopy_save_mark_page(uint64_t offset)
+{
+    PostcopySendBlock *block;
+
+    block = &postcopy_send.blocks[postcopy_send.num_blocks - 1];
+    set_bit(offset / postcopy_send.page_size, block->bitmap);
+    postcopy_send.pages_pending++;
+}
+
+static PostcopySendBlock *postcopy_send_find_block(const char *idstr)
+{
+    int i;
+
+    for (i = 0; i < postcopy_send.num_blocks; i++) {
+        if (!strcmp(postcopy_send.blocks[i].idstr, idstr)) {
+            return &postcopy_send.blocks[i];
+        }
+    }
+    return NULL;
+}
+
+static int postcopy_send_page(PostcopySendBlock *block, uint64_t page)
+{
+    QEMUFile *f = postcopy_send.file;
+    unsigned int size = postcopy_send.page_size;
+    uint8_t *p = block->host + page * size;
+    uint64_t start = qemu_ftell(f);
+    int flags = 0;
+    bool dirty;
+
+    if (block != postcopy_send.last_block) {
+        flags |= POSTCOPY_FLAG_BLOCK;
+    }
+    if (buffer_is_zero(p, size)) {
+        flags |= POSTCOPY_FLAG_FILL;
+    } else {
+        flags |= POSTCOPY_FLAG_PAGE;
+    }
+
+    qemu_put_be64(f, page * size | flags);
+    if (flags & POSTCOPY_FLAG_BLOCK) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        postcopy_send.last_block = block;
+    }
+    if (flags & POSTCOPY_FLAG_FILL) {
+        qemu_put_byte(f, 0);
+    } else {
+        qemu_put_buffer(f, p, size);
+    }
+
+    dirty = test_and_clear_bit(page, block->bitmap);
+
+    qemu_mutex_lock(&postcopy_send.lock);
+    if (dirty) {
+        postcopy_send.pages_pending--;
+    }
+    postcopy_send.bytes_sent += qemu_ftell(f) - start;
+    qemu_mutex_unlock(&postcopy_send.lock);
+
+    return qemu_file_get_error(f);
+}
+
+/* Find the next page to send in the background, from *block and *page */
+static bool postcopy_next_page(int *block, uint64_t *page)
+{
+    int i;
+
+    if (!postcopy_send.num_blocks) {
+        return false;
+    }
+    for (i = 0; i <= postcopy_send.num_blocks; i++) {
+        int b = (*block + i) % postcopy_send.num_blocks;
+        PostcopySendBlock *pb = &postcopy_send.blocks[b];
+        unsigned long size = pb->length / postcopy_send.page_size;
+        unsigned long next;
+
+        next = find_next_bit(pb->bitmap, size, i ? 0 : *page);
+        if (next < size) {
+            *block = b;
+            *page = next;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Read what arrived of the next request.  Returns 1 with *block and
+ * *page set once a whole one is in, 0 if more bytes are needed, or a
+ * negative errno.
+ */
+static int postcopy_read_request(int *block, uint64_t *page)
+{
+    uint8_t *req = postcopy_send.req;
+    PostcopySendBlock *pb;
+    char id[256];
+    uint64_t offset;
+    int len, want;
+
+    want = postcopy_send.req_len ? 1 + req[0] + 8 : 1;
+    do {
+        len = recv(postcopy_send.fd, (void *)(req + postcopy_send.req_len),
+                   want - postcopy_send.req_len, 0);
+    } while (len == -1 && socket_error() == EINTR);
+    if (len <= 0) {
+        return len ? -socket_error() : -EPIPE;
+    }
+    postcopy_send.req_len += len;
+    if (postcopy_send.req_len < 1 + req[0] + 8) {
+        return 0;
+    }
+    postcopy_send.req_len = 0;
+
+    memcpy(id, req + 1, req[0]);
+    id[req[0]] = 0;
+    offset = ldq_be_p(req + 1 + req[0]);
+
+    pb = postcopy_send_find_block(id);
+    if (!pb || offset >= pb->length || offset % postcopy_send.page_size) {
+        fprintf(stderr, "postcopy: bad request for %s at %" PRIx64 "\n",
+                id, offset);
+        return -EINVAL;
+    }
+    *block = pb - postcopy_send.blocks;
+    *page = offset / postcopy_send.page_size;
+    return 1;
+}
+
+/* Wait at most timeout_us (forever if negative) for the channel to be
+ * readable.  Returns 1 if it is, 0 on timeout, or a negative errno. */
+static int postcopy_channel_wait(int64_t timeout_us)
+{
+    struct timeval tv;
+    fd_set rfds;
+    int ret;
+
+    do {
+        FD_ZERO(&rfds);
+        FD_SET(postcopy_send.fd, &rfds);
+        tv.tv_sec = timeout_us / 1000000;
+        tv.tv_usec = timeout_us % 1000000;
+        ret = select(postcopy_send.fd + 1, &rfds, NULL, NULL,
+                     timeout_us < 0 ? NULL : &tv);
+    } while (ret == -1 && socket_error() == EINTR);
+
+    return ret < 0 ? -socket_error() : ret > 0;
+}
+
+static int postcopy_send_pages(void)
+{
+    QEMUFile *f = postcopy_send.file;
+    int block = 0;
+    uint64_t page = 0;
+    int ret;
+
+    for (;;) {
+        /* pages the guest is waiting for go first */
+        while ((ret = postcopy_channel_wait(0)) > 0) {
+            ret = postcopy_read_request(&block, &page);
+            if (ret < 0) {
+                return ret;
+            }
+            if (ret) {
+                DPRINTF("request for %s page %" PRIu64 "\n",
+                        postcopy_send.blocks[block].idstr, page);
+                ret = postcopy_send_page(&postcopy_send.blocks[block], page);
+                qemu_fflush(f);
+                if (ret < 0) {
+                    return ret;
+                }
+                /* the neighbours are likely to be next */
+                page++;
+            }
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (!postcopy_next_page(&block, &page)) {
+            break;
+        }
+        ret = postcopy_send_page(&postcopy_send.blocks[block], page);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    qemu_put_be64(f, POSTCOPY_FLAG_EOS);
+    qemu_fflush(f);
+    return qemu_file_get_error(f);
+}
+
+static void *postcopy_send_thread(void *opaque)
+{
+    uint8_t buf[POSTCOPY_REQUEST_MAX];
+    int ret;
+
+    ret = postcopy_send_pages();
+
+    /* every page has arrived once the destination closes the channel;
+     * requests sent meanwhile are for pages that are on their way */
+    while (ret == 0) {
+        ret = recv(postcopy_send.fd, (void *)buf, sizeof(buf), 0);
+        if (ret == -1) {
+            ret = socket_error() == EINTR ? 0 : -socket_error();
+        } else if (ret == 0) {
+            break;
+        } else {
+            ret = 0;
+        }
+    }
+
+    DPRINTF("thread done, %d\n", ret);
+    qemu_mutex_lock(&postcopy_send.lock);
+    postcopy_send.state = ret < 0 ? ret : 1;
+    qemu_mutex_unlock(&postcopy_send.lock);
+
+    return NULL;
+}
+
+int postcopy_save_run(void)
+{
+    DPRINTF("%" PRIu64 " pages to send\n", postcopy_send.pages_pending);
+    postcopy_send.running = true;
+    qemu_thread_create(&postcopy_send.thread, postcopy_send_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+/* Returns 1 once the destination has every page, 0 until then, or a
+ * negative errno if the channel failed */
+int postcopy_save_poll(void)
+{
+    int ret;
+
+    qemu_mutex_lock(&postcopy_send.lock);
+    ret = postcopy_send.state;
+    qemu_mutex_unlock(&postcopy_send.lock);
+
+    return ret;
+}
+
+uint64_t postcopy_bytes_remaining(void)
+{
+    uint64_t pending;
+
+    if (postcopy_send.fd < 0) {
+        return 0;
+    }
+    qemu_mutex_lock(&postcopy_send.lock);
+    pending = postcopy_send.pages_pending;
+    qemu_mutex_unlock(&postcopy_send.lock);
+
+    return pending * postcopy_send.page_size;
+}
+
+uint64_t postcopy_bytes_sent(void)
+{
+    uint64_t sent;
+
+    if (postcopy_send.fd < 0) {
+        return 0;
+    }
+    qemu_mutex_lock(&postcopy_send.lock);
+    sent = postcopy_send.bytes_sent;
+    qemu_mutex_unlock(&postcopy_send.lock);
+
+    return sent;
+}
+
+/* Stop the thread if it still runs and close the channel */
+void postcopy_save_cleanup(void)
+{
+    int i;
+
+    if (postcopy_send.fd < 0) {
+        return;
+    }
+
+    if (postcopy_send.running) {
+        shutdown(postcopy_send.fd, SHUT_RDWR);
+        qemu_thread_join(&postcopy_send.thread);
+        postcopy_send.running = false;
+    }
+    qemu_fclose(postcopy_send.file);
+    postcopy_send.file = NULL;
+    closesocket(postcopy_send.fd);
+    postcopy_send.fd = -1;
+    qemu_mutex_destroy(&postcopy_send.lock);
+
+    for (i = 0; i < postcopy_send.num_blocks; i++) {
+        g_free(postcopy_send.blocks[i].bitmap);
+    }
+    g_free(postcopy_send.blocks);
+    postcopy_send.blocks = NULL;
+    postcopy_send.num_blocks = 0;
+}
+
+/* incoming */
+
+typedef struct PostcopyRecvBlock {
+    char idstr[256];
+    uint8_t *host;
+    uint64_t length;
+} PostcopyRecvBlock;
+
+static struct {
+    PostcopyRecvBlock *blocks;
+    int num_blocks;
+    unsigned int page_size;
+    int uffd;
+    int fd;
+    QEMUFile *file;
+    int quit_fds[2];
+    QemuThread fault_thread;
+    QemuThread recv_thread;
+    uint8_t *page;
+} postcopy_recv = {
+    .uffd = -1,
+    .fd = -1,
+};
+
+/*
+ * The blocks are looked up by the postcopy threads, so the table is
+ * filled by the main thread before they start and never changes.
+ */
+void postcopy_load_add_block(const char *idstr, uint8_t *host,
+                             uint64_t length)
+{
+    PostcopyRecvBlock *block;
+
+    postcopy_recv.blocks = g_realloc(postcopy_recv.blocks,
+                                     (postcopy_recv.num_blocks + 1) *
+                                     sizeof(PostcopyRecvBlock));
+    block = &postcopy_recv.blocks[postcopy_recv.num_blocks++];
+    pstrcpy(block->idstr, sizeof(block->idstr), idstr);
+    block->host = host;
+    block->length = length;
+}
+
+#ifdef CONFIG_USERFAULTFD
+
+static PostcopyRecvBlock *postcopy_recv_find_block(const char *idstr)
+{
+    int i;
+
+    for (i = 0; i < postcopy_recv.num_blocks; i++) {
+        if (!strcmp(postcopy_recv.blocks[i].idstr, idstr)) {
+            return &postcopy_recv.blocks[i];
+        }
+    }
+    return NULL;
+}
+
+static int postcopy_register(PostcopyRecvBlock *block, bool on)
+{
+    struct uffdio_register reg;
+    struct uffdio_range range;
+
+    if (!on) {
+        range.start = (uintptr_t)block->host;
+        range.len = block->length;
+        return ioctl(postcopy_recv.uffd, UFFDIO_UNREGISTER, &range) ? -errno
+                                                                   : 0;
+    }
+
+    reg.range.start = (uintptr_t)block->host;
+    reg.range.len = block->length;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(postcopy_recv.uffd, UFFDIO_REGISTER, &reg)) {
+        return -errno;
+    }
+    if ((reg.ioctls & ((__u64)1 << _UFFDIO_COPY)) == 0 ||
+        (reg.ioctls & ((__u64)1 << _UFFDIO_ZEROPAGE)) == 0) {
+        return -ENOSYS;
+    }
+    return 0;
+}
+
+/*
+ * Check, while the source still runs the guest, that pages can be
+ * placed on demand here.  The RAM blocks must have been registered with
+ * postcopy_load_add_block() first.
+ */
+int postcopy_load_advise(unsigned int page_size)
+{
+    struct uffdio_api api;
+    int i, ret;
+
+    if (page_size != getpagesize()) {
+        fprintf(stderr, "postcopy: the target page size must be the host "
+                "page size\n");
+        return -EINVAL;
+    }
+    postcopy_recv.page_size = page_size;
+
+    postcopy_recv.uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (postcopy_recv.uffd < 0) {
+        fprintf(stderr, "postcopy: userfaultfd not available: %s\n",
+                strerror(errno));
+        return -errno;
+    }
+
+    api.api = UFFD_API;
+    api.features = 0;
+    if (ioctl(postcopy_recv.uffd, UFFDIO_API, &api)) {
+        ret = -errno;
+        fprintf(stderr, "postcopy: userfaultfd API mismatch\n");
+        goto fail;
+    }
+
+    /* the memory backing the blocks must support it too */
+    for (i = 0; i < postcopy_recv.num_blocks; i++) {
+        PostcopyRecvBlock *block = &postcopy_recv.blocks[i];
+
+        ret = postcopy_register(block, true);
+        if (ret == 0) {
+            ret = postcopy_register(block, false);
+        }
+        if (ret < 0) {
+            fprintf(stderr, "postcopy: cannot fault in block %s: %s\n",
+                    block->idstr, strerror(-ret));
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    close(postcopy_recv.uffd);
+    postcopy_recv.uffd = -1;
+    return ret;
+}
+
+/* Accept the page channel, that the source opens when it switches */
+int postcopy_load_start(void)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int listen_fd = migrate_incoming_listen_fd();
+    int fd;
+
+    if (postcopy_recv.uffd < 0 || listen_fd < 0) {
+        fprintf(stderr, "postcopy: not advised, or not a tcp: or unix: "
+                "incoming migration\n");
+        return -EINVAL;
+    }
+
+    socket_set_block(listen_fd);
+    do {
+        fd = qemu_accept(listen_fd, (struct sockaddr *)&addr, &addrlen);
+    } while (fd == -1 && socket_error() == EINTR);
+    if (fd == -1) {
+        fprintf(stderr, "postcopy: could not accept the page channel\n");
+        return -EIO;
+    }
+
+    postcopy_recv.fd = fd;
+    postcopy_recv.file = qemu_fopen_socket(fd);
+    if (qemu_get_be32(postcopy_recv.file) != POSTCOPY_MAGIC ||
+        qemu_get_be32(postcopy_recv.file) != POSTCOPY_VERSION) {
+        fprintf(stderr, "postcopy: bad channel header\n");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Drop the pages of a block the source will send again */
+int postcopy_load_discard(const char *idstr, uint64_t start, uint64_t length)
+{
+    PostcopyRecvBlock *block = postcopy_recv_find_block(idstr);
+
+    if (!block || start > block->length || length > block->length - start ||
+        (start | length) % postcopy_recv.page_size) {
+        fprintf(stderr, "postcopy: bad discard for %s\n", idstr);
+        return -EINVAL;
+    }
+    if (madvise(block->host + start, length, MADV_DONTNEED)) {
+        return -errno;
+    }
+    return 0;
+}
+
+/* Ask the source for the page at a faulting address */
+static void postcopy_request_page(uint64_t addr)
+{
+    uint8_t req[POSTCOPY_REQUEST_MAX];
+    int i, len;
+
+    for (i = 0; i < postcopy_recv.num_blocks; i++) {
+        PostcopyRecvBlock *block = &postcopy_recv.blocks[i];
+        uint64_t offset = addr - (uintptr_t)block->host;
+
+        if (addr < (uintptr_t)block->host || offset >= block->length) {
+            continue;
+        }
+
+        offset &= ~(uint64_t)(postcopy_recv.page_size - 1);
+        len = strlen(block->idstr);
+        req[0] = len;
+        memcpy(req + 1, block->idstr, len);
+        stq_be_p(req + 1 + len, offset);
+        DPRINTF("fault in %s at %" PRIx64 "\n", block->idstr, offset);
+
+        /* if the channel is gone, the receiving thread reports it */
+        send_all(postcopy_recv.fd, req, 1 + len + 8);
+        return;
+    }
+    fprintf(stderr, "postcopy: fault outside guest RAM at %" PRIx64 "\n",
+            addr);
+}
+
+static void *postcopy_fault_thread(void *opaque)
+{
+    struct pollfd pfd[2];
+    struct uffd_msg msg;
+
+    pfd[0].fd = postcopy_recv.uffd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = postcopy_recv.quit_fds[0];
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "postcopy: poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+        while (read(postcopy_recv.uffd, &msg, sizeof(msg)) == sizeof(msg)) {
+            if (msg.event == UFFD_EVENT_PAGEFAULT) {
+                postcopy_request_page(msg.arg.pagefault.address);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Atomically fill a missing page and wake up whoever waits for it */
+static int postcopy_place_page(uint8_t *host, const uint8_t *data)
+{
+    int ret;
+
+    if (data) {
+        struct uffdio_copy copy;
+
+        copy.dst = (uintptr_t)host;
+        copy.src = (uintptr_t)data;
+        copy.len = postcopy_recv.page_size;
+        copy.mode = 0;
+        ret = ioctl(postcopy_recv.uffd, UFFDIO_COPY, &copy);
+    } else {
+        struct uffdio_zeropage zero;
+
+        zero.range.start = (uintptr_t)host;
+        zero.range.len = postcopy_recv.page_size;
+        zero.mode = 0;
+        ret = ioctl(postcopy_recv.uffd, UFFDIO_ZEROPAGE, &zero);
+    }
+
+    /* a page can be sent twice, if it was requested while on its way */
+    if (ret && errno != EEXIST) {
+        return -errno;
+    }
+    return 0;
+}
+
+static int postcopy_recv_pages(void)
+{
+    QEMUFile *f = postcopy_recv.file;
+    uint64_t page_mask = postcopy_recv.page_size - 1;
+    PostcopyRecvBlock *block = NULL;
+
+    for (;;) {
+        uint64_t v = qemu_get_be64(f);
+        uint64_t offset = v & ~page_mask;
+        int flags = v & page_mask;
+        uint8_t *data = postcopy_recv.page;
+        int ret;
+
+        if (qemu_file_get_error(f)) {
+            return qemu_file_get_error(f);
+        }
+
+        if (flags & POSTCOPY_FLAG_EOS) {
+            return 0;
+        }
+
+        if (flags & POSTCOPY_FLAG_BLOCK) {
+            char id[256];
+            uint8_t len = qemu_get_byte(f);
+
+            qemu_get_buffer(f, (uint8_t *)id, len);
+            id[len] = 0;
+            block = postcopy_recv_find_block(id);
+            if (!block) {
+                fprintf(stderr, "postcopy: can't find block %s!\n", id);
+                return -EINVAL;
+            }
+        }
+        if (!block || offset >= block->length) {
+            fprintf(stderr, "postcopy: bad page record\n");
+            return -EINVAL;
+        }
+
+        if (flags & POSTCOPY_FLAG_FILL) {
+            uint8_t ch = qemu_get_byte(f);
+
+            if (ch) {
+                memset(data, ch, postcopy_recv.page_size);
+            } else {
+                data = NULL;
+            }
+        } else if (flags & POSTCOPY_FLAG_PAGE) {
+            qemu_get_buffer(f, data, postcopy_recv.page_size);
+        } else {
+            fprintf(stderr, "postcopy: unknown record flags %#x\n", flags);
+            return -EINVAL;
+        }
+        if (qemu_file_get_error(f)) {
+            return qemu_file_get_error(f);
+        }
+
+        ret = postcopy_place_page(block->host + offset, data);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+}
+
+static void postcopy_load_finish(void)
+{
+    int i;
+
+    /* every page is in: nothing can fault any more */
+    for (i = 0; i < postcopy_recv.num_blocks; i++) {
+        postcopy_register(&postcopy_recv.blocks[i], false);
+    }
+
+    if (write(postcopy_recv.quit_fds[1], "", 1) != 1) {
+        abort();
+    }
+    qemu_thread_join(&postcopy_recv.fault_thread);
+
+    close(postcopy_recv.quit_fds[0]);
+    close(postcopy_recv.quit_fds[1]);
+    close(postcopy_recv.uffd);
+    postcopy_recv.uffd = -1;
+    qemu_fclose(postcopy_recv.file);
+    postcopy_recv.file = NULL;
+    close(postcopy_recv.fd);
+    postcopy_recv.fd = -1;
+    qemu_vfree(postcopy_recv.page);
+    postcopy_recv.page = NULL;
+    g_free(postcopy_recv.blocks);
+    postcopy_recv.blocks = NULL;
+    postcopy_recv.num_blocks = 0;
+}
+
+static void *postcopy_recv_thread(void *opaque)
+{
+    int ret;
+
+    ret = postcopy_recv_pages();
+    if (ret < 0) {
+        /* the guest runs here already, and its memory is partly missing */
+        fprintf(stderr, "postcopy: lost the page channel: %s\n",
+                strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    DPRINTF("all pages received\n");
+    postcopy_load_finish();
+
+    return NULL;
+}
+
+/*
+ * Start faulting in the pages dropped by postcopy_load_discard().  From
+ * here on, guest RAM must only be touched by the postcopy threads or by
+ * accesses that may block until the page arrives.
+ */
+int postcopy_load_run(void)
+{
+    QemuThread thread;
+    int i, ret;
+
+    if (!postcopy_recv.file) {
+        fprintf(stderr, "postcopy: no page channel\n");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < postcopy_recv.num_blocks; i++) {
+        ret = postcopy_register(&postcopy_recv.blocks[i], true);
+        if (ret < 0) {
+            fprintf(stderr, "postcopy: cannot fault in block %s: %s\n",
+                    postcopy_recv.blocks[i].idstr, strerror(-ret));
+            return ret;
+        }
+    }
+
+    if (qemu_pipe(postcopy_recv.quit_fds) < 0) {
+        return -errno;
+    }
+    postcopy_recv.page = qemu_memalign(postcopy_recv.page_size,
+                                       postcopy_recv.page_size);
+
+    qemu_thread_create(&postcopy_recv.fault_thread, postcopy_fault_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&thread, postcopy_recv_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+    return 0;
+}
+
+#else /* !CONFIG_USERFAULTFD */
+
+int postcopy_load_advise(unsigned int page_size)
+{
+    fprintf(stderr, "postcopy: this host cannot fault in guest pages\n");
+    return -ENOSYS;
+}
+
+int postcopy_load_start(void)
+{
+    return -ENOSYS;
+}
+
+int postcopy_load_discard(const char *idstr, uint64_t start, uint64_t length)
+{
+    return -ENOSYS;
+}
+
+int postcopy_load_run(void)
+{
+    return -ENOSYS;
+}
+
+#endif /* CONFIG_USERFAULTFD */
@@ -285,6 +285,12 @@ typedef struct PCIHostDeviceAddress {
 void tcg_exec_init(unsigned long tb_size);
 bool tcg_enabled(void);
 
+/* Multi-threaded TCG, see docs/multi-thread-tcg.txt */
+extern bool mttcg_enabled;
+bool qemu_tcg_mt_lock_iothread(void);
+void qemu_tcg_mt_unlock_iothread(bool locked);
+void qemu_tcg_mt_reset_iothread(void);
+
 void cpu_exec_init_all(void);
 
 /* CPU save/load.  */
@@ -303,6 +309,7 @@ struct qemu_work_item {
     void (*func)(void *data);
     void *data;
     int done;
+    bool free;
 };
 
 #ifdef CONFIG_USER_ONLY
@@ -360,6 +367,7 @@ void qemu_iovec_memset_skip(QEMUIOVector *qiov, int c, size_t count,
                             size_t skip);
 
 bool buffer_is_zero(const void *buf, size_t len);
+bool test_buffer_is_zero_next_accel(void);
 
 void qemu_progress_init(int enabled, float min_skip);
 void qemu_progress_end(void);
@@ -114,6 +114,19 @@ static QemuOptsList qemu_drive_opts = {
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
             .help = "copy read data from backing file into image file",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_STRING,
+            .help = "maximum L2 table cache size in bytes, or \"full\"",
+        },{
+            .name = "refcount-cache-size",
+            .type = QEMU_OPT_STRING,
+            .help = "maximum refcount block cache size in bytes, or \"full\"",
+        },{
+            .name = "cluster-reservation",
+            .type = QEMU_OPT_SIZE,
+            .help = "reserve image file space for new clusters in chunks "
+                    "of this size",
         },
         { /* end of list */ }
     },
@@ -567,6 +580,10 @@ static QemuOptsList qemu_machine_opts = {
             .name = "kvm_shadow_mem",
             .type = QEMU_OPT_SIZE,
             .help = "KVM shadow MMU size",
+        }, {
+            .name = "tcg_threads",
+            .type = QEMU_OPT_STRING,
+            .help = "host threads for the TCG vCPUs (single or multi)",
         }, {
             .name = "kernel",
             .type = QEMU_OPT_STRING,
@@ -85,6 +85,11 @@ static void help(void)
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
            "\n"
+           "Parameters to convert subcommand:\n"
+           "  '-m' specifies how many coroutines work in parallel during the convert\n"
+           "       process (defaults to 8)\n"
+           "  '-W' allow to write to the target out of order rather than sequential\n"
+           "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
            "       '-r leaks' repairs only cluster leaks, whereas '-r all' fixes all\n"
@@ -379,7 +384,7 @@ static int img_check(int argc, char **argv)
     BlockDriverState *bs;
     BdrvCheckResult result;
     int fix = 0;
-    int flags = BDRV_O_FLAGS;
+    int flags = BDRV_O_FLAGS | BDRV_O_CHECK;
 
     fmt = NULL;
     for(;;) {
@@ -651,25 +656,409 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 }
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
+#define MAX_COROUTINES 16
+
+enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+};
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    enum ImgConvertBlockStatus status;
+    int64_t sector_next_status;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool compressed;
+    bool target_has_backing;
+    bool wr_in_order;
+    int min_sparse;
+    int cluster_sectors;
+    int buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int64_t sector_num;
+    int64_t wr_offs;
+    int ret;
+} ImgConvertState;
+
+/*
+ * Returns the index of the source image that contains sector_num and stores
+ * the first sector of that image (in the concatenated address space) in
+ * *src_offset.
+ */
+static int convert_find_src(ImgConvertState *s, int64_t sector_num,
+                            int64_t *src_offset)
+{
+    int src_cur = 0;
+
+    *src_offset = 0;
+    while (sector_num - *src_offset >= s->src_sectors[src_cur]) {
+        *src_offset += s->src_sectors[src_cur];
+        src_cur++;
+        assert(src_cur < s->src_num);
+    }
+
+    return src_cur;
+}
+
+/*
+ * Decides how many sectors starting at sector_num are handled as one chunk and
+ * leaves their allocation status in s->status.  The status is queried for as
+ * large a range as the driver will report at once and reused for the following
+ * chunks, so that walking a sparse image does not cost one call per chunk.
+ *
+ * Must be called with s->lock held.
+ */
+static int coroutine_fn convert_iteration_sectors(ImgConvertState *s,
+                                                  int64_t sector_num)
+{
+    int64_t src_cur_offset;
+    int src_cur, n;
+
+    src_cur = convert_find_src(s, sector_num, &src_cur_offset);
+
+    if (sector_num >= s->sector_next_status) {
+        BlockDriverState *src = s->src[src_cur];
+        int64_t src_sector = sector_num - src_cur_offset;
+        int count, pnum, ret;
+
+        count = MIN(s->src_sectors[src_cur] - src_sector,
+                    INT_MAX / BDRV_SECTOR_SIZE);
+
+        if (s->target_has_backing) {
+            /* Anything that is unallocated in the top layer comes from the
+             * backing file, which the output image shares */
+            ret = bdrv_co_is_allocated(src, src_sector, count, &pnum);
+            s->status = ret ? BLK_DATA : BLK_BACKING_FILE;
+        } else {
+            /* Unallocated in the whole chain reads as zeros */
+            ret = bdrv_co_is_allocated_above(src, NULL, src_sector, count,
+                                             &pnum);
+            s->status = ret ? BLK_DATA : BLK_ZERO;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        if (pnum == 0) {
+            /* No status to go by, so read the data to be safe */
+            s->status = BLK_DATA;
+            pnum = MIN(count, s->buf_sectors);
+        }
+        s->sector_next_status = sector_num + pnum;
+    }
+
+    n = MIN(s->total_sectors - sector_num,
+            s->sector_next_status - sector_num);
+    if (s->status == BLK_DATA || (s->status == BLK_ZERO && !s->has_zero_init)) {
+        n = MIN(n, s->buf_sectors);
+    } else {
+        n = MIN(n, INT_MAX / BDRV_SECTOR_SIZE);
+    }
+
+    /* Compressed output is written in whole clusters, so every chunk must
+     * start on a cluster boundary */
+    if (s->compressed) {
+        if (n < s->cluster_sectors) {
+            n = MIN(s->cluster_sectors, s->total_sectors - sector_num);
+            s->status = BLK_DATA;
+        } else {
+            n = n - n % s->cluster_sectors;
+        }
+    }
+
+    assert(n > 0);
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        QEMUIOVector qiov;
+        struct iovec iov;
+        int64_t src_cur_offset;
+        int src_cur;
+
+        src_cur = convert_find_src(s, sector_num, &src_cur_offset);
+        n = MIN(nb_sectors,
+                s->src_sectors[src_cur] - (sector_num - src_cur_offset));
+
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[src_cur], sector_num - src_cur_offset,
+                            n, &qiov);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
+{
+    int ret;
+
+    while (nb_sectors > 0) {
+        QEMUIOVector qiov;
+        struct iovec iov;
+        int n = nb_sectors;
+
+        switch (status) {
+        case BLK_BACKING_FILE:
+            /* Leave the range unallocated so that the output image shows the
+             * same data from its backing file */
+            assert(s->target_has_backing);
+            break;
+
+        case BLK_DATA:
+            if (s->compressed) {
+                int cluster_size = s->cluster_sectors * BDRV_SECTOR_SIZE;
+
+                if (n < s->cluster_sectors) {
+                    memset(buf + n * BDRV_SECTOR_SIZE, 0,
+                           cluster_size - n * BDRV_SECTOR_SIZE);
+                } else {
+                    n = s->cluster_sectors;
+                }
+                if (s->target_has_backing ||
+                    !buffer_is_zero(buf, cluster_size)) {
+                    ret = bdrv_write_compressed(s->target, sector_num, buf,
+                                                s->cluster_sectors);
+                    if (ret < 0) {
+                        return ret;
+                    }
+                }
+                break;
+            }
+
+            /* If the output image is being created as a copy on write image,
+               copy all sectors even the ones containing only NUL bytes,
+               because they may differ from the sectors in the base image.
+
+               If the output is to a host device, we also write out
+               sectors that are entirely 0, since whatever data was
+               already there is garbage, not 0s. */
+            if (!s->has_zero_init || s->target_has_backing ||
+                is_allocated_sectors_min(buf, n, &n, s->min_sparse)) {
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            break;
+
+        case BLK_ZERO:
+            if (s->has_zero_init) {
+                break;
+            }
+            ret = bdrv_co_write_zeroes(s->target, sector_num, n);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        enum ImgConvertBlockStatus status;
+        int64_t sector_num;
+        int n;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", s->sector_num, strerror(-n));
+            s->ret = n;
+            break;
+        }
+        /* Claim the chunk before dropping the lock */
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+                break;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* Wait until all chunks before this one have been written */
+            while (s->wr_offs != sector_num) {
+                if (s->ret != -EINPROGRESS) {
+                    goto out;
+                }
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, status);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64
+                         ": %s", sector_num, strerror(-ret));
+            s->ret = ret;
+            break;
+        }
+
+        if (s->wr_in_order) {
+            /* Hand over to the coroutine holding the next chunk.  It cannot
+             * enter us back because our wait_sector_num is -1 now. */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+
+        qemu_progress_print(100.0f * n / s->total_sectors, 100);
+    }
+
+out:
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->wait_sector_num[index] = -1;
+    s->running_coroutines--;
+
+    if (s->ret == -EINPROGRESS) {
+        if (!s->running_coroutines) {
+            s->ret = 0;
+        }
+    } else if (s->ret < 0) {
+        /* On error, let the coroutines waiting for their turn exit too */
+        for (i = 0; i < s->num_coroutines; i++) {
+            if (s->co[i] && s->wait_sector_num[i] != -1) {
+                qemu_coroutine_enter(s->co[i], NULL);
+            }
+        }
+    }
+}
+
+/*
+ * Copies the sources to the target with s->num_coroutines requests in flight.
+ * Each coroutine claims the next chunk, reads it while the others are busy
+ * and then writes it, in order unless s->wr_in_order is false.
+ */
+static int convert_do_copy(ImgConvertState *s)
+{
+    int i;
+
+    s->buf_sectors = IO_BUF_SIZE / BDRV_SECTOR_SIZE;
+    if (s->compressed) {
+        assert(s->cluster_sectors > 0 &&
+               s->buf_sectors % s->cluster_sectors == 0);
+    }
+
+    s->sector_num = 0;
+    s->sector_next_status = 0;
+    s->wr_offs = 0;
+    s->running_coroutines = 0;
+    s->ret = -EINPROGRESS;
+    qemu_co_mutex_init(&s->lock);
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], s);
+        }
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    if (s->ret == 0 && s->compressed) {
+        /* signal EOF to align */
+        s->ret = bdrv_write_compressed(s->target, 0, NULL, 0);
+    }
+
+    return s->ret;
+}
 
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, bs_n, bs_i, compress, cluster_size;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
-    uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
+    int64_t total_sectors;
+    int64_t *bs_sectors = NULL;
+    uint64_t sectors;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
     const char *snapshot_name = NULL;
-    float local_progress;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = 8;
+    bool wr_in_order = true;
+    ImgConvertState state;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -677,7 +1066,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:m:W");
         if (c == -1) {
             break;
         }
@@ -731,6 +1120,22 @@ static int img_convert(int argc, char **argv)
         case 't':
             cache = optarg;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -749,6 +1154,13 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
+    if (compress && !wr_in_order) {
+        error_report("Out of order write and compress are mutually "
+                     "exclusive");
+        ret = -1;
+        goto out;
+    }
+
     if (bs_n > 1 && out_baseimg) {
         error_report("-B makes no sense when concatenating multiple input "
                      "images");
@@ -759,6 +1171,7 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
+    bs_sectors = g_malloc0(bs_n * sizeof(int64_t));
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
@@ -768,8 +1181,9 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        bdrv_get_geometry(bs[bs_i], &bs_sectors);
-        total_sectors += bs_sectors;
+        bdrv_get_geometry(bs[bs_i], &sectors);
+        bs_sectors[bs_i] = sectors;
+        total_sectors += sectors;
     }
 
     if (snapshot_name != NULL) {
@@ -887,10 +1301,7 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
+    memset(&state, 0, sizeof(state));
 
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
@@ -904,168 +1315,27 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, cluster_sectors));
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            }
-            if (!buffer_is_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
+        state.cluster_sectors = cluster_size >> BDRV_SECTOR_BITS;
+    }
 
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
+    state.src = bs;
+    state.src_sectors = bs_sectors;
+    state.src_num = bs_n;
+    state.total_sectors = total_sectors;
+    state.target = out_bs;
+    state.has_zero_init = bdrv_has_zero_init(out_bs);
+    state.compressed = compress;
+    state.target_has_backing = !!out_baseimg;
+    state.wr_in_order = wr_in_order;
+    state.min_sparse = min_sparse;
+    state.num_coroutines = num_coroutines;
 
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
+    ret = convert_do_copy(&state);
 
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
-    }
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_vfree(buf);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
@@ -1077,6 +1347,7 @@ out:
         }
         g_free(bs);
     }
+    g_free(bs_sectors);
     if (ret) {
         return 1;
     }
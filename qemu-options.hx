@@ -33,7 +33,9 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                property accel=accel1[:accel2[:...]] selects accelerator\n"
     "                supported accelerators are kvm, xen, tcg (default: tcg)\n"
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
-    "                kvm_shadow_mem=size of KVM shadow MMU\n",
+    "                kvm_shadow_mem=size of KVM shadow MMU\n"
+    "                tcg_threads=single|multi runs all TCG vCPUs on one host\n"
+    "                thread (default) or each on its own thread\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -50,6 +52,11 @@ to initialize.
 Enables in-kernel irqchip support for the chosen accelerator when available.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item tcg_threads=single|multi
+With @code{single} (the default), one host thread runs all the virtual CPUs
+of the TCG accelerator in turn.  With @code{multi}, each virtual CPU runs on
+its own host thread.  @code{multi} is only available for x86 guests on x86
+Linux hosts, and cannot be combined with @option{-icount}.
 @end table
 ETEXI
 
@@ -142,6 +149,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,l2-cache-size=size|full][,refcount-cache-size=size|full]\n"
+    "       [,cluster-reservation=size]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
@@ -196,6 +205,15 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item l2-cache-size=@var{size},refcount-cache-size=@var{size}
+Set how much memory the format driver may use to cache L2 tables and refcount
+blocks (qcow2 only).  @var{size} is in bytes and accepts the usual k, M, G
+suffixes; "full" sizes the cache so that the metadata of the whole image fits.
+@item cluster-reservation=@var{size}
+Allocate new data clusters from a reservation of @var{size} bytes of the image
+file (qcow2 only).  The reservation is taken in one refcount update and, where
+the host supports it, with one fallocate call, so that allocating writes
+within it only need to update the L2 table.  Off by default.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -231,6 +249,16 @@ Copy-on-read avoids accessing the same backing file sectors repeatedly and is
 useful when the backing file is over a slow network.  By default copy-on-read
 is off.
 
+qcow2 keeps 16 L2 tables and 4 refcount blocks in memory by default, which
+with 64k clusters covers 8 GB of guest disk.  Random I/O spread over a larger
+image keeps re-reading L2 tables from the image; @option{l2-cache-size=full}
+avoids that at the cost of one cluster of memory per 8192 clusters of disk.
+
+With @option{cluster-reservation}, the unused rest of the current reservation
+is given back when the image is closed.  If QEMU does not exit cleanly, it
+shows up as leaked clusters in @command{qemu-img check}, which
+@command{qemu-img check -r leaks} repairs.  Guest data is not affected.
+
 Instead of @option{-cdrom} you can use:
 @example
 qemu-system-i386 -drive file=file,index=2,media=cdrom
@@ -282,6 +282,10 @@ static const QErrorStringTable qerror_table[] = {
         .error_fmt = QERR_SET_PASSWD_FAILED,
         .desc      = "Could not set password",
     },
+    {
+        .error_fmt = QERR_SNAPSHOT_ACTIVE,
+        .desc      = "A snapshot is being saved in the background",
+    },
     {
         .error_fmt = QERR_TOO_MANY_FILES,
         .desc      = "Too many open files",
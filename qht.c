@@ -0,0 +1,330 @@
+/*
+ * QHT: resizable hash table with cache-line sized buckets
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qht.h"
+
+#define QHT_BUCKET_ALIGN 64
+
+/* Fill a 64-byte cache line with hashes, pointers and the chain link */
+#if HOST_LONG_BITS == 32
+#define QHT_BUCKET_ENTRIES 6
+#else
+#define QHT_BUCKET_ENTRIES 4
+#endif
+
+/*
+ * Entries are kept packed: within a chain, all used slots come before
+ * the first empty one.  This lets lookups stop at the first NULL pointer.
+ */
+typedef struct QHTBucket QHTBucket;
+
+struct QHTBucket {
+    uint32_t hashes[QHT_BUCKET_ENTRIES];
+    void *pointers[QHT_BUCKET_ENTRIES];
+    QHTBucket *next;
+} __attribute__((aligned(QHT_BUCKET_ALIGN)));
+
+struct QHTMap {
+    QHTBucket *buckets;
+    size_t n_buckets;
+};
+
+static size_t qht_elems_to_buckets(size_t n_elems)
+{
+    size_t n_buckets = 1;
+
+    while (n_buckets * QHT_BUCKET_ENTRIES < n_elems) {
+        n_buckets <<= 1;
+    }
+    return n_buckets;
+}
+
+static QHTBucket *qht_bucket_new(void)
+{
+    QHTBucket *b = qemu_memalign(QHT_BUCKET_ALIGN, sizeof(*b));
+
+    memset(b, 0, sizeof(*b));
+    return b;
+}
+
+static QHTMap *qht_map_create(size_t n_buckets)
+{
+    QHTMap *map = g_malloc(sizeof(*map));
+
+    map->n_buckets = n_buckets;
+    map->buckets = qemu_memalign(QHT_BUCKET_ALIGN,
+                                 sizeof(QHTBucket) * n_buckets);
+    memset(map->buckets, 0, sizeof(QHTBucket) * n_buckets);
+    return map;
+}
+
+/* Free the overflow buckets chained to @head, but not @head itself */
+static void qht_chain_destroy(QHTBucket *head)
+{
+    QHTBucket *b = head->next;
+
+    while (b) {
+        QHTBucket *next = b->next;
+
+        qemu_vfree(b);
+        b = next;
+    }
+    head->next = NULL;
+}
+
+static void qht_map_destroy(QHTMap *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        qht_chain_destroy(&map->buckets[i]);
+    }
+    qemu_vfree(map->buckets);
+    g_free(map);
+}
+
+static inline QHTBucket *qht_map_to_bucket(QHTMap *map, uint32_t hash)
+{
+    return &map->buckets[hash & (map->n_buckets - 1)];
+}
+
+void qht_init(QHT *ht, size_t n_elems, unsigned int mode)
+{
+    ht->mode = mode;
+    ht->n_entries = 0;
+    ht->map = qht_map_create(qht_elems_to_buckets(n_elems));
+}
+
+void qht_destroy(QHT *ht)
+{
+    qht_map_destroy(ht->map);
+    ht->map = NULL;
+    ht->n_entries = 0;
+}
+
+void qht_reset(QHT *ht)
+{
+    QHTMap *map = ht->map;
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        qht_chain_destroy(&map->buckets[i]);
+    }
+    memset(map->buckets, 0, sizeof(QHTBucket) * map->n_buckets);
+    ht->n_entries = 0;
+}
+
+/* Returns false if @p is already present in @map */
+static bool qht_map_insert(QHTMap *map, void *p, uint32_t hash)
+{
+    QHTBucket *b = qht_map_to_bucket(map, hash);
+    QHTBucket *prev = NULL;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == NULL) {
+                goto found;
+            }
+            if (b->pointers[i] == p) {
+                return false;
+            }
+        }
+        prev = b;
+        b = b->next;
+    } while (b);
+
+    /* the whole chain is full, append an overflow bucket */
+    b = qht_bucket_new();
+    prev->next = b;
+    i = 0;
+
+ found:
+    b->hashes[i] = hash;
+    b->pointers[i] = p;
+    return true;
+}
+
+static void qht_do_resize(QHT *ht, size_t n_buckets)
+{
+    QHTMap *old = ht->map;
+    QHTMap *new = qht_map_create(n_buckets);
+    size_t i;
+
+    for (i = 0; i < old->n_buckets; i++) {
+        QHTBucket *b = &old->buckets[i];
+        int j;
+
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                qht_map_insert(new, b->pointers[j], b->hashes[j]);
+            }
+            b = b->next;
+        } while (b);
+    }
+    ht->map = new;
+    qht_map_destroy(old);
+}
+
+bool qht_resize(QHT *ht, size_t n_elems)
+{
+    size_t n_buckets = qht_elems_to_buckets(n_elems);
+
+    if (n_buckets == ht->map->n_buckets) {
+        return false;
+    }
+    qht_do_resize(ht, n_buckets);
+    return true;
+}
+
+bool qht_insert(QHT *ht, void *p, uint32_t hash)
+{
+    assert(p);
+    if (!qht_map_insert(ht->map, p, hash)) {
+        return false;
+    }
+    ht->n_entries++;
+    if ((ht->mode & QHT_MODE_AUTO_RESIZE) &&
+        ht->n_entries > ht->map->n_buckets * QHT_BUCKET_ENTRIES / 2) {
+        qht_do_resize(ht, ht->map->n_buckets * 2);
+    }
+    return true;
+}
+
+void *qht_lookup(QHT *ht, QHTLookupFunc func, const void *userp,
+                 uint32_t hash)
+{
+    QHTBucket *b = qht_map_to_bucket(ht->map, hash);
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            void *p = b->pointers[i];
+
+            if (p == NULL) {
+                return NULL;
+            }
+            if (b->hashes[i] == hash && func(p, userp)) {
+                return p;
+            }
+        }
+        b = b->next;
+    } while (b);
+    return NULL;
+}
+
+/*
+ * Fill slot @pos of @orig with the last entry of the chain that @orig
+ * belongs to, so that the chain stays packed.
+ */
+static void qht_bucket_remove_entry(QHTBucket *orig, int pos)
+{
+    QHTBucket *b = orig;
+    QHTBucket *prev = NULL;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == NULL) {
+                goto found;
+            }
+        }
+        prev = b;
+        b = b->next;
+    } while (b);
+
+ found:
+    /* the last used slot is the one just before the first free slot */
+    if (b == NULL || i == 0) {
+        b = prev;
+        i = QHT_BUCKET_ENTRIES;
+    }
+    i--;
+    orig->hashes[pos] = b->hashes[i];
+    orig->pointers[pos] = b->pointers[i];
+    b->hashes[i] = 0;
+    b->pointers[i] = NULL;
+}
+
+bool qht_remove(QHT *ht, const void *p, uint32_t hash)
+{
+    QHTBucket *b = qht_map_to_bucket(ht->map, hash);
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == p) {
+                assert(b->hashes[i] == hash);
+                qht_bucket_remove_entry(b, i);
+                ht->n_entries--;
+                return true;
+            }
+            if (b->pointers[i] == NULL) {
+                return false;
+            }
+        }
+        b = b->next;
+    } while (b);
+    return false;
+}
+
+void qht_iter(QHT *ht, QHTIterFunc func, void *userp)
+{
+    QHTMap *map = ht->map;
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b = &map->buckets[i];
+        int j;
+
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                func(b->pointers[j], b->hashes[j], userp);
+            }
+            b = b->next;
+        } while (b);
+    }
+}
+
+void qht_statistics(QHT *ht, QHTStats *stats)
+{
+    QHTMap *map = ht->map;
+    size_t i;
+
+    stats->head_buckets = map->n_buckets;
+    stats->used_head_buckets = 0;
+    stats->entries = 0;
+    stats->chain_buckets = 0;
+    stats->max_chain = 0;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b = &map->buckets[i];
+        size_t chain = 0;
+
+        if (b->pointers[0] == NULL) {
+            continue;
+        }
+        stats->used_head_buckets++;
+        do {
+            int j;
+
+            if (b->pointers[0] == NULL) {
+                break;
+            }
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                stats->entries++;
+            }
+            chain++;
+            b = b->next;
+        } while (b);
+        stats->chain_buckets += chain;
+        if (chain > stats->max_chain) {
+            stats->max_chain = chain;
+        }
+    }
+}
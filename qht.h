@@ -0,0 +1,99 @@
+/*
+ * QHT: resizable hash table with cache-line sized buckets
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#ifndef QEMU_QHT_H
+#define QEMU_QHT_H
+
+#include "qemu-common.h"
+
+/*
+ * The table stores opaque non-NULL pointers together with a 32-bit hash
+ * computed by the caller.  Each bucket holds a few (hash, pointer) pairs
+ * and fits in a host cache line, so a lookup usually touches a single
+ * line and only calls the comparison function for entries whose hash
+ * matches.  Buckets that fill up are chained to overflow buckets.
+ *
+ * The table is not thread safe; callers serialize all accesses.  The
+ * translated block hash relies on tb_lock for this.
+ */
+
+/* Double the number of buckets when the table is half full */
+#define QHT_MODE_AUTO_RESIZE 0x1
+
+typedef struct QHTMap QHTMap;
+
+typedef struct QHT {
+    QHTMap *map;
+    size_t n_entries;
+    unsigned int mode;
+} QHT;
+
+typedef struct QHTStats {
+    size_t head_buckets;        /* number of buckets in the table */
+    size_t used_head_buckets;   /* buckets holding at least one entry */
+    size_t entries;
+    size_t chain_buckets;       /* non-empty buckets, overflow included */
+    size_t max_chain;           /* longest chain of non-empty buckets */
+} QHTStats;
+
+/* Return true if @obj is the object described by @userp */
+typedef bool (*QHTLookupFunc)(const void *obj, const void *userp);
+typedef void (*QHTIterFunc)(void *obj, uint32_t hash, void *userp);
+
+/**
+ * qht_init: initialize a table sized for about @n_elems entries
+ */
+void qht_init(QHT *ht, size_t n_elems, unsigned int mode);
+
+/**
+ * qht_destroy: free the table.  The stored objects are not freed.
+ */
+void qht_destroy(QHT *ht);
+
+/**
+ * qht_reset: remove all entries, keeping the current size
+ */
+void qht_reset(QHT *ht);
+
+/**
+ * qht_resize: rehash the table to hold about @n_elems entries
+ *
+ * Returns true if the number of buckets changed.
+ */
+bool qht_resize(QHT *ht, size_t n_elems);
+
+/**
+ * qht_insert: add @p with hash @hash
+ *
+ * Returns false if @p is already in the table.
+ */
+bool qht_insert(QHT *ht, void *p, uint32_t hash);
+
+/**
+ * qht_lookup: find the first entry with hash @hash for which
+ * @func(entry, @userp) returns true
+ *
+ * Returns the entry, or NULL if none matches.
+ */
+void *qht_lookup(QHT *ht, QHTLookupFunc func, const void *userp,
+                 uint32_t hash);
+
+/**
+ * qht_remove: remove @p, which was inserted with hash @hash
+ *
+ * Returns false if @p is not in the table.
+ */
+bool qht_remove(QHT *ht, const void *p, uint32_t hash);
+
+/**
+ * qht_iter: call @func on every entry.  @func must not modify the table.
+ */
+void qht_iter(QHT *ht, QHTIterFunc func, void *userp);
+
+void qht_statistics(QHT *ht, QHTStats *stats);
+
+#endif
@@ -542,6 +542,147 @@ Example:
 -> { "execute": "migrate_set_speed", "arguments": { "value": 1024 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-set-cache-size",
+        .args_type  = "value:o",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_cache_size,
+    },
+
+SQMP
+migrate-set-cache-size
+----------------------
+
+Set cache size to be used by XBZRLE migration, the cache size will be rounded
+down to the nearest power of 2
+
+Arguments:
+
+- "value": cache size in bytes (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-cache-size", "arguments": { "value": 536870912 } }
+<- { "return": {} }
+
+EQMP
+    {
+        .name       = "query-migrate-cache-size",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_cache_size,
+    },
+
+SQMP
+query-migrate-cache-size
+------------------------
+
+Show cache size to be used by XBZRLE migration
+
+returns a json-object with the following information:
+- "size" : json-int
+
+Example:
+
+-> { "execute": "query-migrate-cache-size" }
+<- { "return": 67108864 }
+
+EQMP
+
+    {
+        .name       = "migrate-set-multifd-channels",
+        .args_type  = "value:i",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_multifd_channels,
+    },
+
+SQMP
+migrate-set-multifd-channels
+----------------------------
+
+Set the number of connections used for RAM pages when the "multifd"
+capability is on.
+
+Arguments:
+
+- "value": number of channels, between 1 and 16 (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-multifd-channels", "arguments": { "value": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-migrate-multifd-channels",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_multifd_channels,
+    },
+
+SQMP
+query-migrate-multifd-channels
+------------------------------
+
+Show the number of connections used for RAM pages by multifd migration
+
+Example:
+
+-> { "execute": "query-migrate-multifd-channels" }
+<- { "return": 2 }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  = "compress-level:i?,compress-threads:i?,decompress-threads:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration tunables.  Parameters that are not given keep their value.
+
+Arguments:
+
+- "compress-level": zlib level of the "compress" capability, between 0 and 9
+  (json-int, optional)
+- "compress-threads": number of compression threads, between 1 and 255
+  (json-int, optional)
+- "decompress-threads": number of decompression threads on the destination,
+  between 1 and 255 (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate-set-parameters",
+     "arguments": { "compress-level": 6, "compress-threads": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
+SQMP
+query-migrate-parameters
+------------------------
+
+Show migration tunables
+
+- "compress-level": zlib level of the "compress" capability (json-int)
+- "compress-threads": number of compression threads (json-int)
+- "decompress-threads": number of decompression threads (json-int)
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- { "return": { "compress-level": 1, "compress-threads": 8,
+                 "decompress-threads": 2 } }
+
 EQMP
 
     {
@@ -1401,6 +1542,15 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "l2_cache_hits": L2 table lookups served from the format driver's
+                       metadata cache (json-int, optional)
+    - "l2_cache_misses": L2 tables read from the image (json-int, optional)
+    - "refcount_cache_hits": refcount block lookups served from the
+                             metadata cache (json-int, optional)
+    - "refcount_cache_misses": refcount blocks read from the image
+                               (json-int, optional)
+    The four cache counters are only present for formats that keep a
+    metadata cache, such as qcow2.
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1435,7 +1585,11 @@ Example:
                "flush_operations":51,
                "wr_total_times_ns":313253456
                "rd_total_times_ns":3465673657
-               "flush_total_times_ns":49653
+               "flush_total_times_ns":49653,
+               "l2_cache_hits":73142,
+               "l2_cache_misses":118,
+               "refcount_cache_hits":1023,
+               "refcount_cache_misses":7
             }
          },
          {
@@ -2064,17 +2218,51 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "active", "completed", "failed", "cancelled"
-- "ram": only present if "status" is "active", it is a json-object with the
-  following RAM information (in bytes):
+     - Possible values: "active", "postcopy-active", "completed", "failed",
+       "cancelled"
+- "ram": only present if "status" is "active" or "postcopy-active", it is a
+  json-object with the following RAM information (in bytes):
          - "transferred": amount transferred (json-int)
          - "remaining": amount remaining (json-int)
          - "total": total (json-int)
+         - "dirty-pages-rate": pages dirtied per second (json-int, optional)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information (in bytes):
          - "transferred": amount transferred (json-int)
          - "remaining": amount remaining (json-int)
          - "total": total (json-int)
+- "xbzrle-cache": only present if XBZRLE is active.
+  It is a json-object with the following XBZRLE information:
+         - "cache-size": XBZRLE cache size
+         - "bytes": total XBZRLE bytes transferred
+         - "pages": number of XBZRLE compressed pages
+         - "cache-miss": number of cache misses
+         - "overflow": number of XBZRLE overflows
+- "cpu-throttle-percentage": only present if auto-converge is slowing the
+  vCPUs down, percentage of time they are kept from running (json-int)
+- "total-time": milliseconds since the migration started, or that it took
+  once completed (json-int)
+- "expected-downtime": only present if "status" is "active", milliseconds
+  the guest would be stopped if the migration completed now (json-int)
+- "downtime": only present if "status" is "postcopy-active" or
+  "completed", milliseconds the guest was stopped (json-int)
+- "phases": present along with "downtime", it is a json-object with the
+  time spent in each phase of the migration (in microseconds):
+         - "setup": connecting and starting the migration (json-int)
+         - "iterate": sending RAM and disks while the guest runs (json-int)
+         - "stop": stopping the guest and finishing other live state
+           (json-int)
+         - "ram": final pass over RAM (json-int)
+         - "block": final pass of block migration (json-int)
+         - "devices": saving device state (json-int)
+         - "flush": sending the data still buffered (json-int)
+  "stop", "ram", "block", "devices" and "flush" add up to the downtime
+- "iterations": json-array of the last passes over RAM, oldest first; each
+  one is a json-object with:
+         - "duration": length of the pass in milliseconds (json-int)
+         - "transferred": bytes sent during the pass (json-int)
+         - "dirty-pages": pages dirtied again during the pass (json-int)
+         - "bandwidth": bytes per second sent during the pass (json-int)
 
 Examples:
 
@@ -2086,7 +2274,28 @@ Examples:
 2. Migration is done and has succeeded
 
 -> { "execute": "query-migrate" }
-<- { "return": { "status": "completed" } }
+<- {
+      "return":{
+         "status":"completed",
+         "total-time":12245,
+         "downtime":142,
+         "phases":{
+            "setup":1632,
+            "iterate":12101302,
+            "stop":2115,
+            "ram":98437,
+            "block":3,
+            "devices":21604,
+            "flush":19893
+         },
+         "iterations":[
+            { "duration":11342, "transferred":1073741824,
+              "dirty-pages":20871, "bandwidth":94668105 },
+            { "duration":759, "transferred":85487616,
+              "dirty-pages":1032, "bandwidth":112632959 }
+         ]
+      }
+   }
 
 3. Migration is done and has failed
 
@@ -2126,6 +2335,28 @@ Examples:
       }
    }
 
+6. Migration is being performed and XBZRLE is active:
+
+-> { "execute": "query-migrate" }
+<- {
+      "return":{
+         "status":"active",
+         "capabilities" : [ { "capability": "xbzrle", "state" : true } ],
+         "ram":{
+            "total":1057024,
+            "remaining":1053304,
+            "transferred":3720
+         },
+         "xbzrle-cache":{
+            "cache-size":67108864,
+            "bytes":20971520,
+            "pages":2444343,
+            "cache-miss":2244,
+            "overflow":34434
+         }
+      }
+   }
+
 EQMP
 
     {
@@ -2134,6 +2365,93 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate,
     },
 
+SQMP
+query-vmstate-times
+-------------------
+
+Time spent on the state of each device by the last migration: saving it
+on the source once the guest was stopped, loading it on the destination.
+
+Return a json-array of json-objects with:
+
+- "name": name of the state section (json-string)
+- "instance-id": instance of the section (json-int)
+- "section-id": id of the section in the migration stream, as used by the
+  savevm and vmstate trace events (json-int)
+- "save-time": microseconds spent saving it (json-int)
+- "load-time": microseconds spent loading it; for RAM and disks this covers
+  the whole migration (json-int)
+
+Example:
+
+-> { "execute": "query-vmstate-times" }
+<- { "return": [ { "name": "ram", "instance-id": 0, "section-id": 3,
+                   "save-time": 98437, "load-time": 0 },
+                 { "name": "cpu", "instance-id": 0, "section-id": 5,
+                   "save-time": 35, "load-time": 0 } ] }
+
+EQMP
+
+    {
+        .name       = "query-vmstate-times",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_vmstate_times,
+    },
+
+SQMP
+migrate-set-capabilities
+------------------------
+
+Enable/Disable migration capabilities
+
+- "xbzrle": XBZRLE support
+- "multifd": send RAM pages over several connections
+- "postcopy": start the guest on the destination early, and send it the
+  remaining pages on demand
+- "auto-converge": throttle the vCPUs if the guest dirties memory faster
+  than it is migrated
+- "compress": compress pages with zlib on several threads
+
+Arguments:
+
+Example:
+
+-> { "execute": "migrate-set-capabilities" , "arguments":
+     { "capabilities": [ { "capability": "xbzrle", "state": true } ] } }
+
+EQMP
+
+    {
+        .name       = "migrate-set-capabilities",
+        .args_type  = "capabilities:O",
+        .params     = "capability:s,state:b",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_capabilities,
+    },
+SQMP
+query-migrate-capabilities
+--------------------------
+
+Query current migration capabilities
+
+- "capabilities": migration capabilities state
+         - "xbzrle" : XBZRLE state (json-bool)
+         - "multifd" : multifd state (json-bool)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-capabilities" }
+<- { "return": [ { "state": false, "capability": "xbzrle" } ] }
+
+EQMP
+
+    {
+        .name       = "query-migrate-capabilities",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
+    },
+
 SQMP
 query-balloon
 -------------
@@ -85,6 +85,8 @@
 #include "cpus.h"
 #include "memory.h"
 #include "qmp-commands.h"
+#include "iov.h"
+#include "trace.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -159,9 +161,11 @@ void qemu_announce_self(void)
 /* savevm/loadvm support */
 
 #define IO_BUF_SIZE 32768
+#define MAX_IOV_SIZE 64
 
 struct QEMUFile {
     QEMUFilePutBufferFunc *put_buffer;
+    QEMUFileWritevBufferFunc *writev_buffer;
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
     QEMUFileRateLimit *rate_limit;
@@ -176,6 +180,11 @@ struct QEMUFile {
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
 
+    /* with writev_buffer, what goes out on the next flush: pieces of buf
+       and the memory queued by qemu_put_buffer_async */
+    struct iovec iov[MAX_IOV_SIZE];
+    unsigned int iovcnt;
+
     int last_error;
 };
 
@@ -389,8 +398,10 @@ fail:
 static int block_put_buffer(void *opaque, const uint8_t *buf,
                            int64_t pos, int size)
 {
-    bdrv_save_vmstate(opaque, buf, pos, size);
-    return size;
+    int ret;
+
+    ret = bdrv_save_vmstate(opaque, buf, pos, size);
+    return ret < 0 ? ret : size;
 }
 
 static int block_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
@@ -434,6 +445,11 @@ QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
     return f;
 }
 
+void qemu_file_set_writev(QEMUFile *f, QEMUFileWritevBufferFunc *writev_buffer)
+{
+    f->writev_buffer = writev_buffer;
+}
+
 int qemu_file_get_error(QEMUFile *f)
 {
     return f->last_error;
@@ -462,6 +478,23 @@ static void qemu_file_set_if_error(QEMUFile *f, int ret)
  */
 void qemu_fflush(QEMUFile *f)
 {
+    if (f->writev_buffer) {
+        if (f->is_write && f->iovcnt > 0) {
+            int len;
+
+            len = f->writev_buffer(f->opaque, f->iov, f->iovcnt,
+                                   f->buf_offset);
+            if (len > 0) {
+                f->buf_offset += len;
+            } else {
+                qemu_file_set_error(f, -EINVAL);
+            }
+        }
+        f->buf_index = 0;
+        f->iovcnt = 0;
+        return;
+    }
+
     if (!f->put_buffer)
         return;
 
@@ -550,6 +583,47 @@ void qemu_file_put_notify(QEMUFile *f)
     f->put_buffer(f->opaque, NULL, 0, 0);
 }
 
+static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
+{
+    struct iovec *last = f->iovcnt ? &f->iov[f->iovcnt - 1] : NULL;
+
+    /* data written right after the previous piece extends it */
+    if (last && buf == (uint8_t *)last->iov_base + last->iov_len) {
+        last->iov_len += size;
+    } else {
+        f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
+        f->iov[f->iovcnt++].iov_len = size;
+    }
+
+    f->is_write = 1;
+    if (f->iovcnt >= MAX_IOV_SIZE) {
+        qemu_fflush(f);
+    }
+}
+
+/** Queues buf for writing without copying it
+ *
+ * buf is only read on the next flush, and must stay valid until then.
+ * Falls back to qemu_put_buffer() if the file cannot do vectored writes.
+ */
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (!f->writev_buffer) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (!f->last_error && f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
+    }
+
+    if (!f->last_error && size > 0) {
+        add_to_iovec(f, buf, size);
+    }
+}
+
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
 {
     int l;
@@ -569,6 +643,9 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
         f->buf_index += l;
         buf += l;
         size -= l;
+        if (f->writev_buffer) {
+            add_to_iovec(f, f->buf + f->buf_index - l, l);
+        }
         if (f->buf_index >= IO_BUF_SIZE)
             qemu_fflush(f);
     }
@@ -584,6 +661,9 @@ void qemu_put_byte(QEMUFile *f, int v)
 
     f->buf[f->buf_index++] = v;
     f->is_write = 1;
+    if (f->writev_buffer) {
+        add_to_iovec(f, f->buf + f->buf_index - 1, 1);
+    }
     if (f->buf_index >= IO_BUF_SIZE)
         qemu_fflush(f);
 }
@@ -672,6 +752,9 @@ int qemu_get_byte(QEMUFile *f)
 
 int64_t qemu_ftell(QEMUFile *f)
 {
+    if (f->writev_buffer) {
+        return f->buf_offset + iov_size(f->iov, f->iovcnt);
+    }
     return f->buf_offset - f->buf_size + f->buf_index;
 }
 
@@ -1179,6 +1262,9 @@ typedef struct SaveStateEntry {
     CompatEntry *compat;
     int no_migrate;
     int is_ram;
+    /* ns spent in the last completion of a migration, and loading one */
+    int64_t save_time;
+    int64_t load_time;
 } SaveStateEntry;
 
 
@@ -1567,6 +1653,7 @@ int qemu_savevm_state_begin(QEMUFile *f, int blk_enable, int shared)
     int ret;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        se->save_time = 0;
         if(se->set_params == NULL) {
             continue;
 	}
@@ -1647,13 +1734,12 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-int qemu_savevm_state_complete(QEMUFile *f)
+static int qemu_savevm_state_complete_live(QEMUFile *f)
 {
     SaveStateEntry *se;
+    int64_t start;
     int ret;
 
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (se->save_live_state == NULL)
             continue;
@@ -1662,11 +1748,21 @@ int qemu_savevm_state_complete(QEMUFile *f)
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
 
+        start = qemu_get_clock_ns(rt_clock);
         ret = se->save_live_state(f, QEMU_VM_SECTION_END, se->opaque);
+        se->save_time = qemu_get_clock_ns(rt_clock) - start;
+        trace_savevm_section_end(se->section_id, se->save_time);
         if (ret < 0) {
             return ret;
         }
     }
+    return 0;
+}
+
+static void qemu_savevm_state_complete_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
+    int64_t start;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -1674,6 +1770,8 @@ int qemu_savevm_state_complete(QEMUFile *f)
 	if (se->save_state == NULL && se->vmsd == NULL)
 	    continue;
 
+        start = qemu_get_clock_ns(rt_clock);
+
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_FULL);
         qemu_put_be32(f, se->section_id);
@@ -1687,7 +1785,22 @@ int qemu_savevm_state_complete(QEMUFile *f)
         qemu_put_be32(f, se->version_id);
 
         vmstate_save(f, se);
+        se->save_time = qemu_get_clock_ns(rt_clock) - start;
+        trace_vmstate_save(se->section_id, se->instance_id, se->save_time);
+    }
+}
+
+int qemu_savevm_state_complete(QEMUFile *f)
+{
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_state_complete_live(f);
+    if (ret < 0) {
+        return ret;
     }
+    qemu_savevm_state_complete_devices(f);
 
     qemu_put_byte(f, QEMU_VM_EOF);
 
@@ -1705,6 +1818,47 @@ void qemu_savevm_state_cancel(QEMUFile *f)
     }
 }
 
+/*
+ * Time the last qemu_savevm_state_complete spent in the live sections
+ * named idstr, or in device state if idstr is NULL, in ns.
+ */
+int64_t qemu_savevm_complete_time(const char *idstr)
+{
+    SaveStateEntry *se;
+    int64_t total = 0;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (idstr ? se->save_live_state && !strcmp(se->idstr, idstr)
+                  : se->save_live_state == NULL) {
+            total += se->save_time;
+        }
+    }
+    return total;
+}
+
+VMStateTimesList *qmp_query_vmstate_times(Error **errp)
+{
+    VMStateTimesList *head = NULL, *entry;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH_REVERSE(se, &savevm_handlers, savevm_handlers, entry) {
+        if (!se->save_time && !se->load_time) {
+            continue;
+        }
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->name = g_strdup(se->idstr);
+        entry->value->instance_id = se->instance_id;
+        entry->value->section_id = se->section_id;
+        entry->value->save_time = se->save_time / 1000;
+        entry->value->load_time = se->load_time / 1000;
+        entry->next = head;
+        head = entry;
+    }
+
+    return head;
+}
+
 static int qemu_savevm_state(QEMUFile *f)
 {
     int ret;
@@ -1878,14 +2032,20 @@ int qemu_loadvm_state(QEMUFile *f)
     QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
         QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
+    SaveStateEntry *se;
     uint8_t section_type;
     unsigned int v;
+    int64_t start, elapsed;
     int ret;
 
     if (qemu_savevm_state_blocked(NULL)) {
         return -EINVAL;
     }
 
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        se->load_time = 0;
+    }
+
     v = qemu_get_be32(f);
     if (v != QEMU_VM_FILE_MAGIC)
         return -EINVAL;
@@ -1900,7 +2060,6 @@ int qemu_loadvm_state(QEMUFile *f)
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
-        SaveStateEntry *se;
         char idstr[257];
         int len;
 
@@ -1939,7 +2098,11 @@ int qemu_loadvm_state(QEMUFile *f)
             le->version_id = version_id;
             QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
 
+            start = qemu_get_clock_ns(rt_clock);
             ret = vmstate_load(f, le->se, le->version_id);
+            elapsed = qemu_get_clock_ns(rt_clock) - start;
+            se->load_time += elapsed;
+            trace_vmstate_load(section_id, instance_id, elapsed);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
@@ -1961,7 +2124,13 @@ int qemu_loadvm_state(QEMUFile *f)
                 goto out;
             }
 
+            start = qemu_get_clock_ns(rt_clock);
             ret = vmstate_load(f, le->se, le->version_id);
+            elapsed = qemu_get_clock_ns(rt_clock) - start;
+            le->se->load_time += elapsed;
+            if (section_type == QEMU_VM_SECTION_END) {
+                trace_loadvm_section_end(section_id, elapsed);
+            }
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
@@ -2041,6 +2210,178 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
+/*
+ * Background snapshots: the guest is paused only to take the disk
+ * snapshots and to save the device state, in memory.  RAM is saved as it
+ * was then while the guest runs again, into the VM state area of the
+ * current image, and the device state after it.  Once complete, the VM
+ * state is moved to the snapshot.
+ */
+typedef struct BackgroundSnapshot {
+    BlockDriverState *bs;       /* image that gets the VM state */
+    QEMUFile *file;
+    QEMUSnapshotInfo sn;
+    GByteArray *devices;
+    QEMUBH *bh;
+    Error *blocker;
+} BackgroundSnapshot;
+
+static BackgroundSnapshot *background_snapshot;
+
+static int buffer_put_buffer(void *opaque, const uint8_t *buf,
+                             int64_t pos, int size)
+{
+    g_byte_array_append(opaque, buf, size);
+    return size;
+}
+
+/* Delete a snapshot that could not be completed from every image */
+static void background_snapshot_delete(QEMUSnapshotInfo *sn)
+{
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn1;
+
+    if (!sn->id_str[0]) {
+        return;
+    }
+    bs = NULL;
+    while ((bs = bdrv_next(bs))) {
+        if (bdrv_can_snapshot(bs) &&
+            bdrv_snapshot_find(bs, &sn1, sn->id_str) >= 0) {
+            bdrv_snapshot_delete(bs, sn->id_str);
+        }
+    }
+}
+
+static int background_snapshot_complete(BackgroundSnapshot *s)
+{
+    int saved_vm_running;
+    int64_t vm_state_size;
+    int ret;
+
+    ret = qemu_savevm_state_complete_live(s->file);
+    if (ret < 0) {
+        return ret;
+    }
+    qemu_put_buffer(s->file, s->devices->data, s->devices->len);
+
+    vm_state_size = qemu_ftell(s->file);
+    ret = qemu_fclose(s->file);
+    s->file = NULL;
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* this rewrites image metadata, which guest requests must not race */
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+    ret = bdrv_snapshot_take_vmstate(s->bs, s->sn.id_str, vm_state_size);
+    if (saved_vm_running) {
+        vm_start();
+    }
+    return ret;
+}
+
+static void background_snapshot_bh(void *opaque)
+{
+    BackgroundSnapshot *s = opaque;
+    int ret;
+
+    ret = qemu_savevm_state_iterate(s->file);
+    if (ret == 0) {
+        qemu_bh_schedule(s->bh);
+        return;
+    }
+    if (ret > 0) {
+        ret = background_snapshot_complete(s);
+    }
+    if (ret < 0) {
+        error_report("Error %d while saving snapshot '%s' in the background",
+                     ret, s->sn.name);
+        if (s->file) {
+            qemu_savevm_state_cancel(s->file);
+            qemu_fclose(s->file);
+        }
+        background_snapshot_delete(&s->sn);
+    }
+
+    qemu_bh_delete(s->bh);
+    migrate_del_blocker(s->blocker);
+    error_free(s->blocker);
+    g_byte_array_free(s->devices, TRUE);
+    g_free(s);
+    background_snapshot = NULL;
+}
+
+/*
+ * Start a background snapshot, with the guest paused and RAM ready to be
+ * write protected by ram_save_background_prepare().
+ */
+static int background_snapshot_start(Monitor *mon, BlockDriverState *bs,
+                                     QEMUSnapshotInfo *sn)
+{
+    BackgroundSnapshot *s;
+    BlockDriverState *bs1;
+    GByteArray *devices;
+    QEMUFile *f, *df;
+    int ret;
+
+    ret = bdrv_snapshot_discard_vmstate(bs);
+    if (ret < 0) {
+        monitor_printf(mon, "Error %d while preparing '%s' for the VM state\n",
+                       ret, bdrv_get_device_name(bs));
+        return ret;
+    }
+
+    /* the VM state is added to the snapshot once it is saved */
+    sn->vm_state_size = 0;
+    bs1 = NULL;
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bdrv_can_snapshot(bs1)) {
+            ret = bdrv_snapshot_create(bs1, sn);
+            if (ret < 0) {
+                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
+                               bdrv_get_device_name(bs1));
+                goto fail;
+            }
+        }
+    }
+
+    f = qemu_fopen_bdrv(bs, 1);
+    ret = qemu_savevm_state_begin(f, 0, 0);
+    if (ret < 0) {
+        monitor_printf(mon, "Error %d while writing VM\n", ret);
+        qemu_fclose(f);
+        goto fail;
+    }
+
+    /* device state may refer to RAM, so it goes after RAM in the stream */
+    devices = g_byte_array_new();
+    df = qemu_fopen_ops(devices, buffer_put_buffer, NULL, NULL,
+                        NULL, NULL, NULL);
+    cpu_synchronize_all_states();
+    qemu_savevm_state_complete_devices(df);
+    qemu_put_byte(df, QEMU_VM_EOF);
+    qemu_fclose(df);
+
+    s = g_malloc0(sizeof(*s));
+    s->bs = bs;
+    s->file = f;
+    s->sn = *sn;
+    s->devices = devices;
+    s->bh = qemu_bh_new(background_snapshot_bh, s);
+    error_set(&s->blocker, QERR_SNAPSHOT_ACTIVE);
+    migrate_add_blocker(s->blocker);
+    background_snapshot = s;
+
+    qemu_bh_schedule(s->bh);
+    return 0;
+
+fail:
+    background_snapshot_delete(sn);
+    return ret;
+}
+
 void do_savevm(Monitor *mon, const QDict *qdict)
 {
     BlockDriverState *bs, *bs1;
@@ -2057,6 +2398,13 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     struct tm tm;
 #endif
     const char *name = qdict_get_try_str(qdict, "name");
+    int background = qdict_get_try_bool(qdict, "background", 0);
+    Error *err = NULL;
+
+    if (background_snapshot) {
+        monitor_printf(mon, "A snapshot is being saved in the background\n");
+        return;
+    }
 
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
@@ -2079,6 +2427,25 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         return;
     }
 
+    if (background) {
+        if (migration_is_running()) {
+            monitor_printf(mon, "A migration is in progress\n");
+            return;
+        }
+        if (qemu_savevm_state_blocked(&err)) {
+            monitor_printf(mon, "%s\n", error_get_pretty(err));
+            error_free(err);
+            return;
+        }
+        /* this takes a while, so do it before pausing the guest */
+        ret = ram_save_background_prepare();
+        if (ret < 0) {
+            monitor_printf(mon, "Cannot save RAM in the background: %s\n",
+                           strerror(-ret));
+            return;
+        }
+    }
+
     saved_vm_running = runstate_is_running();
     vm_stop(RUN_STATE_SAVE_VM);
 
@@ -2121,6 +2488,11 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         goto the_end;
     }
 
+    if (background) {
+        background_snapshot_start(mon, bs, sn);
+        goto the_end;
+    }
+
     /* save the VM state */
     f = qemu_fopen_bdrv(bs, 1);
     if (!f) {
@@ -2151,6 +2523,9 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     }
 
  the_end:
+    if (background && !background_snapshot) {
+        ram_save_background_cancel();
+    }
     if (saved_vm_running)
         vm_start();
 }
@@ -2188,6 +2563,11 @@ int load_vmstate(const char *name)
     QEMUFile *f;
     int ret;
 
+    if (background_snapshot) {
+        error_report("A snapshot is being saved in the background");
+        return -EBUSY;
+    }
+
     bs_vm_state = bdrv_snapshots();
     if (!bs_vm_state) {
         error_report("No block device supports snapshots");
@@ -2267,6 +2647,11 @@ void do_delvm(Monitor *mon, const QDict *qdict)
     int ret;
     const char *name = qdict_get_str(qdict, "name");
 
+    if (background_snapshot) {
+        monitor_printf(mon, "A snapshot is being saved in the background\n");
+        return;
+    }
+
     bs = bdrv_snapshots();
     if (!bs) {
         monitor_printf(mon, "No block device supports snapshots\n");
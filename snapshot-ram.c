@@ -0,0 +1,404 @@
+/*
+ * QEMU background snapshot: RAM
+ *
+ * "savevm -b" saves the RAM while the guest keeps running, as it was
+ * when the guest was paused to take the snapshot.  Guest RAM is write
+ * protected with userfaultfd at that point.  Pages are then saved in
+ * order; each one is copied while still protected, after which writes
+ * to it are allowed again.  A write to a page that was not saved yet
+ * blocks, and a thread copies the page aside before letting the write
+ * through; the copies are saved ahead of the other pages.
+ *
+ * The faulting thread may hold the global mutex, so the fault thread
+ * never takes it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "qemu-queue.h"
+#include "bitmap.h"
+#include "migration.h"
+
+#ifdef CONFIG_USERFAULTFD
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#endif
+
+//#define DEBUG_SNAPSHOT_RAM
+
+#ifdef DEBUG_SNAPSHOT_RAM
+#define DPRINTF(fmt, ...) \
+    do { printf("snapshot-ram: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#ifdef CONFIG_USERFAULTFD
+
+typedef struct SnapshotBlock {
+    void *opaque;
+    uint8_t *host;
+    uint64_t length;
+    /* pages that were saved or copied aside, protected by lock */
+    unsigned long *saved;
+} SnapshotBlock;
+
+typedef struct SnapshotPage {
+    SnapshotBlock *block;
+    uint64_t offset;
+    QSIMPLEQ_ENTRY(SnapshotPage) next;
+    uint8_t data[];
+} SnapshotPage;
+
+static struct {
+    SnapshotBlock *blocks;
+    int num_blocks;
+    unsigned int page_size;
+    int uffd;
+    int quit_fds[2];
+    QemuThread thread;
+    bool running;
+    /* next page to save in order, owned by the caller */
+    int cur_block;
+    uint64_t cur_page;
+    QemuMutex lock;
+    /* protected by lock */
+    QSIMPLEQ_HEAD(, SnapshotPage) copied;
+    int error;
+} snapshot_ram = {
+    .uffd = -1,
+};
+
+static int snapshot_ram_write_protect(uint8_t *host, uint64_t length,
+                                      bool on)
+{
+    struct uffdio_writeprotect wp;
+
+    wp.range.start = (uintptr_t)host;
+    wp.range.len = length;
+    wp.mode = on ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+    return ioctl(snapshot_ram.uffd, UFFDIO_WRITEPROTECT, &wp) ? -errno : 0;
+}
+
+/*
+ * Check that guest RAM can be write protected.  The RAM blocks are then
+ * registered with snapshot_ram_add_block(), while the guest still runs,
+ * and protected with snapshot_ram_protect() once it is paused.
+ */
+int snapshot_ram_setup(unsigned int page_size)
+{
+    struct uffdio_api api;
+    int ret;
+
+    if (page_size != getpagesize()) {
+        fprintf(stderr, "snapshot: the target page size must be the host "
+                "page size\n");
+        return -EINVAL;
+    }
+    snapshot_ram.page_size = page_size;
+
+    snapshot_ram.uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (snapshot_ram.uffd < 0) {
+        fprintf(stderr, "snapshot: userfaultfd not available: %s\n",
+                strerror(errno));
+        return -errno;
+    }
+
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+    if (ioctl(snapshot_ram.uffd, UFFDIO_API, &api)) {
+        ret = -errno;
+    } else if (!(api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+        ret = -ENOSYS;
+    } else {
+        ret = 0;
+    }
+    if (ret < 0) {
+        fprintf(stderr, "snapshot: userfaultfd cannot write protect\n");
+        close(snapshot_ram.uffd);
+        snapshot_ram.uffd = -1;
+        return ret;
+    }
+
+    snapshot_ram.error = 0;
+    QSIMPLEQ_INIT(&snapshot_ram.copied);
+    qemu_mutex_init(&snapshot_ram.lock);
+    return 0;
+}
+
+int snapshot_ram_add_block(void *opaque, uint8_t *host, uint64_t length)
+{
+    struct uffdio_register reg;
+    SnapshotBlock *block;
+    volatile uint8_t *p;
+
+    /* only pages that are mapped can be protected */
+    for (p = host; p < host + length; p += snapshot_ram.page_size) {
+        (void)*p;
+    }
+
+    reg.range.start = (uintptr_t)host;
+    reg.range.len = length;
+    reg.mode = UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(snapshot_ram.uffd, UFFDIO_REGISTER, &reg)) {
+        return -errno;
+    }
+    if ((reg.ioctls & ((__u64)1 << _UFFDIO_WRITEPROTECT)) == 0) {
+        ioctl(snapshot_ram.uffd, UFFDIO_UNREGISTER, &reg.range);
+        return -ENOSYS;
+    }
+
+    snapshot_ram.blocks = g_realloc(snapshot_ram.blocks,
+                                    (snapshot_ram.num_blocks + 1) *
+                                    sizeof(SnapshotBlock));
+    block = &snapshot_ram.blocks[snapshot_ram.num_blocks++];
+    block->opaque = opaque;
+    block->host = host;
+    block->length = length;
+    block->saved = bitmap_new(length / snapshot_ram.page_size);
+    return 0;
+}
+
+/* Copy aside the page at a faulting address, then let the write go on */
+static int snapshot_ram_copy_page(uint64_t addr)
+{
+    unsigned int size = snapshot_ram.page_size;
+    int i;
+
+    for (i = 0; i < snapshot_ram.num_blocks; i++) {
+        SnapshotBlock *block = &snapshot_ram.blocks[i];
+        uint64_t offset = addr - (uintptr_t)block->host;
+        SnapshotPage *page;
+
+        if (addr < (uintptr_t)block->host || offset >= block->length) {
+            continue;
+        }
+        offset &= ~(uint64_t)(size - 1);
+
+        qemu_mutex_lock(&snapshot_ram.lock);
+        if (!test_and_set_bit(offset / size, block->saved)) {
+            page = g_malloc(sizeof(*page) + size);
+            page->block = block;
+            page->offset = offset;
+            memcpy(page->data, block->host + offset, size);
+            QSIMPLEQ_INSERT_TAIL(&snapshot_ram.copied, page, next);
+            DPRINTF("copied %p at %" PRIx64 "\n", block->opaque, offset);
+        }
+        qemu_mutex_unlock(&snapshot_ram.lock);
+
+        return snapshot_ram_write_protect(block->host + offset, size, false);
+    }
+    fprintf(stderr, "snapshot: fault outside guest RAM at %" PRIx64 "\n",
+            addr);
+    return -EINVAL;
+}
+
+static void *snapshot_ram_fault_thread(void *opaque)
+{
+    struct pollfd pfd[2];
+    struct uffd_msg msg;
+    int ret;
+
+    pfd[0].fd = snapshot_ram.uffd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = snapshot_ram.quit_fds[0];
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "snapshot: poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+        while (read(snapshot_ram.uffd, &msg, sizeof(msg)) == sizeof(msg)) {
+            if (msg.event != UFFD_EVENT_PAGEFAULT ||
+                !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+                continue;
+            }
+            ret = snapshot_ram_copy_page(msg.arg.pagefault.address);
+            if (ret < 0) {
+                qemu_mutex_lock(&snapshot_ram.lock);
+                snapshot_ram.error = ret;
+                qemu_mutex_unlock(&snapshot_ram.lock);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Write protect guest RAM, with the guest paused */
+int snapshot_ram_protect(void)
+{
+    int i, ret;
+
+    for (i = 0; i < snapshot_ram.num_blocks; i++) {
+        SnapshotBlock *block = &snapshot_ram.blocks[i];
+
+        ret = snapshot_ram_write_protect(block->host, block->length, true);
+        if (ret < 0) {
+            fprintf(stderr, "snapshot: cannot write protect RAM: %s\n",
+                    strerror(-ret));
+            return ret;
+        }
+    }
+
+    if (qemu_pipe(snapshot_ram.quit_fds) < 0) {
+        return -errno;
+    }
+    snapshot_ram.cur_block = 0;
+    snapshot_ram.cur_page = 0;
+    snapshot_ram.running = true;
+    qemu_thread_create(&snapshot_ram.thread, snapshot_ram_fault_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+/*
+ * Fetch the next page to save into buf, which holds a page: first the
+ * ones copied aside, then the others in order.  Returns 1 with *opaque
+ * and *offset set, 0 once every page was fetched, or a negative errno.
+ */
+int snapshot_ram_next_page(void **opaque, uint64_t *offset, uint8_t *buf)
+{
+    unsigned int size = snapshot_ram.page_size;
+    SnapshotBlock *block;
+    SnapshotPage *page;
+    int ret;
+
+    qemu_mutex_lock(&snapshot_ram.lock);
+    ret = snapshot_ram.error;
+    page = QSIMPLEQ_FIRST(&snapshot_ram.copied);
+    if (page) {
+        QSIMPLEQ_REMOVE_HEAD(&snapshot_ram.copied, next);
+    }
+    qemu_mutex_unlock(&snapshot_ram.lock);
+
+    if (ret < 0) {
+        g_free(page);
+        return ret;
+    }
+    if (page) {
+        *opaque = page->block->opaque;
+        *offset = page->offset;
+        memcpy(buf, page->data, size);
+        g_free(page);
+        return 1;
+    }
+
+    while (snapshot_ram.cur_block < snapshot_ram.num_blocks) {
+        unsigned long pages, next;
+
+        block = &snapshot_ram.blocks[snapshot_ram.cur_block];
+        pages = block->length / size;
+
+        qemu_mutex_lock(&snapshot_ram.lock);
+        next = find_next_zero_bit(block->saved, pages,
+                                  snapshot_ram.cur_page);
+        if (next < pages) {
+            /* still protected, as nobody saved it yet */
+            set_bit(next, block->saved);
+            memcpy(buf, block->host + next * size, size);
+        }
+        qemu_mutex_unlock(&snapshot_ram.lock);
+
+        if (next < pages) {
+            snapshot_ram.cur_page = next + 1;
+            *opaque = block->opaque;
+            *offset = (uint64_t)next * size;
+            ret = snapshot_ram_write_protect(block->host + *offset, size,
+                                             false);
+            return ret < 0 ? ret : 1;
+        }
+        snapshot_ram.cur_block++;
+        snapshot_ram.cur_page = 0;
+    }
+    return 0;
+}
+
+/* Let the guest write anywhere again and drop what was not saved */
+void snapshot_ram_cleanup(void)
+{
+    SnapshotPage *page;
+    int i;
+
+    if (snapshot_ram.uffd < 0) {
+        return;
+    }
+
+    for (i = 0; i < snapshot_ram.num_blocks; i++) {
+        SnapshotBlock *block = &snapshot_ram.blocks[i];
+        struct uffdio_range range;
+
+        snapshot_ram_write_protect(block->host, block->length, false);
+        range.start = (uintptr_t)block->host;
+        range.len = block->length;
+        ioctl(snapshot_ram.uffd, UFFDIO_UNREGISTER, &range);
+    }
+
+    if (snapshot_ram.running) {
+        if (write(snapshot_ram.quit_fds[1], "", 1) != 1) {
+            abort();
+        }
+        qemu_thread_join(&snapshot_ram.thread);
+        close(snapshot_ram.quit_fds[0]);
+        close(snapshot_ram.quit_fds[1]);
+        snapshot_ram.running = false;
+    }
+    close(snapshot_ram.uffd);
+    snapshot_ram.uffd = -1;
+
+    for (i = 0; i < snapshot_ram.num_blocks; i++) {
+        g_free(snapshot_ram.blocks[i].saved);
+    }
+    while ((page = QSIMPLEQ_FIRST(&snapshot_ram.copied))) {
+        QSIMPLEQ_REMOVE_HEAD(&snapshot_ram.copied, next);
+        g_free(page);
+    }
+    qemu_mutex_destroy(&snapshot_ram.lock);
+
+    g_free(snapshot_ram.blocks);
+    snapshot_ram.blocks = NULL;
+    snapshot_ram.num_blocks = 0;
+}
+
+#else /* !CONFIG_USERFAULTFD */
+
+int snapshot_ram_setup(unsigned int page_size)
+{
+    fprintf(stderr, "snapshot: this host cannot write protect guest RAM\n");
+    return -ENOSYS;
+}
+
+int snapshot_ram_add_block(void *opaque, uint8_t *host, uint64_t length)
+{
+    return -ENOSYS;
+}
+
+int snapshot_ram_protect(void)
+{
+    return -ENOSYS;
+}
+
+int snapshot_ram_next_page(void **opaque, uint64_t *offset, uint8_t *buf)
+{
+    return -ENOSYS;
+}
+
+void snapshot_ram_cleanup(void)
+{
+}
+
+#endif
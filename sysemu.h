@@ -81,6 +81,7 @@ int qemu_savevm_state_begin(QEMUFile *f, int blk_enable, int shared);
 int qemu_savevm_state_iterate(QEMUFile *f);
 int qemu_savevm_state_complete(QEMUFile *f);
 void qemu_savevm_state_cancel(QEMUFile *f);
+int64_t qemu_savevm_complete_time(const char *idstr);
 int qemu_loadvm_state(QEMUFile *f);
 
 /* SLIRP */
@@ -735,7 +735,7 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 /* Set PC and Thumb state from var.  var is marked as dead.  */
 static inline void gen_bx(DisasContext *s, TCGv var)
 {
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
     tcg_gen_andi_i32(cpu_R[15], var, ~1);
     tcg_gen_andi_i32(var, var, 1);
     store_cpu_field(var, thumb);
@@ -2475,24 +2475,14 @@ static void gen_vfp_msr(TCGv tmp)
 
 static void gen_neon_dup_u8(TCGv var, int shift)
 {
-    TCGv tmp = tcg_temp_new_i32();
     if (shift)
         tcg_gen_shri_i32(var, var, shift);
-    tcg_gen_ext8u_i32(var, var);
-    tcg_gen_shli_i32(tmp, var, 8);
-    tcg_gen_or_i32(var, var, tmp);
-    tcg_gen_shli_i32(tmp, var, 16);
-    tcg_gen_or_i32(var, var, tmp);
-    tcg_temp_free_i32(tmp);
+    tcg_gen_vec_dup_i32(0, var, var);
 }
 
 static void gen_neon_dup_low16(TCGv var)
 {
-    TCGv tmp = tcg_temp_new_i32();
-    tcg_gen_ext16u_i32(var, var);
-    tcg_gen_shli_i32(tmp, var, 16);
-    tcg_gen_or_i32(var, var, tmp);
-    tcg_temp_free_i32(tmp);
+    tcg_gen_vec_dup_i32(1, var, var);
 }
 
 static void gen_neon_dup_high16(TCGv var)
@@ -3325,6 +3315,22 @@ static int disas_vfp_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
     return 0;
 }
 
+/* Jump to the TB at the PC already stored in r15, looking it up at run
+   time.  Falls back to the main loop if it is not in the virtual PC cache.  */
+static void gen_goto_ptr(void)
+{
+    TCGv_ptr ptr;
+
+    if (!TCG_TARGET_HAS_goto_ptr) {
+        tcg_gen_exit_tb(0);
+        return;
+    }
+    ptr = tcg_temp_new_ptr();
+    gen_helper_lookup_tb_ptr(ptr, cpu_env);
+    tcg_gen_goto_ptr(ptr);
+    tcg_temp_free_ptr(ptr);
+}
+
 static inline void gen_goto_tb(DisasContext *s, int n, uint32_t dest)
 {
     TranslationBlock *tb;
@@ -3336,7 +3342,7 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint32_t dest)
         tcg_gen_exit_tb((tcg_target_long)tb + n);
     } else {
         gen_set_pc_im(dest);
-        tcg_gen_exit_tb(0);
+        gen_goto_ptr();
     }
 }
 
@@ -3488,22 +3494,18 @@ static void gen_nop_hint(DisasContext *s, int val)
 
 static inline void gen_neon_add(int size, TCGv t0, TCGv t1)
 {
-    switch (size) {
-    case 0: gen_helper_neon_add_u8(t0, t0, t1); break;
-    case 1: gen_helper_neon_add_u16(t0, t0, t1); break;
-    case 2: tcg_gen_add_i32(t0, t0, t1); break;
-    default: abort();
+    if (size > 2) {
+        abort();
     }
+    tcg_gen_vec_add_i32(size, t0, t0, t1);
 }
 
 static inline void gen_neon_rsb(int size, TCGv t0, TCGv t1)
 {
-    switch (size) {
-    case 0: gen_helper_neon_sub_u8(t0, t1, t0); break;
-    case 1: gen_helper_neon_sub_u16(t0, t1, t0); break;
-    case 2: tcg_gen_sub_i32(t0, t1, t0); break;
-    default: return;
+    if (size > 2) {
+        return;
     }
+    tcg_gen_vec_sub_i32(size, t0, t1, t0);
 }
 
 /* 32-bit pairwise ops end up the same as the elementwise versions.  */
@@ -4677,12 +4679,10 @@ static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t ins
             if (!u) { /* VADD */
                 gen_neon_add(size, tmp, tmp2);
             } else { /* VSUB */
-                switch (size) {
-                case 0: gen_helper_neon_sub_u8(tmp, tmp, tmp2); break;
-                case 1: gen_helper_neon_sub_u16(tmp, tmp, tmp2); break;
-                case 2: tcg_gen_sub_i32(tmp, tmp, tmp2); break;
-                default: abort();
+                if (size > 2) {
+                    abort();
                 }
+                tcg_gen_vec_sub_i32(size, tmp, tmp, tmp2);
             }
             break;
         case NEON_3R_VTST_VCEQ:
@@ -4694,12 +4694,10 @@ static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t ins
                 default: abort();
                 }
             } else { /* VCEQ */
-                switch (size) {
-                case 0: gen_helper_neon_ceq_u8(tmp, tmp, tmp2); break;
-                case 1: gen_helper_neon_ceq_u16(tmp, tmp, tmp2); break;
-                case 2: gen_helper_neon_ceq_u32(tmp, tmp, tmp2); break;
-                default: abort();
+                if (size > 2) {
+                    abort();
                 }
+                tcg_gen_vec_cmpeq_i32(size, tmp, tmp, tmp2);
             }
             break;
         case NEON_3R_VML: /* VMLA, VMLAL, VMLS,VMLSL */
@@ -5977,13 +5975,11 @@ static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t ins
                             }
                             break;
                         case NEON_2RM_VCEQ0:
-                            tmp2 = tcg_const_i32(0);
-                            switch(size) {
-                            case 0: gen_helper_neon_ceq_u8(tmp, tmp, tmp2); break;
-                            case 1: gen_helper_neon_ceq_u16(tmp, tmp, tmp2); break;
-                            case 2: gen_helper_neon_ceq_u32(tmp, tmp, tmp2); break;
-                            default: abort();
+                            if (size > 2) {
+                                abort();
                             }
+                            tmp2 = tcg_const_i32(0);
+                            tcg_gen_vec_cmpeq_i32(size, tmp, tmp, tmp2);
                             tcg_temp_free(tmp2);
                             break;
                         case NEON_2RM_VABS:
@@ -9901,8 +9897,11 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            /* the next TB is only known at run time */
+            gen_goto_ptr();
+            break;
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
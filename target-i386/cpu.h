@@ -33,6 +33,10 @@
 /* support for self modifying code even if the modified instruction is
    close to the modifying instruction */
 #define TARGET_HAS_PRECISE_SMC
+/* the translator can build hot traces (CF_TRACE) */
+#define TARGET_HAS_HOT_TRACES
+/* each vCPU can run on its own thread (-machine tcg_threads=multi) */
+#define TARGET_SUPPORTS_MTTCG
 
 #define TARGET_HAS_ICE 1
 
@@ -886,6 +890,10 @@ static inline void cpu_x86_set_cpl(CPUX86State *s, int cpl)
 void cpu_get_fp80(uint64_t *pmant, uint16_t *pexp, floatx80 f);
 floatx80 cpu_set_fp80(uint64_t mant, uint16_t upper);
 
+/* mem_helper.c */
+void cpu_x86_lock_init(void);
+void cpu_x86_lock_reset(void);
+
 /* cpu-exec.c */
 /* the following helpers are only usable in user mode simulation as
    they can trigger unexpected exceptions */
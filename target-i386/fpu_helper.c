@@ -135,7 +135,11 @@ static void fpu_raise_exception(void)
     }
 #if !defined(CONFIG_USER_ONLY)
     else {
+        /* raises the FERR# interrupt line */
+        bool locked = qemu_tcg_mt_lock_iothread();
+
         cpu_set_ferr(env);
+        qemu_tcg_mt_unlock_iothread(locked);
     }
 #endif
 }
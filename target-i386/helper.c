@@ -377,10 +377,17 @@ void cpu_x86_set_a20(CPUX86State *env, int a20_state)
            all the potentially executing TB */
         cpu_interrupt(env, CPU_INTERRUPT_EXITTB);
 
+        env->a20_mask = ~(1 << 20) | (a20_state << 20);
         /* when a20 is changed, all the MMU mappings are invalid, so
            we must flush everything */
+#if !defined(CONFIG_USER_ONLY)
+        if (mttcg_enabled && env != cpu_single_env) {
+            /* the TLB belongs to another vCPU thread */
+            cpu_interrupt(env, CPU_INTERRUPT_TLB_FLUSH);
+            return;
+        }
+#endif
         tlb_flush(env, 1);
-        env->a20_mask = ~(1 << 20) | (a20_state << 20);
     }
 }
 
@@ -1114,8 +1121,11 @@ void cpu_report_tpr_access(CPUX86State *env, TPRAccess access)
 
         cpu_interrupt(env, CPU_INTERRUPT_TPR);
     } else {
+        bool locked = tcg_tb_lock_nested();
+
         tb = tb_find_pc(env->mem_io_pc);
         cpu_restore_state(tb, env, env->mem_io_pc);
+        tcg_tb_unlock_nested(locked);
 
         apic_handle_tpr_access_report(env->apic_state, env->eip, access);
     }
@@ -1166,6 +1176,7 @@ X86CPU *cpu_x86_init(const char *cpu_model)
         inited = 1;
         optimize_flags_init();
 #ifndef CONFIG_USER_ONLY
+        cpu_x86_lock_init();
         prev_debug_excp_handler =
             cpu_set_debug_excp_handler(breakpoint_handler);
 #endif
@@ -218,4 +218,6 @@ DEF_HELPER_2(rclq, tl, tl, tl)
 DEF_HELPER_2(rcrq, tl, tl, tl)
 #endif
 
+DEF_HELPER_1(lookup_tb_ptr, ptr, env)
+
 #include "def-helper.h"
@@ -23,19 +23,56 @@
 
 #if !defined(CONFIG_USER_ONLY)
 #include "softmmu_exec.h"
+#include "qemu-thread.h"
 #endif /* !defined(CONFIG_USER_ONLY) */
 
 /* broken thread support */
 
 static spinlock_t global_cpu_lock = SPIN_LOCK_UNLOCKED;
 
+#if !defined(CONFIG_USER_ONLY)
+/* With tcg_threads=multi, LOCK-prefixed instructions of different vCPUs
+   exclude each other through this mutex.  Plain stores of other vCPUs
+   are not excluded.  */
+static QemuMutex global_cpu_mutex;
+static DEFINE_TLS(bool, have_global_cpu_mutex);
+
+void cpu_x86_lock_init(void)
+{
+    qemu_mutex_init(&global_cpu_mutex);
+}
+
+/* Called by cpu_exec() after a longjmp, e.g. a page fault in the middle
+   of a locked instruction.  */
+void cpu_x86_lock_reset(void)
+{
+    if (tls_var(have_global_cpu_mutex)) {
+        tls_var(have_global_cpu_mutex) = false;
+        qemu_mutex_unlock(&global_cpu_mutex);
+    }
+}
+#endif
+
 void helper_lock(void)
 {
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled) {
+        qemu_mutex_lock(&global_cpu_mutex);
+        tls_var(have_global_cpu_mutex) = true;
+        return;
+    }
+#endif
     spin_lock(&global_cpu_lock);
 }
 
 void helper_unlock(void)
 {
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled) {
+        cpu_x86_lock_reset();
+        return;
+    }
+#endif
     spin_unlock(&global_cpu_lock);
 }
 
@@ -140,9 +177,14 @@ void tlb_fill(CPUX86State *env1, target_ulong addr, int is_write, int mmu_idx,
     int ret;
     CPUX86State *saved_env;
 
+    bool locked;
+
     saved_env = env;
     env = env1;
 
+    /* the page walk reads the memory map, and the TB lookup below needs
+       the lock too; raise_exception_err() leaves it to cpu_exec() */
+    locked = tcg_tb_lock_nested();
     ret = cpu_x86_handle_mmu_fault(env, addr, is_write, mmu_idx);
     if (ret) {
         if (retaddr) {
@@ -156,6 +198,7 @@ void tlb_fill(CPUX86State *env1, target_ulong addr, int is_write, int mmu_idx,
         }
         raise_exception_err(env, env->exception_index, env->error_code);
     }
+    tcg_tb_unlock_nested(locked);
     env = saved_env;
 }
 #endif
@@ -26,6 +26,24 @@
 #include "softmmu_exec.h"
 #endif /* !defined(CONFIG_USER_ONLY) */
 
+/* With tcg_threads=multi, I/O ports and the local APIC are accessed with
+   the global mutex held, as for MMIO (see tlb_io_lock()) */
+static inline bool io_lock(void)
+{
+#if !defined(CONFIG_USER_ONLY)
+    return qemu_tcg_mt_lock_iothread();
+#else
+    return false;
+#endif
+}
+
+static inline void io_unlock(bool locked)
+{
+#if !defined(CONFIG_USER_ONLY)
+    qemu_tcg_mt_unlock_iothread(locked);
+#endif
+}
+
 /* check if Port I/O is allowed in TSS */
 static inline void check_io(int addr, int size)
 {
@@ -70,32 +88,56 @@ void helper_check_iol(uint32_t t0)
 
 void helper_outb(uint32_t port, uint32_t data)
 {
+    bool locked = io_lock();
+
     cpu_outb(port, data & 0xff);
+    io_unlock(locked);
 }
 
 target_ulong helper_inb(uint32_t port)
 {
-    return cpu_inb(port);
+    bool locked = io_lock();
+    target_ulong val;
+
+    val = cpu_inb(port);
+    io_unlock(locked);
+    return val;
 }
 
 void helper_outw(uint32_t port, uint32_t data)
 {
+    bool locked = io_lock();
+
     cpu_outw(port, data & 0xffff);
+    io_unlock(locked);
 }
 
 target_ulong helper_inw(uint32_t port)
 {
-    return cpu_inw(port);
+    bool locked = io_lock();
+    target_ulong val;
+
+    val = cpu_inw(port);
+    io_unlock(locked);
+    return val;
 }
 
 void helper_outl(uint32_t port, uint32_t data)
 {
+    bool locked = io_lock();
+
     cpu_outl(port, data);
+    io_unlock(locked);
 }
 
 target_ulong helper_inl(uint32_t port)
 {
-    return cpu_inl(port);
+    bool locked = io_lock();
+    target_ulong val;
+
+    val = cpu_inl(port);
+    io_unlock(locked);
+    return val;
 }
 
 void helper_into(int next_eip_addend)
@@ -155,7 +197,10 @@ target_ulong helper_read_crN(int reg)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = io_lock();
+
             val = cpu_get_apic_tpr(env->apic_state);
+            io_unlock(locked);
         } else {
             val = env->v_tpr;
         }
@@ -179,7 +224,10 @@ void helper_write_crN(int reg, target_ulong t0)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = io_lock();
+
             cpu_set_apic_tpr(env->apic_state, t0);
+            io_unlock(locked);
         }
         env->v_tpr = t0 & 0x0f;
         break;
@@ -285,7 +333,12 @@ void helper_wrmsr(void)
         env->sysenter_eip = val;
         break;
     case MSR_IA32_APICBASE:
-        cpu_set_apic_base(env->apic_state, val);
+        {
+            bool locked = io_lock();
+
+            cpu_set_apic_base(env->apic_state, val);
+            io_unlock(locked);
+        }
         break;
     case MSR_EFER:
         {
@@ -430,7 +483,12 @@ void helper_rdmsr(void)
         val = env->sysenter_eip;
         break;
     case MSR_IA32_APICBASE:
-        val = cpu_get_apic_base(env->apic_state);
+        {
+            bool locked = io_lock();
+
+            val = cpu_get_apic_base(env->apic_state);
+            io_unlock(locked);
+        }
         break;
     case MSR_EFER:
         val = env->efer;
@@ -188,6 +188,7 @@ void helper_rsm(void)
     target_ulong sm_state;
     int i, offset;
     uint32_t val;
+    bool locked;
 
     sm_state = env->smbase + 0x8000;
 #ifdef TARGET_X86_64
@@ -298,7 +299,10 @@ void helper_rsm(void)
 #endif
     CC_OP = CC_OP_EFLAGS;
     env->hflags &= ~HF_SMM_MASK;
+    /* the chipset may remap SMRAM */
+    locked = qemu_tcg_mt_lock_iothread();
     cpu_smm_update(env);
+    qemu_tcg_mt_unlock_iothread(locked);
 
     qemu_log_mask(CPU_LOG_INT, "SMM: after RSM\n");
     log_cpu_state_mask(CPU_LOG_INT, env, X86_DUMP_CCOP);
@@ -37,6 +37,9 @@
 #define PREFIX_DATA   0x08
 #define PREFIX_ADR    0x10
 
+/* conditional branches a hot trace may absorb before it ends */
+#define MAX_TRACE_EXITS 3
+
 #ifdef TARGET_X86_64
 #define CODE64(s) ((s)->code64)
 #define REX_X(s) ((s)->rex_x)
@@ -98,6 +101,9 @@ typedef struct DisasContext {
     int tf;     /* TF cpu flag */
     int singlestep_enabled; /* "hardware" single step enabled */
     int jmp_opt; /* use direct block chaining for direct jumps */
+    int trace;  /* hot trace: conditional branches become side exits */
+    int trace_exits; /* number of side exits emitted so far */
+    int goto_tb_used; /* mask of the goto_tb slots already emitted */
     int mem_index; /* select memory access functions */
     uint64_t flags; /* all execution flags */
     struct TranslationBlock *tb;
@@ -110,6 +116,7 @@ typedef struct DisasContext {
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
+static void gen_jr(DisasContext *s);
 static void gen_jmp(DisasContext *s, target_ulong eip);
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num);
 
@@ -2284,17 +2291,24 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
 
     pc = s->cs_base + eip;
     tb = s->tb;
+    /* a trace has more exits than a TB has jump slots: any free slot
+       will do, and the remaining exits look the target up */
+    if (s->goto_tb_used & (1 << tb_num)) {
+        tb_num ^= 1;
+    }
     /* NOTE: we handle the case where the TB spans two pages here */
-    if ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) ||
-        (pc & TARGET_PAGE_MASK) == ((s->pc - 1) & TARGET_PAGE_MASK))  {
+    if (!(s->goto_tb_used & (1 << tb_num)) &&
+        ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) ||
+         (pc & TARGET_PAGE_MASK) == ((s->pc - 1) & TARGET_PAGE_MASK)))  {
         /* jump to same page: we can use a direct jump */
+        s->goto_tb_used |= 1 << tb_num;
         tcg_gen_goto_tb(tb_num);
         gen_jmp_im(eip);
         tcg_gen_exit_tb((tcg_target_long)tb + tb_num);
     } else {
-        /* jump to another page: currently not optimized */
+        /* jump to another page: look the TB up at run time */
         gen_jmp_im(eip);
-        gen_eob(s);
+        gen_jr(s);
     }
 }
 
@@ -2307,6 +2321,20 @@ static inline void gen_jcc(DisasContext *s, int b,
     gen_update_cc_op(s);
     if (s->jmp_opt) {
         l1 = gen_new_label();
+        if (s->trace && s->trace_exits < MAX_TRACE_EXITS) {
+            /* leave the trace if the branch is taken and keep
+               translating the fall-through path.  Without a free
+               goto_tb slot, gen_goto_tb ends the block through gen_jr,
+               which must not end the translation too.  */
+            int is_jmp = s->is_jmp;
+
+            s->trace_exits++;
+            gen_jcc1(s, cc_op, b ^ 1, l1);
+            gen_goto_tb(s, 0, val);
+            s->is_jmp = is_jmp;
+            gen_set_label(l1);
+            return;
+        }
         gen_jcc1(s, cc_op, b, l1);
         
         gen_goto_tb(s, 0, next_eip);
@@ -2689,8 +2717,9 @@ static void gen_debug(DisasContext *s, target_ulong cur_eip)
 }
 
 /* generate a generic end of block. Trace exception is also generated
-   if needed */
-static void gen_eob(DisasContext *s)
+   if needed.  If jr is set, the new eip was computed at run time and the
+   next TB is looked up without going back to the main loop. */
+static void gen_eob_worker(DisasContext *s, int jr)
 {
     if (s->cc_op != CC_OP_DYNAMIC)
         gen_op_set_cc_op(s->cc_op);
@@ -2704,12 +2733,60 @@ static void gen_eob(DisasContext *s)
         gen_helper_debug();
     } else if (s->tf) {
 	gen_helper_single_step();
+    } else if (jr && s->jmp_opt && TCG_TARGET_HAS_goto_ptr) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+
+        gen_helper_lookup_tb_ptr(ptr, cpu_env);
+        tcg_gen_goto_ptr(ptr);
+        tcg_temp_free_ptr(ptr);
     } else {
         tcg_gen_exit_tb(0);
     }
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+static void gen_eob(DisasContext *s)
+{
+    gen_eob_worker(s, 0);
+}
+
+/* end of block for an indirect jump (the new eip is already stored) */
+static void gen_jr(DisasContext *s)
+{
+    gen_eob_worker(s, 1);
+}
+
+/* Count the executions of a cold TB in the TB itself, so that it can
+   stay chained, and return to cpu_exec() once it is hot enough to be
+   retranslated as a trace.  eip is not stored when the TB is entered
+   through a direct jump, so store it before leaving.  The counter
+   address is not relocatable, so nothing is counted while TBs are
+   recorded for the persistent translation cache.  */
+static void gen_trace_count(DisasContext *s, TranslationBlock *tb)
+{
+    TCGv_ptr ptr;
+    TCGv_i32 count;
+    int l1;
+
+    if (tb->cflags != 0 || use_icount || !s->jmp_opt ||
+        tcg_ctx.code_relocs_enabled) {
+        return;
+    }
+
+    l1 = gen_new_label();
+    ptr = tcg_const_ptr((tcg_target_long)&tb->exec_count);
+    count = tcg_temp_new_i32();
+    tcg_gen_ld_i32(count, ptr, 0);
+    tcg_gen_addi_i32(count, count, 1);
+    tcg_gen_st_i32(count, ptr, 0);
+    tcg_gen_brcondi_i32(TCG_COND_LTU, count, TB_TRACE_THRESHOLD, l1);
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(ptr);
+    gen_jmp_im(tb->pc - s->cs_base);
+    tcg_gen_exit_tb(0);
+    gen_set_label(l1);
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
@@ -2950,6 +3027,105 @@ static const SSEFunc_0_pp sse_op_table2[3 * 8][2] = {
     [16 + 7] = { NULL, gen_helper_pslldq_xmm },
 };
 
+/* Integer MMX/SSE operations that are expanded inline, 64 bits at a time,
+   instead of calling the sse_op_table1 helper.  */
+typedef void (*SSEInlineFunc)(int vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b);
+
+typedef struct SSEInlineOp {
+    SSEInlineFunc fn;
+    int vece;
+} SSEInlineOp;
+
+static void gen_sse_and(int vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gen_sse_andn(int vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, b, a);
+}
+
+static void gen_sse_or(int vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gen_sse_xor(int vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static const SSEInlineOp sse_inline_ops[256] = {
+    [0x54] = { gen_sse_and }, /* andps, andpd */
+    [0x55] = { gen_sse_andn }, /* andnps, andnpd */
+    [0x56] = { gen_sse_or }, /* orps, orpd */
+    [0x57] = { gen_sse_xor }, /* xorps, xorpd */
+    [0x74] = { tcg_gen_vec_cmpeq_i64, 0 }, /* pcmpeqb */
+    [0x75] = { tcg_gen_vec_cmpeq_i64, 1 }, /* pcmpeqw */
+    [0x76] = { tcg_gen_vec_cmpeq_i64, 2 }, /* pcmpeql */
+    [0xd4] = { tcg_gen_vec_add_i64, 3 }, /* paddq */
+    [0xdb] = { gen_sse_and }, /* pand */
+    [0xdf] = { gen_sse_andn }, /* pandn */
+    [0xeb] = { gen_sse_or }, /* por */
+    [0xef] = { gen_sse_xor }, /* pxor */
+    [0xf8] = { tcg_gen_vec_sub_i64, 0 }, /* psubb */
+    [0xf9] = { tcg_gen_vec_sub_i64, 1 }, /* psubw */
+    [0xfa] = { tcg_gen_vec_sub_i64, 2 }, /* psubl */
+    [0xfb] = { tcg_gen_vec_sub_i64, 3 }, /* psubq */
+    [0xfc] = { tcg_gen_vec_add_i64, 0 }, /* paddb */
+    [0xfd] = { tcg_gen_vec_add_i64, 1 }, /* paddw */
+    [0xfe] = { tcg_gen_vec_add_i64, 2 }, /* paddl */
+};
+
+/* offset of the nth quadword of an MMX or XMM register */
+static inline int sse_q_offset(int is_xmm, int n)
+{
+    if (!is_xmm) {
+        return offsetof(MMXReg, MMX_Q(0));
+    }
+    return n ? offsetof(XMMReg, XMM_Q(1)) : offsetof(XMMReg, XMM_Q(0));
+}
+
+static void gen_sse_inline(const SSEInlineOp *op, int is_xmm,
+                           int op1_offset, int op2_offset)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    int i;
+
+    for (i = 0; i < (is_xmm ? 2 : 1); i++) {
+        tcg_gen_ld_i64(t0, cpu_env, op1_offset + sse_q_offset(is_xmm, i));
+        tcg_gen_ld_i64(t1, cpu_env, op2_offset + sse_q_offset(is_xmm, i));
+        op->fn(op->vece, t0, t0, t1);
+        tcg_gen_st_i64(t0, cpu_env, op1_offset + sse_q_offset(is_xmm, i));
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+}
+
+/* psrl and psll by an immediate */
+static void gen_sse_shifti(int vece, int left, int is_xmm, int offset, int c)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    int i;
+
+    for (i = 0; i < (is_xmm ? 2 : 1); i++) {
+        if (c >= (8 << vece)) {
+            tcg_gen_movi_i64(t0, 0);
+        } else {
+            tcg_gen_ld_i64(t0, cpu_env, offset + sse_q_offset(is_xmm, i));
+            if (left) {
+                tcg_gen_vec_shli_i64(vece, t0, t0, c);
+            } else {
+                tcg_gen_vec_shri_i64(vece, t0, t0, c);
+            }
+        }
+        tcg_gen_st_i64(t0, cpu_env, offset + sse_q_offset(is_xmm, i));
+    }
+    tcg_temp_free_i64(t0);
+}
+
 static const SSEFunc_0_pi sse_op_table3ai[] = {
     gen_helper_cvtsi2ss,
     gen_helper_cvtsi2sd
@@ -3107,7 +3283,7 @@ static const struct SSEOpHelper_ppi sse_op_table7[256] = {
 
 static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
 {
-    int b1, op1_offset, op2_offset, is_xmm, val, ot;
+    int b1, op1_offset, op2_offset, is_xmm, val, ot, op;
     int modrm, mod, rm, reg, reg_addr, offset_addr;
     SSEFunc_0_pp sse_fn_pp;
     SSEFunc_0_ppi sse_fn_ppi;
@@ -3496,6 +3672,20 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
 	        goto illegal_op;
             }
             val = ldub_code(s->pc++);
+            op = (modrm >> 3) & 7;
+            if (op == 2 || op == 6) {
+                /* logical shifts are done inline */
+                if (is_xmm) {
+                    rm = (modrm & 7) | REX_B(s);
+                    op2_offset = offsetof(CPUX86State,xmm_regs[rm]);
+                } else {
+                    rm = (modrm & 7);
+                    op2_offset = offsetof(CPUX86State,fpregs[rm].mmx);
+                }
+                gen_sse_shifti(((b - 1) & 3) + 1, op == 6, is_xmm,
+                               op2_offset, val);
+                break;
+            }
             if (is_xmm) {
                 gen_op_movl_T0_im(val);
                 tcg_gen_st32_tl(cpu_T[0], cpu_env, offsetof(CPUX86State,xmm_t0.XMM_L(0)));
@@ -4116,6 +4306,11 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
             sse_fn_ppt(cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (sse_inline_ops[b].fn) {
+                gen_sse_inline(&sse_inline_ops[b], is_xmm,
+                               op1_offset, op2_offset);
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_pp(cpu_ptr0, cpu_ptr1);
@@ -4682,7 +4877,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             gen_movtl_T1_im(next_eip);
             gen_push_T1(s);
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -4709,7 +4904,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             if (s->dflag == 0)
                 gen_op_andl_T0_ffff();
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -6237,7 +6432,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xc3: /* ret */
         gen_pop_T0(s);
@@ -6245,7 +6440,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xca: /* lret im */
         val = ldsw_code(s->pc);
@@ -7826,6 +8021,9 @@ static inline void gen_intermediate_code_internal(CPUX86State *env,
                     || (flags & HF_SOFTMMU_MASK)
 #endif
                     );
+    dc->trace = dc->jmp_opt && (tb->cflags & CF_TRACE);
+    dc->trace_exits = 0;
+    dc->goto_tb_used = 0;
 #if 0
     /* check addseg logic */
     if (!dc->addseg && (dc->vm86 || !dc->pe || !dc->code32))
@@ -7857,6 +8055,9 @@ static inline void gen_intermediate_code_internal(CPUX86State *env,
         max_insns = CF_COUNT_MASK;
 
     gen_icount_start();
+#ifdef TARGET_HAS_HOT_TRACES
+    gen_trace_count(dc, tb);
+#endif
     for(;;) {
         if (unlikely(!QTAILQ_EMPTY(&env->breakpoints))) {
             QTAILQ_FOREACH(bp, &env->breakpoints, entry) {
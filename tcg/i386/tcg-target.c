@@ -263,6 +263,7 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_JMP_short	(0xeb)
 #define OPC_LEA         (0x8d)
 #define OPC_MOVB_EvGv	(0x88)		/* stores, more or less */
+#define OPC_MOVB_EvIz	(0xc6)
 #define OPC_MOVL_EvGv	(0x89)		/* stores, more or less */
 #define OPC_MOVL_GvEv	(0x8b)		/* loads, more or less */
 #define OPC_MOVL_EvIz	(0xc7)
@@ -942,15 +943,70 @@ static void tcg_out_branch(TCGContext *s, int call, tcg_target_long dest)
     tcg_target_long disp = dest - (tcg_target_long)s->code_ptr - 5;
 
     if (disp == (int32_t)disp) {
+        tcg_out_code_reloc(s, s->code_ptr, TCG_CODE_RELOC_BRANCH, dest);
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
         tcg_out32(s, disp);
     } else {
+        tcg_out_code_reloc(s, s->code_ptr, TCG_CODE_RELOC_BRANCH_ABS, dest);
         tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, dest);
         tcg_out_modrm(s, OPC_GRP5,
                       call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
     }
 }
 
+/* Same as tcg_out_branch, for code that has been moved to CODE_BUF */
+static int tcg_branch_is_direct(uint8_t *code_ptr, tcg_target_long dest)
+{
+    tcg_target_long disp = dest - (tcg_target_long)code_ptr - 5;
+
+    return disp == (int32_t)disp;
+}
+
+int tcg_apply_code_reloc(uint8_t *code_buf, int code_size,
+                         const TCGCodeReloc *r, tcg_target_long tb)
+{
+    uint8_t *code_ptr = code_buf + r->offset;
+    int width;
+
+    switch (r->type) {
+    case TCG_CODE_RELOC_BRANCH:
+        width = 5;
+        break;
+    case TCG_CODE_RELOC_TB:
+        width = sizeof(tcg_target_long);
+        break;
+    default:
+        width = 0;
+        break;
+    }
+    if (r->offset > code_size || code_size - r->offset < width) {
+        return -1;
+    }
+
+    switch (r->type) {
+    case TCG_CODE_RELOC_BRANCH:
+        if (!tcg_branch_is_direct(code_ptr, r->value)) {
+            return -1;
+        }
+        *(uint32_t *)(code_ptr + 1) = r->value - (tcg_target_long)code_ptr - 5;
+        return 0;
+    case TCG_CODE_RELOC_BRANCH_ABS:
+        /* the absolute address is unchanged, but tcg_out_branch would
+           now pick the shorter encoding */
+        return tcg_branch_is_direct(code_ptr, r->value) ? -1 : 0;
+    case TCG_CODE_RELOC_TB:
+        tb += r->value & 3;
+#if TCG_TARGET_REG_BITS == 64
+        *(uint64_t *)code_ptr = tb;
+#else
+        *(uint32_t *)code_ptr = tb;
+#endif
+        return 0;
+    default:
+        return -1;
+    }
+}
+
 static inline void tcg_out_calli(TCGContext *s, tcg_target_long dest)
 {
     tcg_out_branch(s, 1, dest);
@@ -1082,6 +1138,47 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
     tcg_out_modrm_offset(s, OPC_ADD_GvEv + P_REXW, r0, r1,
                          offsetof(CPUTLBEntry, addend) - which);
 }
+
+/* Mark the RAM page written by a TLB hit store in env->dirty_log.  For
+   RAM, the iotlb entry holds the ram_addr of the page minus its virtual
+   address (see tlb_set_page), with the section number in the low bits.
+   The store has been done, so both argument registers are free again.  */
+static void tcg_out_dirty_log(TCGContext *s, int addrlo, int mem_index)
+{
+    const int r0 = tcg_target_call_iarg_regs[0];
+    const int r1 = tcg_target_call_iarg_regs[1];
+    const int iotlb_bits = sizeof(target_phys_addr_t) == 8 ? 3 : 2;
+    TCGType type = TCG_TYPE_I32;
+    int rexw = 0;
+
+    if (TCG_TARGET_REG_BITS == 64 && TARGET_LONG_BITS == 64) {
+        type = TCG_TYPE_I64;
+        rexw = P_REXW;
+    }
+
+    tcg_out_mov(s, type, r1, addrlo);
+    tcg_out_shifti(s, SHIFT_SHR + rexw, r1, TARGET_PAGE_BITS - iotlb_bits);
+    tgen_arithi(s, ARITH_AND + rexw, r1,
+                (CPU_TLB_SIZE - 1) << iotlb_bits, 0);
+
+    /* mov iotlb(env, r1), r0; only the low half on 32-bit hosts */
+    tcg_out_modrm_sib_offset(s, OPC_MOVL_GvEv + P_REXW, r0, TCG_AREG0, r1, 0,
+                             offsetof(CPUArchState, iotlb[mem_index][0]));
+
+    /* r0 = ((r0 & TARGET_PAGE_MASK) + (addrlo & TARGET_PAGE_MASK))
+            >> TARGET_PAGE_BITS */
+    tcg_out_mov(s, type, r1, addrlo);
+    tgen_arithi(s, ARITH_AND + rexw, r1, TARGET_PAGE_MASK, 0);
+    tgen_arithi(s, ARITH_AND + P_REXW, r0, TARGET_PAGE_MASK, 0);
+    tgen_arithr(s, ARITH_ADD + P_REXW, r0, r1);
+    tcg_out_shifti(s, SHIFT_SHR + P_REXW, r0, TARGET_PAGE_BITS);
+
+    /* movb $1, (dirty_log, r0) */
+    tcg_out_ld(s, TCG_TYPE_PTR, r1, TCG_AREG0,
+               offsetof(CPUArchState, dirty_log));
+    tcg_out_modrm_sib_offset(s, OPC_MOVB_EvIz, 0, r1, r0, 0, 0);
+    tcg_out8(s, 1);
+}
 #endif
 
 static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
@@ -1406,6 +1503,9 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     /* TLB Hit.  */
     tcg_out_qemu_st_direct(s, data_reg, data_reg2,
                            tcg_target_call_iarg_regs[0], 0, opc);
+    if (s->dirty_log) {
+        tcg_out_dirty_log(s, args[addrlo_idx], mem_index);
+    }
 
     /* jmp label2 */
     tcg_out8(s, OPC_JMP_short);
@@ -1513,12 +1613,27 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        if (s->code_relocs_enabled && args[0] != 0) {
+            /* always the full-width immediate, so that it can be patched */
+            tcg_out_opc(s, OPC_MOVL_Iv + P_REXW, 0, TCG_REG_EAX, 0);
+            tcg_out_code_reloc(s, s->code_ptr, TCG_CODE_RELOC_TB, args[0]);
+            tcg_out32(s, args[0]);
+            if (TCG_TARGET_REG_BITS == 64) {
+                tcg_out32(s, args[0] >> 31 >> 1);
+            }
+        } else {
+            tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        }
         tcg_out_jmp(s, (tcg_target_long) tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
             /* direct jump method */
+            /* align the displacement, so that tb_set_jmp_target1() can
+               patch it while another vCPU thread runs this code */
+            while (((tcg_target_long)s->code_ptr + 1) & 3) {
+                tcg_out8(s, OPC_XCHG_ax_r32); /* nop */
+            }
             tcg_out8(s, OPC_JMP_long); /* jmp im */
             s->tb_jmp_offset[args[0]] = s->code_ptr - s->code_buf;
             tcg_out32(s, 0);
@@ -1529,6 +1644,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp *reg */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out_calli(s, args[0]);
@@ -1840,6 +1959,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_call, { "ri" } },
     { INDEX_op_jmp, { "ri" } },
     { INDEX_op_br, { } },
@@ -2048,6 +2168,10 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     /* jmp *tb.  */
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 
+    /* Return path for goto_ptr: exit_tb(0) */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -86,6 +86,7 @@ typedef enum {
 #define TCG_TARGET_HAS_nand_i32         0
 #define TCG_TARGET_HAS_nor_i32          0
 #define TCG_TARGET_HAS_deposit_i32      1
+#define TCG_TARGET_HAS_goto_ptr         1
 
 #if TCG_TARGET_REG_BITS == 64
 #define TCG_TARGET_HAS_div2_i64         1
@@ -116,6 +117,12 @@ typedef enum {
 
 #define TCG_TARGET_HAS_GUEST_BASE
 
+/* Generated code can be moved, see TCGCodeReloc */
+#define TCG_TARGET_HAS_CODE_RELOCS
+
+/* qemu_st can log dirty RAM pages inline, see TCGContext.dirty_log */
+#define TCG_TARGET_HAS_DIRTY_LOG
+
 /* Note: must be synced with dyngen-exec.h */
 #if TCG_TARGET_REG_BITS == 64
 # define TCG_AREG0 TCG_REG_R14
@@ -132,6 +132,7 @@ typedef enum {
 #define TCG_TARGET_HAS_rot_i32          1
 #define TCG_TARGET_HAS_rot_i64          1
 #define TCG_TARGET_HAS_deposit_i32      0
+#define TCG_TARGET_HAS_goto_ptr         0
 #define TCG_TARGET_HAS_deposit_i64      0
 
 /* optional instructions automatically implemented */
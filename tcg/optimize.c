@@ -516,10 +516,574 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
     return gen_args;
 }
 
+/* Bits that may be nonzero (z_mask) and bits that are known to be one
+   (o_mask) for each temp.  For temps written by 32-bit operations only
+   the low 32 bits are tracked; the high bits are left unknown because
+   hosts do not agree on what they contain. */
+struct tcg_temp_bits {
+    tcg_target_ulong z_mask;
+    tcg_target_ulong o_mask;
+};
+
+static struct tcg_temp_bits temp_bits[TCG_MAX_TEMPS];
+
+/* A value known to live in memory at BASE + OFS.  For the load cache VAL
+   holds the temp the value can be copied from and OP is the load that
+   would produce it.  For pending stores ARGS and OP_INDEX locate the
+   store in the output stream so that it can be deleted if overwritten. */
+struct tcg_mem_info {
+    TCGArg base;
+    tcg_target_long ofs;
+    int size;
+    TCGOpcode op;
+    TCGArg val;
+    TCGArg *args;
+    int op_index;
+};
+
+#define TCG_OPT_MEM_ENTRIES 16
+
+static struct tcg_mem_info mem_loads[TCG_OPT_MEM_ENTRIES];
+static int nb_mem_loads;
+static struct tcg_mem_info mem_stores[TCG_OPT_MEM_ENTRIES];
+static int nb_mem_stores;
+
+static tcg_target_ulong op_width_mask(TCGOpcode op)
+{
+    return op_bits(op) == 32 ? 0xffffffffu : (tcg_target_ulong)-1;
+}
+
+static void reset_bits(TCGArg temp)
+{
+    temp_bits[temp].z_mask = -1;
+    temp_bits[temp].o_mask = 0;
+}
+
+static void set_bits(TCGOpcode op, TCGArg temp, tcg_target_ulong z_mask,
+                     tcg_target_ulong o_mask)
+{
+    tcg_target_ulong width = op_width_mask(op);
+
+    temp_bits[temp].z_mask = (z_mask & width) | ~width;
+    temp_bits[temp].o_mask = o_mask & width;
+}
+
+static bool bits_are_const(TCGOpcode op, TCGArg temp)
+{
+    return ((temp_bits[temp].z_mask ^ temp_bits[temp].o_mask)
+            & op_width_mask(op)) == 0;
+}
+
+static int mem_op_size(TCGOpcode op)
+{
+    switch (op) {
+    case INDEX_op_ld8u_i32:
+    case INDEX_op_ld8s_i32:
+    case INDEX_op_st8_i32:
+    case INDEX_op_ld8u_i64:
+    case INDEX_op_ld8s_i64:
+    case INDEX_op_st8_i64:
+        return 1;
+    case INDEX_op_ld16u_i32:
+    case INDEX_op_ld16s_i32:
+    case INDEX_op_st16_i32:
+    case INDEX_op_ld16u_i64:
+    case INDEX_op_ld16s_i64:
+    case INDEX_op_st16_i64:
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static bool mem_ranges_overlap(tcg_target_long ofs1, int size1,
+                               tcg_target_long ofs2, int size2)
+{
+    return ofs1 < ofs2 + size2 && ofs2 < ofs1 + size1;
+}
+
+/* Accesses are only tracked relative to fixed registers (env), and never
+   to the slots backing globals or the spill area: the register allocator
+   reads and writes those behind the back of the opcode stream. */
+static bool mem_is_tracked(TCGContext *s, TCGArg base, tcg_target_long ofs,
+                           int size)
+{
+    TCGTemp *ts;
+    int i;
+
+    if (base >= s->nb_globals || !s->temps[base].fixed_reg) {
+        return false;
+    }
+    if (s->temps[base].reg == s->frame_reg &&
+        mem_ranges_overlap(ofs, size, s->frame_start,
+                           s->frame_end - s->frame_start)) {
+        return false;
+    }
+    for (i = 0; i < s->nb_globals; i++) {
+        ts = &s->temps[i];
+        if (!ts->fixed_reg && ts->mem_reg == s->temps[base].reg &&
+            mem_ranges_overlap(ofs, size, ts->mem_offset,
+                               ts->type == TCG_TYPE_I64 ? 8 : 4)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Two different fixed registers may point to the same memory. */
+static bool mem_may_alias(const struct tcg_mem_info *m, TCGArg base,
+                          tcg_target_long ofs, int size)
+{
+    return m->base != base || mem_ranges_overlap(m->ofs, m->size, ofs, size);
+}
+
+static void mem_remove(struct tcg_mem_info *tab, int *nb, int i)
+{
+    tab[i] = tab[--*nb];
+}
+
+static void mem_add(struct tcg_mem_info *tab, int *nb, TCGArg base,
+                    tcg_target_long ofs, int size, TCGOpcode op, TCGArg val,
+                    TCGArg *args, int op_index)
+{
+    struct tcg_mem_info *m;
+
+    if (*nb == TCG_OPT_MEM_ENTRIES) {
+        return;
+    }
+    m = &tab[(*nb)++];
+    m->base = base;
+    m->ofs = ofs;
+    m->size = size;
+    m->op = op;
+    m->val = val;
+    m->args = args;
+    m->op_index = op_index;
+}
+
+/* TEMP is about to be overwritten: forget everything that refers to it. */
+static void mem_invalidate_temp(TCGArg temp)
+{
+    int i;
+
+    for (i = nb_mem_loads - 1; i >= 0; i--) {
+        if (mem_loads[i].val == temp || mem_loads[i].base == temp) {
+            mem_remove(mem_loads, &nb_mem_loads, i);
+        }
+    }
+    for (i = nb_mem_stores - 1; i >= 0; i--) {
+        if (mem_stores[i].base == temp) {
+            mem_remove(mem_stores, &nb_mem_stores, i);
+        }
+    }
+}
+
+static void mem_reset(void)
+{
+    nb_mem_loads = 0;
+    nb_mem_stores = 0;
+}
+
+static void opt_write_temp(TCGArg temp)
+{
+    reset_bits(temp);
+    mem_invalidate_temp(temp);
+}
+
+/* The load that reads back exactly what store OP wrote, if any. */
+static TCGOpcode mem_forward_op(TCGOpcode op)
+{
+    switch (op) {
+    case INDEX_op_st_i32:
+        return INDEX_op_ld_i32;
+    case INDEX_op_st_i64:
+        return INDEX_op_ld_i64;
+    default:
+        return INDEX_op_end;
+    }
+}
+
+/* Known bits of the result of a load, for the zero-extending ones. */
+static tcg_target_ulong mem_load_z_mask(TCGOpcode op)
+{
+    switch (op) {
+    case INDEX_op_ld8u_i32:
+    case INDEX_op_ld8u_i64:
+        return 0xff;
+    case INDEX_op_ld16u_i32:
+    case INDEX_op_ld16u_i64:
+        return 0xffff;
+    case INDEX_op_ld32u_i64:
+        return 0xffffffffu;
+    default:
+        return -1;
+    }
+}
+
+/* Emit "mov dst, src" (or nothing if they are the same temp) in place of
+   the operation at OP_INDEX.  Returns the number of arguments written. */
+static int opt_gen_mov(TCGOpcode op, int op_index, TCGArg *gen_args,
+                       TCGArg dst, TCGArg src)
+{
+    struct tcg_temp_bits bits = temp_bits[src];
+
+    if (dst == src) {
+        gen_opc_buf[op_index] = INDEX_op_nop;
+        return 0;
+    }
+    gen_opc_buf[op_index] = op_to_mov(op);
+    opt_write_temp(dst);
+    set_bits(op, dst, bits.z_mask, bits.o_mask);
+    gen_args[0] = dst;
+    gen_args[1] = src;
+    return 2;
+}
+
+static int opt_gen_movi(TCGOpcode op, int op_index, TCGArg *gen_args,
+                        TCGArg dst, TCGArg val)
+{
+    gen_opc_buf[op_index] = op_to_movi(op);
+    opt_write_temp(dst);
+    set_bits(op, dst, val, val);
+    gen_args[0] = dst;
+    gen_args[1] = val;
+    return 2;
+}
+
+/* Second pass over the output of constant folding.  Within each basic
+   block it tracks known bits to drop redundant masking, replaces repeated
+   loads from env (and loads of a value just stored to env) with moves,
+   and deletes stores to env that are overwritten before anything could
+   observe them.  Opcodes are never removed, only replaced with nops, so
+   that search_pc keeps working. */
+static TCGArg *tcg_mem_and_bits(TCGContext *s, uint16_t *tcg_opc_ptr,
+                                TCGArg *args, TCGOpDef *tcg_op_defs)
+{
+    int i, nb_ops, op_index, nb_call_args, size;
+    TCGOpcode op;
+    const TCGOpDef *def;
+    TCGArg *gen_args;
+    tcg_target_ulong width, z1, z2, o1, o2;
+    tcg_target_long ofs;
+    TCGArg val, base;
+
+    for (i = 0; i < s->nb_temps; i++) {
+        reset_bits(i);
+    }
+    mem_reset();
+
+    nb_ops = tcg_opc_ptr - gen_opc_buf;
+    gen_args = args;
+    for (op_index = 0; op_index < nb_ops; op_index++) {
+        op = gen_opc_buf[op_index];
+        def = &tcg_op_defs[op];
+        width = op_width_mask(op);
+
+        switch (op) {
+        CASE_OP_32_64(movi):
+            opt_write_temp(args[0]);
+            set_bits(op, args[0], args[1], args[1]);
+            gen_args[0] = args[0];
+            gen_args[1] = args[1];
+            gen_args += 2;
+            args += 2;
+            continue;
+
+        CASE_OP_32_64(mov):
+            gen_args += opt_gen_mov(op, op_index, gen_args, args[0], args[1]);
+            args += 2;
+            continue;
+
+        CASE_OP_32_64(and):
+            z1 = temp_bits[args[1]].z_mask;
+            z2 = temp_bits[args[2]].z_mask;
+            o1 = temp_bits[args[1]].o_mask;
+            o2 = temp_bits[args[2]].o_mask;
+            if ((z1 & z2 & width) == 0) {
+                gen_args += opt_gen_movi(op, op_index, gen_args, args[0], 0);
+            } else if ((z1 & ~o2 & width) == 0) {
+                gen_args += opt_gen_mov(op, op_index, gen_args,
+                                        args[0], args[1]);
+            } else if ((z2 & ~o1 & width) == 0) {
+                gen_args += opt_gen_mov(op, op_index, gen_args,
+                                        args[0], args[2]);
+            } else {
+                opt_write_temp(args[0]);
+                set_bits(op, args[0], z1 & z2, o1 & o2);
+                gen_args[0] = args[0];
+                gen_args[1] = args[1];
+                gen_args[2] = args[2];
+                gen_args += 3;
+            }
+            args += 3;
+            continue;
+
+        CASE_OP_32_64(or):
+            z1 = temp_bits[args[1]].z_mask;
+            z2 = temp_bits[args[2]].z_mask;
+            o1 = temp_bits[args[1]].o_mask;
+            o2 = temp_bits[args[2]].o_mask;
+            if ((z2 & ~o1 & width) == 0) {
+                gen_args += opt_gen_mov(op, op_index, gen_args,
+                                        args[0], args[1]);
+            } else if ((z1 & ~o2 & width) == 0) {
+                gen_args += opt_gen_mov(op, op_index, gen_args,
+                                        args[0], args[2]);
+            } else {
+                opt_write_temp(args[0]);
+                set_bits(op, args[0], z1 | z2, o1 | o2);
+                gen_args[0] = args[0];
+                gen_args[1] = args[1];
+                gen_args[2] = args[2];
+                gen_args += 3;
+            }
+            args += 3;
+            continue;
+
+        CASE_OP_32_64(xor):
+            z1 = temp_bits[args[1]].z_mask;
+            z2 = temp_bits[args[2]].z_mask;
+            o1 = temp_bits[args[1]].o_mask;
+            o2 = temp_bits[args[2]].o_mask;
+            opt_write_temp(args[0]);
+            set_bits(op, args[0], z1 | z2, (o1 & ~z2) | (o2 & ~z1));
+            gen_args[0] = args[0];
+            gen_args[1] = args[1];
+            gen_args[2] = args[2];
+            gen_args += 3;
+            args += 3;
+            continue;
+
+        CASE_OP_32_64(shl):
+        CASE_OP_32_64(shr):
+            z1 = temp_bits[args[1]].z_mask & width;
+            o1 = temp_bits[args[1]].o_mask & width;
+            o2 = temp_bits[args[2]].o_mask;
+            if (bits_are_const(op, args[2]) && o2 < op_bits(op)) {
+                if (op == INDEX_op_shl_i32 || op == INDEX_op_shl_i64) {
+                    z1 <<= o2;
+                    o1 <<= o2;
+                } else {
+                    z1 >>= o2;
+                    o1 >>= o2;
+                }
+                if ((z1 & width) == 0) {
+                    gen_args += opt_gen_movi(op, op_index, gen_args,
+                                             args[0], 0);
+                    args += 3;
+                    continue;
+                }
+                opt_write_temp(args[0]);
+                set_bits(op, args[0], z1, o1);
+            } else {
+                opt_write_temp(args[0]);
+            }
+            gen_args[0] = args[0];
+            gen_args[1] = args[1];
+            gen_args[2] = args[2];
+            gen_args += 3;
+            args += 3;
+            continue;
+
+        CASE_OP_32_64(ext8u):
+        CASE_OP_32_64(ext16u):
+        case INDEX_op_ext32u_i64:
+            if (op == INDEX_op_ext8u_i32 || op == INDEX_op_ext8u_i64) {
+                z2 = 0xff;
+            } else if (op == INDEX_op_ext16u_i32 || op == INDEX_op_ext16u_i64) {
+                z2 = 0xffff;
+            } else {
+                z2 = 0xffffffffu;
+            }
+            z1 = temp_bits[args[1]].z_mask;
+            o1 = temp_bits[args[1]].o_mask;
+            if ((z1 & ~z2 & width) == 0) {
+                gen_args += opt_gen_mov(op, op_index, gen_args,
+                                        args[0], args[1]);
+            } else {
+                opt_write_temp(args[0]);
+                set_bits(op, args[0], z1 & z2, o1 & z2);
+                gen_args[0] = args[0];
+                gen_args[1] = args[1];
+                gen_args += 2;
+            }
+            args += 2;
+            continue;
+
+        CASE_OP_32_64(setcond):
+            opt_write_temp(args[0]);
+            set_bits(op, args[0], 1, 0);
+            for (i = 0; i < def->nb_args; i++) {
+                gen_args[i] = args[i];
+            }
+            gen_args += def->nb_args;
+            args += def->nb_args;
+            continue;
+
+        case INDEX_op_ld8u_i32:
+        case INDEX_op_ld8s_i32:
+        case INDEX_op_ld16u_i32:
+        case INDEX_op_ld16s_i32:
+        case INDEX_op_ld_i32:
+        case INDEX_op_ld8u_i64:
+        case INDEX_op_ld8s_i64:
+        case INDEX_op_ld16u_i64:
+        case INDEX_op_ld16s_i64:
+        case INDEX_op_ld32u_i64:
+        case INDEX_op_ld32s_i64:
+        case INDEX_op_ld_i64:
+            size = mem_op_size(op);
+            ofs = args[2];
+            if (mem_is_tracked(s, args[1], ofs, size)) {
+                for (i = 0; i < nb_mem_loads; i++) {
+                    if (mem_loads[i].op == op &&
+                        mem_loads[i].base == args[1] &&
+                        mem_loads[i].ofs == ofs) {
+                        break;
+                    }
+                }
+                if (i < nb_mem_loads) {
+                    gen_args += opt_gen_mov(op, op_index, gen_args,
+                                            args[0], mem_loads[i].val);
+                    args += 3;
+                    continue;
+                }
+            }
+            /* The load is kept: stores it can see are no longer dead. */
+            for (i = nb_mem_stores - 1; i >= 0; i--) {
+                if (args[1] >= s->nb_globals || !s->temps[args[1]].fixed_reg ||
+                    mem_may_alias(&mem_stores[i], args[1], ofs, size)) {
+                    mem_remove(mem_stores, &nb_mem_stores, i);
+                }
+            }
+            opt_write_temp(args[0]);
+            set_bits(op, args[0], mem_load_z_mask(op), 0);
+            if (args[0] != args[1] && mem_is_tracked(s, args[1], ofs, size)) {
+                mem_add(mem_loads, &nb_mem_loads, args[1], ofs, size, op,
+                        args[0], NULL, op_index);
+            }
+            gen_args[0] = args[0];
+            gen_args[1] = args[1];
+            gen_args[2] = args[2];
+            gen_args += 3;
+            args += 3;
+            continue;
+
+        case INDEX_op_st8_i32:
+        case INDEX_op_st16_i32:
+        case INDEX_op_st_i32:
+        case INDEX_op_st8_i64:
+        case INDEX_op_st16_i64:
+        case INDEX_op_st32_i64:
+        case INDEX_op_st_i64:
+            size = mem_op_size(op);
+            /* gen_args may lag behind args after an op was shortened, so
+               read the operands before writing the op back */
+            val = args[0];
+            base = args[1];
+            ofs = args[2];
+            gen_args[0] = val;
+            gen_args[1] = base;
+            gen_args[2] = ofs;
+            if (mem_is_tracked(s, base, ofs, size)) {
+                for (i = nb_mem_stores - 1; i >= 0; i--) {
+                    if (mem_stores[i].base == base &&
+                        mem_stores[i].ofs == ofs &&
+                        mem_stores[i].size == size) {
+                        /* Overwritten before being read: delete it. */
+                        gen_opc_buf[mem_stores[i].op_index] = INDEX_op_nopn;
+                        mem_stores[i].args[0] = 3;
+                        mem_stores[i].args[2] = 3;
+                        mem_remove(mem_stores, &nb_mem_stores, i);
+                    }
+                }
+                for (i = nb_mem_loads - 1; i >= 0; i--) {
+                    if (mem_may_alias(&mem_loads[i], base, ofs, size)) {
+                        mem_remove(mem_loads, &nb_mem_loads, i);
+                    }
+                }
+                mem_add(mem_stores, &nb_mem_stores, base, ofs, size, op,
+                        val, gen_args, op_index);
+                if (mem_forward_op(op) != INDEX_op_end && val != base) {
+                    mem_add(mem_loads, &nb_mem_loads, base, ofs, size,
+                            mem_forward_op(op), val, NULL, op_index);
+                }
+            } else {
+                /* Unknown address: it may alias any cached value. */
+                nb_mem_loads = 0;
+            }
+            gen_args += 3;
+            args += 3;
+            continue;
+
+        case INDEX_op_call:
+            nb_call_args = (args[0] >> 16) + (args[0] & 0xffff);
+            mem_reset();
+            for (i = 0; i < s->nb_globals; i++) {
+                reset_bits(i);
+            }
+            for (i = 0; i < (args[0] >> 16); i++) {
+                reset_bits(args[i + 1]);
+            }
+            i = nb_call_args + 3;
+            while (i) {
+                *gen_args = *args;
+                args++;
+                gen_args++;
+                i--;
+            }
+            continue;
+
+        case INDEX_op_nopn:
+            i = args[0];
+            memmove(gen_args, args, i * sizeof(TCGArg));
+            gen_args += i;
+            args += i;
+            continue;
+
+        default:
+            break;
+        }
+
+        /* Anything else: leaving the block, possibly raising an exception
+           or clobbering memory makes all the tracked state stale. */
+        if (op == INDEX_op_set_label ||
+            (def->flags & (TCG_OPF_BB_END | TCG_OPF_CALL_CLOBBER |
+                           TCG_OPF_SIDE_EFFECTS))) {
+            mem_reset();
+            if (op == INDEX_op_set_label || (def->flags & TCG_OPF_BB_END)) {
+                for (i = 0; i < s->nb_temps; i++) {
+                    reset_bits(i);
+                }
+            }
+        }
+        for (i = 0; i < def->nb_oargs; i++) {
+            opt_write_temp(args[i]);
+        }
+        for (i = 0; i < def->nb_args; i++) {
+            gen_args[i] = args[i];
+        }
+        args += def->nb_args;
+        gen_args += def->nb_args;
+    }
+
+    return gen_args;
+}
+
 TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr,
         TCGArg *args, TCGOpDef *tcg_op_defs)
 {
     TCGArg *res;
     res = tcg_constant_folding(s, tcg_opc_ptr, args, tcg_op_defs);
+    res = tcg_mem_and_bits(s, tcg_opc_ptr, args, tcg_op_defs);
     return res;
 }
@@ -2118,6 +2118,267 @@ static inline void tcg_gen_deposit_i64(TCGv_i64 ret, TCGv_i64 arg1,
     tcg_temp_free_i64(t1);
 }
 
+/***************************************/
+/* Lane-wise integer vector operations.  The lanes are packed in an i32 or
+   i64 value and handled with ordinary integer ops ("SIMD within a
+   register"), so that guest vector instructions can be translated inline
+   instead of calling a helper for every instruction.  'vece' is the log2
+   of the lane size in bytes: 0 for 8-bit lanes up to 3 for a single 64-bit
+   lane.  There are no vector types in the IR, so wider guest registers
+   are handled in 64-bit pieces; see tcg/TODO. */
+
+/* Replicate the low lane of c to all the lanes of a 64-bit value */
+static inline uint64_t tcg_vec_dup_const(int vece, uint64_t c)
+{
+    switch (vece) {
+    case 0:
+        return 0x0101010101010101ull * (uint8_t)c;
+    case 1:
+        return 0x0001000100010001ull * (uint16_t)c;
+    case 2:
+        return 0x0000000100000001ull * (uint32_t)c;
+    default:
+        return c;
+    }
+}
+
+/* The top bit of every lane */
+static inline uint64_t tcg_vec_msb(int vece)
+{
+    return tcg_vec_dup_const(vece, 1ull << ((8 << vece) - 1));
+}
+
+/* The top bit of every lane is computed separately, so that the carries
+   and borrows of the other bits never cross into the next lane.  m has
+   the top bit of every lane set. */
+static inline void tcg_gen_vec_add_mask_i64(TCGv_i64 ret, TCGv_i64 arg1,
+                                            TCGv_i64 arg2, int64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, arg1, ~m);
+    tcg_gen_andi_i64(t2, arg2, ~m);
+    tcg_gen_xor_i64(t3, arg1, arg2);
+    tcg_gen_add_i64(ret, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(ret, ret, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static inline void tcg_gen_vec_sub_mask_i64(TCGv_i64 ret, TCGv_i64 arg1,
+                                            TCGv_i64 arg2, int64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_ori_i64(t1, arg1, m);
+    tcg_gen_andi_i64(t2, arg2, ~m);
+    tcg_gen_eqv_i64(t3, arg1, arg2);
+    tcg_gen_sub_i64(ret, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(ret, ret, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static inline void tcg_gen_vec_cmpeq_mask_i64(TCGv_i64 ret, TCGv_i64 arg1,
+                                              TCGv_i64 arg2, int64_t m,
+                                              int lane_bits)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+
+    /* set the top bit of the lanes that differ, then invert */
+    tcg_gen_xor_i64(t1, arg1, arg2);
+    tcg_gen_andi_i64(t2, t1, ~m);
+    tcg_gen_addi_i64(t2, t2, ~m);
+    tcg_gen_or_i64(t2, t2, t1);
+    tcg_gen_not_i64(t2, t2);
+    tcg_gen_andi_i64(t2, t2, m);
+    /* spread the top bit over the lane: (0x80 - 0x01) | 0x80 */
+    tcg_gen_shri_i64(t1, t2, lane_bits - 1);
+    tcg_gen_sub_i64(t1, t2, t1);
+    tcg_gen_or_i64(ret, t1, t2);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+static inline void tcg_gen_vec_add_i64(int vece, TCGv_i64 ret,
+                                       TCGv_i64 arg1, TCGv_i64 arg2)
+{
+    if (vece == 3) {
+        tcg_gen_add_i64(ret, arg1, arg2);
+    } else {
+        tcg_gen_vec_add_mask_i64(ret, arg1, arg2, tcg_vec_msb(vece));
+    }
+}
+
+static inline void tcg_gen_vec_sub_i64(int vece, TCGv_i64 ret,
+                                       TCGv_i64 arg1, TCGv_i64 arg2)
+{
+    if (vece == 3) {
+        tcg_gen_sub_i64(ret, arg1, arg2);
+    } else {
+        tcg_gen_vec_sub_mask_i64(ret, arg1, arg2, tcg_vec_msb(vece));
+    }
+}
+
+/* Set the lanes that are equal to all ones, the others to zero */
+static inline void tcg_gen_vec_cmpeq_i64(int vece, TCGv_i64 ret,
+                                         TCGv_i64 arg1, TCGv_i64 arg2)
+{
+    if (vece == 3) {
+        tcg_gen_setcond_i64(TCG_COND_EQ, ret, arg1, arg2);
+        tcg_gen_neg_i64(ret, ret);
+    } else {
+        tcg_gen_vec_cmpeq_mask_i64(ret, arg1, arg2, tcg_vec_msb(vece),
+                                   8 << vece);
+    }
+}
+
+/* Logical shifts of every lane by c, which must be less than the lane
+   size in bits */
+static inline void tcg_gen_vec_shli_i64(int vece, TCGv_i64 ret,
+                                        TCGv_i64 arg1, int c)
+{
+    tcg_gen_shli_i64(ret, arg1, c);
+    if (vece != 3) {
+        tcg_gen_andi_i64(ret, ret, tcg_vec_dup_const(vece, -1ull << c));
+    }
+}
+
+static inline void tcg_gen_vec_shri_i64(int vece, TCGv_i64 ret,
+                                        TCGv_i64 arg1, int c)
+{
+    tcg_gen_shri_i64(ret, arg1, c);
+    if (vece != 3) {
+        uint64_t lane = (1ull << (8 << vece)) - 1;
+
+        tcg_gen_andi_i64(ret, ret, tcg_vec_dup_const(vece, lane >> c));
+    }
+}
+
+/* Replicate the low lane of arg1 to all the lanes */
+static inline void tcg_gen_vec_dup_i64(int vece, TCGv_i64 ret, TCGv_i64 arg1)
+{
+    switch (vece) {
+    case 0:
+        tcg_gen_ext8u_i64(ret, arg1);
+        break;
+    case 1:
+        tcg_gen_ext16u_i64(ret, arg1);
+        break;
+    case 2:
+        tcg_gen_ext32u_i64(ret, arg1);
+        break;
+    default:
+        tcg_gen_mov_i64(ret, arg1);
+        return;
+    }
+    tcg_gen_muli_i64(ret, ret, tcg_vec_dup_const(vece, 1));
+}
+
+/* The same on the lanes of an i32.  vece is at most 2. */
+static inline void tcg_gen_vec_add_i32(int vece, TCGv_i32 ret,
+                                       TCGv_i32 arg1, TCGv_i32 arg2)
+{
+    int32_t m = tcg_vec_msb(vece);
+    TCGv_i32 t1, t2, t3;
+
+    if (vece == 2) {
+        tcg_gen_add_i32(ret, arg1, arg2);
+        return;
+    }
+    t1 = tcg_temp_new_i32();
+    t2 = tcg_temp_new_i32();
+    t3 = tcg_temp_new_i32();
+    tcg_gen_andi_i32(t1, arg1, ~m);
+    tcg_gen_andi_i32(t2, arg2, ~m);
+    tcg_gen_xor_i32(t3, arg1, arg2);
+    tcg_gen_add_i32(ret, t1, t2);
+    tcg_gen_andi_i32(t3, t3, m);
+    tcg_gen_xor_i32(ret, ret, t3);
+    tcg_temp_free_i32(t1);
+    tcg_temp_free_i32(t2);
+    tcg_temp_free_i32(t3);
+}
+
+static inline void tcg_gen_vec_sub_i32(int vece, TCGv_i32 ret,
+                                       TCGv_i32 arg1, TCGv_i32 arg2)
+{
+    int32_t m = tcg_vec_msb(vece);
+    TCGv_i32 t1, t2, t3;
+
+    if (vece == 2) {
+        tcg_gen_sub_i32(ret, arg1, arg2);
+        return;
+    }
+    t1 = tcg_temp_new_i32();
+    t2 = tcg_temp_new_i32();
+    t3 = tcg_temp_new_i32();
+    tcg_gen_ori_i32(t1, arg1, m);
+    tcg_gen_andi_i32(t2, arg2, ~m);
+    tcg_gen_eqv_i32(t3, arg1, arg2);
+    tcg_gen_sub_i32(ret, t1, t2);
+    tcg_gen_andi_i32(t3, t3, m);
+    tcg_gen_xor_i32(ret, ret, t3);
+    tcg_temp_free_i32(t1);
+    tcg_temp_free_i32(t2);
+    tcg_temp_free_i32(t3);
+}
+
+static inline void tcg_gen_vec_cmpeq_i32(int vece, TCGv_i32 ret,
+                                         TCGv_i32 arg1, TCGv_i32 arg2)
+{
+    int32_t m = tcg_vec_msb(vece);
+    TCGv_i32 t1, t2;
+
+    if (vece == 2) {
+        tcg_gen_setcond_i32(TCG_COND_EQ, ret, arg1, arg2);
+        tcg_gen_neg_i32(ret, ret);
+        return;
+    }
+    t1 = tcg_temp_new_i32();
+    t2 = tcg_temp_new_i32();
+    tcg_gen_xor_i32(t1, arg1, arg2);
+    tcg_gen_andi_i32(t2, t1, ~m);
+    tcg_gen_addi_i32(t2, t2, ~m);
+    tcg_gen_or_i32(t2, t2, t1);
+    tcg_gen_not_i32(t2, t2);
+    tcg_gen_andi_i32(t2, t2, m);
+    tcg_gen_shri_i32(t1, t2, (8 << vece) - 1);
+    tcg_gen_sub_i32(t1, t2, t1);
+    tcg_gen_or_i32(ret, t1, t2);
+    tcg_temp_free_i32(t1);
+    tcg_temp_free_i32(t2);
+}
+
+static inline void tcg_gen_vec_dup_i32(int vece, TCGv_i32 ret, TCGv_i32 arg1)
+{
+    switch (vece) {
+    case 0:
+        tcg_gen_ext8u_i32(ret, arg1);
+        tcg_gen_muli_i32(ret, ret, 0x01010101);
+        break;
+    case 1:
+        tcg_gen_ext16u_i32(ret, arg1);
+        tcg_gen_muli_i32(ret, ret, 0x00010001);
+        break;
+    default:
+        tcg_gen_mov_i32(ret, arg1);
+        break;
+    }
+}
+
 /***************************************/
 /* QEMU specific operations. Their type depend on the QEMU CPU
    type. */
@@ -2171,6 +2432,12 @@ static inline void tcg_gen_goto_tb(int idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* Only valid if TCG_TARGET_HAS_goto_ptr */
+static inline void tcg_gen_goto_ptr(TCGv_ptr ptr)
+{
+    tcg_gen_op1i(INDEX_op_goto_ptr, GET_TCGV_PTR(ptr));
+}
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
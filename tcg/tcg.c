@@ -165,6 +165,25 @@ static void tcg_out_label(TCGContext *s, int label_index, void *ptr)
     l->u.value = value;
 }
 
+/* Remember that the code at CODE_PTR refers to VALUE, which lies outside
+   of the TB being generated; see TCGCodeReloc. */
+static inline void tcg_out_code_reloc(TCGContext *s, uint8_t *code_ptr,
+                                      int type, tcg_target_long value)
+{
+    TCGCodeReloc *r;
+
+    if (!s->code_relocs_enabled) {
+        return;
+    }
+    if (s->nb_code_relocs < TCG_MAX_CODE_RELOCS) {
+        r = &s->code_relocs[s->nb_code_relocs];
+        r->offset = code_ptr - s->code_buf;
+        r->type = type;
+        r->value = value;
+    }
+    s->nb_code_relocs++;
+}
+
 int gen_new_label(void)
 {
     TCGContext *s = &tcg_ctx;
@@ -299,6 +318,8 @@ void tcg_func_start(TCGContext *s)
     s->nb_labels = 0;
     s->current_frame_offset = s->frame_start;
 
+    s->nb_code_relocs = 0;
+
     gen_opc_ptr = gen_opc_buf;
     gen_opparam_ptr = gen_opparam_buf;
 }
@@ -2042,6 +2063,27 @@ static void dump_op_count(void)
 #endif
 
 
+/* Number of operations that will generate code, i.e. not counting nops */
+static int tcg_count_ops(void)
+{
+    int i, n = 0;
+
+    for (i = 0; gen_opc_buf[i] != INDEX_op_end; i++) {
+        switch (gen_opc_buf[i]) {
+        case INDEX_op_nop:
+        case INDEX_op_nop1:
+        case INDEX_op_nop2:
+        case INDEX_op_nop3:
+        case INDEX_op_nopn:
+            break;
+        default:
+            n++;
+            break;
+        }
+    }
+    return n;
+}
+
 static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
                                       long search_pc)
 {
@@ -2050,6 +2092,7 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
     const TCGOpDef *def;
     unsigned int dead_args;
     const TCGArg *args;
+    int nb_ops = 0;
 
 #ifdef DEBUG_DISAS
     if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP))) {
@@ -2057,6 +2100,14 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
         tcg_dump_ops(s);
         qemu_log("\n");
     }
+    if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP_OPT))) {
+        nb_ops = tcg_count_ops();
+    }
+#endif
+#ifdef CONFIG_PROFILER
+    if (search_pc < 0) {
+        nb_ops = tcg_count_ops();
+    }
 #endif
 
 #ifdef USE_TCG_OPTIMIZATIONS
@@ -2076,9 +2127,16 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
     if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP_OPT))) {
         qemu_log("OP after liveness analysis:\n");
         tcg_dump_ops(s);
+        qemu_log("ops: %d before, %d after optimization\n",
+                 nb_ops, tcg_count_ops());
         qemu_log("\n");
     }
 #endif
+#ifdef CONFIG_PROFILER
+    if (search_pc < 0) {
+        s->opt_op_count += nb_ops - tcg_count_ops();
+    }
+#endif
 
     tcg_reg_alloc_start(s);
 
@@ -2224,6 +2282,8 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "deleted ops/TB      %0.2f\n",
                 s->tb_count ? 
                 (double)s->del_op_count / s->tb_count : 0);
+    cpu_fprintf(f, "optimized ops/TB    %0.2f\n",
+                s->tb_count ? (double)s->opt_op_count / s->tb_count : 0);
     cpu_fprintf(f, "avg temps/TB        %0.2f max=%d\n",
                 s->tb_count ? 
                 (double)s->temp_count / s->tb_count : 0,
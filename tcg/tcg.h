@@ -328,6 +328,23 @@ typedef struct TCGHelperInfo {
     const char *name;
 } TCGHelperInfo;
 
+/* Places in the generated code of a TB that refer to something outside
+   of it.  They are recorded when s->code_relocs_enabled is set, so that
+   the code can be copied elsewhere and fixed up with tcg_apply_code_reloc. */
+enum {
+    TCG_CODE_RELOC_BRANCH,      /* pc-relative call/jump to 'value' */
+    TCG_CODE_RELOC_BRANCH_ABS,  /* call/jump to 'value' through a register */
+    TCG_CODE_RELOC_TB,          /* exit_tb operand, TB pointer + n */
+};
+
+typedef struct TCGCodeReloc {
+    uint32_t offset;            /* from the start of the TB code */
+    uint32_t type;
+    uint64_t value;
+} TCGCodeReloc;
+
+#define TCG_MAX_CODE_RELOCS 128
+
 typedef struct TCGContext TCGContext;
 
 struct TCGContext {
@@ -347,6 +364,18 @@ struct TCGContext {
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset; /* != NULL if USE_DIRECT_JUMP */
 
+    /* goto_ptr target when no TB was found: exit_tb(0) */
+    void *code_gen_epilogue;
+
+    /* external references of the code being generated */
+    int code_relocs_enabled;
+    int nb_code_relocs; /* may exceed TCG_MAX_CODE_RELOCS on overflow */
+    TCGCodeReloc code_relocs[TCG_MAX_CODE_RELOCS];
+
+    /* qemu_st marks the RAM page it writes in env->dirty_log
+       (only set if TCG_TARGET_HAS_DIRTY_LOG) */
+    int dirty_log;
+
     /* liveness analysis */
     uint16_t *op_dead_args; /* for each operation, each bit tells if the
                                corresponding argument is dead */
@@ -377,6 +406,7 @@ struct TCGContext {
     int64_t temp_count;
     int temp_count_max;
     int64_t del_op_count;
+    int64_t opt_op_count; /* ops removed by optimizer and liveness */
     int64_t code_in_len;
     int64_t code_out_len;
     int64_t interm_time;
@@ -568,6 +598,15 @@ void tcg_gen_shifti_i64(TCGv_i64 ret, TCGv_i64 arg1,
 TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr, TCGArg *args,
                      TCGOpDef *tcg_op_def);
 
+#ifdef TCG_TARGET_HAS_CODE_RELOCS
+/* Fix up reference R of the CODE_SIZE bytes of code moved to CODE_BUF.
+   TB is the value of the new TranslationBlock pointer.  Returns -1 if R
+   does not lie within the code, or if the reference cannot be expressed
+   at the new location with the same code layout. */
+int tcg_apply_code_reloc(uint8_t *code_buf, int code_size,
+                         const TCGCodeReloc *r, tcg_target_long tb);
+#endif
+
 /* only used for debugging purposes */
 void tcg_register_helper(void *func, const char *name);
 const char *tcg_helper_get_name(TCGContext *s, void *func);
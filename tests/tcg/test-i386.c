@@ -2390,6 +2390,38 @@ void test_fxsave(void)
     }
 }
 
+/* psrlq $64 makes xmm0 a known zero, so the TCG optimizer shortens the
+   pand to a movi and the por to a mov.  The stores of xmm1 that follow
+   them, and the loads of xmm1 forwarded from those stores, must still
+   use the right temps.  */
+void test_sse_forward(void)
+{
+    XMMReg r, a, b;
+
+    a.q[0] = test_values[0][0];
+    a.q[1] = test_values[0][1];
+    b.q[0] = test_values[1][0];
+    b.q[1] = test_values[1][1];
+    asm volatile("movdqu %1, %%xmm1\n"
+                 "movdqu %2, %%xmm2\n"
+                 "psrlq $64, %%xmm0\n"
+                 "pand %%xmm0, %%xmm1\n"
+                 "por %%xmm2, %%xmm1\n"
+                 "movdqa %%xmm1, %%xmm3\n"
+                 "paddq %%xmm1, %%xmm3\n"
+                 "pxor %%xmm2, %%xmm1\n"
+                 "por %%xmm1, %%xmm3\n"
+                 "movdqu %%xmm3, %0\n"
+                 : "=m" (r)
+                 : "m" (a), "m" (b)
+                 : "xmm0", "xmm1", "xmm2", "xmm3");
+    printf("%-9s: a=" FMT64X "" FMT64X " b=" FMT64X "" FMT64X " r=" FMT64X "" FMT64X "\n",
+           "forward",
+           a.q[1], a.q[0],
+           b.q[1], b.q[0],
+           r.q[1], r.q[0]);
+}
+
 void test_sse(void)
 {
     XMMReg r, a, b;
@@ -2759,6 +2791,7 @@ int main(int argc, char **argv)
 #ifdef TEST_SSE
     test_sse();
     test_fxsave();
+    test_sse_forward();
 #endif
     return 0;
 }
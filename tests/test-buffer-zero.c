@@ -0,0 +1,103 @@
+/*
+ * Zero buffer detection tests
+ *
+ * Every test runs once per implementation the host supports.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+
+#define BUF_SIZE 8192
+
+static uint8_t *buffer;
+
+static void check_lengths(void)
+{
+    size_t ofs, len, i;
+
+    for (ofs = 0; ofs < 64; ofs++) {
+        for (len = 0; len < 1024; len += (len < 256 ? 1 : 61)) {
+            g_assert(buffer_is_zero(buffer + ofs, len));
+
+            /* a non-zero byte anywhere inside is found */
+            for (i = 0; i < len; i++) {
+                buffer[ofs + i] = 0x80 >> (i % 8);
+                g_assert(!buffer_is_zero(buffer + ofs, len));
+                buffer[ofs + i] = 0;
+            }
+
+            /* and none outside is looked at */
+            buffer[ofs + len] = 1;
+            if (ofs) {
+                buffer[ofs - 1] = 1;
+            }
+            g_assert(buffer_is_zero(buffer + ofs, len));
+            buffer[ofs + len] = 0;
+            if (ofs) {
+                buffer[ofs - 1] = 0;
+            }
+        }
+    }
+}
+
+static void test_buffer_is_zero(void)
+{
+    buffer = g_malloc0(BUF_SIZE);
+    do {
+        check_lengths();
+    } while (test_buffer_is_zero_next_accel());
+    g_free(buffer);
+}
+
+static void test_page_sizes(void)
+{
+    size_t size;
+
+    buffer = g_malloc0(BUF_SIZE);
+    do {
+        for (size = 512; size <= BUF_SIZE; size *= 2) {
+            g_assert(buffer_is_zero(buffer, size));
+            buffer[size - 1] = 1;
+            g_assert(!buffer_is_zero(buffer, size));
+            g_assert(buffer_is_zero(buffer, size - 1));
+            buffer[size - 1] = 0;
+        }
+    } while (test_buffer_is_zero_next_accel());
+    g_free(buffer);
+}
+
+static void perf_buffer_is_zero(void)
+{
+    unsigned int i, max, n = 0;
+    double duration;
+
+    max = 1000000;
+    buffer = g_malloc0(BUF_SIZE);
+    do {
+        g_test_timer_start();
+        for (i = 0; i < max; i++) {
+            g_assert(buffer_is_zero(buffer, 4096));
+        }
+        duration = g_test_timer_elapsed();
+
+        g_test_message("Implementation %u: %u zero pages in %f s, %f GB/s\n",
+                       n++, max, duration,
+                       (double)max * 4096 / duration / 1e9);
+    } while (test_buffer_is_zero_next_accel());
+    g_free(buffer);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/buffer-zero/lengths", test_buffer_is_zero);
+    g_test_add_func("/buffer-zero/page_sizes", test_page_sizes);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/buffer-zero", perf_buffer_is_zero);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,158 @@
+/*
+ * QHT hash table tests
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qht.h"
+
+#define N 5000
+
+static QHT ht;
+static int32_t arr[N];
+
+/* A deliberately weak hash so that buckets overflow into chains */
+static uint32_t hash_func(int32_t val)
+{
+    return val & 0xff;
+}
+
+static bool is_equal(const void *obj, const void *userp)
+{
+    const int32_t *a = obj;
+    const int32_t *b = userp;
+
+    return *a == *b;
+}
+
+static void insert(int a, int b)
+{
+    int i;
+
+    for (i = a; i < b; i++) {
+        arr[i] = i;
+        g_assert(qht_insert(&ht, &arr[i], hash_func(i)));
+    }
+}
+
+static void rm(int a, int b)
+{
+    int i;
+
+    for (i = a; i < b; i++) {
+        g_assert(qht_remove(&ht, &arr[i], hash_func(i)));
+    }
+}
+
+static void check(int a, int b, bool expected)
+{
+    int i;
+
+    for (i = a; i < b; i++) {
+        int32_t val = i;
+        void *p = qht_lookup(&ht, is_equal, &val, hash_func(i));
+
+        if (expected) {
+            g_assert(p == &arr[i]);
+        } else {
+            g_assert(p == NULL);
+        }
+    }
+}
+
+static void count_func(void *obj, uint32_t hash, void *userp)
+{
+    size_t *count = userp;
+
+    g_assert(hash == hash_func(*(int32_t *)obj));
+    (*count)++;
+}
+
+static void check_n(size_t expected)
+{
+    QHTStats stats;
+    size_t count = 0;
+
+    qht_iter(&ht, count_func, &count);
+    g_assert_cmpuint(count, ==, expected);
+    g_assert_cmpuint(ht.n_entries, ==, expected);
+
+    qht_statistics(&ht, &stats);
+    g_assert_cmpuint(stats.entries, ==, expected);
+}
+
+static void test_insert_remove(unsigned int mode)
+{
+    qht_init(&ht, 0, mode);
+
+    check_n(0);
+    insert(0, N);
+    check(0, N, true);
+    check_n(N);
+
+    /* duplicates are refused */
+    g_assert(!qht_insert(&ht, &arr[10], hash_func(10)));
+    check_n(N);
+
+    /* holes in the middle of chains must be refilled */
+    rm(100, 200);
+    check_n(N - 100);
+    check(0, 100, true);
+    check(100, 200, false);
+    check(200, N, true);
+    g_assert(!qht_remove(&ht, &arr[150], hash_func(150)));
+
+    insert(100, 200);
+    check(0, N, true);
+    check_n(N);
+
+    rm(0, N);
+    check(0, N, false);
+    check_n(0);
+
+    insert(0, 10);
+    qht_reset(&ht);
+    check(0, 10, false);
+    check_n(0);
+
+    qht_destroy(&ht);
+}
+
+static void test_fixed_size(void)
+{
+    test_insert_remove(0);
+}
+
+static void test_auto_resize(void)
+{
+    test_insert_remove(QHT_MODE_AUTO_RESIZE);
+}
+
+static void test_resize(void)
+{
+    qht_init(&ht, 8, 0);
+    insert(0, N);
+
+    g_assert(qht_resize(&ht, N * 4));
+    check(0, N, true);
+    check_n(N);
+
+    g_assert(qht_resize(&ht, 16));
+    check(0, N, true);
+    check_n(N);
+    g_assert(!qht_resize(&ht, 16));
+
+    qht_destroy(&ht);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qht/fixed_size", test_fixed_size);
+    g_test_add_func("/qht/auto_resize", test_auto_resize);
+    g_test_add_func("/qht/resize", test_resize);
+    return g_test_run();
+}
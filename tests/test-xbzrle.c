@@ -0,0 +1,201 @@
+/*
+ * XBZRLE encoding and page cache tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "migration.h"
+#include "qemu/page_cache.h"
+
+#define PAGE_SIZE 4096
+
+static uint8_t *page_new(void)
+{
+    return g_malloc0(PAGE_SIZE);
+}
+
+static void test_encode_decode_zero(void)
+{
+    uint8_t *buffer = page_new();
+    uint8_t *zero = page_new();
+    uint8_t *compressed = page_new();
+    int i, dlen, rc;
+
+    /* a change in the middle of an otherwise zero page */
+    for (i = 0; i < 1500; i++) {
+        buffer[1000 + i] = i % 255 + 1;
+    }
+
+    dlen = xbzrle_encode_buffer(zero, buffer, PAGE_SIZE, compressed,
+                                PAGE_SIZE);
+    g_assert(dlen == 1500 + 4);
+
+    rc = xbzrle_decode_buffer(compressed, dlen, zero, PAGE_SIZE);
+    g_assert(rc == 2500);
+    g_assert(memcmp(zero, buffer, PAGE_SIZE) == 0);
+
+    g_free(buffer);
+    g_free(zero);
+    g_free(compressed);
+}
+
+static void test_encode_decode_unchanged(void)
+{
+    uint8_t *compressed = page_new();
+    uint8_t *test = page_new();
+    int i, dlen;
+
+    for (i = 0; i < PAGE_SIZE; i += 23) {
+        test[i] = i % 255 + 1;
+    }
+
+    dlen = xbzrle_encode_buffer(test, test, PAGE_SIZE, compressed,
+                                PAGE_SIZE);
+    g_assert(dlen == 0);
+
+    g_free(test);
+    g_free(compressed);
+}
+
+static void test_encode_decode_overflow(void)
+{
+    uint8_t *compressed = page_new();
+    uint8_t *test = page_new();
+    uint8_t *buffer = page_new();
+    int i, rc;
+
+    /* every other byte changes: the encoding is larger than the page */
+    for (i = 0; i < PAGE_SIZE; i += 2) {
+        test[i] = 1;
+    }
+
+    rc = xbzrle_encode_buffer(buffer, test, PAGE_SIZE, compressed,
+                              PAGE_SIZE);
+    g_assert(rc == -1);
+
+    g_free(buffer);
+    g_free(compressed);
+    g_free(test);
+}
+
+static void encode_decode_range(void)
+{
+    uint8_t *buffer = page_new();
+    uint8_t *compressed = page_new();
+    uint8_t *test = page_new();
+    int i, dlen, rc;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        buffer[i] = g_test_rand_int_range(0, 256);
+    }
+    memcpy(test, buffer, PAGE_SIZE);
+
+    /* change a few random ranges */
+    for (i = 0; i < 16; i++) {
+        int start = g_test_rand_int_range(0, PAGE_SIZE);
+        int len = g_test_rand_int_range(1, 64);
+        int j;
+
+        for (j = start; j < start + len && j < PAGE_SIZE; j++) {
+            test[j] = ~buffer[j];
+        }
+    }
+
+    dlen = xbzrle_encode_buffer(buffer, test, PAGE_SIZE, compressed,
+                                PAGE_SIZE);
+    g_assert(dlen > 0 && dlen < PAGE_SIZE);
+
+    rc = xbzrle_decode_buffer(compressed, dlen, buffer, PAGE_SIZE);
+    g_assert(rc > 0 && rc <= PAGE_SIZE);
+    g_assert(memcmp(test, buffer, PAGE_SIZE) == 0);
+
+    g_free(buffer);
+    g_free(compressed);
+    g_free(test);
+}
+
+static void test_encode_decode(void)
+{
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        encode_decode_range();
+    }
+}
+
+static void test_decode_malformed(void)
+{
+    uint8_t *buffer = page_new();
+    /* zrun of 4090 bytes, then an nzrun running past the page */
+    uint8_t bad_len[] = { 0xfa, 0x1f, 0x10, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+                          11, 12, 13, 14, 15, 16 };
+    /* nzrun longer than the data that follows it */
+    uint8_t short_data[] = { 0x00, 0x08, 1, 2 };
+
+    g_assert(xbzrle_decode_buffer(bad_len, sizeof(bad_len), buffer,
+                                  PAGE_SIZE) == -1);
+    g_assert(xbzrle_decode_buffer(short_data, sizeof(short_data), buffer,
+                                  PAGE_SIZE) == -1);
+
+    g_free(buffer);
+}
+
+static void test_cache(void)
+{
+    PageCache *cache;
+    uint8_t *page = page_new();
+    uint64_t addr;
+
+    /* rounded down to 4 pages */
+    cache = cache_init(5, PAGE_SIZE);
+    g_assert(cache);
+
+    for (addr = 0; addr < 4 * PAGE_SIZE; addr += PAGE_SIZE) {
+        memset(page, addr / PAGE_SIZE + 1, PAGE_SIZE);
+        g_assert(!cache_is_cached(cache, addr));
+        cache_insert(cache, addr, page);
+        g_assert(cache_is_cached(cache, addr));
+    }
+    g_assert(get_cached_data(cache, 2 * PAGE_SIZE)[0] == 3);
+
+    /* the same slot as page 0 */
+    memset(page, 0xff, PAGE_SIZE);
+    cache_insert(cache, 4 * PAGE_SIZE, page);
+    g_assert(!cache_is_cached(cache, 0));
+    g_assert(get_cached_data(cache, 0) == NULL);
+    g_assert(get_cached_data(cache, 4 * PAGE_SIZE)[0] == 0xff);
+
+    /* shrinking keeps the most recently inserted of colliding pages */
+    g_assert(cache_resize(cache, 2) == 2);
+    g_assert(cache_is_cached(cache, 4 * PAGE_SIZE));
+    g_assert(cache_is_cached(cache, 3 * PAGE_SIZE));
+    g_assert(!cache_is_cached(cache, 2 * PAGE_SIZE));
+    g_assert(get_cached_data(cache, 3 * PAGE_SIZE)[0] == 4);
+
+    g_assert(cache_resize(cache, 16) == 16);
+    g_assert(cache_is_cached(cache, 4 * PAGE_SIZE));
+    g_assert(cache_is_cached(cache, 3 * PAGE_SIZE));
+
+    cache_fini(cache);
+    g_free(page);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_rand_int();
+    g_test_add_func("/xbzrle/encode_decode_zero", test_encode_decode_zero);
+    g_test_add_func("/xbzrle/encode_decode_unchanged",
+                    test_encode_decode_unchanged);
+    g_test_add_func("/xbzrle/encode_decode_overflow",
+                    test_encode_decode_overflow);
+    g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/decode_malformed", test_decode_malformed);
+    g_test_add_func("/xbzrle/page_cache", test_cache);
+
+    return g_test_run();
+}
@@ -2092,6 +2092,15 @@ static QEMUMachine *machine_parse(const char *name)
 
 static int tcg_init(void)
 {
+    QemuOptsList *list = qemu_find_opts("machine");
+    const char *threads = NULL;
+
+    if (!QTAILQ_EMPTY(&list->head)) {
+        threads = qemu_opt_get(QTAILQ_FIRST(&list->head), "tcg_threads");
+    }
+    if (threads && qemu_tcg_configure_threads(threads) < 0) {
+        exit(1);
+    }
     tcg_exec_init(tcg_tb_size * 1024 * 1024);
     return 0;
 }
@@ -0,0 +1,171 @@
+/*
+ * Xor Based Zero Run Length Encoding
+ *
+ * Encodes a page as the difference from the copy of it sent before:
+ *
+ *   page   = zrun nzrun
+ *          | zrun nzrun page
+ *   zrun   = length
+ *   nzrun  = length byte...
+ *   length = uleb128 encoded integer
+ *
+ * A zrun is a run of bytes that did not change, an nzrun carries the
+ * new contents of the bytes that did.  A trailing zrun is not encoded.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "migration.h"
+
+static int uleb128_encode_small(uint8_t *out, uint32_t n)
+{
+    int i = 0;
+
+    do {
+        uint8_t byte = n & 0x7f;
+
+        n >>= 7;
+        out[i++] = byte | (n ? 0x80 : 0);
+    } while (n);
+    return i;
+}
+
+/* Returns the number of bytes read, or -1 if 'in' holds no valid length */
+static int uleb128_decode_small(const uint8_t *in, int len, uint32_t *n)
+{
+    int i;
+
+    *n = 0;
+    for (i = 0; i < len && i < 5; i++) {
+        *n |= (uint32_t)(in[i] & 0x7f) << (7 * i);
+        if (!(in[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+/* largest encoding of a run length: pages are far below 2^21 bytes */
+#define XBZRLE_LEN_MAX 3
+
+/* 0x0101...01, to find a zero byte in a word */
+#define ONES_LONG (~0UL / 0xff)
+
+/*
+ * Encode the difference between old_buf and new_buf (both slen bytes,
+ * aligned to sizeof(long)) into dst.
+ *
+ * Returns the encoded length, 0 if the buffers are equal, or -1 if the
+ * encoding does not fit in dlen bytes.
+ */
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0;
+
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    while (i < slen) {
+        /* zero run: skip whole words first, then the remaining bytes */
+        zrun_len = 0;
+        if (!(i % sizeof(long))) {
+            while (i < slen &&
+                   *(unsigned long *)(old_buf + i) ==
+                   *(unsigned long *)(new_buf + i)) {
+                i += sizeof(long);
+                zrun_len += sizeof(long);
+            }
+        }
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+            zrun_len++;
+        }
+
+        if (i == slen) {
+            /* the trailing zero run is implicit */
+            break;
+        }
+
+        /* non-zero run, up to the next unchanged word or byte */
+        nzrun_len = 0;
+        while (i < slen && old_buf[i] != new_buf[i]) {
+            i++;
+            nzrun_len++;
+            if (!(i % sizeof(long))) {
+                unsigned long xor;
+
+                /* skip words that have no unchanged byte at all */
+                while (i < slen) {
+                    xor = *(unsigned long *)(old_buf + i) ^
+                          *(unsigned long *)(new_buf + i);
+                    if ((xor - ONES_LONG) & ~xor & (ONES_LONG << 7)) {
+                        break;
+                    }
+                    i += sizeof(long);
+                    nzrun_len += sizeof(long);
+                }
+            }
+        }
+
+        if (d + 2 * XBZRLE_LEN_MAX + nzrun_len > dlen) {
+            return -1;
+        }
+        d += uleb128_encode_small(dst + d, zrun_len);
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        memcpy(dst + d, new_buf + i - nzrun_len, nzrun_len);
+        d += nzrun_len;
+    }
+
+    return d;
+}
+
+/*
+ * Apply the encoded difference in src (slen bytes) to dst (dlen bytes).
+ *
+ * Returns the number of bytes of dst covered by the encoding, or -1 if
+ * src is malformed.
+ */
+int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
+{
+    int i = 0, d = 0;
+    int ret;
+    uint32_t count;
+
+    while (i < slen) {
+        /* zrun */
+        ret = uleb128_decode_small(src + i, slen - i, &count);
+        if (ret < 0 || (i && !count)) {
+            return -1;
+        }
+        i += ret;
+
+        /* overflow */
+        if (count > dlen - d) {
+            return -1;
+        }
+        d += count;
+
+        /* nzrun */
+        ret = uleb128_decode_small(src + i, slen - i, &count);
+        if (ret < 0 || !count) {
+            return -1;
+        }
+        i += ret;
+
+        /* overflow */
+        if (count > dlen - d || count > slen - i) {
+            return -1;
+        }
+
+        memcpy(dst + d, src + i, count);
+        d += count;
+        i += count;
+    }
+
+    return d;
+}